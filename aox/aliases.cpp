@@ -187,6 +187,7 @@ void CreateAlias::execute()
         error( "Internal error: Inserted " + fn( d->q->rows() ) +
                " instead of 1. Not committing." );
 
+    d->t->enqueue( new Query( "notify users_updated", 0 ) );
     d->t->commit();
 
     finish();
@@ -242,6 +243,8 @@ void DeleteAlias::execute()
             q->bind( 4, target->domain() );
         }
         q->execute();
+        Query * n = new Query( "notify users_updated", 0 );
+        n->execute();
     }
 
     if ( !q->done() )
@@ -2,8 +2,6 @@
 
 #include "anonymise.h"
 
-#include "file.h"
-
 #include <stdio.h>
 
 
@@ -33,11 +31,34 @@ void Anonymise::execute()
     EString s( next() );
     end();
 
-    File f( s );
-    if ( f.valid() )
-        fprintf( stdout, "%s\n", f.contents().anonymised().cstr() );
-    else
+    FILE * in = fopen( s.cstr(), "r" );
+    if ( !in )
         error( "Couldn't open file: " + s );
 
+    // anonymised() munges one word at a time and words never span
+    // lines, so we can stream the file through it a block at a time,
+    // as long as each block ends on a line boundary. memory use is
+    // bounded by the longest line, not by the file.
+
+    EString buffer;
+    char block[16384];
+    size_t n;
+    while ( ( n = fread( block, 1, sizeof( block ), in ) ) > 0 ) {
+        buffer.append( block, n );
+        int i = buffer.length() - 1;
+        while ( i >= 0 && buffer[i] != '\n' )
+            i--;
+        if ( i < 0 )
+            continue;
+        EString a( buffer.mid( 0, i + 1 ).anonymised() );
+        fwrite( a.data(), 1, a.length(), stdout );
+        buffer = buffer.mid( i + 1 );
+    }
+    fclose( in );
+
+    EString a( buffer.anonymised() );
+    fwrite( a.data(), 1, a.length(), stdout );
+    fprintf( stdout, "\n" );
+
     finish();
 }
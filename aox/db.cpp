@@ -230,6 +230,35 @@ void Vacuum::execute()
                     if (!q->done())
                         return;
                 } while (q->rows());
+                qstate = 5;
+                log( "vacuum: reconcile mailbox_counts",
+                     Log::Significant );
+                // the triggers keep mailbox_counts exact, but anyone
+                // poking at the database by hand can introduce drift,
+                // so recompute any rows that are off.
+                q = new Query( "update mailbox_counts mc "
+                               "set messages=c.messages, "
+                               "unseen=c.unseen, size=c.size "
+                               "from (select m.id as mailbox, "
+                               "count(mm.uid)::int as messages, "
+                               "coalesce(sum(case when not mm.seen then 1"
+                               " else 0 end),0)::int as unseen, "
+                               "coalesce(sum(msg.rfc822size::bigint),0)"
+                               " as size "
+                               "from mailboxes m "
+                               "left join mailbox_messages mm on"
+                               " (mm.mailbox=m.id) "
+                               "left join messages msg on"
+                               " (mm.message=msg.id) "
+                               "group by m.id) c "
+                               "where mc.mailbox=c.mailbox and "
+                               "(mc.messages<>c.messages or "
+                               "mc.unseen<>c.unseen or "
+                               "mc.size<>c.size)", this );
+                q->execute();
+            case 5:
+                if (!q->done())
+                    return;
         }
 
         t = new Transaction( this );
@@ -273,6 +302,8 @@ void Vacuum::execute()
             t->enqueue(
                 "delete from addresses where id in "
                 "(select address from au where not used)" );
+            // running servers may have cached ids for those rows
+            t->enqueue( "notify addresses_updated" );
             // the index has to go away again
             t->enqueue( "drop table au" );
             t->enqueue( "drop index af_a" );
@@ -473,6 +504,11 @@ struct TunableIndex {
       "USING gin (to_tsvector('simple'::regconfig, value)) "
       "WHERE (octet_length(value) < (640000) and field=20)",
       false, false, true },
+    { "hf_trgm", "header_fields",
+      "CREATE INDEX hf_trgm ON header_fields "
+      "USING gin (value gin_trgm_ops) "
+      "WHERE (octet_length(value) < (640000))",
+      false, false, true },
     { 0, 0, 0, false, false, false }
 };
 
@@ -481,13 +517,15 @@ class TuneDatabaseData
     : public Garbage
 {
 public:
-    TuneDatabaseData(): mode( Reading ), t( 0 ), find( 0 ), set( false ) {}
+    TuneDatabaseData()
+        : mode( Reading ), t( 0 ), find( 0 ), trgm( 0 ), set( false ) {}
     enum Mode {
         Writing, Reading, Advanced
     };
     Mode mode;
     Transaction * t;
     Query * find;
+    Query * trgm;
     bool set;
 };
 
@@ -547,10 +585,14 @@ void TuneDatabase::execute()
         d->find->bind( 2, indexnames );
 
         d->t->enqueue( d->find );
+
+        d->trgm = new Query( "select opcname from pg_opclass "
+                             "where opcname='gin_trgm_ops'", this );
+        d->t->enqueue( d->trgm );
         d->t->execute();
     }
 
-    if ( !d->find->done() )
+    if ( !d->find->done() || !d->trgm->done() )
         return;
 
     if ( d->t->failed() )
@@ -589,9 +631,24 @@ void TuneDatabase::execute()
                     printf( "Error: "
                             "Full-text indexing needs PostgreSQL 8.3\n" );
                 }
+                else if ( EString( tunableIndices[i].name ) == "hf_trgm" &&
+                          !d->trgm->hasResults() ) {
+                    printf( "Error: "
+                            "Substring indexing needs the pg_trgm "
+                            "extension (create extension pg_trgm)\n" );
+                }
                 else {
-                    q = new Query( tunableIndices[i].definition, 0 );
-                    printf( "Executing %s;\n", tunableIndices[i].definition );
+                    EString def( tunableIndices[i].definition );
+                    EString ts( Configuration::text(
+                                    Configuration::SearchConfig ) );
+                    if ( ts != "simple" )
+                        // the full-text indices use the configured
+                        // language; Selector reads the regconfig
+                        // back from the indexdef, so the searches it
+                        // emits follow along automatically
+                        def.replace( "'simple'", "'" + ts + "'" );
+                    q = new Query( def, 0 );
+                    printf( "Executing %s;\n", def.cstr() );
                 }
             }
             else if ( present.find( tunableIndices[i].name ) && !wanted ) {
@@ -752,7 +809,7 @@ static EString rowSummary( class Query * q ) {
             s.append( r->getEString( name.cstr() ).quoted() );
             break;
         case Column::Timestamp:
-            s.append( "(timestamptz)" );
+            s.append( fn( r->getTimestamp( name.cstr() ) ) );
             break;
         case Column::Null:
             s.append( "null" );
@@ -16,50 +16,63 @@
 #include <unistd.h> // getpid
 
 
-class ReparseData
-    : public Garbage
+// reparses the unparsed messages whose bodypart ids lie in
+// (sofar,rangeEnd], one chunk-sized transaction at a time, and
+// notifies its owner when the range is exhausted. several workers can
+// run at once, each on its own database handle, as long as their
+// ranges are disjoint.
+
+class ReparseWorker
+    : public EventHandler
 {
 public:
-    ReparseData()
-        : q( 0 ), t( 0 )
+    ReparseWorker( Reparse * owner, uint from, uint to, bool copies )
+        : t( 0 ), find( 0 ), injector( 0 ),
+          owner( owner ), sofar( from ), rangeEnd( to ),
+          reparsed( 0 ), failures( 0 ),
+          errorCopies( copies ), committing( false ), finished( false )
     {}
 
-    Query * q;
+    void execute();
+
     Transaction * t;
+    Query * find;
+    Injector * injector;
+    Reparse * owner;
+    uint sofar;
+    uint rangeEnd;
+    uint reparsed;
+    uint failures;
+    bool errorCopies;
+    bool committing;
+    bool finished;
+    EString err;
 };
 
 
-static AoxFactory<Reparse>
-f( "reparse", "", "Retry previously-stored unparsable messages.",
-   "    Synopsis: aox reparse\n\n"
-   "    Looks for messages that \"arrived but could not be stored\",\n"
-   "    and tries to reparse them with parsing workarounds added more\n"
-   "    recently. If it succeeds, the new messages are injected.\n" );
-
-
-/*! \class Reparse reparse.h
-    This class handles the "aox reparse" command.
-*/
-
-Reparse::Reparse( EStringList * args )
-    : AoxCommand( args ), d( new ReparseData )
-{
-}
-
-
-void Reparse::execute()
+void ReparseWorker::execute()
 {
-    if ( !d->q && !d->t ) {
-        parseOptions();
-        end();
+    if ( finished )
+        return;
 
-        printf( "Looking for messages with parse failures\n" );
+    if ( t && t->done() ) {
+        if ( t->failed() ) {
+            err = "Reparsing failed: " + t->error();
+            finished = true;
+            owner->notify();
+            return;
+        }
+        t = 0;
+        injector = 0;
+        committing = false;
+    }
 
-        database( true );
-        Mailbox::setup( this );
+    if ( committing )
+        return;
 
-        d->t = new Transaction( this );
-        d->q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
+    if ( !t ) {
+        t = new Transaction( this );
+        find = new Query( "select mm.mailbox, mm.uid, "
                           "mm.message as wrapper, "
                           "mb.nextmodseq, "
                           "b.id as bodypart, b.text, b.data "
@@ -68,24 +81,29 @@ void Reparse::execute()
                           "join part_numbers p on (p.bodypart=b.id) "
                           "join mailbox_messages mm on (p.message=mm.message) "
                           "join mailboxes mb on (mm.mailbox=mb.id) "
-                          "order by mm.mailbox "
+                          "where u.bodypart>$1 and u.bodypart<=$2 "
+                          "order by u.bodypart limit 512 "
                           "for update",
                           this );
-        d->t->enqueue( d->q );
-        d->t->execute();
+        find->bind( 1, sofar );
+        find->bind( 2, rangeEnd );
+        t->enqueue( find );
+        t->execute();
     }
 
-    if ( !choresDone() )
-        return;
-
-    if ( !d->q->done() )
+    if ( !find->done() )
         return;
 
     IntegerSet parsable;
+    List<Injectee> * injectables = new List<Injectee>;
+    uint rows = 0;
+    while ( find->hasResults() ) {
+        Row * r = find->nextRow();
+        rows++;
 
-    List<Injectee> injectables;
-    while ( d->q && d->q->hasResults() ) {
-        Row * r = d->q->nextRow();
+        uint bodypart = r->getInt( "bodypart" );
+        if ( bodypart > sofar )
+            sofar = bodypart;
 
         EString text;
         if ( r->isNull( "data" ) )
@@ -98,9 +116,9 @@ void Reparse::execute()
         if ( im->valid() ) {
             EStringList x;
             im->setFlags( mb, &x );
-            injectables.append( im );
+            injectables->append( im );
 
-            parsable.add( r->getInt( "bodypart" ) );
+            parsable.add( bodypart );
 
             Query * q
                 = new Query( "insert into deleted_messages "
@@ -114,42 +132,173 @@ void Reparse::execute()
             q->bind( 6,
                      EString( "reparsed by aox " ) +
                      Configuration::compiledIn( Configuration::Version ) );
-            d->t->enqueue( q );
+            t->enqueue( q );
+
+            // the wrapper's cached bodystructure is obsolete now
+            Query * qbs
+                = new Query( "delete from bodystructures where message=$1",
+                             this );
+            qbs->bind( 1, r->getInt( "wrapper" ) );
+            t->enqueue( qbs );
+
+            reparsed++;
             printf( "- reparsed %s:%d\n",
                     mb->name().utf8().cstr(),
                     r->getInt( "uid" ) );
         }
         else {
+            failures++;
             printf( "- parsing %s:%d still fails: %s\n",
                     mb->name().utf8().cstr(), r->getInt( "uid" ),
                     im->error().simplified().cstr() );
-            if ( opt( 'e' ) )
+            if ( errorCopies )
                 printf( "- wrote a copy to %s\n",
-                        writeErrorCopy( text ).cstr() );
+                        owner->writeErrorCopy( text ).cstr() );
         }
+    }
 
+    if ( !rows ) {
+        finished = true;
+        t->rollback();
+        t = 0;
+        owner->notify();
+        return;
     }
-    if ( !injectables.isEmpty() ) {
+
+    if ( !injectables->isEmpty() ) {
         Query * q =
             new Query( "delete from unparsed_messages where "
                        "bodypart=any($1)", this );
         q->bind( 1, parsable );
-        d->t->enqueue( q );
+        t->enqueue( q );
 
-        Injector * injector = new Injector( this );
-        injector->addInjection( &injectables );
-        injector->setTransaction( d->t );
+        injector = new Injector( this );
+        injector->addInjection( injectables );
+        injector->setTransaction( t );
         injector->execute();
+    }
+
+    committing = true;
+    t->commit();
+}
+
+
+class ReparseData
+    : public Garbage
+{
+public:
+    ReparseData()
+        : bounds( 0 ), workers( 0 ), handles( 1 )
+    {}
+
+    Query * bounds;
+    List<ReparseWorker> * workers;
+    uint handles;
+};
+
+
+static AoxFactory<Reparse>
+f( "reparse", "", "Retry previously-stored unparsable messages.",
+   "    Synopsis: aox reparse [-e] [-p...]\n\n"
+   "    Looks for messages that \"arrived but could not be stored\",\n"
+   "    and tries to reparse them with parsing workarounds added more\n"
+   "    recently. If it succeeds, the new messages are injected.\n\n"
+   "    Each -p adds one worker; workers process disjoint id ranges\n"
+   "    concurrently, each over its own database handle, committing\n"
+   "    after each chunk.\n" );
+
+
+/*! \class Reparse reparse.h
+    This class handles the "aox reparse" command.
+*/
+
+Reparse::Reparse( EStringList * args )
+    : AoxCommand( args ), d( new ReparseData )
+{
+}
+
+
+void Reparse::execute()
+{
+    if ( !d->bounds ) {
+        parseOptions();
+        end();
+
+        printf( "Looking for messages with parse failures\n" );
 
+        d->handles = 1 + opt( 'p' );
+        if ( d->handles > 8 )
+            d->handles = 8;
+        Database::setup( d->handles, Database::DbOwner );
+        Mailbox::setup( this );
+
+        d->bounds
+            = new Query( "select coalesce(min(bodypart),0)::integer as lo, "
+                         "coalesce(max(bodypart),0)::integer as hi, "
+                         "count(*)::integer as unparsed "
+                         "from unparsed_messages", this );
+        d->bounds->execute();
     }
 
-    d->t->commit();
+    if ( !choresDone() )
+        return;
 
-    if ( !d->t->done() )
+    if ( !d->bounds->done() )
         return;
 
-    if ( d->t->failed() )
-        error( "Reparsing failed: " + d->t->error() );
+    if ( !d->workers ) {
+        Row * r = d->bounds->nextRow();
+        uint lo = 0;
+        uint hi = 0;
+        if ( r ) {
+            lo = r->getInt( "lo" );
+            hi = r->getInt( "hi" );
+            printf( "Messages with parse failures: %d.\n",
+                    r->getInt( "unparsed" ) );
+        }
+        d->workers = new List<ReparseWorker>;
+        if ( lo ) {
+            uint n = d->handles;
+            if ( n > 1 + ( hi - lo ) / 512 )
+                n = 1 + ( hi - lo ) / 512;
+            uint span = ( hi - lo + n ) / n;
+            uint from = lo - 1;
+            uint i = 0;
+            while ( i < n ) {
+                uint to = from + span;
+                if ( to > hi || i == n - 1 )
+                    to = hi;
+                d->workers->append(
+                    new ReparseWorker( this, from, to, opt( 'e' ) != 0 ) );
+                from = to;
+                i++;
+            }
+            if ( n > 1 )
+                printf( "Reparsing bodyparts %d-%d using %d workers.\n",
+                        lo, hi, n );
+            List<ReparseWorker>::Iterator w( d->workers );
+            while ( w ) {
+                w->execute();
+                ++w;
+            }
+        }
+    }
+
+    uint reparsed = 0;
+    uint failures = 0;
+    List<ReparseWorker>::Iterator w( d->workers );
+    while ( w ) {
+        if ( !w->err.isEmpty() )
+            error( w->err );
+        if ( !w->finished )
+            return;
+        reparsed += w->reparsed;
+        failures += w->failures;
+        ++w;
+    }
+
+    printf( "Reparsed %d messages; %d still cannot be parsed.\n",
+            reparsed, failures );
     finish();
 }
 
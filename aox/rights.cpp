@@ -285,6 +285,7 @@ void SetAcl::execute()
         }
 
         d->t->enqueue( d->store );
+        d->t->enqueue( new Query( "notify permissions_updated", 0 ) );
         d->t->commit();
     }
 
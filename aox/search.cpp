@@ -6,10 +6,24 @@
 
 #include "selector.h"
 #include "mailbox.h"
+#include "query.h"
+#include "graph.h"
 
 #include <stdio.h> // fprintf, stderr
 
 
+class ShowSearchData
+    : public Garbage
+{
+public:
+    ShowSearchData(): selector( 0 ), explain( 0 ), queued( 0 ) {}
+
+    Selector * selector;
+    Query * explain;
+    int64 queued;
+};
+
+
 void dumpSelector( Selector * s, uint l )
 {
     EString a;
@@ -125,10 +139,14 @@ void dumpSelector( Selector * s, uint l )
 
 static AoxFactory<ShowSearch>
 f( "show", "search", "Parse and explain the effects of a search expression",
-   "    Synopsis: show search <search>\n\n"
+   "    Synopsis: show search [-s] [-e] <search>\n\n"
    "    Parses the search expression and explains (in a different way) what\n"
    "    it does. This is a good way to experiment with searches before using\n"
-   "    e.g. aox undelete.\n" );
+   "    e.g. aox undelete.\n\n"
+   "    With -s, also shows the SQL the search compiles to. With -e, also\n"
+   "    runs EXPLAIN ANALYZE on the database server and shows the resulting\n"
+   "    plan and timings, which helps when tuning searches and the indexes\n"
+   "    they use.\n" );
 
 
 /*! \class ShowSearch search.h
@@ -140,7 +158,7 @@ f( "show", "search", "Parse and explain the effects of a search expression",
 */
 
 ShowSearch::ShowSearch( EStringList * args )
-    : AoxCommand( args )
+    : AoxCommand( args ), d( new ShowSearchData )
 {
     parseOptions();
     Selector * s = parseSelector( args );
@@ -174,11 +192,52 @@ ShowSearch::ShowSearch( EStringList * args )
             fprintf( stdout, "Showing generic SQL form:\n  %s\n", qs.cstr() );
         }
     }
+    if ( opt( 'e' ) )
+        d->selector = s;
 }
 
 
 void ShowSearch::execute()
 {
-    // nothing yet - may one day carry out a search
+    if ( d->selector && !d->explain ) {
+        database();
+        EStringList wanted;
+        wanted.append( "mailbox" );
+        wanted.append( "uid" );
+
+        int64 before = GraphableHistogram::milliTime();
+        Query * q = d->selector->query( 0, 0, 0, this, false,
+                                        &wanted, false );
+        int64 after = GraphableHistogram::milliTime();
+        fprintf( stdout, "Compiled search to SQL in %d ms\n",
+                 (int)( after - before ) );
+
+        // with the extended query protocol, explain analyze plans
+        // and runs the statement with the selector's bound values
+        q->setString( "explain analyze " + q->string() );
+        d->explain = q;
+        d->queued = GraphableHistogram::milliTime();
+        fprintf( stdout, "Explain analyze:\n" );
+        q->execute();
+    }
+
+    if ( !d->explain ) {
+        finish();
+        return;
+    }
+
+    while ( d->explain->hasResults() ) {
+        Row * r = d->explain->nextRow();
+        fprintf( stdout, "  %s\n", r->getEString( "QUERY PLAN" ).cstr() );
+    }
+
+    if ( !d->explain->done() )
+        return;
+
+    if ( d->explain->failed() )
+        fprintf( stderr, "Error: %s\n", d->explain->error().cstr() );
+    else
+        fprintf( stdout, "Round trip (queue and execution): %d ms\n",
+                 (int)( GraphableHistogram::milliTime() - d->queued ) );
     finish();
 }
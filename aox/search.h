@@ -16,6 +16,9 @@ public:
     ShowSearch( EStringList * );
 
     void execute();
+
+private:
+    class ShowSearchData * d;
 };
 
 
@@ -1448,6 +1448,49 @@ void ShowStatus::execute()
 
 
 
+static AoxFactory<ShowMemory>
+f10( "show", "memory", "Make the running servers log their memory usage.",
+    "    Synopsis: aox show memory\n\n"
+    "    Asks each running server to log its memory usage, ranked by\n"
+    "    allocation root, at its next garbage collection. The dump\n"
+    "    appears in the server's log file at log level info.\n" );
+
+
+/*! \class ShowMemory servers.h
+    This class handles the "aox show memory" command.
+*/
+
+ShowMemory::ShowMemory( EStringList * args )
+    : AoxCommand( args )
+{
+    execute();
+}
+
+
+void ShowMemory::execute()
+{
+    parseOptions();
+    end();
+
+    int i = 0;
+    int n = 0;
+    while ( i < nservers ) {
+        int pid = serverPid( servers[i] );
+        if ( pid > 0 && kill( pid, SIGUSR2 ) == 0 ) {
+            printf( "Asked %s (pid %d) to log its memory usage.\n",
+                    servers[i], pid );
+            n++;
+        }
+        i++;
+    }
+    if ( !n )
+        printf( "No servers are running.\n" );
+
+    finish();
+}
+
+
+
 static AoxFactory<ShowBuild>
 f6( "show", "build", "Display build settings.",
     "    Synopsis: aox show build\n\n"
@@ -124,6 +124,15 @@ public:
 };
 
 
+class ShowMemory
+    : public AoxCommand
+{
+public:
+    ShowMemory( EStringList * );
+    void execute();
+};
+
+
 class ShowConfiguration
     : public AoxCommand
 {
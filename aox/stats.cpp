@@ -4,20 +4,115 @@
 
 #include "query.h"
 #include "configuration.h"
+#include "estringlist.h"
+#include "connection.h"
+#include "eventloop.h"
+#include "resolver.h"
+#include "buffer.h"
 
 #include <stdio.h>
 
 
+// connects to the running server's statistics port and collects the
+// GraphDumper output, so that show counts can display live counters
+// without touching the database.
+
+class CounterReader
+    : public Connection
+{
+public:
+    CounterReader( EventHandler * owner )
+        : Connection(), o( owner ), finished( false )
+    {
+        EString a( Configuration::text( Configuration::StatisticsAddress ) );
+        EString addr;
+        if ( a.isEmpty() ) {
+            addr = "127.0.0.1";
+        }
+        else {
+            EStringList::Iterator it( Resolver::resolve( a ) );
+            if ( it )
+                addr = *it;
+        }
+        if ( addr.isEmpty() ) {
+            finished = true;
+            return;
+        }
+        connect( Endpoint( addr,
+                           Configuration::scalar(
+                               Configuration::StatisticsPort ) ) );
+        setTimeoutAfter( 2 );
+        EventLoop::global()->addConnection( this );
+    }
+
+    void react( Event e ) {
+        switch ( e ) {
+        case Read:
+        case Connect:
+            break;
+
+        case Timeout:
+        case Error:
+        case Shutdown:
+            setState( Closing );
+            finished = true;
+            break;
+
+        case Close:
+            // the server dumps everything and closes, so a close is
+            // success: the read buffer holds the entire dump.
+            dump = readBuffer()->string( readBuffer()->size() );
+            finished = true;
+            break;
+        }
+        if ( finished )
+            o->execute();
+    }
+
+    bool done() const { return finished; }
+
+    // each dump line is "name t:v t:v..."; the last pair holds the
+    // current value.
+    EStringList * counters() const {
+        EStringList * r = new EStringList;
+        EStringList::Iterator l( EStringList::split( '\n', dump ) );
+        while ( l ) {
+            EStringList::Iterator w( EStringList::split( ' ',
+                                                         l->simplified() ) );
+            if ( w && !w->isEmpty() ) {
+                EString name = *w;
+                EString last;
+                while ( w ) {
+                    last = *w;
+                    ++w;
+                }
+                int c = last.find( ':' );
+                if ( c > 0 )
+                    r->append( name + ": " + last.mid( c + 1 ) );
+            }
+            ++l;
+        }
+        return r;
+    }
+
+private:
+    EventHandler * o;
+    bool finished;
+    EString dump;
+};
+
+
 class ShowCountsData
     : public Garbage
 {
 public:
     ShowCountsData()
-        : state( 0 ), query( 0 )
+        : state( 0 ), query( 0 ), counters( 0 )
     {}
 
     int state;
     Query * query;
+    CounterReader * counters;
 };
 
 
@@ -28,7 +123,8 @@ f( "show", "counts", "Show number of users, messages etc..",
    "    as well as the total size of the mail stored.\n"
    "\n"
    "    The -f flag makes aox collect slow-but-accurate counts.\n"
-   "    Without it, by default, you get quick estimates.\n" );
+   "    Without it, by default, you get quick estimates, plus live\n"
+   "    counters from the running server if use-statistics is on.\n" );
 
 
 /*! \class ShowCounts stats.h
@@ -99,8 +195,14 @@ void ShowCounts::execute()
                     r->getInt( "bodyparts" ) );
             printf( "Addresses: %d (estimated)\n",
                     r->getInt( "addresses" ) );
-            d->state = 666;
-            finish();
+            if ( Configuration::toggle( Configuration::UseStatistics ) ) {
+                d->counters = new CounterReader( this );
+                d->state = 5;
+            }
+            else {
+                d->state = 666;
+                finish();
+            }
             return;
         }
 
@@ -176,5 +278,19 @@ void ShowCounts::execute()
         d->state = 666;
     }
 
+    if ( d->state == 5 ) {
+        if ( !d->counters->done() )
+            return;
+
+        EStringList::Iterator c( d->counters->counters() );
+        if ( c )
+            printf( "Live server counters:\n" );
+        while ( c ) {
+            printf( "  %s\n", c->cstr() );
+            ++c;
+        }
+        d->state = 666;
+    }
+
     finish();
 }
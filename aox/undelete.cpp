@@ -20,7 +20,8 @@ class UndeleteData
 {
 public:
     UndeleteData(): state( 0 ), m( 0 ), t( 0 ),
-                    find( 0 ), uidnext( 0 ), usernames( 0 ) {}
+                    find( 0 ), uidnext( 0 ), usernames( 0 ),
+                    total( 0 ), restored( 0 ) {}
 
     uint state;
     Mailbox * m;
@@ -29,6 +30,11 @@ public:
     Query * find;
     Query * uidnext;
     Query * usernames;
+
+    IntegerSet remaining;
+    IntegerSet chunk;
+    uint total;
+    uint restored;
 };
 
 
@@ -107,26 +113,15 @@ void Undelete::execute()
         d->find = s->query( 0, d->m, 0, 0, true, &wanted, true );
         d->t->enqueue( d->find );
 
-        d->uidnext = new Query( "select uidnext, nextmodseq "
-                                "from mailboxes "
-                                "where id=$1 for update", this );
-        d->uidnext->bind( 1, d->m->id() );
-        d->t->enqueue( d->uidnext );
-
         d->t->execute();
         d->state = 3;
     }
 
     if ( d->state == 3 ) {
-        if ( !d->uidnext->done() )
+        if ( !d->find->done() )
             return;
 
-        Row * r = d->uidnext->nextRow();
-        if ( !r )
-            error( "Internal error - could not read mailbox UID" );
-        uint uidnext = r->getInt( "uidnext" );
-        int64 modseq = r->getBigint( "nextmodseq" );
-
+        Row * r;
         Map<EString> logins;
         if ( d->usernames ) {
             while ( d->usernames->hasResults() ) {
@@ -164,55 +159,109 @@ void Undelete::execute()
             ++i;
         }
 
-        Query * q;
-
-        q = new Query( "create temporary sequence s start " + fn( uidnext ),
-                       0 );
-        d->t->enqueue( q );
-
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox,uid,message,modseq) "
-                       "select $1,nextval('s'),message,$2 "
-                       "from deleted_messages "
-                       "where mailbox=$1 and uid=any($3)", 0 );
-        q->bind( 1, d->m->id() );
-        q->bind( 2, modseq );
-        q->bind( 3, s );
-        d->t->enqueue( q );
-
-        q = new Query( "delete from deleted_messages "
-                       "where mailbox=$1 and uid=any($2)", 0 );
-        q->bind( 1, d->m->id() );
-        q->bind( 2, s );
-        d->t->enqueue( q );
-
-        q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
-                       "where id=$2", 0 );
-        q->bind( 1, modseq + 1 );
-        q->bind( 2, d->m->id() );
-        d->t->enqueue( q );
-
-        d->t->enqueue( new Query( "drop sequence s", 0 ) );
-
-        Mailbox::refreshMailboxes( d->t );
-
-        if ( opt( 'n' ) ) {
-            printf( "aox: Cancelling undeleting due to -n. Rerun without -n to actually undelete.\n" );
-            d->t->rollback();
-        }
-        else {
-            d->t->commit();
-        }
+        d->remaining = s;
+        d->total = s.count();
         d->state = 4;
     }
 
-    if ( d->state == 4 ) {
-        if ( !d->t->done() )
-            return;
+    // the restore proceeds in chunks, each a transaction of its own,
+    // so an accidental bulk deletion can be rolled back without hours
+    // of lock-holding and with visible progress. -n keeps everything
+    // in one transaction, since it's rolled back anyway.
+
+    while ( d->state >= 4 ) {
+        if ( d->state == 4 ) {
+            d->chunk = d->remaining;
+            if ( !opt( 'n' ) && d->chunk.count() > 32768 ) {
+                uint last = d->chunk.value( 32768 );
+                d->chunk.remove( last + 1, d->chunk.largest() );
+                d->remaining.remove( 1, last );
+            }
+            else {
+                d->remaining.clear();
+            }
+
+            d->uidnext = new Query( "select uidnext, nextmodseq "
+                                    "from mailboxes "
+                                    "where id=$1 for update", this );
+            d->uidnext->bind( 1, d->m->id() );
+            d->t->enqueue( d->uidnext );
+            d->t->execute();
+            d->state = 5;
+        }
 
-        if ( d->t->failed() )
-            error( "Undelete failed." );
-        finish();
+        if ( d->state == 5 ) {
+            if ( !d->uidnext->done() )
+                return;
+
+            Row * r = d->uidnext->nextRow();
+            if ( !r )
+                error( "Internal error - could not read mailbox UID" );
+            uint uidnext = r->getInt( "uidnext" );
+            int64 modseq = r->getBigint( "nextmodseq" );
+
+            Query * q;
+
+            q = new Query( "create temporary sequence s start " +
+                           fn( uidnext ), 0 );
+            d->t->enqueue( q );
+
+            q = new Query( "insert into mailbox_messages "
+                           "(mailbox,uid,message,modseq) "
+                           "select $1,nextval('s'),message,$2 "
+                           "from deleted_messages "
+                           "where mailbox=$1 and uid=any($3)", 0 );
+            q->bind( 1, d->m->id() );
+            q->bind( 2, modseq );
+            q->bind( 3, d->chunk );
+            d->t->enqueue( q );
+
+            q = new Query( "delete from deleted_messages "
+                           "where mailbox=$1 and uid=any($2)", 0 );
+            q->bind( 1, d->m->id() );
+            q->bind( 2, d->chunk );
+            d->t->enqueue( q );
+
+            q = new Query( "update mailboxes "
+                           "set uidnext=nextval('s'), nextmodseq=$1 "
+                           "where id=$2", 0 );
+            q->bind( 1, modseq + 1 );
+            q->bind( 2, d->m->id() );
+            d->t->enqueue( q );
+
+            d->t->enqueue( new Query( "drop sequence s", 0 ) );
+
+            Mailbox::refreshMailboxes( d->t );
+
+            if ( opt( 'n' ) ) {
+                printf( "aox: Cancelling undeleting due to -n. Rerun without -n to actually undelete.\n" );
+                d->t->rollback();
+            }
+            else {
+                d->t->commit();
+            }
+            d->state = 6;
+        }
+
+        if ( d->state == 6 ) {
+            if ( !d->t->done() )
+                return;
+
+            if ( d->t->failed() )
+                error( "Undelete failed." );
+
+            d->restored += d->chunk.count();
+            if ( !opt( 'n' ) )
+                printf( "aox: Undeleted %d of %d messages.\n",
+                        d->restored, d->total );
+
+            if ( d->remaining.isEmpty() ) {
+                finish();
+                return;
+            }
+
+            d->t = new Transaction( this );
+            d->state = 4;
+        }
     }
 }
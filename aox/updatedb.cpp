@@ -34,91 +34,63 @@ public:
 };
 
 
-class UpdateDatabaseData
-    : public Garbage
+// threads the messages whose ids lie in (sofar,rangeEnd], one
+// chunk-sized transaction at a time, and notifies its owner when the
+// range is exhausted. several workers can run at once, each on its
+// own database handle, as long as their ranges are disjoint.
+
+class ThreadingWorker
+    : public EventHandler
 {
 public:
-    UpdateDatabaseData()
-        : Garbage(), t( 0 ),
-          findMessages( 0 ),
-          threader( 0 ),
-          messages( 0 ), byMessageId( 0 ),
-          report( 0 ), temp( 0 ), update( 0 ),
-          sofar( 0 ), threading( true )
-        {}
+    ThreadingWorker( EventHandler * owner, uint from, uint to )
+        : t( 0 ), findMessages( 0 ), threader( 0 ),
+          messages( 0 ), byMessageId( 0 ), temp( 0 ), update( 0 ),
+          owner( owner ), sofar( from ), rangeEnd( to ),
+          processed( 0 ), finished( false )
+    {}
+
+    void execute();
 
     Transaction * t;
     Query * findMessages;
     ThreadRootCreator * threader;
     List<ThreadRootCreator::Message> * messages;
     Dict<DbMessage> * byMessageId;
-
-    Query * report;
     Query * temp;
     Query * update;
-
+    EventHandler * owner;
     uint sofar;
-
-    bool threading;
+    uint rangeEnd;
+    uint processed;
+    bool finished;
+    EString err;
 };
 
 
-static AoxFactory<UpdateDatabase>
-f( "update", "database", "Update the database contents.",
-   "    Synopsis: aox update database\n\n"
-   "    Performs any updates to the database contents which are too\n"
-   "    slow for inclusion in \"aox upgrade schema\". This command is\n"
-   "    meant to be used while the server is running. It does its\n"
-   "    work in small chunks, so it can be restarted at any time,\n"
-   "    and is tolerant of interruptions.\n" );
-
-
-/*! \class UpdateDatabase updatedb.h
-    This class handles the "aox update database" command.
-*/
-
-UpdateDatabase::UpdateDatabase( EStringList * args )
-    : AoxCommand( args ), d( new UpdateDatabaseData )
+void ThreadingWorker::execute()
 {
-}
-
-
-void UpdateDatabase::execute()
-{
-    if ( !d->threading )
+    if ( finished )
         return;
 
-    if ( !d->report ) {
-        database( true );
-        d->report
-            = new Query( "select count(*)::integer as threadnull "
-                         "from messages where thread_root is null",
-                         this );
-        d->report->execute();
-    }
-    if ( !d->report->done() )
-        return;
-    if ( d->report->hasResults() ) {
-        Row * r = d->report->nextRow();
-        printf( "Messages that might need threading: %d.\n",
-                r->getInt( "threadnull" ) );
-    }
-
-    if ( d->t && d->t->done() ) {
-        if ( d->t->failed() )
-            error( "Transaction failed: " + d->t->error() );
-        d->t = 0;
-        if ( d->update && d->update->rows() )
+    if ( t && t->done() ) {
+        if ( t->failed() ) {
+            err = "Transaction failed: " + t->error();
+            finished = true;
+            owner->notify();
+            return;
+        }
+        t = 0;
+        if ( update && update->rows() ) {
+            processed += update->rows();
             printf( "Processed %d messages.\nCommitted transaction.\n",
-                    d->update->rows() );
+                    update->rows() );
+        }
     }
 
-    end();
-
-    if ( !d->t ) {
-        printf( "Looking for 4096 more messages to thread.\n" );
-        d->t = new Transaction( this );
-        d->findMessages
+    if ( !t ) {
+        t = new Transaction( this );
+        findMessages
             = new Query( "select m.id, msgid.value as messageid, "
                          "ref.value as references "
                          "from messages m "
@@ -126,30 +98,32 @@ void UpdateDatabase::execute()
                          " (m.id=msgid.message and msgid.field=$2 and msgid.part='') "
                          "left join header_fields ref on"
                          " (m.id=ref.message and ref.field=$3 and ref.part='') "
-                         "where m.thread_root is null and m.id>$1 "
+                         "where m.thread_root is null "
+                         "and m.id>$1 and m.id<=$4 "
                          "order by id limit 4096", this );
-        d->findMessages->bind( 1, d->sofar );
-        d->findMessages->bind( 2, HeaderField::MessageId );
-        d->findMessages->bind( 3, HeaderField::References );
-        d->t->enqueue( d->findMessages );
-        d->t->execute();
-        d->messages = new List<ThreadRootCreator::Message>();
-        d->byMessageId = new Dict<DbMessage>();
-        d->threader = 0;
-        d->temp = 0;
-        d->update = 0;
+        findMessages->bind( 1, sofar );
+        findMessages->bind( 2, HeaderField::MessageId );
+        findMessages->bind( 3, HeaderField::References );
+        findMessages->bind( 4, rangeEnd );
+        t->enqueue( findMessages );
+        t->execute();
+        messages = new List<ThreadRootCreator::Message>();
+        byMessageId = new Dict<DbMessage>();
+        threader = 0;
+        temp = 0;
+        update = 0;
     }
 
-    while ( d->findMessages->hasResults() ) {
-        Row * r = d->findMessages->nextRow();
+    while ( findMessages->hasResults() ) {
+        Row * r = findMessages->nextRow();
         DbMessage * m = new DbMessage;
         m->id = r->getInt( "id" );
-        m->t = d->t;
-        if ( m->id > d->sofar )
-            d->sofar = m->id;
+        m->t = t;
+        if ( m->id > sofar )
+            sofar = m->id;
         if ( !r->isNull( "messageid" ) ) {
             m->mid = r->getEString( "messageid" );
-            d->byMessageId->insert( m->mid, m );
+            byMessageId->insert( m->mid, m );
         }
         if ( !r->isNull( "references" ) ) {
             AddressParser * ap
@@ -162,45 +136,46 @@ void UpdateDatabase::execute()
             }
         }
         if ( !m->mid.isEmpty() )
-            d->messages->append( m );
+            messages->append( m );
     }
 
-    if ( !d->findMessages->done() )
+    if ( !findMessages->done() )
         return;
 
-    if ( d->messages->isEmpty() ) {
-        d->threading = false;
-        printf( "All messages are now threaded.\n" );
-        finish();
+    if ( messages->isEmpty() ) {
+        finished = true;
+        t->rollback();
+        t = 0;
+        owner->notify();
         return;
     }
 
-    if ( !d->threader ) {
+    if ( !threader ) {
         printf( "%s",
-                ("Threading " + fn( d->messages->count() ) +
+                ("Threading " + fn( messages->count() ) +
                  " messages.\n").cstr() );
-        d->threader = new ThreadRootCreator( d->messages, d->t );
-        d->threader->execute();
-        d->temp = new Query( "create temporary table md ("
-                             "message integer,"
-                             "messageid text,"
-                             "thread_root integer"
-                             ")", this );
-        d->t->enqueue( d->temp );
-        d->t->execute();
+        threader = new ThreadRootCreator( messages, t );
+        threader->execute();
+        temp = new Query( "create temporary table md ("
+                          "message integer,"
+                          "messageid text,"
+                          "thread_root integer"
+                          ")", this );
+        t->enqueue( temp );
+        t->execute();
     }
 
-    if ( !d->temp->done() )
+    if ( !temp->done() )
         return;
 
-    if ( !d->update ) {
+    if ( !update ) {
         Query * q = new Query( "copy md( message, messageid, thread_root ) "
-                             "from stdin with binary", 0 );
+                               "from stdin with binary", 0 );
         Dict<ThreadRootCreator::ThreadNode>::Iterator
-            i( d->threader->threadNodes() );
+            i( threader->threadNodes() );
         while ( i ) {
             ThreadRootCreator::ThreadNode * n = i;
-            DbMessage * m = d->byMessageId->find( n->id );
+            DbMessage * m = byMessageId->find( n->id );
             if ( m ) {
                 q->bind( 1, m->id );
                 q->bind( 2, n->id );
@@ -211,43 +186,167 @@ void UpdateDatabase::execute()
             }
             ++i;
         }
-        d->t->enqueue( q );
+        t->enqueue( q );
 
         // occasionally messages are duplicated. thread all duplicates.
-        d->t->enqueue( "insert into md( message, messageid, thread_root ) "
-                       "select m.id, md.messageid, md.thread_root"
-                       "  from messages m"
-                       "  join header_fields hf on"
-                       "   (m.id=hf.message and hf.field=13 and hf.part='')"
-                       "  join md on (hf.value=md.messageid)"
-                       "  where m.id!=md.message and m.thread_root is null" );
+        t->enqueue( "insert into md( message, messageid, thread_root ) "
+                    "select m.id, md.messageid, md.thread_root"
+                    "  from messages m"
+                    "  join header_fields hf on"
+                    "   (m.id=hf.message and hf.field=13 and hf.part='')"
+                    "  join md on (hf.value=md.messageid)"
+                    "  where m.id!=md.message and m.thread_root is null" );
 
         // lock for nextmodseq in the right order
-        d->t->enqueue( "select * from mailboxes "
-                       "where id in ("
-                       "select mm.mailbox from mailbox_messages mm "
-                       "join md using (message)"
-                       ") order by id for update" );
+        t->enqueue( "select * from mailboxes "
+                    "where id in ("
+                    "select mm.mailbox from mailbox_messages mm "
+                    "join md using (message)"
+                    ") order by id for update" );
         // write the changes from the temptable
-        d->update = new Query( "update messages set "
-                               "thread_root=md.thread_root "
-                               "from md "
-                               "where id=md.message", this );
-        d->t->enqueue( d->update );
+        update = new Query( "update messages set "
+                            "thread_root=md.thread_root "
+                            "from md "
+                            "where id=md.message", this );
+        t->enqueue( update );
         // update modseq on all affected messages
-        d->t->enqueue( "update mailbox_messages "
-                       "set modseq=mailboxes.nextmodseq "
-                       "from md, mailboxes "
-                       "where mailbox_messages.message=md.message "
-                       "and mailbox=mailboxes.id" );
+        t->enqueue( "update mailbox_messages "
+                    "set modseq=mailboxes.nextmodseq "
+                    "from md, mailboxes "
+                    "where mailbox_messages.message=md.message "
+                    "and mailbox=mailboxes.id" );
         // ... and the mailboxes' nextmodseq
-        d->t->enqueue( "update mailboxes set nextmodseq=nextmodseq+1 "
-                       "where id in ("
-                       "select mm.mailbox from mailbox_messages mm "
-                       "join md using (message)"
-                       ")" );
-        d->t->enqueue( "notify mailboxes_updated" );
-        d->t->enqueue( "drop table md" );
-        d->t->commit();
+        t->enqueue( "update mailboxes set nextmodseq=nextmodseq+1 "
+                    "where id in ("
+                    "select mm.mailbox from mailbox_messages mm "
+                    "join md using (message)"
+                    ")" );
+        t->enqueue( "notify mailboxes_updated" );
+        t->enqueue( "drop table md" );
+        t->commit();
+    }
+}
+
+
+class UpdateDatabaseData
+    : public Garbage
+{
+public:
+    UpdateDatabaseData()
+        : Garbage(),
+          report( 0 ), bounds( 0 ), workers( 0 ), handles( 1 )
+        {}
+
+    Query * report;
+    Query * bounds;
+    List<ThreadingWorker> * workers;
+    uint handles;
+};
+
+
+static AoxFactory<UpdateDatabase>
+f( "update", "database", "Update the database contents.",
+   "    Synopsis: aox update database [-p...]\n\n"
+   "    Performs any updates to the database contents which are too\n"
+   "    slow for inclusion in \"aox upgrade schema\". This command is\n"
+   "    meant to be used while the server is running. It does its\n"
+   "    work in small chunks, so it can be restarted at any time,\n"
+   "    is tolerant of interruptions, and resumes where the last\n"
+   "    run stopped.\n\n"
+   "    Each -p adds one worker; workers process disjoint id ranges\n"
+   "    concurrently, each over its own database handle.\n" );
+
+
+/*! \class UpdateDatabase updatedb.h
+    This class handles the "aox update database" command.
+*/
+
+UpdateDatabase::UpdateDatabase( EStringList * args )
+    : AoxCommand( args ), d( new UpdateDatabaseData )
+{
+}
+
+
+void UpdateDatabase::execute()
+{
+    if ( !d->report ) {
+        parseOptions();
+        end();
+        d->handles = 1 + opt( 'p' );
+        if ( d->handles > 8 )
+            d->handles = 8;
+        Database::setup( d->handles, Database::DbOwner );
+        d->report
+            = new Query( "select count(*)::integer as threadnull "
+                         "from messages where thread_root is null",
+                         this );
+        d->report->execute();
+        // every id up to the first unthreaded message is done, so
+        // interrupted runs resume where the last commit stopped
+        d->bounds
+            = new Query( "select coalesce(min(m.id),0)::integer as lo, "
+                         "coalesce(max(m.id),0)::integer as hi "
+                         "from messages m "
+                         "join header_fields msgid on"
+                         " (m.id=msgid.message and msgid.field=$1 and msgid.part='') "
+                         "where m.thread_root is null", this );
+        d->bounds->bind( 1, HeaderField::MessageId );
+        d->bounds->execute();
+    }
+
+    if ( !d->report->done() || !d->bounds->done() )
+        return;
+
+    if ( d->report->hasResults() ) {
+        Row * r = d->report->nextRow();
+        printf( "Messages that might need threading: %d.\n",
+                r->getInt( "threadnull" ) );
     }
+
+    if ( !d->workers ) {
+        Row * r = d->bounds->nextRow();
+        uint lo = 0;
+        uint hi = 0;
+        if ( r ) {
+            lo = r->getInt( "lo" );
+            hi = r->getInt( "hi" );
+        }
+        d->workers = new List<ThreadingWorker>;
+        if ( lo ) {
+            uint n = d->handles;
+            if ( n > 1 + ( hi - lo ) / 4096 )
+                n = 1 + ( hi - lo ) / 4096;
+            uint span = ( hi - lo + n ) / n;
+            uint from = lo - 1;
+            uint i = 0;
+            while ( i < n ) {
+                uint to = from + span;
+                if ( to > hi || i == n - 1 )
+                    to = hi;
+                d->workers->append( new ThreadingWorker( this, from, to ) );
+                from = to;
+                i++;
+            }
+            if ( n > 1 )
+                printf( "Threading ids %d-%d using %d workers.\n",
+                        lo, hi, n );
+            List<ThreadingWorker>::Iterator w( d->workers );
+            while ( w ) {
+                w->execute();
+                ++w;
+            }
+        }
+    }
+
+    List<ThreadingWorker>::Iterator w( d->workers );
+    while ( w ) {
+        if ( !w->err.isEmpty() )
+            error( w->err );
+        if ( !w->finished )
+            return;
+        ++w;
+    }
+
+    printf( "All messages are now threaded.\n" );
+    finish();
 }
@@ -542,6 +542,7 @@ void ChangeUsername::execute()
             d->t->enqueue( q );
         }
 
+        d->t->enqueue( new Query( "notify users_updated", 0 ) );
         d->t->commit();
         d->query = 0;
     }
@@ -643,6 +644,7 @@ void ChangeAddress::execute()
         d->query->bind( 1, d->user->id() );
         d->query->bind( 2, d->address->id() );
         d->t->enqueue( d->query );
+        d->t->enqueue( new Query( "notify users_updated", 0 ) );
         d->t->commit();
     }
 
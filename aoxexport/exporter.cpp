@@ -8,6 +8,7 @@
 #include "mailbox.h"
 #include "message.h"
 #include "fetcher.h"
+#include "transaction.h"
 #include "query.h"
 #include "date.h"
 #include "list.h"
@@ -21,12 +22,13 @@ class ExporterData
 {
 public:
     ExporterData()
-        : find( 0 ), fetcher( 0 ),
+        : find( 0 ), t( 0 ), fetcher( 0 ),
           mailbox( 0 ), selector( 0 ),
           messages( new List<Message> )
         {}
 
     Query * find;
+    Transaction * t;
     Fetcher * fetcher;
     UString sourceName;
     Mailbox * mailbox;
@@ -77,18 +79,39 @@ void Exporter::execute()
         }
     }
 
-    if ( !d->find ) {
+    if ( !d->t ) {
+        // we read the matches through a cursor, so that we hold (and
+        // fetch, and render) only a batch at a time no matter how big
+        // the export is, and start writing as soon as the first batch
+        // arrives
         EStringList wanted;
         wanted.append( "message" );
-        d->find = d->selector->query( 0, d->mailbox, 0, this,
-                                      true, &wanted, false );
-        d->find->execute();
+        Query * q = d->selector->query( 0, d->mailbox, 0, this,
+                                        true, &wanted, false );
+        q->setString( "declare export cursor for " + q->string() );
+        d->t = new Transaction( this );
+        d->t->enqueue( q );
+        d->find = new Query( "fetch 256 from export", this );
+        d->t->enqueue( d->find );
+        d->t->execute();
     }
 
-    if ( !d->find->done() )
+    if ( d->t->failed() ) {
+        log( "Database error: " + d->t->error(), Log::Disaster );
+        EventLoop::global()->stop();
         return;
+    }
 
     if ( !d->fetcher ) {
+        if ( !d->find->done() )
+            return;
+        if ( !d->find->rows() ) {
+            // the cursor is exhausted, so we're done
+            d->t->commit();
+            if ( d->t->done() )
+                EventLoop::global()->stop();
+            return;
+        }
         d->messages = new List<Message>;
         while ( d->find->hasResults() ) {
             Row * r = d->find->nextRow();
@@ -162,6 +185,10 @@ void Exporter::execute()
         r = r;
     }
 
-    EventLoop::global()->stop();
+    // this batch is written; ask the cursor for the next one
+    d->fetcher = 0;
+    d->find = new Query( "fetch 256 from export", this );
+    d->t->enqueue( d->find );
+    d->t->execute();
 }
 
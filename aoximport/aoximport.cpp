@@ -10,6 +10,7 @@
 #include "database.h"
 #include "mailbox.h"
 #include "entropy.h"
+#include "timer.h"
 #include "flag.h"
 #include "log.h"
 #include "utf.h"
@@ -38,6 +39,22 @@ int main( int ac, char ** av )
 
     int i = 1;
     while( i < ac && *av[i] == '-' ) {
+        if ( av[i][1] == 'j' && !av[i][2] ) {
+            if ( i + 1 < ac )
+                Migrator::setJournal( av[++i] );
+            else
+                bad = true;
+            i++;
+            continue;
+        }
+        if ( av[i][1] == 'C' && !av[i][2] ) {
+            if ( i + 1 < ac )
+                Migrator::setCopyDirectory( av[++i] );
+            else
+                bad = true;
+            i++;
+            continue;
+        }
         uint j = 1;
         while ( av[i][j] ) {
             switch( av[i][j] ) {
@@ -87,17 +104,23 @@ int main( int ac, char ** av )
 
     if ( bad ) {
         fprintf( stderr,
-                 "Usage: %s [-vq] "
+                 "Usage: %s [-vqe] [-j journal] [-C directory] "
                  "<mailbox> <type> <source [, source ...]>\n"
                  "See aoximport(8) for details.\n", av[0] );
         exit( -1 );
     }
 
     Entropy::setup();
-    Database::setup();
-    Mailbox::setup( m );
-
-    Flag::setup();
+    if ( Migrator::offline() ) {
+        // copy-dump mode doesn't touch the database at all; just
+        // start the migrator once the event loop runs
+        (void)new Timer( m, 0 );
+    }
+    else {
+        Database::setup();
+        Mailbox::setup( m );
+        Flag::setup();
+    }
 
     uint limit = Configuration::scalar( Configuration::MemoryLimit );
     if ( !limit )
@@ -0,0 +1,828 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "copydump.h"
+
+#include "file.h"
+#include "dict.h"
+#include "list.h"
+#include "injector.h"
+#include "integerset.h"
+#include "estringlist.h"
+#include "addressfield.h"
+#include "imapstructure.h"
+#include "helperrowcreator.h"
+#include "mimefields.h"
+#include "datefield.h"
+#include "bodypart.h"
+#include "address.h"
+#include "message.h"
+#include "header.h"
+#include "field.h"
+#include "html.h"
+#include "date.h"
+#include "md5.h"
+#include "utf.h"
+
+#include <sys/stat.h> // mkdir
+#include <unistd.h> // getcwd
+
+
+// One COPY text-format data file. Rows are buffered and written in
+// 64KB chunks, so a terabyte dump doesn't do a write() per row.
+
+class CopyFile
+    : public Garbage
+{
+public:
+    CopyFile( const EString & name )
+        : f( new File( name, File::Write, 0644 ) )
+    {}
+
+    void add( const EString & row ) {
+        b.append( row );
+        if ( b.length() >= 65536 )
+            flush();
+    }
+
+    void flush() {
+        if ( b.isEmpty() )
+            return;
+        f->write( b );
+        b.truncate();
+    }
+
+    bool valid() const { return f->valid(); }
+    EString name() const { return f->name(); }
+
+    File * f;
+    EString b;
+};
+
+
+// A numeric id, so Dict can map strings to assigned serial values.
+
+class Id
+    : public Garbage
+{
+public:
+    Id( uint i ): n( i ) {}
+    uint n;
+};
+
+
+// The id and uid counter for one destination mailbox.
+
+class MailboxDump
+    : public Garbage
+{
+public:
+    MailboxDump(): id( 0 ), uidnext( 1 ) {}
+    uint id;
+    uint uidnext;
+    EString name;
+};
+
+
+class CopyDumperData
+    : public Garbage
+{
+public:
+    CopyDumperData()
+        : messages( 0 ), bodyparts( 0 ), partNumbers( 0 ),
+          headerFields( 0 ), addressFields( 0 ), dateFields( 0 ),
+          addresses( 0 ), fieldNames( 0 ), flagNames( 0 ), flags( 0 ),
+          mailboxMessages( 0 ), unparsedMessages( 0 ),
+          bodystructures( 0 ), sortKeys( 0 ),
+          messageId( 0 ), bodypartId( 0 ), addressId( 0 ),
+          fieldNameId( HeaderField::Other - 1 ), flagNameId( 5 ),
+          mailboxId( 0 ), finished( false )
+    {}
+
+    EString dir;
+    EString error;
+
+    CopyFile * messages;
+    CopyFile * bodyparts;
+    CopyFile * partNumbers;
+    CopyFile * headerFields;
+    CopyFile * addressFields;
+    CopyFile * dateFields;
+    CopyFile * addresses;
+    CopyFile * fieldNames;
+    CopyFile * flagNames;
+    CopyFile * flags;
+    CopyFile * mailboxMessages;
+    CopyFile * unparsedMessages;
+    CopyFile * bodystructures;
+    CopyFile * sortKeys;
+    List<CopyFile> files;
+
+    // the last id used in each table. the dump targets a freshly
+    // installed schema, so the well-known field_names and flag_names
+    // rows exist and everything else starts just past empty.
+    uint messageId;
+    uint bodypartId;
+    uint addressId;
+    uint fieldNameId;
+    uint flagNameId;
+    uint mailboxId;
+
+    Dict<Id> bodypartIds;
+    Dict<Id> addressIds;
+    Dict<Id> fieldNameIds;
+    Dict<Id> flagNameIds;
+    Dict<MailboxDump> mailboxes;
+    List<MailboxDump> mailboxList;
+    IntegerSet unparsed;
+
+    bool finished;
+};
+
+
+// Escapes s for the text form of COPY: backslash, tab, CR and LF are
+// the characters postgres treats specially there.
+
+static EString escaped( const EString & s )
+{
+    EString r;
+    r.reserve( s.length() );
+    uint i = 0;
+    while ( i < s.length() ) {
+        char c = s[i];
+        switch ( c ) {
+        case '\\':
+            r.append( "\\\\" );
+            break;
+        case '\t':
+            r.append( "\\t" );
+            break;
+        case '\r':
+            r.append( "\\r" );
+            break;
+        case '\n':
+            r.append( "\\n" );
+            break;
+        default:
+            r.append( c );
+            break;
+        }
+        i++;
+    }
+    return r;
+}
+
+
+// Opens name within d->dir and remembers the file for flushing.
+
+static CopyFile * output( CopyDumperData * d, const char * name )
+{
+    CopyFile * f = new CopyFile( d->dir + "/" + name );
+    d->files.append( f );
+    if ( !f->valid() && d->error.isEmpty() )
+        d->error = "Cannot write to " + f->name();
+    return f;
+}
+
+
+/*! \class CopyDumper copydump.h
+
+    The CopyDumper writes parsed messages as PostgreSQL COPY
+    text-format data files instead of injecting them, plus a load.sql
+    that loads the files with server-side COPY and fixes the sequences
+    afterwards. For initial migrations measured in terabytes, loading
+    such a dump is much faster than even a batched Injector, since the
+    per-message transaction and round-trip work disappears entirely.
+
+    The dump assigns all ids itself, starting at 1, so it can only be
+    loaded into a freshly installed schema, before any users or
+    messages exist. The row logic mirrors Injector's: bodyparts are
+    deduplicated by content hash, addresses by AddressCreator::key(),
+    and the bodystructures and sort_keys caches are filled in so the
+    imported mail is as fast to serve as injected mail.
+*/
+
+
+/*! Constructs a CopyDumper writing to \a directory, which is created
+    if necessary. valid() reports whether the data files could be
+    opened.
+*/
+
+CopyDumper::CopyDumper( const EString & directory )
+    : d( new CopyDumperData )
+{
+    d->dir = directory;
+    if ( !directory.startsWith( "/" ) ) {
+        // load.sql quotes these names for the server, which doesn't
+        // share our working directory
+        char buf[1025];
+        if ( getcwd( buf, 1024 ) )
+            d->dir = EString( buf ) + "/" + directory;
+    }
+    ::mkdir( d->dir.cstr(), 0777 );
+
+    d->messages = output( d, "messages.copy" );
+    d->bodyparts = output( d, "bodyparts.copy" );
+    d->partNumbers = output( d, "part_numbers.copy" );
+    d->headerFields = output( d, "header_fields.copy" );
+    d->addressFields = output( d, "address_fields.copy" );
+    d->dateFields = output( d, "date_fields.copy" );
+    d->addresses = output( d, "addresses.copy" );
+    d->fieldNames = output( d, "field_names.copy" );
+    d->flagNames = output( d, "flag_names.copy" );
+    d->flags = output( d, "flags.copy" );
+    d->mailboxMessages = output( d, "mailbox_messages.copy" );
+    d->unparsedMessages = output( d, "unparsed_messages.copy" );
+    d->bodystructures = output( d, "bodystructures.copy" );
+    d->sortKeys = output( d, "sort_keys.copy" );
+}
+
+
+/*! Returns true if all the data files could be opened for writing,
+    and false if not.
+*/
+
+bool CopyDumper::valid() const
+{
+    return d->error.isEmpty();
+}
+
+
+/*! Returns an error message if valid() is false, and an empty string
+    if all is well.
+*/
+
+EString CopyDumper::error() const
+{
+    return d->error;
+}
+
+
+/*! Writes rows for \a m, delivered into \a mailbox with \a flags, to
+    the data files. This mirrors what Injector does to its tables, but
+    synchronously and with locally assigned ids.
+*/
+
+void CopyDumper::add( Injectee * m, const UString & mailbox,
+                      const EStringList * flags )
+{
+    PgUtf8Codec u;
+
+    EString mn( u.fromUnicode( mailbox ) );
+    MailboxDump * mb = d->mailboxes.find( mn );
+    if ( !mb ) {
+        mb = new MailboxDump;
+        mb->id = ++d->mailboxId;
+        mb->name = mn;
+        d->mailboxes.insert( mn, mb );
+        d->mailboxList.append( mb );
+    }
+    uint uid = mb->uidnext++;
+
+    uint mid = ++d->messageId;
+
+    EString r;
+    r.appendNumber( mid );
+    r.append( '\t' );
+    r.appendNumber( internalDate( m ) );
+    r.append( '\t' );
+    r.appendNumber( m->rfc822Size() );
+    r.append( '\n' );
+    d->messages->add( r );
+
+    // assigns bodypart ids, which addPartNumber() needs below
+    addBodyparts( m );
+
+    // the top-level header fields are linked to a special part named
+    // "" that does not correspond to any entry in the bodyparts table
+    addPartNumber( mid, "" );
+    addHeader( mid, "", m->header() );
+
+    // the serialized ENVELOPE/BODYSTRUCTURE and the normalized sort
+    // keys, so imported messages are as cheap to serve as injected
+    // ones
+    r.truncate();
+    r.appendNumber( mid );
+    r.append( '\t' );
+    r.append( escaped( ImapStructure::envelope( m, false ) ) );
+    r.append( '\t' );
+    r.append( escaped( ImapStructure::bodyStructure( m, true, false ) ) );
+    r.append( '\n' );
+    d->bodystructures->add( r );
+
+    r.truncate();
+    r.appendNumber( mid );
+    r.append( '\t' );
+    HeaderField * sf = m->header()->field( HeaderField::Subject );
+    if ( sf )
+        r.append( escaped( u.fromUnicode(
+                      Message::baseSubject( sf->value().simplified() ) ) ) );
+    else
+        r.append( "\\N" );
+    r.append( '\t' );
+    List<Address> * fl = m->header()->addresses( HeaderField::From );
+    if ( fl && !fl->isEmpty() )
+        r.append( escaped( u.fromUnicode( fl->first()->localpart() ) ) );
+    else
+        r.append( "\\N" );
+    r.append( '\n' );
+    d->sortKeys->add( r );
+
+    // the MIME header fields belonging to the first-child of a
+    // single-part message are part of the RFC 822 header, so they
+    // must not be dumped again
+    bool skip = false;
+    ContentType * ct = m->header()->contentType();
+    if ( !ct || ct->type() != "multipart" )
+        skip = true;
+
+    Bodypart * pgp = 0;
+    if ( m->hasPGPsignedPart() ) {
+        pgp = m->children()->shift(); // avoid starting pns with 2
+        addPartNumber( mid, "raw-pgp-signed", pgp );
+    }
+    List<Bodypart>::Iterator bi( m->allBodyparts() );
+    while ( bi ) {
+        Bodypart * b = bi;
+        EString pn( m->partNumber( b ) );
+
+        addPartNumber( mid, pn, b );
+        if ( !skip )
+            addHeader( mid, pn, b->header() );
+        else
+            skip = false;
+
+        // message/rfc822 bodyparts get a special part number too
+        if ( b->message() ) {
+            EString rpn( pn + ".rfc822" );
+            addPartNumber( mid, rpn, b );
+            addHeader( mid, rpn, b->message()->header() );
+        }
+
+        if ( m->isWrapped() && pn == "2" &&
+             !d->unparsed.contains( b->id() ) ) {
+            d->unparsed.add( b->id() );
+            r.truncate();
+            r.appendNumber( b->id() );
+            r.append( '\n' );
+            d->unparsedMessages->add( r );
+        }
+
+        ++bi;
+    }
+    if ( pgp )
+        m->children()->prepend( pgp );
+
+    bool seen = false;
+    bool deleted = false;
+    EStringList::Iterator fi( flags );
+    while ( fi ) {
+        EString n = fi->lower();
+        ++fi;
+        if ( n == "\\seen" ) {
+            seen = true;
+        }
+        else if ( n == "\\deleted" ) {
+            deleted = true;
+        }
+        else {
+            r.truncate();
+            r.appendNumber( mb->id );
+            r.append( '\t' );
+            r.appendNumber( uid );
+            r.append( '\t' );
+            r.appendNumber( flagNameId( n ) );
+            r.append( '\n' );
+            d->flags->add( r );
+        }
+    }
+
+    r.truncate();
+    r.appendNumber( mb->id );
+    r.append( '\t' );
+    r.appendNumber( uid );
+    r.append( '\t' );
+    r.appendNumber( mid );
+    r.append( '\t' );
+    r.append( '1' ); // modseq
+    r.append( '\t' );
+    r.append( seen ? 't' : 'f' );
+    r.append( '\t' );
+    r.append( deleted ? 't' : 'f' );
+    r.append( '\n' );
+    d->mailboxMessages->add( r );
+}
+
+
+/*! Writes a bodyparts row for each new bodypart of \a m, and sets the
+    id on every bodypart. Deduplication mirrors
+    Injector::addBodypartRow(), except that the content hash only has
+    to be compared against this dump, not against the database.
+*/
+
+void CopyDumper::addBodyparts( Injectee * m )
+{
+    List<Bodypart>::Iterator bi( m->allBodyparts() );
+    while ( bi ) {
+        Bodypart * b = bi;
+        ++bi;
+
+        bool storeText = false;
+        bool storeData = false;
+
+        ContentType * ct = b->contentType();
+        if ( ct ) {
+            if ( ct->type() == "text" ) {
+                storeText = true;
+                if ( ct->subtype() == "html" )
+                    storeData = true;
+            }
+            else {
+                storeData = true;
+                if ( ct->type() == "multipart" && ct->subtype() != "signed" )
+                    storeData = false;
+                if ( ct->type() == "message" && ct->subtype() == "rfc822" )
+                    storeData = false;
+            }
+        }
+        else {
+            storeText = true;
+        }
+
+        if ( !( storeText || storeData ) )
+            continue;
+
+        PgUtf8Codec u;
+        EString * s;
+        EString * text = 0;
+        EString * data = 0;
+
+        if ( storeText ) {
+            text = s = new EString( u.fromUnicode( b->text() ) );
+            if ( storeData ) {
+                data = s;
+                text =
+                    new EString( u.fromUnicode( HTML::asText( b->text() ) ) );
+            }
+        }
+        else {
+            data = s = new EString( b->data() );
+        }
+        EString hash = MD5::hash( *s ).hex();
+
+        Id * i = d->bodypartIds.find( hash );
+        if ( !i ) {
+            i = new Id( ++d->bodypartId );
+            d->bodypartIds.insert( hash, i );
+            EString r;
+            r.appendNumber( i->n );
+            r.append( '\t' );
+            r.appendNumber( b->numBytes() );
+            r.append( '\t' );
+            r.append( hash );
+            r.append( '\t' );
+            if ( text )
+                r.append( escaped( *text ) );
+            else
+                r.append( "\\N" );
+            r.append( '\t' );
+            if ( data ) {
+                r.append( "\\\\x" );
+                r.append( data->hex() );
+            }
+            else {
+                r.append( "\\N" );
+            }
+            r.append( '\n' );
+            d->bodyparts->add( r );
+        }
+        b->setId( i->n );
+    }
+}
+
+
+/*! Writes a part_numbers row for the given \a part of the message
+    with id \a mid, describing the bodypart \a b (null for the
+    top-level part "").
+*/
+
+void CopyDumper::addPartNumber( uint mid, const EString & part,
+                                Bodypart * b )
+{
+    EString r;
+    r.appendNumber( mid );
+    r.append( '\t' );
+    r.append( escaped( part ) );
+    r.append( '\t' );
+    if ( b ) {
+        if ( b->id() )
+            r.appendNumber( b->id() );
+        else
+            r.append( "\\N" );
+        r.append( '\t' );
+        r.appendNumber( b->numEncodedBytes() );
+        r.append( '\t' );
+        r.appendNumber( b->numEncodedLines() );
+    }
+    else {
+        r.append( "\\N\t\\N\t\\N" );
+    }
+    r.append( '\n' );
+    d->partNumbers->add( r );
+}
+
+
+/*! Writes a row for each field of the header \a h (belonging to the
+    given \a part of the message with id \a mid) to the
+    header_fields, address_fields or date_fields file, depending on
+    its type.
+*/
+
+void CopyDumper::addHeader( uint mid, const EString & part, Header * h )
+{
+    PgUtf8Codec u;
+    List<HeaderField>::Iterator it( h->fields() );
+    while ( it ) {
+        HeaderField * hf = it;
+
+        if ( hf->type() <= HeaderField::LastAddressField ) {
+            List<Address> * al = ((AddressField *)hf)->addresses();
+            List<Address>::Iterator ai( al );
+            uint n = 0;
+            while ( ai ) {
+                EString r;
+                r.appendNumber( mid );
+                r.append( '\t' );
+                r.append( escaped( part ) );
+                r.append( '\t' );
+                r.appendNumber( hf->position() );
+                r.append( '\t' );
+                r.appendNumber( hf->type() );
+                r.append( '\t' );
+                r.appendNumber( n );
+                r.append( '\t' );
+                r.appendNumber( addressId( ai ) );
+                r.append( '\n' );
+                d->addressFields->add( r );
+                ++ai;
+                ++n;
+            }
+        }
+        else {
+            uint t = hf->type();
+            if ( t == HeaderField::Other )
+                t = fieldNameId( hf->name() );
+
+            EString r;
+            r.appendNumber( mid );
+            r.append( '\t' );
+            r.append( escaped( part ) );
+            r.append( '\t' );
+            r.appendNumber( hf->position() );
+            r.append( '\t' );
+            r.appendNumber( t );
+            r.append( '\t' );
+            r.append( escaped( u.fromUnicode( hf->value() ) ) );
+            r.append( '\n' );
+            d->headerFields->add( r );
+
+            if ( part.isEmpty() && hf->type() == HeaderField::Date ) {
+                DateField * df = (DateField *)hf;
+                EString dv = df->date()->isoDateTime();
+                if ( !dv.isEmpty() ) {
+                    r.truncate();
+                    r.appendNumber( mid );
+                    r.append( '\t' );
+                    r.append( escaped( dv ) );
+                    r.append( '\n' );
+                    d->dateFields->add( r );
+                }
+            }
+        }
+
+        ++it;
+    }
+}
+
+
+/*! Returns the id assigned to \a a, writing an addresses row if this
+    is the first time the address (in the AddressCreator::key() sense)
+    is seen.
+*/
+
+uint CopyDumper::addressId( Address * a )
+{
+    EString k( AddressCreator::key( a ) );
+    Id * i = d->addressIds.find( k );
+    if ( !i ) {
+        PgUtf8Codec u;
+        i = new Id( ++d->addressId );
+        d->addressIds.insert( k, i );
+        EString r;
+        r.appendNumber( i->n );
+        r.append( '\t' );
+        r.append( escaped( u.fromUnicode( a->uname() ) ) );
+        r.append( '\t' );
+        r.append( escaped( u.fromUnicode( a->localpart() ) ) );
+        r.append( '\t' );
+        r.append( escaped( u.fromUnicode( a->domain() ) ) );
+        r.append( '\n' );
+        d->addresses->add( r );
+    }
+    return i->n;
+}
+
+
+/*! Returns the field_names id for \a name, which the HeaderField type
+    enum doesn't cover. The well-known fields have fixed ids in a
+    fresh schema (the field-names file matches the enum), so new names
+    are numbered from just past HeaderField::Other.
+*/
+
+uint CopyDumper::fieldNameId( const EString & name )
+{
+    Id * i = d->fieldNameIds.find( name );
+    if ( !i ) {
+        i = new Id( ++d->fieldNameId );
+        d->fieldNameIds.insert( name, i );
+        EString r;
+        r.appendNumber( i->n );
+        r.append( '\t' );
+        r.append( escaped( name ) );
+        r.append( '\n' );
+        d->fieldNames->add( r );
+    }
+    return i->n;
+}
+
+
+/*! Returns the flag_names id for \a name. The five system flags have
+    fixed ids in a fresh schema (from the flag-names file); other
+    flags are numbered from 6 and deduplicated case-insensitively,
+    matching the unique index on lower(name).
+*/
+
+uint CopyDumper::flagNameId( const EString & name )
+{
+    EString k( name.lower() );
+    if ( k == "\\deleted" )
+        return 1;
+    if ( k == "\\answered" )
+        return 2;
+    if ( k == "\\flagged" )
+        return 3;
+    if ( k == "\\draft" )
+        return 4;
+    if ( k == "\\seen" )
+        return 5;
+
+    Id * i = d->flagNameIds.find( k );
+    if ( !i ) {
+        i = new Id( ++d->flagNameId );
+        d->flagNameIds.insert( k, i );
+        EString r;
+        r.appendNumber( i->n );
+        r.append( '\t' );
+        r.append( escaped( name ) );
+        r.append( '\n' );
+        d->flagNames->add( r );
+    }
+    return i->n;
+}
+
+
+/*! Computes an internaldate for \a m just as Injector does: the
+    message's own internaldate if set, else the newest Received field,
+    else the Date field, else now.
+*/
+
+uint CopyDumper::internalDate( Injectee * m ) const
+{
+    if ( !m )
+        return 0;
+    if ( m->internalDate() )
+        return m->internalDate();
+
+    Date id;
+    List<HeaderField>::Iterator it( m->header()->fields() );
+    while ( it && !id.valid() ) {
+        if ( it->type() == HeaderField::Received ) {
+            EString v = it->rfc822( false );
+            int i = 0;
+            while ( v.find( ';', i+1 ) > 0 )
+                i = v.find( ';', i+1 );
+            if ( i >= 0 )
+                id.setRfc822( v.mid( i+1 ) );
+        }
+        ++it;
+    }
+
+    if ( !id.valid() ) {
+        Date * date = m->header()->date();
+        if ( date )
+            id.setUnixTime( date->unixTime() );
+    }
+
+    if ( !id.valid() )
+        id.setCurrentTime();
+
+    m->setInternalDate( id.unixTime() );
+    return id.unixTime();
+}
+
+
+/*! Writes the mailboxes file, flushes all the data files and writes
+    load.sql, which loads the dump in foreign-key order and fixes the
+    sequences the explicit ids bypassed. May be called more than once;
+    only the first call does anything.
+*/
+
+void CopyDumper::finish()
+{
+    if ( d->finished )
+        return;
+    d->finished = true;
+
+    CopyFile * mbf = output( d, "mailboxes.copy" );
+    List<MailboxDump>::Iterator mi( d->mailboxList );
+    while ( mi ) {
+        EString r;
+        r.appendNumber( mi->id );
+        r.append( '\t' );
+        r.append( escaped( mi->name ) );
+        r.append( '\t' );
+        r.appendNumber( mi->uidnext );
+        r.append( '\t' );
+        r.append( '2' ); // nextmodseq; everything was loaded at 1
+        r.append( '\n' );
+        mbf->add( r );
+        ++mi;
+    }
+
+    List<CopyFile>::Iterator f( d->files );
+    while ( f ) {
+        f->flush();
+        ++f;
+    }
+
+    EString s;
+    s.append( "-- generated by aoximport -C\n"
+              "-- load with e.g. psql -U aox -d archiveopteryx -f load.sql\n"
+              "-- the paths below are opened by the postgres server, so the\n"
+              "-- files must be readable by the backend; use \\copy if the\n"
+              "-- server runs on another host.\n"
+              "\\set ON_ERROR_STOP\n"
+              "begin;\n" );
+
+    EString p( "' from '" + d->dir + "/" );
+    s.append( "copy mailboxes (id,name,uidnext,nextmodseq"
+              + p + "mailboxes.copy';\n" );
+    s.append( "copy messages (id,idate,rfc822size"
+              + p + "messages.copy';\n" );
+    s.append( "copy bodyparts (id,bytes,hash,text,data"
+              + p + "bodyparts.copy';\n" );
+    s.append( "copy part_numbers (message,part,bodypart,bytes,lines"
+              + p + "part_numbers.copy';\n" );
+    s.append( "copy field_names (id,name"
+              + p + "field_names.copy';\n" );
+    s.append( "copy flag_names (id,name"
+              + p + "flag_names.copy';\n" );
+    s.append( "copy addresses (id,name,localpart,domain"
+              + p + "addresses.copy';\n" );
+    s.append( "copy header_fields (message,part,position,field,value"
+              + p + "header_fields.copy';\n" );
+    s.append( "copy address_fields (message,part,position,field,number,address"
+              + p + "address_fields.copy';\n" );
+    s.append( "copy date_fields (message,value"
+              + p + "date_fields.copy';\n" );
+    s.append( "copy mailbox_messages (mailbox,uid,message,modseq,seen,deleted"
+              + p + "mailbox_messages.copy';\n" );
+    s.append( "copy flags (mailbox,uid,flag"
+              + p + "flags.copy';\n" );
+    s.append( "copy unparsed_messages (bodypart"
+              + p + "unparsed_messages.copy';\n" );
+    s.append( "copy bodystructures (message,envelope,bodystructure"
+              + p + "bodystructures.copy';\n" );
+    s.append( "copy sort_keys (message,subject,sfrom"
+              + p + "sort_keys.copy';\n" );
+
+    s.append( "select setval('mailboxes_id_seq',"
+              "(select max(id) from mailboxes));\n"
+              "select setval('messages_id_seq',"
+              "(select max(id) from messages));\n"
+              "select setval('bodypart_ids',"
+              "(select max(id) from bodyparts));\n"
+              "select setval('addresses_id_seq',"
+              "(select max(id) from addresses));\n"
+              "select setval('field_names_id_seq',"
+              "(select max(id) from field_names));\n"
+              "select setval('flag_names_id_seq',"
+              "(select max(id) from flag_names));\n"
+              "commit;\n"
+              "analyze;\n" );
+
+    File sql( d->dir + "/load.sql", File::Write, 0644 );
+    if ( sql.valid() )
+        sql.write( s );
+    else if ( d->error.isEmpty() )
+        d->error = "Cannot write to " + sql.name();
+}
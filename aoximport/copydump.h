@@ -0,0 +1,40 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef COPYDUMP_H
+#define COPYDUMP_H
+
+#include "global.h"
+#include "estring.h"
+
+
+class Injectee;
+class UString;
+class EStringList;
+
+
+class CopyDumper
+    : public Garbage
+{
+public:
+    CopyDumper( const EString & );
+
+    bool valid() const;
+    EString error() const;
+
+    void add( Injectee *, const UString &, const EStringList * );
+    void finish();
+
+private:
+    class CopyDumperData * d;
+
+    void addBodyparts( Injectee * );
+    void addPartNumber( uint, const EString &, class Bodypart * = 0 );
+    void addHeader( uint, const EString &, class Header * );
+    uint addressId( class Address * );
+    uint fieldNameId( const EString & );
+    uint flagNameId( const EString & );
+    uint internalDate( Injectee * ) const;
+};
+
+
+#endif
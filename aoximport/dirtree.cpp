@@ -9,19 +9,198 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h> // strlen
 
+#include <pthread.h>
+
+
+// a directory entry found by the scanner thread, ready to be tested
+// with isMailbox() by the main thread. the stat results travel along
+// so the main thread never needs to touch the file system.
+
+struct ScannedEntry
+{
+    ScannedEntry * next;
+    struct stat st;
+    char path[1]; // really strlen(path)+1 bytes
+};
+
+
+// a directory name the scanner still has to read.
+
+struct PendingDir
+{
+    PendingDir * next;
+    char * path;
+};
+
+
+// The scanner walks the tree in a thread of its own, so that the
+// latency of stat() and readdir() (painful on NFS) overlaps with
+// message parsing and injection instead of preceding it. It feeds a
+// bounded queue of ScannedEntry objects to the main thread.
+//
+// The thread must not allocate Garbage: the Allocator is not
+// thread-safe. Everything on this side of the fence uses malloc.
+
+class DirectoryScanner
+{
+public:
+    DirectoryScanner( const char * root )
+        : head( 0 ), tail( 0 ), queued( 0 ), done( false )
+    {
+        pthread_mutex_init( &mutex, 0 );
+        pthread_cond_init( &notEmpty, 0 );
+        pthread_cond_init( &notFull, 0 );
+        dirs = (PendingDir *)malloc( sizeof( PendingDir ) );
+        dirs->next = 0;
+        dirs->path = strdup( root );
+        pthread_create( &thread, 0, scan, this );
+    }
+
+    // appends path (described by st) to the queue, waiting if the
+    // main thread is more than maxQueued entries behind.
+    void enqueue( const char * path, const struct stat * st ) {
+        ScannedEntry * e =
+            (ScannedEntry *)malloc( sizeof( ScannedEntry ) +
+                                    strlen( path ) );
+        e->next = 0;
+        e->st = *st;
+        strcpy( e->path, path );
+        pthread_mutex_lock( &mutex );
+        while ( queued >= maxQueued )
+            pthread_cond_wait( &notFull, &mutex );
+        if ( tail )
+            tail->next = e;
+        else
+            head = e;
+        tail = e;
+        queued++;
+        pthread_cond_signal( &notEmpty );
+        pthread_mutex_unlock( &mutex );
+    }
+
+    // returns the next entry, waiting for the scanner if necessary,
+    // or a null pointer once the tree has been exhausted. the caller
+    // must free() the result.
+    ScannedEntry * dequeue() {
+        pthread_mutex_lock( &mutex );
+        while ( !head && !done )
+            pthread_cond_wait( &notEmpty, &mutex );
+        ScannedEntry * e = head;
+        if ( e ) {
+            head = e->next;
+            if ( !head )
+                tail = 0;
+            queued--;
+            pthread_cond_signal( &notFull );
+        }
+        pthread_mutex_unlock( &mutex );
+        return e;
+    }
+
+    static void * scan( void * );
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    ScannedEntry * head;
+    ScannedEntry * tail;
+    PendingDir * dirs;
+    uint queued;
+    bool done;
+
+    static const uint maxQueued = 256;
+};
+
+
+// visits each directory breadth-first, like the old serial code did,
+// stats every entry, hands it to the queue and remembers
+// subdirectories for later.
+
+void * DirectoryScanner::scan( void * p )
+{
+    DirectoryScanner * s = (DirectoryScanner *)p;
+
+    bool first = true;
+    while ( s->dirs ) {
+        PendingDir * dir = s->dirs;
+        s->dirs = dir->next;
+
+        struct stat st;
+        if ( ::stat( dir->path, &st ) >= 0 ) {
+            if ( first )
+                s->enqueue( dir->path, &st );
+            if ( S_ISDIR( st.st_mode ) ) {
+                DIR * dp = opendir( dir->path );
+                if ( dp ) {
+                    struct dirent * de = readdir( dp );
+                    while ( de ) {
+                        if ( !( de->d_name[0] == '.' &&
+                                ( de->d_name[1] == '\0' ||
+                                  ( de->d_name[1] == '.' &&
+                                    de->d_name[2] == '\0' ) ) ) )
+                        {
+                            char * tmp =
+                                (char *)malloc( strlen( dir->path ) + 2 +
+                                                strlen( de->d_name ) );
+                            strcpy( tmp, dir->path );
+                            strcat( tmp, "/" );
+                            strcat( tmp, de->d_name );
+                            struct stat cst;
+                            if ( ::stat( tmp, &cst ) >= 0 ) {
+                                s->enqueue( tmp, &cst );
+                                if ( S_ISDIR( cst.st_mode ) ) {
+                                    PendingDir * pd = (PendingDir *)
+                                        malloc( sizeof( PendingDir ) );
+                                    pd->path = tmp;
+                                    pd->next = 0;
+                                    tmp = 0;
+                                    PendingDir * t = s->dirs;
+                                    while ( t && t->next )
+                                        t = t->next;
+                                    if ( t )
+                                        t->next = pd;
+                                    else
+                                        s->dirs = pd;
+                                }
+                            }
+                            if ( tmp )
+                                free( tmp );
+                        }
+                        de = readdir( dp );
+                    }
+                    closedir( dp );
+                }
+            }
+        }
+        first = false;
+
+        free( dir->path );
+        free( dir );
+    }
+
+    pthread_mutex_lock( &s->mutex );
+    s->done = true;
+    pthread_cond_signal( &s->notEmpty );
+    pthread_mutex_unlock( &s->mutex );
+    return 0;
+}
+
 
 class DirectoryTreeData
     : public Garbage
 {
 public:
     DirectoryTreeData()
-        : prefixLength( 0 )
+        : prefixLength( 0 ), scanner( 0 )
     {}
 
-    EStringList paths;
+    EString root;
     uint prefixLength;
+    DirectoryScanner * scanner;
 };
 
 
@@ -29,6 +208,10 @@ public:
 
     Represents a directory tree from which subclasses can pick out the
     entries that represent viable mailboxes.
+
+    A helper thread walks the tree and stats its entries, so that the
+    source file system's latency is hidden behind parsing and
+    injection work, which matters greatly for big trees on NFS.
 */
 
 
@@ -38,16 +221,17 @@ DirectoryTree::DirectoryTree( const EString &path )
     : d( new DirectoryTreeData )
 {
     if ( path.length() > 0 && path[path.length()-1] == '/' )
-        d->paths.append( path.mid( 0, path.length()-1 ) );
+        d->root = path.mid( 0, path.length()-1 );
     else
-        d->paths.append( path );
-    d->prefixLength = d->paths.first()->length();
+        d->root = path;
+    d->prefixLength = d->root.length();
 }
 
 
-/*! Recursively examines each entry in this DirectoryTree to find valid
-    mailboxes. Returns a pointer to a MigratorMailbox object, or 0 if
-    there are no more mailboxes under this tree.
+/*! Examines each entry in this DirectoryTree to find valid mailboxes,
+    in the order the scanner thread delivers them. Returns a pointer
+    to a MigratorMailbox object, or 0 if there are no more mailboxes
+    under this tree.
 
     This function depends on the implementation of isMailbox() and
     newMailbox() by subclasses.
@@ -55,50 +239,21 @@ DirectoryTree::DirectoryTree( const EString &path )
 
 MigratorMailbox * DirectoryTree::nextMailbox()
 {
-    EString *p = 0;
+    if ( !d->scanner )
+        d->scanner = new DirectoryScanner( d->root.cstr() );
 
-    while ( !p ) {
-        if ( d->paths.isEmpty() )
+    while ( true ) {
+        ScannedEntry * e = d->scanner->dequeue();
+        if ( !e )
             return 0;
 
-        p = d->paths.shift();
+        EString p( e->path );
+        struct stat st = e->st;
+        free( e );
 
-        struct stat st;
-        int n = ::stat( p->cstr(), &st );
-        if ( n < 0 ) {
-            p = 0;
-        }
-        else if ( S_ISDIR( st.st_mode ) ) {
-            DIR *dp = opendir( p->cstr() );
-            if ( dp ) {
-                struct dirent *de = readdir( dp );
-                while ( de ) {
-                    if ( !( de->d_name[0] == '.' &&
-                            ( de->d_name[1] == '\0' ||
-                              ( de->d_name[1] == '.' &&
-                                de->d_name[2] == '\0' ) ) ) )
-                    {
-                        EString * tmp = new EString;
-                        uint len = strlen( de->d_name );
-                        tmp->reserve( p->length() + 1 + len );
-                        tmp->append( *p );
-                        tmp->append( "/" );
-                        tmp->append( de->d_name, len );
-                        d->paths.append( tmp );
-                    }
-                    de = readdir( dp );
-                }
-                closedir( dp );
-            }
-        }
-        if ( n < 0 || !isMailbox( *p, &st ) )
-            p = 0;
+        if ( isMailbox( p, &st ) )
+            return newMailbox( p, d->prefixLength );
     }
-
-    if ( !p )
-        return 0;
-
-    return newMailbox( *p, d->prefixLength );
 }
 
 
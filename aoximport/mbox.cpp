@@ -7,8 +7,11 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
 #include <dirent.h>
-#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 
 /*! \class MboxDirectory mbox.h
@@ -45,10 +48,29 @@ class MboxMailboxData
     : public Garbage
 {
 public:
-    MboxMailboxData(): file( 0 ), msn( 1 ) {}
+    MboxMailboxData()
+        : fd( -1 ), base( 0 ), length( 0 ), offset( 0 ),
+          tried( false ), msn( 1 )
+    {}
+
+    // unmaps and closes the source file, and makes sure that
+    // nextMessage() won't look at it again.
+    void close() {
+        if ( base )
+            munmap( (void *)base, length );
+        if ( fd >= 0 )
+            ::close( fd );
+        base = 0;
+        fd = -1;
+        offset = length;
+    }
 
     EString path;
-    FILE * file;
+    int fd;
+    const char * base;
+    size_t length;
+    size_t offset;
+    bool tried;
     uint msn;
 };
 
@@ -75,36 +97,38 @@ MboxMailbox::MboxMailbox( const EString & path, uint n )
 }
 
 
-static bool isFrom( const char * s )
+// returns true if the line starting at the first of the n bytes at s
+// looks like an mbox From_ separator, and false if not.
+
+static bool isFrom( const char * s, size_t n )
 {
-    if ( s[0] != 'F' || s[1] != 'r' || s[2] != 'o' || s[3] != 'm' ||
+    if ( n < 5 ||
+         s[0] != 'F' || s[1] != 'r' || s[2] != 'o' || s[3] != 'm' ||
          s[4] != ' ' )
         return false;
 
-    EString f( s );
-
-    uint n = 5;
-    while ( n < f.length() &&
-            !( s[n] == ' ' &&
-               ( s[n+1] >= '0' && s[n+1] <= '9' ) &&
-               ( s[n+2] >= '0' && s[n+2] <= '9' ) &&
-               s[n+3] == ':' &&
-               ( s[n+4] >= '0' && s[n+4] <= '9' ) &&
-               ( s[n+5] >= '0' && s[n+5] <= '9' ) &&
-               s[n+6] == ':' &&
-               ( s[n+7] >= '0' && s[n+7] <= '9' ) &&
-               ( s[n+8] >= '0' && s[n+8] <= '9' ) &&
-               s[n+9] == ' ' &&
-               ( s[n+10] >= '0' && s[n+10] <= '9' ) &&
-               ( s[n+11] >= '0' && s[n+11] <= '9' ) &&
-               ( s[n+12] >= '0' && s[n+12] <= '9' ) &&
-               ( s[n+13] >= '0' && s[n+13] <= '9' ) ) )
+    size_t i = 5;
+    while ( i + 13 < n && s[i] != '\n' &&
+            !( s[i] == ' ' &&
+               ( s[i+1] >= '0' && s[i+1] <= '9' ) &&
+               ( s[i+2] >= '0' && s[i+2] <= '9' ) &&
+               s[i+3] == ':' &&
+               ( s[i+4] >= '0' && s[i+4] <= '9' ) &&
+               ( s[i+5] >= '0' && s[i+5] <= '9' ) &&
+               s[i+6] == ':' &&
+               ( s[i+7] >= '0' && s[i+7] <= '9' ) &&
+               ( s[i+8] >= '0' && s[i+8] <= '9' ) &&
+               s[i+9] == ' ' &&
+               ( s[i+10] >= '0' && s[i+10] <= '9' ) &&
+               ( s[i+11] >= '0' && s[i+11] <= '9' ) &&
+               ( s[i+12] >= '0' && s[i+12] <= '9' ) &&
+               ( s[i+13] >= '0' && s[i+13] <= '9' ) ) )
     {
-        n++;
+        i++;
     }
 
     // Did we find "11:22:33 4567" in the line?
-    if ( f[n] == '\0' )
+    if ( i + 13 >= n || s[i] == '\n' )
         return false;
 
     return true;
@@ -121,30 +145,67 @@ static bool isFrom( const char * s )
 
 MigratorMessage * MboxMailbox::nextMessage()
 {
-    char s[65537];
-
-    if ( !d->file ) {
-        d->file = fopen( d->path.cstr(), "r" );
-        // If we can't read a "From " line at the very beginning, we
+    if ( !d->base ) {
+        if ( d->tried )
+            return 0;
+        d->tried = true;
+        d->fd = open( d->path.cstr(), O_RDONLY );
+        if ( d->fd < 0 )
+            return 0;
+        struct stat st;
+        if ( fstat( d->fd, &st ) >= 0 && st.st_size > 0 ) {
+            void * m = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE,
+                             d->fd, 0 );
+            if ( m != MAP_FAILED ) {
+                d->base = (const char *)m;
+                d->length = st.st_size;
+                // we read the file once, front to back, so the
+                // kernel may as well read far ahead of us
+                (void)madvise( m, st.st_size, MADV_SEQUENTIAL );
+            }
+        }
+        // If we can't see a "From " line at the very beginning, we
         // assume this isn't an mbox, and give up.
-        if ( !d->file || fgets( s, 128, d->file ) == 0 ||
-             !( s[0] == 'F' && s[1] == 'r' && s[2] == 'o' && s[3] == 'm' &&
-                s[4] == ' ' ) )
+        if ( !d->base || !isFrom( d->base, d->length ) ) {
+            d->close();
             return 0;
+        }
     }
 
-    EString contents;
-    bool done = false;
-    while ( !done ) {
-        s[65536] = '\0';
-        if ( fgets( s, 65536, d->file ) != 0 && !isFrom( s ) )
-            contents.append( s );
-        else
-            done = true;
+    if ( d->offset >= d->length ) {
+        d->close();
+        return 0;
+    }
+
+    // we're looking at a From_ line. the message starts after it...
+    const char * p = (const char *)
+        memchr( d->base + d->offset, '\n', d->length - d->offset );
+    size_t start = d->length;
+    if ( p )
+        start = p - d->base + 1;
+
+    // ...and runs to the next From_ line, or to the end of the file.
+    size_t end = start;
+    while ( end < d->length ) {
+        p = (const char *)memchr( d->base + end, '\n',
+                                  d->length - end );
+        if ( !p ) {
+            end = d->length;
+        }
+        else {
+            end = p - d->base + 1;
+            if ( isFrom( d->base + end, d->length - end ) )
+                break;
+        }
     }
+    d->offset = end;
 
-    if ( contents.isEmpty() )
+    if ( end <= start ) {
+        d->close();
         return 0;
+    }
+
+    EString contents( d->base + start, end - start );
 
     MigratorMessage * m
         = new MigratorMessage( contents, d->path + ":" + fn( d->msn ) );
@@ -4,16 +4,22 @@
 
 #include "file.h"
 #include "list.h"
+#include "dict.h"
 #include "flag.h"
+#include "md5.h"
 #include "timer.h"
 #include "scope.h"
 #include "mailbox.h"
 #include "database.h"
+#include "configuration.h"
 #include "allocator.h"
+#include "arena.h"
 #include "transaction.h"
 #include "recipient.h"
 #include "eventloop.h"
 #include "injector.h"
+#include "graph.h"
+#include "copydump.h"
 #include "dirtree.h"
 #include "maildir.h"
 #include "cyrus.h"
@@ -22,31 +28,48 @@
 #include "mh.h"
 
 #include <stdio.h>
+#include <stdlib.h> // exit
 #include <sys/stat.h> // mkdir
 #include <sys/types.h> // mkdir
 #include <unistd.h> // getpid
 #include <time.h> // time
 
 
+static File * journal = 0;
+static Dict<EString> * imported = 0;
+static CopyDumper * dumper = 0;
+
+
+// returns the journal key for m: an md5 digest of the entire source
+// message. hashing the text rather than remembering file name and
+// offset means that renamed, compacted or re-delivered source files
+// don't defeat the journal.
+
+static EString journalKey( MigratorMessage * m )
+{
+    return MD5::hash( m->original() ).hex();
+}
+
+
 class MigratorData
     : public Garbage
 {
 public:
     MigratorData()
-        : working( 0 ),
-          messagesDone( 0 ), mailboxesDone( 0 ),
+        : messagesDone( 0 ), mailboxesDone( 0 ),
           mode( Migrator::Mbox ),
-          startup( (uint)time( 0 ) )
+          startup( (uint)time( 0 ) ), reported( false )
     {}
 
     UString destination;
     List< MigratorSource > sources;
-    MailboxMigrator * working;
+    List< MailboxMigrator > working;
 
     uint messagesDone;
     uint mailboxesDone;
     Migrator::Mode mode;
     uint startup;
+    bool reported;
 };
 
 
@@ -57,8 +80,11 @@ public:
 
     Its API consists of the two functions start() and running(). The
     execute() function does the heavy loading, by ensuring that the
-    Migrator always has four MailboxMigrator objects working. (The
-    MailboxMigrator objects must call execute() when they're done.)
+    Migrator always has as many MailboxMigrator objects working as the
+    database has handles (see db-max-handles), so the import scales
+    with the database instead of serialising behind one injection at a
+    time. (The MailboxMigrator objects must call execute() when
+    they're done.)
 */
 
 
@@ -110,26 +136,34 @@ void Migrator::addSource( const EString &s )
 }
 
 
-/*! Finds another mailbox to migrate.
+/*! Finds more mailboxes to migrate.
 */
 
 void Migrator::execute()
 {
-    if ( d->working && d->working->done() ) {
-        d->messagesDone += d->working->migrated();
-        d->mailboxesDone++;
-        d->working = 0;
+    List<MailboxMigrator>::Iterator w( d->working );
+    while ( w ) {
+        if ( w->done() ) {
+            d->messagesDone += w->migrated();
+            d->mailboxesDone++;
+            d->working.take( w );
+        }
+        else {
+            ++w;
+        }
     }
 
-    while ( !d->working && !d->sources.isEmpty() ) {
+    // each worker occupies one database handle while its injector
+    // runs, so more workers than handles would just queue up
+    uint limit = Configuration::scalar( Configuration::DbMaxHandles );
+    while ( d->working.count() < limit && !d->sources.isEmpty() ) {
         MigratorSource * source = d->sources.first();
         MigratorMailbox * m( source->nextMailbox() );
         if ( m ) {
             MailboxMigrator * n = new MailboxMigrator( m, this );
             if ( n->valid() ) {
-                d->working = n;
+                d->working.append( n );
                 n->execute();
-                return;
             }
         }
         else {
@@ -137,13 +171,62 @@ void Migrator::execute()
         }
     }
 
-    if ( d->working )
+    if ( !d->working.isEmpty() )
         return;
 
-    if ( Database::idle() )
+    if ( ::dumper )
+        ::dumper->finish();
+
+    if ( Database::idle() ) {
+        report();
         EventLoop::global()->shutdown();
-    else
+    }
+    else {
         Database::notifyWhenIdle( this );
+    }
+}
+
+
+/*! Prints a one-time summary of the completed import: messages per
+    second, database queries and database output, in total and per
+    message. The latter two come from the same statistics objects
+    the servers graph, so the numbers are comparable across tools.
+*/
+
+void Migrator::report()
+{
+    if ( d->reported || !verbosity() )
+        return;
+    d->reported = true;
+
+    uint n = messagesMigrated();
+    uint t = uptime();
+    fprintf( stdout, "Imported %d messages from %d mailboxes in %ds",
+             n, mailboxesMigrated(), t );
+    if ( n && t )
+        fprintf( stdout, " (%.1f/s)", ((double)n) / t );
+    fprintf( stdout, "\n" );
+    if ( !n )
+        return;
+
+    if ( ::dumper ) {
+        if ( ::dumper->valid() )
+            fprintf( stdout,
+                     "Wrote COPY data files; load them with "
+                     "psql -f <directory>/load.sql\n" );
+        else
+            fprintf( stderr, "aoximport: %s\n", ::dumper->error().cstr() );
+        return;
+    }
+
+    GraphableNumber * q = GraphableNumber::named( "queries-executed" );
+    if ( q )
+        fprintf( stdout, "Issued %d database queries (%.1f/message)\n",
+                 q->lastValue(), ((double)q->lastValue()) / n );
+    GraphableNumber * b = GraphableNumber::named( "db-output-bytes" );
+    if ( b )
+        fprintf( stdout, "Sent %d bytes to the database (%d/message)\n",
+                 b->lastValue(), b->lastValue() / n );
 }
 
 
@@ -266,8 +349,16 @@ MigratorMessage::MigratorMessage( const EString & rfc822, const EString & desc )
                  desc.cstr(), m->error().cstr() );
     if ( Migrator::errorCopies() ) {
         EString a = o.anonymised();
-        Message * am = new Message;
-        am->parse( a );
+        // the anonymised copy is parsed only to compare error
+        // messages, so its temporaries can live in an arena and be
+        // dropped in one shot below
+        Arena * arena = new Arena;
+        Message * am = 0;
+        {
+            ArenaScope x( arena );
+            am = new Message;
+            am->parse( a );
+        }
         EString dir;
         EString name;
         EString c;
@@ -295,6 +386,8 @@ MigratorMessage::MigratorMessage( const EString & rfc822, const EString & desc )
             name = fn( ++uniq );
             c = o;
         }
+        am = 0;
+        arena->clear();
         ::mkdir( dir.cstr(), 0777 );
         File f( dir + "/" + name, File::Write );
         f.write( c );
@@ -353,18 +446,20 @@ public:
           migrator( 0 ),
           validated( false ), valid( false ),
           injector( 0 ),
-          migrated( 0 ), migrating( 0 )
+          migrated( 0 ), migrating( 0 ), skipped( 0 )
     {}
 
     MigratorMailbox * source;
     Mailbox * destination;
     Migrator * migrator;
     List<MigratorMessage> messages;
+    EStringList migratingKeys;
     bool validated;
     bool valid;
     Injector * injector;
     uint migrated;
     uint migrating;
+    uint skipped;
     EString error;
     Log log;
 };
@@ -409,7 +504,10 @@ bool MailboxMigrator::valid() const
             d->valid = true;
         if ( d->valid ) {
             log( "Source apparently is a valid mailbox" );
-            d->messages.append( m );
+            if ( ::imported && ::imported->contains( journalKey( m ) ) )
+                d->skipped++;
+            else
+                d->messages.append( m );
         }
         else {
             log( "Source is not a valid mailbox" );
@@ -429,6 +527,8 @@ void MailboxMigrator::execute()
 
     if ( d->injector && d->injector->failed() ) {
         d->error = "Database error: " + d->injector->error();
+        d->injector = 0;
+        d->migratingKeys.clear();
         d->migrator->execute();
         return;
     }
@@ -436,8 +536,17 @@ void MailboxMigrator::execute()
         d->migrated += d->migrating;
         d->migrating = 0;
         d->injector = 0;
+        if ( ::journal && !d->migratingKeys.isEmpty() ) {
+            ::journal->write( d->migratingKeys.join( "\n" ) + "\n" );
+            EStringList::Iterator k( d->migratingKeys );
+            while ( k ) {
+                ::imported->insert( *k, k );
+                ++k;
+            }
+            d->migratingKeys.clear();
+        }
     }
-    else if ( !d->destination ) {
+    else if ( !d->destination && !::dumper ) {
         UString tmp = d->migrator->destination();
         if ( !d->source->partialName().isEmpty() ) {
             if ( !d->source->partialName().startsWith( "/" ) )
@@ -448,11 +557,19 @@ void MailboxMigrator::execute()
         d->destination = Mailbox::obtain( tmp, true );
     }
 
-    uint limit = EventLoop::global()->memoryUsage();
+    // the concurrent workers share the memory budget, so that a
+    // parallel import doesn't buffer more than a serial one did
+    uint limit = EventLoop::global()->memoryUsage() /
+                 Configuration::scalar( Configuration::DbMaxHandles );
     uint before = Allocator::allocated();
     MigratorMessage * mm = 0;
     do {
         mm = d->source->nextMessage();
+        if ( mm && ::imported &&
+             ::imported->contains( journalKey( mm ) ) ) {
+            d->skipped++;
+            continue;
+        }
         if ( mm )
             d->messages.append( mm );
     } while ( mm && Allocator::allocated() * 2 - before < limit );
@@ -468,7 +585,40 @@ void MailboxMigrator::execute()
         fprintf( stdout, "\n" );
     }
 
-    if ( !d->messages.isEmpty() ) {
+    if ( !d->messages.isEmpty() && ::dumper ) {
+        Scope x( new Log );
+        log( "Dumping " + fn( d->messages.count() ) +
+             " messages starting with " + d->messages.first()->description() );
+        UString name = d->migrator->destination();
+        if ( !d->source->partialName().isEmpty() ) {
+            if ( !d->source->partialName().startsWith( "/" ) )
+                name.append( '/' );
+            Utf8Codec u;
+            name.append( u.toUnicode( d->source->partialName() ) );
+        }
+        List<MigratorMessage>::Iterator i( d->messages );
+        while ( i ) {
+            ::dumper->add( i->message(), name, i->flags() );
+            if ( ::journal )
+                d->migratingKeys.append( journalKey( i ) );
+            ++i;
+        }
+        d->migrated += d->messages.count();
+        d->messages.clear();
+        if ( ::journal && !d->migratingKeys.isEmpty() ) {
+            ::journal->write( d->migratingKeys.join( "\n" ) + "\n" );
+            EStringList::Iterator k( d->migratingKeys );
+            while ( k ) {
+                ::imported->insert( *k, k );
+                ++k;
+            }
+            d->migratingKeys.clear();
+        }
+        // return to the event loop between chunks, so the chunk's
+        // garbage can be collected; the timer resumes us at once
+        (void)new Timer( this, 0 );
+    }
+    else if ( !d->messages.isEmpty() ) {
         Scope x( new Log );
         log( "Starting migration of " + fn ( d->messages.count() ) +
              " messages starting with " + d->messages.first()->description() );
@@ -478,6 +628,8 @@ void MailboxMigrator::execute()
             Injectee * m = i->message();
             m->setFlags( d->destination, i->flags() );
             messages->append( m );
+            if ( ::journal )
+                d->migratingKeys.append( journalKey( i ) );
             ++i;
         }
         d->injector = new Injector( this );
@@ -487,6 +639,11 @@ void MailboxMigrator::execute()
         d->messages.clear();
     }
     else {
+        if ( d->skipped ) {
+            log( "Skipped " + fn( d->skipped ) +
+                 " messages already recorded in the journal" );
+            d->skipped = 0;
+        }
         d->migrator->execute();
     }
 }
@@ -501,6 +658,8 @@ bool MailboxMigrator::done() const
 {
     if ( !d->validated )
         return false;
+    if ( d->injector )
+        return false;
     if ( !d->messages.isEmpty() )
         return false;
     return true;
@@ -530,8 +689,11 @@ EString MailboxMigrator::error() const
 uint Migrator::messagesMigrated() const
 {
     uint n = d->messagesDone;
-    if ( d->working )
-        n += d->working->migrated();
+    List<MailboxMigrator>::Iterator w( d->working );
+    while ( w ) {
+        n += w->migrated();
+        ++w;
+    }
     return n;
 }
 
@@ -593,6 +755,64 @@ bool Migrator::errorCopies()
 }
 
 
+/*! Opens \a name as the import journal. The journal records one line
+    per successfully imported message, and any message recorded there
+    is skipped by later runs, so a nightly aoximport against a growing
+    source archive imports each message exactly once and touches only
+    the new mail.
+
+    Exits with an error if \a name cannot be opened for append.
+*/
+
+void Migrator::setJournal( const EString & name )
+{
+    ::imported = new Dict<EString>;
+    Allocator::addEternal( ::imported, "journal of imported messages" );
+    File old( name );
+    EStringList::Iterator i( old.lines() );
+    while ( i ) {
+        EString * key = new EString( i->simplified() );
+        if ( !key->isEmpty() )
+            ::imported->insert( *key, key );
+        ++i;
+    }
+    ::journal = new File( name, File::Append );
+    if ( !::journal->valid() ) {
+        fprintf( stderr, "aoximport: Cannot append to journal %s\n",
+                 name.cstr() );
+        exit( -1 );
+    }
+    Allocator::addEternal( ::journal, "journal of imported messages" );
+}
+
+
+/*! Makes the import write COPY data files to \a directory instead of
+    injecting anything into the database, so the dump can be loaded
+    with server-side COPY later. Exits with an error if the data
+    files cannot be created.
+*/
+
+void Migrator::setCopyDirectory( const EString & directory )
+{
+    ::dumper = new CopyDumper( directory );
+    Allocator::addEternal( ::dumper, "copy dump writer" );
+    if ( !::dumper->valid() ) {
+        fprintf( stderr, "aoximport: %s\n", ::dumper->error().cstr() );
+        exit( -1 );
+    }
+}
+
+
+/*! Returns true if setCopyDirectory() has been called, ie. if this
+    import writes data files and doesn't need the database at all.
+*/
+
+bool Migrator::offline()
+{
+    return ::dumper != 0;
+}
+
+
 /*! Returns the list of flags that should be set on the injected
     message. The list may contain duplicates.
 */
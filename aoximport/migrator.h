@@ -25,12 +25,19 @@ public:
     uint messagesMigrated() const;
     uint mailboxesMigrated() const;
 
+    void report();
+
     static void setVerbosity( uint );
     static uint verbosity();
 
     static void setErrorCopies( bool );
     static bool errorCopies();
 
+    static void setJournal( const EString & );
+
+    static void setCopyDirectory( const EString & );
+    static bool offline();
+
     uint uptime();
 
 private:
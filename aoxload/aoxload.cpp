@@ -0,0 +1,369 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "log.h"
+#include "scope.h"
+#include "event.h"
+#include "buffer.h"
+#include "resolver.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "connection.h"
+#include "estringlist.h"
+
+#include <stdio.h> // fprintf, printf
+#include <stdlib.h> // exit
+#include <sys/time.h> // gettimeofday
+
+
+static Endpoint * ep = 0;
+static EString * username = 0;
+static EString * password = 0;
+static EString * mailbox = 0;
+static uint connections = 1;
+static uint commands = 100;
+static uint window = 10;
+static uint idlepct = 0;
+
+static uint working = 0;
+static uint failures = 0;
+
+// command latencies, one millisecond per bucket, long tail in the
+// last bucket
+static const uint maxLatency = 10000;
+static uint latencies[maxLatency+1];
+static uint measured = 0;
+
+
+static uint now()
+{
+    struct timeval t;
+    gettimeofday( &t, 0 );
+    return t.tv_sec * 1000 + t.tv_usec / 1000;
+}
+
+
+static void record( uint ms )
+{
+    if ( ms > maxLatency )
+        ms = maxLatency;
+    latencies[ms]++;
+    measured++;
+}
+
+
+static uint percentile( uint p )
+{
+    uint below = 0;
+    uint target = measured * p / 100;
+    uint ms = 0;
+    while ( ms < maxLatency && below + latencies[ms] < target )
+        below += latencies[ms++];
+    return ms;
+}
+
+
+class LoadClient
+    : public Connection
+{
+public:
+    enum Stage { Banner, Login, Select, Fetch, Idle, Logout };
+
+    LoadClient( uint id )
+        : Connection(), stage( Banner ), finished( false ), n( id ),
+          tag( 0 ), done( 0 ), exists( 0 ), next( 1 ), sent( 0 )
+    {
+        connect( *ep );
+        EventLoop::global()->addConnection( this );
+        working++;
+    }
+
+    void react( Event );
+    void line( const EString & );
+    void command( const EString & );
+    void fetchMore();
+    void finish();
+
+    Stage stage;
+    bool finished;
+    uint n;
+    uint tag;
+    uint done;
+    uint exists;
+    uint next;
+    uint sent;
+};
+
+
+/*! \nodoc */
+
+
+void LoadClient::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        {
+            EString * l = readBuffer()->removeLine();
+            while ( l ) {
+                line( l->simplified() );
+                l = readBuffer()->removeLine();
+            }
+        }
+        break;
+    case Connect:
+        break;
+    case Error:
+    case Close:
+        if ( stage != Logout )
+            failures++;
+        finish();
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*! Sends \a c as the next tagged command and records when. */
+
+void LoadClient::command( const EString & c )
+{
+    tag++;
+    EString s( "a" );
+    s.appendNumber( tag );
+    s.append( " " );
+    s.append( c );
+    s.append( "\r\n" );
+    enqueue( s );
+    sent = now();
+}
+
+
+/*! Reacts to the single response \a l, advancing the scripted
+    workload: banner, login, select, then either a fetch loop or a
+    long idle.
+*/
+
+void LoadClient::line( const EString & l )
+{
+    if ( stage == Banner ) {
+        if ( !l.startsWith( "* OK" ) ) {
+            failures++;
+            finish();
+            return;
+        }
+        stage = Login;
+        command( "login \"" + *username + "\" \"" + *password + "\"" );
+        return;
+    }
+
+    if ( l.startsWith( "* " ) ) {
+        if ( stage == Select && l.endsWith( " EXISTS" ) )
+            exists = l.mid( 2 ).section( " ", 1 ).number( 0 );
+        return;
+    }
+    if ( l.startsWith( "+" ) ) {
+        // idle accepted; stay there until the fetchers are finished
+        return;
+    }
+
+    EString t( "a" );
+    t.appendNumber( tag );
+    if ( !l.startsWith( t + " " ) )
+        return;
+
+    if ( !l.mid( t.length() + 1 ).startsWith( "OK" ) ) {
+        failures++;
+        finish();
+        return;
+    }
+
+    record( now() - sent );
+
+    switch ( stage ) {
+    case Banner:
+        break;
+    case Login:
+        stage = Select;
+        command( "select \"" + *mailbox + "\"" );
+        break;
+    case Select:
+        if ( idlepct && n % 100 < idlepct ) {
+            stage = Idle;
+            tag++;
+            EString s( "a" );
+            s.appendNumber( tag );
+            s.append( " idle\r\n" );
+            enqueue( s );
+            working--;
+            if ( !working )
+                finish();
+        }
+        else {
+            stage = Fetch;
+            fetchMore();
+        }
+        break;
+    case Fetch:
+        fetchMore();
+        break;
+    case Idle:
+        break;
+    case Logout:
+        finish();
+        break;
+    }
+}
+
+
+/*! Sends the next fetch of the workload, or logs out once this
+    client has done its share.
+*/
+
+void LoadClient::fetchMore()
+{
+    if ( done >= commands ) {
+        stage = Logout;
+        command( "logout" );
+        return;
+    }
+
+    done++;
+    uint lo = next;
+    uint hi = lo + window - 1;
+    if ( exists && hi > exists ) {
+        hi = exists;
+        next = 1;
+    }
+    else {
+        next = hi + 1;
+    }
+    command( "fetch " + fn( lo ) + ":" + fn( hi ) +
+             " (uid flags envelope)" );
+}
+
+
+/*! Takes this client out of the workload, and shuts the whole run
+    down once it was the last one still fetching.
+*/
+
+void LoadClient::finish()
+{
+    if ( finished )
+        return;
+    finished = true;
+    if ( stage != Idle )
+        working--;
+    stage = Logout;
+    close();
+    EventLoop::global()->removeConnection( this );
+    if ( !working )
+        EventLoop::global()->stop();
+}
+
+
+int main( int argc, char ** argv )
+{
+    Scope global;
+    EventLoop::setup();
+
+    const char * error = 0;
+    bool ok = true;
+    if ( argc < 7 || argc > 10 ) {
+        error = "Wrong number of arguments";
+        ok = false;
+    }
+
+    uint port = 0;
+    if ( ok ) {
+        port = EString( argv[2] ).number( &ok );
+        if ( !ok )
+            error = "Could not parse the server's port number";
+    }
+
+    if ( ok ) {
+        EStringList l = Resolver::resolve( argv[1] );
+        if ( l.isEmpty() ) {
+            ok = false;
+            error = ( EString( "Cannot resolve " ) + argv[1] +
+                      ": " + Resolver::errors().join( ", " ) ).cstr();
+        }
+        else {
+            ep = new Endpoint( *l.first(), port );
+            Allocator::addEternal( ep, "target server endpoint" );
+            if ( !ep->valid() ) {
+                ok = false;
+                error = "Invalid server address";
+            }
+        }
+    }
+
+    if ( ok ) {
+        connections = EString( argv[3] ).number( &ok );
+        if ( !ok || !connections )
+            error = "Could not parse the number of connections";
+    }
+    if ( ok ) {
+        commands = EString( argv[4] ).number( &ok );
+        if ( !ok || !commands )
+            error = "Could not parse the number of commands";
+    }
+
+    if ( ok ) {
+        username = new EString( argv[5] );
+        password = new EString( argv[6] );
+        mailbox = new EString( argc > 7 ? argv[7] : "inbox" );
+        Allocator::addEternal( username, "login name" );
+        Allocator::addEternal( password, "login password" );
+        Allocator::addEternal( mailbox, "mailbox to select" );
+    }
+    if ( ok && argc > 8 ) {
+        window = EString( argv[8] ).number( &ok );
+        if ( !ok || !window )
+            error = "Could not parse the fetch window";
+    }
+    if ( ok && argc > 9 ) {
+        idlepct = EString( argv[9] ).number( &ok );
+        if ( !ok || idlepct > 99 )
+            error = "Could not parse the idle percentage";
+    }
+
+    if ( !ok ) {
+        fprintf( stderr,
+                 "Error: %s\n"
+                 "Usage: aoxload address port connections commands"
+                 " username password [mailbox] [window] [idle%%]\n"
+                 "       Address/port: The IMAP server to talk to.\n"
+                 "       Connections: Number of concurrent clients.\n"
+                 "       Commands: Fetches per fetching client.\n"
+                 "       Username/password: Login for every client.\n"
+                 "       Mailbox: What to select (default inbox).\n"
+                 "       Window: Messages per fetch (default 10).\n"
+                 "       Idle%%: Clients parked in IDLE (default 0).\n",
+                 error );
+        exit( 1 );
+    }
+
+    global.setLog( new Log );
+
+    uint i = 0;
+    while ( i < connections ) {
+        (void)new LoadClient( i );
+        i++;
+    }
+
+    uint started = now();
+    EventLoop::global()->start();
+    uint elapsed = now() - started;
+
+    printf( "{ \"connections\": %d, \"commands\": %d, \"failures\": %d,\n"
+            "  \"elapsed-ms\": %d,\n"
+            "  \"latency-ms\": { \"p50\": %d, \"p90\": %d,"
+            " \"p99\": %d, \"max\": %d } }\n",
+            connections, measured, failures,
+            elapsed,
+            percentile( 50 ), percentile( 90 ), percentile( 99 ),
+            percentile( 100 ) );
+    if ( failures )
+        exit( 1 );
+    return 0;
+}
@@ -12,6 +12,11 @@
 #include "flag.h"
 #include "event.h"
 #include "cache.h"
+#include "query.h"
+#include "message.h"
+#include "fetcher.h"
+#include "messagecache.h"
+#include "estringlist.h"
 #include "mailbox.h"
 #include "listener.h"
 #include "database.h"
@@ -19,6 +24,7 @@
 #include "selector.h"
 #include "managesieve.h"
 #include "spoolmanager.h"
+#include "retentionenforcer.h"
 #include "entropy.h"
 #include "egd.h"
 
@@ -37,12 +43,22 @@ class StartupWatcher
     : public EventHandler
 {
 public:
-    StartupWatcher(): EventHandler() {}
+    StartupWatcher( uint n ): EventHandler(), remaining( n ) {}
     void execute() {
         if ( Log::disastersYet() )
             ::exit( 1 );
-        EventLoop::global()->setStartup( false );
+        // the critical setup stages run in parallel on separate
+        // database handles; we start accepting connections when the
+        // last of them is done, not the first. everything else
+        // (flags, field names and the like) finishes in the
+        // background.
+        if ( remaining )
+            remaining--;
+        if ( !remaining )
+            EventLoop::global()->setStartup( false );
     }
+private:
+    uint remaining;
 };
 
 
@@ -72,6 +88,86 @@ public:
 };
 
 
+class CacheWarmer
+    : public EventHandler
+{
+public:
+    CacheWarmer()
+        : EventHandler(), signal( 0 ), messages( new List<Message> )
+    {
+        setLog( new Log );
+        signal = new DatabaseSignal( "message_injected", this );
+    }
+
+    void execute()
+    {
+        // whenever an injector (in this process or any other, even on
+        // another host) commits new messages, it announces where they
+        // went; fetch them into the cache right away, so the client
+        // that reads them shortly finds them hot. a warm spare doing
+        // nothing else thus fails over with a warm cache.
+        EString payload = signal->payload();
+        if ( !payload.isEmpty() && payload != seen ) {
+            seen = payload;
+            EStringList::Iterator i( EStringList::split( ',', payload ) );
+            while ( i ) {
+                uint mb = i->section( ":", 1 ).number( 0 );
+                uint uid = i->section( ":", 2 ).number( 0 );
+                Mailbox * m = Mailbox::find( mb );
+                if ( m && uid ) {
+                    Query * q =
+                        new Query( "select mailbox, uid, message "
+                                   "from mailbox_messages "
+                                   "where mailbox=$1 and uid>=$2", this );
+                    q->bind( 1, m->id() );
+                    q->bind( 2, uid );
+                    q->setReadOnly();
+                    q->execute();
+                    queries.append( q );
+                }
+                ++i;
+            }
+        }
+
+        List<Query>::Iterator q( queries );
+        while ( q ) {
+            while ( q->hasResults() ) {
+                Row * r = q->nextRow();
+                Mailbox * m = Mailbox::find( r->getInt( "mailbox" ) );
+                if ( m ) {
+                    Message * msg =
+                        MessageCache::provide( m, r->getInt( "uid" ) );
+                    msg->setDatabaseId( r->getInt( "message" ) );
+                    if ( !( msg->hasHeaders() && msg->hasAddresses() &&
+                            msg->hasTrivia() ) )
+                        messages->append( msg );
+                }
+            }
+            if ( q->done() )
+                queries.take( q );
+            else
+                ++q;
+        }
+
+        if ( !queries.isEmpty() || messages->isEmpty() )
+            return;
+
+        Fetcher * f = new Fetcher( messages, this, 0 );
+        f->fetch( Fetcher::Addresses );
+        f->fetch( Fetcher::OtherHeader );
+        f->fetch( Fetcher::Trivia );
+        f->execute();
+        messages = new List<Message>;
+    }
+
+private:
+    DatabaseSignal * signal;
+    EString seen;
+    List<Query> queries;
+    List<Message> * messages;
+};
+
+
 class ArchiveopteryxEventLoop
     : public EventLoop
 {
@@ -281,6 +377,10 @@ int main( int argc, char *argv[] )
         "Statistics", Configuration::toggle( Configuration::UseStatistics ),
         Configuration::StatisticsAddress, Configuration::StatisticsPort
     );
+    Listener< MetricsDumper >::create(
+        "Metrics", Configuration::toggle( Configuration::UseMetrics ),
+        Configuration::MetricsAddress, Configuration::MetricsPort
+    );
 
     EventLoop::global()->setMemoryUsage(
         1024 * 1024 * Configuration::scalar( Configuration::MemoryLimit ) );
@@ -289,7 +389,12 @@ int main( int argc, char *argv[] )
 
     Database::setup();
 
-    StartupWatcher * w = new StartupWatcher;
+    // the schema check, the access check and the mailbox tree are
+    // what a new connection cannot do without
+    uint critical = 2;
+    if ( security )
+        critical++;
+    StartupWatcher * w = new StartupWatcher( critical );
 
     Database::checkSchema( w );
     if ( security )
@@ -298,6 +403,7 @@ int main( int argc, char *argv[] )
     Mailbox::setup( w );
 
     SpoolManager::setup();
+    RetentionEnforcer::setup();
     Selector::setup();
     Flag::setup();
     IMAP::setup();
@@ -305,5 +411,8 @@ int main( int argc, char *argv[] )
     if ( !security )
         (void)new ConnectionObliterator;
 
+    if ( Server::useCache() )
+        (void)new CacheWarmer;
+
     s.run();
 }
@@ -2,6 +2,7 @@
 
 #include "allocator.h"
 
+#include "arena.h"
 #include "cache.h"
 #include "estring.h"
 #include "log.h"
@@ -24,6 +25,12 @@
 
 #include <errno.h>
 
+// open, pread, write, close
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 
 // the heuristics in adminLikelyHappy() will probably need changing
 // if BlockShift changes
@@ -151,6 +158,51 @@ static uint tos;
 static uint peak;
 static AllocationBlock ** stack;
 
+static bool generational = true;
+static bool youngCollection;
+static uint youngCollections;
+
+
+// Generational collection uses the kernel's soft-dirty page tracking
+// (Linux, /proc/self/pagemap bit 55) as its remembered set: a full
+// collection promotes every survivor to the old generation and clears
+// the soft-dirty bits, and since storing a pointer to a
+// later-allocated object into an old object necessarily dirties the
+// old object's page, a young collection only needs to scan old
+// objects on dirtied pages to find every old-to-young pointer.
+
+static int pagemapFd = -2;
+
+
+static bool softDirtySupported()
+{
+    if ( pagemapFd == -2 ) {
+        pagemapFd = ::open( "/proc/self/pagemap", O_RDONLY );
+        if ( pagemapFd >= 0 ) {
+            int f = ::open( "/proc/self/clear_refs", O_WRONLY );
+            if ( f < 0 ) {
+                ::close( pagemapFd );
+                pagemapFd = -1;
+            }
+            else {
+                ::close( f );
+            }
+        }
+    }
+    return pagemapFd >= 0;
+}
+
+
+static void clearSoftDirty()
+{
+    int f = ::open( "/proc/self/clear_refs", O_WRONLY );
+    if ( f < 0 )
+        return;
+    if ( ::write( f, "4\n", 2 ) < 2 )
+        ::pagemapFd = -1;
+    ::close( f );
+}
+
 
 static void oneMegabyteAllocated()
 {
@@ -174,6 +226,9 @@ void * Allocator::alloc( uint s, uint n )
 {
     if ( s > SizeLimit )
         die( Memory );
+    Arena * arena = Arena::scope();
+    if ( arena )
+        return arena->allocate( s );
     if ( n > s / sizeof( void* ) )
         n = s / sizeof( void* );
     if ( s > 262144 ) {
@@ -228,6 +283,7 @@ static struct {
 static uint numRoots;
 
 static bool verbose;
+static bool usageDumpWanted;
 
 
 /*! Returns a pointer to the Allocator responsible for \a size. \a
@@ -284,7 +340,7 @@ Allocator * Allocator::allocator( uint size )
 
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
-      used( 0 ), marked( 0 ), buffer( 0 ),
+      used( 0 ), marked( 0 ), old( 0 ), buffer( 0 ),
       next( 0 )
 {
     if ( s < ( BlockSize ) )
@@ -327,6 +383,9 @@ Allocator::Allocator( uint s )
     marked = (ulong*)::calloc( bl, sizeof( ulong ) );
     if ( !marked )
         die( Memory );
+    old = (ulong*)::calloc( bl, sizeof( ulong ) );
+    if ( !old )
+        die( Memory );
 
     AllocatorMapTable::insert( this );
 }
@@ -344,9 +403,11 @@ Allocator::~Allocator()
 
     ::free( used );
     ::free( marked );
+    ::free( old );
 
     next = 0;
     used = 0;
+    old = 0;
     buffer = 0;
 }
 
@@ -379,6 +440,7 @@ void * Allocator::allocate( uint size, uint pointers )
                         b->x.number = pointers;
                     b->x.magic = ::magic;
                     marked[base/bits] &= ~( 1UL << j );
+                    old[base/bits] &= ~( 1UL << j );
                     used[base/bits] |= ( 1UL << j );
                     taken++;
                     base++;
@@ -411,10 +473,13 @@ void Allocator::deallocate( void * p )
         return;
 
     AllocationBlock * m = (AllocationBlock *)block( i );
+    if ( (void*)m->payload != p )
+        return; // an interior pointer, e.g. into an Arena chunk
     if ( m->x.magic != ::magic )
         die( Memory );
     used[i/bits] &= ~(1UL << i);
     marked[i/bits] &= ~(1UL << i);
+    old[i/bits] &= ~(1UL << i);
     taken--;
     m->x.magic = 0;
 
@@ -448,6 +513,8 @@ void Allocator::setNumPointers( const void * p, uint n )
         return;
 
     AllocationBlock * m = (AllocationBlock *)block( i );
+    if ( (void*)m->payload != p )
+        return; // an interior pointer, e.g. into an Arena chunk
     if ( m->x.magic != ::magic )
         die( Memory );
 
@@ -477,6 +544,11 @@ void Allocator::mark( void * p )
     // does it have our magic marker?
     if ( b->x.magic != ::magic )
         die( Memory );
+    // old objects are implicitly live during a young collection, and
+    // any pointers they hold to young objects are found separately by
+    // markDirtyOldObjects()
+    if ( ::youngCollection && (a->old[i/bits] & 1UL << (i%bits)) )
+        return;
     // is it already marked?
     if ( (a->marked[i/bits] & 1UL << (i%bits)) )
         return;
@@ -533,6 +605,90 @@ void Allocator::mark()
 }
 
 
+/*! This private helper finds every old-generation object that lives
+    on a page the kernel has seen a write to since the last full
+    collection, and pushes it onto the mark stack so that mark() will
+    scan it for pointers to young objects. The object itself is not
+    marked; old objects are never freed by a young collection.
+*/
+
+void Allocator::markDirtyOldObjects()
+{
+    uint bi = 0;
+    while ( bi < 32 ) {
+        Allocator * a = allocators[bi];
+        while ( a ) {
+            uint bl = ( a->capacity + bits - 1 ) / bits;
+            bool any = false;
+            uint w = 0;
+            while ( w < bl && !any ) {
+                if ( a->old[w] )
+                    any = true;
+                w++;
+            }
+            if ( any ) {
+                uint l = a->capacity * a->step;
+                l = ( ( l-1 ) | 4095 ) + 1;
+                uint pages = l / 4096;
+                unsigned long long * pm =
+                    (unsigned long long*)malloc( pages * sizeof( unsigned long long ) );
+                if ( !pm )
+                    die( Memory );
+                ssize_t n = ::pread( pagemapFd, pm,
+                                     pages * sizeof( unsigned long long ),
+                                     ( (ulong)a->buffer / 4096 ) *
+                                     sizeof( unsigned long long ) );
+                uint ok = 0;
+                if ( n > 0 )
+                    ok = n / sizeof( unsigned long long );
+                uint i = 0;
+                while ( i < a->capacity ) {
+                    if ( a->old[i/bits] & ( 1UL << (i%bits) ) ) {
+                        uint p0 = ( i * a->step ) / 4096;
+                        uint p1 = ( ( i + 1 ) * a->step - 1 ) / 4096;
+                        bool dirty = false;
+                        uint p = p0;
+                        while ( p <= p1 && !dirty ) {
+                            if ( p >= ok ||
+                                 ( pm[p] & ( 1ULL << 55 ) ) )
+                                dirty = true;
+                            p++;
+                        }
+                        if ( dirty ) {
+                            AllocationBlock * b =
+                                (AllocationBlock*)a->block( i );
+                            if ( b->x.number ) {
+                                if ( !stack ) {
+                                    stack = (AllocationBlock**)
+                                        malloc( 524288 *
+                                                sizeof(AllocationBlock *) );
+                                    if ( !stack )
+                                        die( Memory );
+                                    tos = 0;
+                                }
+                                if ( tos == 524288 )
+                                    log( "Ran out of stack space while "
+                                         "collecting garbage",
+                                         Log::Disaster );
+                                else
+                                    stack[tos++] = b;
+                                if ( tos > peak )
+                                    peak = tos;
+                            }
+                        }
+                    }
+                    i++;
+                }
+                ::free( pm );
+                mark();
+            }
+            a = a->next;
+        }
+        bi++;
+    }
+}
+
+
 /*! Frees all memory that's no longer in use. This can take some time.
 
     Returns null if entries is null or empty, returns an object in
@@ -553,6 +709,15 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
     Cache::clearAllCaches( false );
 
+    // a young collection frees only objects allocated since the last
+    // full one; every 16th collection (or if soft-dirty tracking is
+    // unavailable) we do the full mark/sweep.
+    bool full = true;
+    if ( ::generational && softDirtySupported() &&
+         ::youngCollections < 16 )
+        full = false;
+    ::youngCollection = !full;
+
     total = 0;
     peak = 0;
     uint freed = 0;
@@ -562,6 +727,8 @@ Garbage * Allocator::free( List<Garbage> * entries )
     Garbage * biggest = 0;
 
     // mark
+    if ( !full )
+        markDirtyOldObjects();
     if ( entries ) {
         uint size = 0;
         List<Garbage>::Iterator i( entries );
@@ -599,7 +766,7 @@ Garbage * Allocator::free( List<Garbage> * entries )
         while ( a ) {
             uint taken = a->taken;
             if ( a->taken )
-                a->sweep();
+                a->sweep( full );
             freed = freed + ( taken - a->taken ) * a->step;
             total = total + a->taken * a->step;
             a = a->next;
@@ -623,6 +790,16 @@ Garbage * Allocator::free( List<Garbage> * entries )
     }
     gettimeofday( &afterSweep, 0 );
 
+    ::youngCollection = false;
+    if ( full ) {
+        ::youngCollections = 0;
+        if ( ::generational && softDirtySupported() )
+            clearSoftDirty();
+    }
+    else {
+        ::youngCollections++;
+    }
+
     uint timeToMark = 0;
     uint timeToSweep = 0;
     if ( start.tv_sec ) {
@@ -633,6 +810,38 @@ Garbage * Allocator::free( List<Garbage> * entries )
     }
     // dumpRandomObject();
 
+    if ( ::usageDumpWanted && full ) {
+        ::usageDumpWanted = false;
+        log( "Memory usage by allocation root (live data " +
+             EString::humanNumber( total ) + "b in " +
+             fn( objects ) + " objects):", Log::Info );
+        // log the 20 biggest roots, biggest first
+        bool dumped[maxRoots];
+        i = 0;
+        while ( i < numRoots )
+            dumped[i++] = false;
+        uint shown = 0;
+        while ( shown < 20 ) {
+            uint biggestRoot = UINT_MAX;
+            i = 0;
+            while ( i < numRoots ) {
+                if ( roots[i].root && roots[i].size && !dumped[i] &&
+                     ( biggestRoot == UINT_MAX ||
+                       roots[i].size > roots[biggestRoot].size ) )
+                    biggestRoot = i;
+                i++;
+            }
+            if ( biggestRoot == UINT_MAX )
+                break;
+            dumped[biggestRoot] = true;
+            log( EString( "  " ) + roots[biggestRoot].name + ": " +
+                 EString::humanNumber( roots[biggestRoot].size ) +
+                 "b in " + fn( roots[biggestRoot].objects ) +
+                 " objects", Log::Info );
+            shown++;
+        }
+    }
+
     if ( !freed )
         return biggest;
 
@@ -708,16 +917,22 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
 
 /*! Sweeps this allocator, freeing all unmarked memory blocks and
-    unmarking all memory blocks.
+    unmarking all memory blocks. If \a promote is true (a full
+    collection), every survivor moves to the old generation; if not, a
+    young collection is ending and old objects survive regardless of
+    marking.
 */
 
-void Allocator::sweep()
+void Allocator::sweep( bool promote )
 {
     uint b = 0;
     while ( taken > 0 && b * bits < capacity ) {
         uint i = 0;
-        while ( ( used[b] & ~marked[b] ) ) {
-            if ( (used[b] & (1UL<<i)) && !(marked[b] & (1UL<<i)) ) {
+        ulong live = marked[b];
+        if ( !promote )
+            live |= old[b];
+        while ( ( used[b] & ~live ) ) {
+            if ( (used[b] & (1UL<<i)) && !(live & (1UL<<i)) ) {
                 AllocationBlock * m
                     = (AllocationBlock *)block( b * bits + i );
                 if ( m ) {
@@ -730,6 +945,8 @@ void Allocator::sweep()
             }
             i++;
         }
+        if ( promote )
+            old[b] = marked[b];
         marked[b] = 0;
         b++;
     }
@@ -863,6 +1080,36 @@ void Allocator::setReporting( bool report )
 }
 
 
+/*! Requests that the next full garbage collection log a ranking of
+    live bytes by allocation root, and forces that collection to be a
+    full one so the numbers are accurate.
+
+    This function only sets flags, so it may be called from a signal
+    handler; the dump itself happens inside free().
+*/
+
+void Allocator::requestUsageDump()
+{
+    ::usageDumpWanted = true;
+    ::youngCollections = 16;
+}
+
+
+/*! Enables generational collection if \a g is true, and disables it
+    if \a g is false, falling back to a full mark/sweep every time.
+
+    The initial value is true, but generational collection is used
+    only where the kernel provides soft-dirty page tracking (Linux);
+    elsewhere every collection is a full one regardless of this
+    setting.
+*/
+
+void Allocator::setGenerational( bool g )
+{
+    ::generational = g;
+}
+
+
 
 
 /*! Returns the number of bytes allocated since the last memory sweep. */
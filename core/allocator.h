@@ -27,6 +27,8 @@ public:
     static void removeEternal( const void * );
 
     static void setReporting( bool );
+    static void requestUsageDump();
+    static void setGenerational( bool );
 
     static uint allocated();
     static uint inUse();
@@ -54,6 +56,7 @@ private:
     uint capacity;
     ulong * used;
     ulong * marked;
+    ulong * old;
     void * buffer;
     Allocator * next;
 
@@ -63,7 +66,8 @@ private:
 private:
     static void mark( void * );
     static void mark();
-    void sweep();
+    static void markDirtyOldObjects();
+    void sweep( bool );
 };
 
 
@@ -0,0 +1,163 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "arena.h"
+
+#include "allocator.h"
+
+
+static Arena * currentArena = 0;
+
+static const uint ChunkSize = 32768;
+
+
+class ArenaData
+    : public Garbage
+{
+public:
+    ArenaData(): chunks( 0 ), taken( 0 ) {}
+
+    class Chunk
+        : public Garbage
+    {
+    public:
+        Chunk(): data( 0 ), size( 0 ), used( 0 ), next( 0 ) {}
+        char * data;
+        uint size;
+        uint used;
+        Chunk * next;
+    };
+
+    Chunk * chunks;
+    uint taken;
+};
+
+
+/*! \class Arena arena.h
+
+    The Arena class provides a bump-pointer allocation region for
+    objects whose lifetimes all end at the same time, such as the
+    temporaries created while parsing a message.
+
+    The point of an Arena is to lighten the load on the garbage
+    collector: Allocator::free() never needs to sweep the individual
+    objects, and clear() returns the entire region in one shot once
+    the caller knows nothing in it remains in use.
+
+    An Arena is activated by creating an ArenaScope; while the scope
+    exists, Allocator::alloc() (and therefore operator new for all
+    Garbage classes) takes memory from the Arena instead of from the
+    regular collected heap. The underlying chunks are allocated via
+    Allocator::alloc() and are scanned in full during garbage
+    collection, so objects in an Arena keep whatever they point to
+    alive, and an Arena that is never cleared merely degrades to
+    normal collectible memory.
+*/
+
+
+/*! Creates a new, empty Arena. No memory is allocated until the first
+    call to allocate().
+*/
+
+Arena::Arena()
+    : d( new ArenaData )
+{
+}
+
+
+/*! Allocates \a s bytes from this Arena and returns a pointer to the
+    zero-filled region. The memory remains valid until clear() is
+    called, no matter what the garbage collector does in the meantime.
+*/
+
+void * Arena::allocate( uint s )
+{
+    // round up, so every object is pointer-aligned
+    s = ( ( s - 1 ) | ( sizeof( void* ) - 1 ) ) + 1;
+
+    ArenaData::Chunk * c = d->chunks;
+    if ( !c || c->used + s > c->size ) {
+        // the new chunk must not itself come from this arena
+        Arena * p = ::currentArena;
+        ::currentArena = 0;
+        c = new ArenaData::Chunk;
+        c->size = ChunkSize;
+        if ( s > c->size )
+            c->size = s;
+        c->data = (char*)Allocator::alloc( c->size );
+        c->next = d->chunks;
+        d->chunks = c;
+        ::currentArena = p;
+    }
+
+    void * r = c->data + c->used;
+    c->used += s;
+    d->taken += s;
+    return r;
+}
+
+
+/*! Discards everything ever allocated from this Arena, returning the
+    memory to the collected heap at once. The caller must ensure that
+    nothing allocated from this Arena is referenced any longer.
+*/
+
+void Arena::clear()
+{
+    ArenaData::Chunk * c = d->chunks;
+    while ( c ) {
+        Allocator::dealloc( c->data );
+        c = c->next;
+    }
+    d->chunks = 0;
+    d->taken = 0;
+}
+
+
+/*! Returns the number of bytes allocated from this Arena and not yet
+    returned by clear().
+*/
+
+uint Arena::allocated() const
+{
+    return d->taken;
+}
+
+
+/*! Returns a pointer to the currently active Arena, or a null pointer
+    if allocation currently uses the regular collected heap.
+*/
+
+Arena * Arena::scope()
+{
+    return ::currentArena;
+}
+
+
+/*! \class ArenaScope arena.h
+
+    An ArenaScope directs all allocation to a given Arena for as long
+    as it exists, in the same way that a Scope selects the current
+    Log. ArenaScope objects nest; when one is destroyed, the Arena
+    that was active when it was created becomes active again.
+*/
+
+
+/*! Creates an ArenaScope, which makes \a arena the current arena
+    until this object is destroyed.
+*/
+
+ArenaScope::ArenaScope( Arena * arena )
+    : a( arena ), parent( ::currentArena )
+{
+    ::currentArena = a;
+}
+
+
+/*! Restores the arena that was current when this ArenaScope was
+    created.
+*/
+
+ArenaScope::~ArenaScope()
+{
+    ::currentArena = parent;
+}
@@ -0,0 +1,41 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "global.h"
+
+
+class Arena
+    : public Garbage
+{
+public:
+    Arena();
+
+    void * allocate( uint );
+    void clear();
+
+    uint allocated() const;
+
+    static Arena * scope();
+
+private:
+    class ArenaData * d;
+    friend class ArenaScope;
+};
+
+
+class ArenaScope
+    : public Garbage
+{
+public:
+    ArenaScope( Arena * );
+    ~ArenaScope();
+
+private:
+    Arena * a;
+    Arena * parent;
+};
+
+
+#endif
@@ -0,0 +1,157 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include "global.h"
+#include "allocator.h"
+
+
+/*! \class Array array.h
+    A contiguous alternative to List for hot queue-like paths.
+
+    Array stores its member pointers in one allocation instead of a
+    node per member, so iterating touches consecutive memory instead
+    of chasing a pointer per element. It supports appending at the
+    tail and shifting from the head cheaply (it is a ring
+    internally), which is the access pattern of row queues and
+    response queues; List remains the right choice when members are
+    inserted or removed in the middle.
+
+    The iterator surface matches the subset of List::Iterator such
+    consumers use: construction from the container, operator bool,
+    conversion to T *, -> and prefix ++.
+*/
+
+template< class T >
+class Array
+    : public Garbage
+{
+public:
+    Array() { data = 0; max = 0; head = 0; tail = 0; }
+    ~Array() {}
+
+    bool isEmpty() const
+    {
+        return head == tail;
+    }
+
+    uint count() const
+    {
+        return tail - head;
+    }
+
+    void clear()
+    {
+        while ( head != tail ) {
+            data[head & (max-1)] = 0;
+            head++;
+        }
+        head = tail = 0;
+    }
+
+    T * firstElement() const
+    {
+        if ( head == tail )
+            return 0;
+        return data[head & (max-1)];
+    }
+
+    T * lastElement() const
+    {
+        if ( head == tail )
+            return 0;
+        return data[(tail-1) & (max-1)];
+    }
+
+    void append( T * d )
+    {
+        if ( tail - head == max )
+            grow();
+        data[tail & (max-1)] = d;
+        tail++;
+    }
+
+    T * shift()
+    {
+        if ( head == tail )
+            return 0;
+        T * d = data[head & (max-1)];
+        data[head & (max-1)] = 0;
+        head++;
+        return d;
+    }
+
+    T * pop()
+    {
+        if ( head == tail )
+            return 0;
+        tail--;
+        T * d = data[tail & (max-1)];
+        data[tail & (max-1)] = 0;
+        return d;
+    }
+
+    class Iterator
+        : public Garbage
+    {
+    public:
+        Iterator()                     { a = 0; i = 0; }
+        Iterator( const Array< T > *l ) {
+            a = l;
+            i = l ? l->head : 0;
+        }
+        Iterator( const Array< T > &l ) {
+            a = &l;
+            i = l.head;
+        }
+
+        operator bool() { return a && i != a->tail; }
+        operator T *() {
+            if ( !a || i == a->tail )
+                return 0;
+            return a->data[i & (a->max-1)];
+        }
+        T * operator ->() {
+            ok();
+            return a->data[i & (a->max-1)];
+        }
+        Iterator & operator ++() { ok(); i++; return *this; }
+
+        bool ok() const {
+            if ( !a || i == a->tail )
+                die( Invariant );
+            return true;
+        }
+
+    private:
+        const Array< T > * a;
+        uint i;
+    };
+
+private:
+    void grow()
+    {
+        uint nm = max ? max * 2 : 8;
+        T ** nd = (T**)Allocator::alloc( nm * sizeof( T* ), nm );
+        uint n = 0;
+        while ( head != tail ) {
+            nd[n++] = data[head & (max-1)];
+            head++;
+        }
+        data = nd;
+        max = nm;
+        head = 0;
+        tail = n;
+    }
+
+    T ** data;
+    uint max;
+    uint head;
+    uint tail;
+
+    friend class Iterator;
+};
+
+
+#endif
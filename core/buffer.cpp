@@ -10,6 +10,8 @@
 #include <fcntl.h>
 // read, write, unlink, lseek, close
 #include <unistd.h>
+// writev, struct iovec
+#include <sys/uio.h>
 // strlen, memmove
 #include <string.h>
 
@@ -20,6 +22,9 @@ static const uint bufsiz = 8192;
 static char buffer[bufsiz];
 
 
+List< Buffer::Vector > * Buffer::pool = 0;
+
+
 
 /*! \class Buffer buffer.h
     A Buffer is a FIFO of bytes.
@@ -140,21 +145,16 @@ void Buffer::append2( const char * s, uint l )
 
     }
 
-    // Then we use a new vector for the rest.
+    // Then we use a new (or recycled) vector for the rest.
     if ( copied < l ) {
-        int remains = l - copied;
-        Vector *f = new Vector;
-        f->len = remains;
-        if ( f->len < 1500 )
-            f->len = 1500;
-        f->len = Allocator::rounded( f->len );
-        f->base = (char*)Allocator::alloc( f->len, 0 );
+        uint remains = l - copied;
+        Vector *f = allocVector( remains );
 
         if ( vecs.isEmpty() )
             firstused = 0;
         vecs.append(f);
 
-        int n = f->len;
+        uint n = f->len;
         if ( n > remains )
             n = remains;
 
@@ -165,6 +165,59 @@ void Buffer::append2( const char * s, uint l )
 }
 
 
+/*! Returns a Vector with room for at least \a min bytes, taken from
+    the global page pool if it contains one big enough, and freshly
+    allocated otherwise.
+
+    Recycling pages means that steady-state network I/O allocates
+    nothing, so the garbage collector has correspondingly less churn
+    to mark and sweep.
+*/
+
+Buffer::Vector * Buffer::allocVector( uint min )
+{
+    if ( min < 1500 )
+        min = 1500;
+    min = Allocator::rounded( min );
+
+    if ( pool ) {
+        List< Vector >::Iterator it( pool );
+        while ( it && it->len < min )
+            ++it;
+        if ( it )
+            return pool->take( it );
+    }
+
+    Vector * f = new Vector;
+    f->len = min;
+    f->base = (char*)Allocator::alloc( f->len, 0 );
+    return f;
+}
+
+
+/*! Puts \a v back into the global page pool, provided it's a sensible
+    size and nothing else can be referencing it. A Vector which has
+    been handed out as a string() slice is shared, and must be left
+    for the garbage collector instead of being overwritten.
+
+    The pool is capped, so a brief burst of big buffers doesn't pin
+    memory forever.
+*/
+
+void Buffer::recycle( Vector * v )
+{
+    if ( !v || v->shared || v->len < 1500 || v->len > 65536 )
+        return;
+
+    if ( !pool ) {
+        pool = new List< Vector >;
+        Allocator::addEternal( pool, "buffer page pool" );
+    }
+    if ( pool->count() < 64 )
+        pool->append( v );
+}
+
+
 /*! \overload
     Appends the EString \a s to a Buffer.
 */
@@ -195,28 +248,47 @@ void Buffer::read( int fd )
 
 /*! Writes as much as possible from the Buffer to its file descriptor
     \a fd. That file descriptor must be nonblocking.
+
+    All the fragments are gathered into a single writev() call, so a
+    large response costs one syscall per flush instead of one per
+    Vector.
 */
 
 void Buffer::write( int fd )
 {
-    int written = 1;
+    while ( bytes > 0 ) {
+        const uint maxVectors = 64;
+        struct iovec iov[maxVectors];
+        uint n = 0;
+        uint gathered = 0;
+        uint used = firstused;
+
+        List< Vector >::Iterator it( vecs );
+        while ( it && n < maxVectors ) {
+            Vector * v = it;
+            ++it;
+            // only part of the last vector contains data
+            uint max = v->len;
+            if ( !it )
+                max = firstfree;
+            if ( max > used ) {
+                iov[n].iov_base = v->base + used;
+                iov[n].iov_len = max - used;
+                gathered += max - used;
+                n++;
+            }
+            used = 0;
+        }
 
-    while ( written > 0 ) {
-        Vector * v = vecs.firstElement();
+        if ( !n )
+            return;
 
-        int max = 0;
-        if ( v )
-            max = v->len;
-        if ( vecs.count() == 1 )
-            max = firstfree;
-        int n = max - firstused;
-
-        if ( n <= 0 || !v )
-            written = 0;
-        else
-            written = ::write( fd, v->base+firstused, n );
-        if ( written > 0 )
-            remove( written );
+        ssize_t written = ::writev( fd, iov, n );
+        if ( written <= 0 )
+            return;
+        remove( written );
+        if ( (uint)written < gathered )
+            return;
     }
 }
 
@@ -240,22 +312,28 @@ void Buffer::remove( uint n )
 
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
-        vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        vecs.shift();
+        while ( !vecs.isEmpty() )
+            recycle( vecs.shift() );
+        // a shared vector may still be referenced by a string() slice,
+        // so it must not be recycled and overwritten
+        if ( v && !v->shared && ( v->len > 100 && v->len < 20000 ) )
             vecs.append( v );
+        else
+            recycle( v );
         return;
     }
 
     while ( v && n >= v->len - firstused ) {
         n -= v->len - firstused;
         firstused = 0;
-        vecs.shift();
+        recycle( vecs.shift() );
         v = vecs.firstElement();
     }
     if ( v ) {
         firstused += n;
         if ( firstused >= firstfree && vecs.count() == 1 ) {
-            vecs.shift();
+            recycle( vecs.shift() );
             firstused = firstfree = 0;
         }
     }
@@ -265,6 +343,73 @@ void Buffer::remove( uint n )
 }
 
 
+/*! Rearranges the Buffer so that its first \a n bytes lie within a
+    single Vector. If they already do (the common case, since read()
+    appends in large blocks), this is free. Otherwise the bytes are
+    copied once into a fresh Vector, along with the rest of the
+    vectors they touch.
+
+    Afterwards operator[] stays on its inline fast path for any index
+    below \a n, and string() hands out slices of the coalesced memory
+    without copying. Protocol parsers use this to process one frame at
+    a time in place even when the frame straddles a read boundary.
+*/
+
+void Buffer::coalesce( uint n )
+{
+    if ( n > bytes )
+        n = bytes;
+    if ( !n || vecs.count() < 2 )
+        return;
+
+    Vector * first = vecs.firstElement();
+    if ( n <= first->len - firstused )
+        return;
+
+    // count the vectors the first n bytes touch, and the data they
+    // hold in all.
+    uint span = 0;
+    uint count = 0;
+    List< Vector >::Iterator it( vecs );
+    while ( it && span < n ) {
+        Vector * f = it;
+        ++it;
+        uint content = f->len;
+        if ( !it )
+            content = firstfree;
+        if ( !count )
+            content -= firstused;
+        span += content;
+        count++;
+    }
+
+    bool all = ( count == vecs.count() );
+
+    Vector * v = new Vector;
+    v->len = span;
+    v->base = (char*)Allocator::alloc( span, 0 );
+
+    uint copied = 0;
+    uint used = firstused;
+    while ( count ) {
+        Vector * f = vecs.shift();
+        count--;
+        uint max = f->len;
+        if ( all && !count )
+            max = firstfree;
+        memmove( v->base + copied, f->base + used, max - used );
+        copied += max - used;
+        used = 0;
+        recycle( f );
+    }
+
+    vecs.prepend( v );
+    firstused = 0;
+    if ( all )
+        firstfree = v->len;
+}
+
+
 /*! \fn char Buffer::operator[]( uint i ) const
 
     Returns the byte at index \a i of the Buffer. Returns 0 if \a i is
@@ -296,6 +441,11 @@ char Buffer::at( uint i ) const
 /*! Returns a string containing the first \a num bytes in the buffer. If
     the buffer contains fewer than \a num bytes, they are all returned.
     This function does not remove() the returned data.
+
+    If the requested bytes lie within a single Vector, the returned
+    string is a read-only slice referencing the Vector's memory
+    directly, so e.g. a large IMAP literal is handed onwards without
+    being copied. Otherwise the bytes are coalesced (copied) once.
 */
 
 EString Buffer::string( uint num ) const
@@ -307,6 +457,19 @@ EString Buffer::string( uint num ) const
         return result;
     if ( num < n )
         n = num;
+
+    Vector * first = vecs.firstElement();
+    uint firstmax = first->len;
+    if ( vecs.count() == 1 )
+        firstmax = firstfree;
+    if ( n <= firstmax - firstused ) {
+        first->shared = 1;
+        result.d = new EStringData;
+        result.d->str = first->base + firstused;
+        result.d->len = n;
+        return result;
+    }
+
     result.reserve( n );
 
     List< Vector >::Iterator it( vecs );
@@ -353,10 +516,33 @@ EString * Buffer::removeLine( uint s )
     if ( s == 0 || s > size() )
         s = size();
 
-    while ( i < s && (*this)[i] != '\012' )
-        i++;
+    // look for the LF with one memchr() per vector, instead of
+    // probing operator[] for every byte
+    bool found = false;
+    uint scanned = 0;
+    uint used = firstused;
+    List< Vector >::Iterator it( vecs );
+    while ( it && !found && scanned < s ) {
+        Vector * v = it;
+        ++it;
+        uint max = v->len;
+        if ( !it )
+            max = firstfree;
+        uint l = max - used;
+        if ( scanned + l > s )
+            l = s - scanned;
+        if ( l ) {
+            char * p = (char*)memchr( v->base + used, '\012', l );
+            if ( p ) {
+                i = scanned + ( p - ( v->base + used ) );
+                found = true;
+            }
+        }
+        scanned += l;
+        used = 0;
+    }
 
-    if ( i == s )
+    if ( !found )
         return 0;
 
     n = 1;
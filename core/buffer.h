@@ -28,6 +28,7 @@ public:
 
     uint size() const { return bytes; }
     void remove( uint );
+    void coalesce( uint );
     EString string( uint ) const;
     EString * removeLine( uint = 0 );
 
@@ -52,17 +53,24 @@ private:
     void append( const char *, uint, bool );
     void append2( const char *, uint );
 
+    struct Vector;
+    static Vector * allocVector( uint );
+    static void recycle( Vector * );
+
     struct Vector
         : public Garbage
     {
-        Vector() : base( 0 ), len( 0 ) {
+        Vector() : base( 0 ), len( 0 ), shared( 0 ) {
             setFirstNonPointer( &len );
         }
         char *base;
         // no pointers after this line
         uint len;
+        uint shared;
     };
 
+    static List< Vector > * pool;
+
     List< Vector > vecs;
     Compression filter;
     struct z_stream_s * zs;
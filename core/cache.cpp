@@ -4,6 +4,7 @@
 
 #include "list.h"
 #include "allocator.h"
+#include "configuration.h"
 
 
 static List<Cache> * caches;
@@ -59,26 +60,81 @@ Cache::~Cache()
 }
 
 
-/*! Calls clear() for each currently extant Cache. Called from
+/*! Trims or clears each currently extant Cache. Called from
     Allocator::free(). If \a harder is set, then all caches are
-    cleared completely, no matter how high their duration factors are.
+    cleared completely; that is the emergency path.
+
+    Otherwise, caches which can report their size() share a byte
+    budget (an eighth of memory-limit), and each sheds its oldest
+    entries via trim() only if the sized caches together exceed that
+    budget. Caches which cannot report a size are cleared wholesale
+    every factor'th collection, as before.
 */
 
-void Cache::clearAllCaches( bool harder)
+void Cache::clearAllCaches( bool harder )
 {
+    uint total = 0;
     List<Cache>::Iterator i( ::caches );
     while ( i ) {
         Cache * c = i;
         ++i;
-        c->n++;
-        if ( harder || c->n > c->factor ) {
-            c->n = 0;
-            c->clear(); // careful: no iterator pointing to c meanwhile
+        uint s = harder ? 0 : c->size();
+        if ( s ) {
+            total += s;
+        }
+        else {
+            c->n++;
+            if ( harder || c->n > c->factor ) {
+                c->n = 0;
+                c->clear(); // careful: no iterator pointing to c meanwhile
+            }
         }
     }
+
+    if ( !total )
+        return;
+
+    uint budget = Configuration::scalar( Configuration::MemoryLimit )
+                  * 1024 * 1024 / 8;
+    if ( total <= budget )
+        return;
+
+    // each sized cache sheds down to its proportional share
+    List<Cache>::Iterator j( ::caches );
+    while ( j ) {
+        Cache * c = j;
+        ++j;
+        uint s = c->size();
+        if ( s )
+            c->trim( (uint)( (int64)s * budget / total ) );
+    }
 }
 
 
 /*! \fn virtual void Cache::clear() = 0;
     Implemented by subclasses to discards the contents of the cache.
 */
+
+
+/*! Returns the approximate number of bytes of RAM this cache keeps
+    alive, or 0 if it cannot tell. The default implementation returns
+    0. Caches which return 0 age out wholesale via clear(); the others
+    are trimmed to a byte budget by clearAllCaches().
+*/
+
+uint Cache::size() const
+{
+    return 0;
+}
+
+
+/*! Called by clearAllCaches() to shrink this cache to at most \a
+    target bytes, oldest entries first. The default implementation
+    just calls clear(); caches which implement size() should do
+    better.
+*/
+
+void Cache::trim( uint )
+{
+    clear();
+}
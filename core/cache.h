@@ -16,6 +16,8 @@ public:
     static void clearAllCaches( bool );
 
     virtual void clear() = 0;
+    virtual uint size() const;
+    virtual void trim( uint );
 
 private:
     uint factor;
@@ -159,12 +159,20 @@ static struct {
     { "db-max-handles", Configuration::DbMaxHandles, 4 },
     { "db-handle-interval", Configuration::DbHandleInterval, 120 },
     { "db-handle-timeout", Configuration::DbHandleTimeout, 10 },
+    { "db-interactive-handles", Configuration::DbInteractiveHandles, 1 },
+    { "db-replica-port", Configuration::DbReplicaPort, 5432 },
     { "managesieve-port", Configuration::ManageSievePort, 4190 },
     { "undelete-time", Configuration::UndeleteTime, 49 },
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
+    { "metrics-port", Configuration::MetricsPort, 17221 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "smarthost-parallelism", Configuration::SmartHostParallelism, 4 },
+    { "slow-query-threshold", Configuration::SlowQueryThreshold, 500 },
+    { "imap-output-rate", Configuration::ImapOutputRate, 0 },
+    { "ldap-pool-size", Configuration::LdapPoolSize, 4 },
+    { "ldap-idle-time", Configuration::LdapIdleTime, 300 }
 };
 
 
@@ -181,6 +189,7 @@ static struct {
     { "db-user", Configuration::DbUser, AOXUSER },
     { "db-password", Configuration::DbPassword, "" },
     { "db-address", Configuration::DbAddress, DBADDRESS },
+    { "db-replica-address", Configuration::DbReplicaAddress, "" },
     { "hostname", Configuration::Hostname, "" },
     { "jail-user", Configuration::JailUser, AOXUSER },
     { "jail-group", Configuration::JailGroup, AOXGROUP },
@@ -211,7 +220,10 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "metrics-address", Configuration::MetricsAddress, "127.0.0.1" },
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "search-config", Configuration::SearchConfig, "simple" },
+    { "statistics-file", Configuration::StatisticsFile, "" }
 };
 
 
@@ -241,6 +253,8 @@ static struct {
     { "use-sieve", Configuration::UseSieve, true },
     { "use-subaddressing", Configuration::UseSubaddressing, false },
     { "use-statistics", Configuration::UseStatistics, false },
+    { "use-metrics", Configuration::UseMetrics, false },
+    { "log-query-plans", Configuration::LogQueryPlans, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
     { "use-imap-quota", Configuration::UseImapQuota, true }
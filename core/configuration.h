@@ -52,12 +52,20 @@ public:
         DbMaxHandles,
         DbHandleInterval,
         DbHandleTimeout,
+        DbInteractiveHandles,
+        DbReplicaPort,
         ManageSievePort,
         UndeleteTime,
         SmartHostPort,
         StatisticsPort,
+        MetricsPort,
         LdapServerPort,
         MemoryLimit,
+        SmartHostParallelism,
+        SlowQueryThreshold,
+        ImapOutputRate,
+        LdapPoolSize,
+        LdapIdleTime,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -74,6 +82,7 @@ public:
         DbUser,
         DbPassword,
         DbAddress,
+        DbReplicaAddress,
         Hostname,
         JailUser,
         JailGroup,
@@ -102,7 +111,10 @@ public:
         SmartHostAddress,
         AddressSeparator,
         StatisticsAddress,
+        MetricsAddress,
         LdapServerAddress,
+        SearchConfig,
+        StatisticsFile,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -132,6 +144,8 @@ public:
         UseSieve,
         UseSubaddressing,
         UseStatistics,
+        UseMetrics,
+        LogQueryPlans,
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
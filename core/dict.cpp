@@ -8,13 +8,15 @@
 /*! \class Dict dict.h
   The Dict class provides a simple string-to-object dictionary.
 
-  It is optimized for simplicity, and for extremely fast lookups when
-  the number of items can be estimated in advance. Its other
-  facilities are somewhat primitive. There is no iterator, for
-  example, and no way to remove an object from the dictionary.
-
-  An item can be added with insert(), retrieved with find() or the
-  presence of an item can be tested with contains(). That's it.
+  It is an open-addressing hash table, so find() costs a hash of the
+  key and typically one comparison, instead of the node-per-bit chase
+  a PatriciaTree does. Iteration is possible, but yields the items in
+  no particular order; code that needs ordered traversal should use a
+  PatriciaTree directly.
+
+  An item can be added with insert(), retrieved with find(), removed
+  with remove(), and the presence of an item can be tested with
+  contains().
 */
 
 
@@ -37,6 +39,25 @@
     dictionary, and false otherwise.
 */
 
+/*! \fn T * Dict::remove( const EString &s )
+    Removes the object identified by \a s from the dictionary, and
+    returns a pointer to it (or 0 if no such object was found).
+*/
+
+/*! \fn uint Dict::count() const
+    Returns the number of objects in the dictionary.
+*/
+
+/*! \fn bool Dict::isEmpty() const
+    Returns true if the dictionary contains no objects, and false
+    otherwise.
+*/
+
+/*! \fn void Dict::clear()
+    Removes everything from the dictionary, leaving it as empty as
+    the constructor made it.
+*/
+
 /*! \class UDict dict.h
     A Dict that takes UString keys.
 */
@@ -4,29 +4,185 @@
 #define DICT_H
 
 #include "patriciatree.h"
+#include "allocator.h"
 #include "ustring.h"
 #include "estring.h"
 
 
 template<class T>
-class Dict: public PatriciaTree<T> {
+class Dict: public Garbage {
 public:
-    Dict(): PatriciaTree<T>() {}
+    Dict(): slots( 0 ), size( 0 ), used( 0 ), tombstones( 0 ) {}
+    virtual ~Dict() {}
 
     T * find( const EString & s ) const {
-        return PatriciaTree<T>::find( s.data(), s.length() * 8 );
+        uint i;
+        if ( locate( s, i ) )
+            return slots[i].data;
+        return 0;
     }
     void insert( const EString & s, T* r ) {
-        PatriciaTree<T>::insert( s.data(), s.length() * 8, r );
+        if ( ( used + tombstones + 1 ) * 2 > size )
+            grow();
+        uint i;
+        if ( locate( s, i ) ) {
+            slots[i].data = r;
+            return;
+        }
+        // reuse the first tombstone passed on the way, if any
+        uint h = hash( s ) & ( size - 1 );
+        while ( slots[h].state == Used )
+            h = ( h + 1 ) & ( size - 1 );
+        if ( slots[h].state == Deleted )
+            tombstones--;
+        slots[h].key = new EString( s );
+        slots[h].data = r;
+        slots[h].state = Used;
+        used++;
     }
     T* remove( const EString & s ) {
-        return PatriciaTree<T>::remove( s.data(), s.length() * 8 );
+        uint i;
+        if ( !locate( s, i ) )
+            return 0;
+        T * r = slots[i].data;
+        slots[i].key = 0;
+        slots[i].data = 0;
+        slots[i].state = Deleted;
+        used--;
+        tombstones++;
+        return r;
     }
     bool contains( const EString & s ) const {
         return find( s ) != 0;
     }
 
+    bool isEmpty() const {
+        return used == 0;
+    }
+    uint count() const {
+        return used;
+    }
+    void clear() {
+        slots = 0;
+        size = 0;
+        used = 0;
+        tombstones = 0;
+    }
+
+    class Iterator
+        : public Garbage
+    {
+    public:
+        Iterator(): t( 0 ), i( 0 ) {}
+        Iterator( const Dict<T> * d ): t( d ), i( 0 ) { skip(); }
+        Iterator( const Dict<T> & d ): t( &d ), i( 0 ) { skip(); }
+
+        operator bool() { return t && i < t->size; }
+        operator T *() {
+            if ( t && i < t->size )
+                return t->slots[i].data;
+            return 0;
+        }
+        T * operator ->() { ok(); return t->slots[i].data; }
+        T & operator *() { ok(); return *( t->slots[i].data ); }
+        Iterator & operator ++() {
+            ok();
+            i++;
+            skip();
+            return *this;
+        }
+
+        EString key() { ok(); return *( t->slots[i].key ); }
+
+        bool operator ==( const Iterator & x ) {
+            return t == x.t && i == x.i;
+        }
+        bool operator !=( const Iterator & x ) {
+            return !( *this == x );
+        }
+
+    private:
+        void skip() {
+            while ( t && i < t->size && t->slots[i].state != Used )
+                i++;
+        }
+        void ok() {
+            if ( !t || i >= t->size )
+                die( Invariant );
+        }
+
+        const Dict<T> * t;
+        uint i;
+    };
+    friend class Iterator;
+
 private:
+    enum { Empty, Used, Deleted };
+
+    struct Slot {
+        EString * key;
+        T * data;
+        uint state;
+    };
+
+    static uint hash( const EString & s ) {
+        // FNV-1a
+        uint h = 2166136261U;
+        uint i = 0;
+        uint l = s.length();
+        while ( i < l ) {
+            h = ( h ^ (uint)s[i] ) * 16777619U;
+            i++;
+        }
+        return h;
+    }
+
+    // sets i to the slot where s is, and returns true, or returns
+    // false if s isn't in the table.
+    bool locate( const EString & s, uint & i ) const {
+        if ( !size )
+            return false;
+        uint h = hash( s ) & ( size - 1 );
+        while ( slots[h].state != Empty ) {
+            if ( slots[h].state == Used && *slots[h].key == s ) {
+                i = h;
+                return true;
+            }
+            h = ( h + 1 ) & ( size - 1 );
+        }
+        return false;
+    }
+
+    void grow() {
+        uint os = size;
+        Slot * o = slots;
+        size = size ? size * 2 : 16;
+        slots = (Slot*)Allocator::alloc( size * sizeof( Slot ) );
+        uint i = 0;
+        while ( i < size ) {
+            slots[i].key = 0;
+            slots[i].data = 0;
+            slots[i].state = Empty;
+            i++;
+        }
+        tombstones = 0;
+        i = 0;
+        while ( i < os ) {
+            if ( o[i].state == Used ) {
+                uint h = hash( *o[i].key ) & ( size - 1 );
+                while ( slots[h].state == Used )
+                    h = ( h + 1 ) & ( size - 1 );
+                slots[h] = o[i];
+            }
+            i++;
+        }
+    }
+
+    Slot * slots;
+    uint size;
+    uint used;
+    uint tombstones;
+
     // operators explicitly undefined because there is no single
     // correct way to implement them.
     Dict< T > &operator =( const Dict< T > & ) { return *this; }
@@ -35,6 +191,9 @@ private:
 };
 
 
+// UDict still sits on a PatriciaTree: its users are few, and some
+// (e.g. Thread) want the ordered traversal a tree gives them.
+
 template<class T>
 class UDict: public PatriciaTree<T> {
 public:
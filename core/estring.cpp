@@ -9,6 +9,248 @@
 // strlen
 #include <string.h>
 
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#elif defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
+
+
+/* Scanning helpers for the hot loops in lower(), simplified(),
+   trimmed() and crlf() below. Each returns the index of the first
+   byte at or after \a i that its caller has to look at, or \a len if
+   there is no such byte. When the compiler targets SSE2 or NEON the
+   loops examine sixteen bytes per step; the scalar tail doubles as
+   the complete implementation on other targets.
+*/
+
+#if defined( __SSE2__ )
+
+static inline uint scanWhitespace( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        __m128i c = _mm_loadu_si128( (const __m128i*)( s + i ) );
+        __m128i m = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( c, _mm_set1_epi8( 9 ) ),
+                          _mm_cmpeq_epi8( c, _mm_set1_epi8( 10 ) ) ),
+            _mm_or_si128( _mm_cmpeq_epi8( c, _mm_set1_epi8( 13 ) ),
+                          _mm_cmpeq_epi8( c, _mm_set1_epi8( 32 ) ) ) );
+        int b = _mm_movemask_epi8( m );
+        if ( b )
+            return i + __builtin_ctz( b );
+        i += 16;
+    }
+    while ( i < len ) {
+        char c = s[i];
+        if ( c == 9 || c == 10 || c == 13 || c == 32 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanNonWhitespace( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        __m128i c = _mm_loadu_si128( (const __m128i*)( s + i ) );
+        __m128i m = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( c, _mm_set1_epi8( 9 ) ),
+                          _mm_cmpeq_epi8( c, _mm_set1_epi8( 10 ) ) ),
+            _mm_or_si128( _mm_cmpeq_epi8( c, _mm_set1_epi8( 13 ) ),
+                          _mm_cmpeq_epi8( c, _mm_set1_epi8( 32 ) ) ) );
+        int b = _mm_movemask_epi8( m ) ^ 0xffff;
+        if ( b )
+            return i + __builtin_ctz( b );
+        i += 16;
+    }
+    while ( i < len ) {
+        char c = s[i];
+        if ( c != 9 && c != 10 && c != 13 && c != 32 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanCrLf( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        __m128i c = _mm_loadu_si128( (const __m128i*)( s + i ) );
+        __m128i m = _mm_or_si128(
+            _mm_cmpeq_epi8( c, _mm_set1_epi8( 13 ) ),
+            _mm_cmpeq_epi8( c, _mm_set1_epi8( 10 ) ) );
+        int b = _mm_movemask_epi8( m );
+        if ( b )
+            return i + __builtin_ctz( b );
+        i += 16;
+    }
+    while ( i < len ) {
+        if ( s[i] == 13 || s[i] == 10 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanUpperCase( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        __m128i c = _mm_loadu_si128( (const __m128i*)( s + i ) );
+        // bytes >= 0x80 look negative to the signed compare and fail
+        // the first test, which is just what we want.
+        __m128i m = _mm_and_si128(
+            _mm_cmpgt_epi8( c, _mm_set1_epi8( 'A'-1 ) ),
+            _mm_cmpgt_epi8( _mm_set1_epi8( 'Z'+1 ), c ) );
+        int b = _mm_movemask_epi8( m );
+        if ( b )
+            return i + __builtin_ctz( b );
+        i += 16;
+    }
+    while ( i < len ) {
+        if ( s[i] >= 'A' && s[i] <= 'Z' )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+#elif defined( __ARM_NEON )
+
+// NEON has no movemask, so once a step sees an interesting byte the
+// scalar tail pinpoints it; it's at most fifteen bytes away.
+
+static inline bool anyLaneSet( uint8x16_t m )
+{
+    uint64x2_t p = vreinterpretq_u64_u8( m );
+    return ( vgetq_lane_u64( p, 0 ) | vgetq_lane_u64( p, 1 ) ) != 0;
+}
+
+static inline uint scanWhitespace( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        uint8x16_t c = vld1q_u8( (const uint8_t*)( s + i ) );
+        uint8x16_t m = vorrq_u8(
+            vorrq_u8( vceqq_u8( c, vdupq_n_u8( 9 ) ),
+                      vceqq_u8( c, vdupq_n_u8( 10 ) ) ),
+            vorrq_u8( vceqq_u8( c, vdupq_n_u8( 13 ) ),
+                      vceqq_u8( c, vdupq_n_u8( 32 ) ) ) );
+        if ( anyLaneSet( m ) )
+            break;
+        i += 16;
+    }
+    while ( i < len ) {
+        char c = s[i];
+        if ( c == 9 || c == 10 || c == 13 || c == 32 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanNonWhitespace( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        uint8x16_t c = vld1q_u8( (const uint8_t*)( s + i ) );
+        uint8x16_t m = vorrq_u8(
+            vorrq_u8( vceqq_u8( c, vdupq_n_u8( 9 ) ),
+                      vceqq_u8( c, vdupq_n_u8( 10 ) ) ),
+            vorrq_u8( vceqq_u8( c, vdupq_n_u8( 13 ) ),
+                      vceqq_u8( c, vdupq_n_u8( 32 ) ) ) );
+        if ( anyLaneSet( vmvnq_u8( m ) ) )
+            break;
+        i += 16;
+    }
+    while ( i < len ) {
+        char c = s[i];
+        if ( c != 9 && c != 10 && c != 13 && c != 32 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanCrLf( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        uint8x16_t c = vld1q_u8( (const uint8_t*)( s + i ) );
+        uint8x16_t m = vorrq_u8( vceqq_u8( c, vdupq_n_u8( 13 ) ),
+                                 vceqq_u8( c, vdupq_n_u8( 10 ) ) );
+        if ( anyLaneSet( m ) )
+            break;
+        i += 16;
+    }
+    while ( i < len ) {
+        if ( s[i] == 13 || s[i] == 10 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanUpperCase( const char * s, uint i, uint len )
+{
+    while ( i + 16 <= len ) {
+        uint8x16_t c = vld1q_u8( (const uint8_t*)( s + i ) );
+        uint8x16_t m = vandq_u8( vcgeq_u8( c, vdupq_n_u8( 'A' ) ),
+                                 vcleq_u8( c, vdupq_n_u8( 'Z' ) ) );
+        if ( anyLaneSet( m ) )
+            break;
+        i += 16;
+    }
+    while ( i < len ) {
+        if ( s[i] >= 'A' && s[i] <= 'Z' )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+#else
+
+static inline uint scanWhitespace( const char * s, uint i, uint len )
+{
+    while ( i < len ) {
+        char c = s[i];
+        if ( c == 9 || c == 10 || c == 13 || c == 32 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanNonWhitespace( const char * s, uint i, uint len )
+{
+    while ( i < len ) {
+        char c = s[i];
+        if ( c != 9 && c != 10 && c != 13 && c != 32 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanCrLf( const char * s, uint i, uint len )
+{
+    while ( i < len ) {
+        if ( s[i] == 13 || s[i] == 10 )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+static inline uint scanUpperCase( const char * s, uint i, uint len )
+{
+    while ( i < len ) {
+        if ( s[i] >= 'A' && s[i] <= 'Z' )
+            return i;
+        i++;
+    }
+    return len;
+}
+
+#endif
+
 
 /*! \class EStringData estring.h
 
@@ -72,7 +314,7 @@ void * EStringData::operator new( size_t ownSize, uint extra )
 /*! Creates an empty EString */
 
 EString::EString()
-    : d( 0 )
+    : d( 0 ), id( ibuf, sizeof( ibuf ) )
 {
 }
 
@@ -80,7 +322,7 @@ EString::EString()
     The NUL is not copied. */
 
 EString::EString( const char *s )
-    : d( 0 )
+    : d( 0 ), id( ibuf, sizeof( ibuf ) )
 {
     *this = s;
 }
@@ -89,7 +331,7 @@ EString::EString( const char *s )
     contain NULs. */
 
 EString::EString( const char *s, uint n )
-    : d( 0 )
+    : d( 0 ), id( ibuf, sizeof( ibuf ) )
 {
     append( s, n );
 }
@@ -98,7 +340,7 @@ EString::EString( const char *s, uint n )
 /*! Creates a copy of \a s. */
 
 EString::EString( const EString &s )
-    : Garbage(), d( 0 )
+    : Garbage(), d( 0 ), id( ibuf, sizeof( ibuf ) )
 {
     *this = s;
 }
@@ -123,7 +365,7 @@ EString::EString( const EString &s )
 
 EString::~EString()
 {
-    if ( d && d->max )
+    if ( d && d->max && d != &id )
         Allocator::dealloc( d );
     d = 0;
 }
@@ -135,10 +377,10 @@ EString::~EString()
 
 void EString::operator delete( void *p )
 {
-    EStringData * & d = ((EString *)p)->d;
-    if ( d && d->max )
-        Allocator::dealloc( d );
-    d = 0;
+    EString * s = (EString *)p;
+    if ( s->d && s->d->max && s->d != &s->id )
+        Allocator::dealloc( s->d );
+    s->d = 0;
 }
 
 
@@ -147,9 +389,21 @@ void EString::operator delete( void *p )
 
 EString & EString::operator=( const EString & other )
 {
-    d = other.d;
-    if ( d )
-        d->max = 0;
+    if ( this == &other )
+        return *this;
+    if ( other.d == &other.id ) {
+        // a short string's bytes live inside the other object, so
+        // they have to be copied, not shared
+        id.len = other.id.len;
+        if ( id.len )
+            memmove( ibuf, other.ibuf, id.len );
+        d = &id;
+    }
+    else {
+        d = other.d;
+        if ( d )
+            d->max = 0;
+    }
     return *this;
 }
 
@@ -221,10 +475,20 @@ const char * EString::cstr() const
         d->str[d->len] = '\0';
         return data();
     }
-    EString tmp;
-    tmp.reserve( length() + 1 );
-    tmp = *this;
-    return tmp.cstr();
+    // the remaining cases are shared data, a full inline block and no
+    // data at all. make a zero-terminated copy on the heap; a copy in
+    // some temporary's inline block would die with the temporary.
+    uint n = length();
+    uint num = Allocator::rounded( n + 1 + sizeof( EStringData ) ) -
+               sizeof( EStringData );
+    EStringData * nd = new( num ) EStringData( 0 );
+    nd->max = num;
+    nd->str = sizeof( EStringData ) + (char*)nd;
+    nd->len = n;
+    if ( n )
+        memmove( nd->str, d->str, n );
+    nd->str[n] = '\0';
+    return nd->str;
 }
 
 
@@ -234,12 +498,35 @@ const char * EString::cstr() const
 EString EString::lower() const
 {
     EString result( *this );
-    uint i = 0;
-    while ( i < result.length() ) {
-        if ( result[i] >= 'A' && result[i] <= 'Z' ) {
-            result.detach();
-            result.d->str[i] = result.d->str[i] + 32;
-        }
+    uint i = scanUpperCase( data(), 0, length() );
+    if ( i >= length() )
+        return result;
+    result.detach();
+    char * s = result.d->str;
+    uint len = result.d->len;
+#if defined( __SSE2__ )
+    while ( i + 16 <= len ) {
+        __m128i c = _mm_loadu_si128( (const __m128i*)( s + i ) );
+        __m128i m = _mm_and_si128(
+            _mm_cmpgt_epi8( c, _mm_set1_epi8( 'A'-1 ) ),
+            _mm_cmpgt_epi8( _mm_set1_epi8( 'Z'+1 ), c ) );
+        c = _mm_or_si128( c, _mm_and_si128( m, _mm_set1_epi8( 0x20 ) ) );
+        _mm_storeu_si128( (__m128i*)( s + i ), c );
+        i += 16;
+    }
+#elif defined( __ARM_NEON )
+    while ( i + 16 <= len ) {
+        uint8x16_t c = vld1q_u8( (uint8_t*)( s + i ) );
+        uint8x16_t m = vandq_u8( vcgeq_u8( c, vdupq_n_u8( 'A' ) ),
+                                 vcleq_u8( c, vdupq_n_u8( 'Z' ) ) );
+        c = vorrq_u8( c, vandq_u8( m, vdupq_n_u8( 0x20 ) ) );
+        vst1q_u8( (uint8_t*)( s + i ), c );
+        i += 16;
+    }
+#endif
+    while ( i < len ) {
+        if ( s[i] >= 'A' && s[i] <= 'Z' )
+            s[i] = s[i] + 32;
         i++;
     }
     return result;
@@ -446,12 +733,7 @@ void EString::appendNumber( int n, int base )
 
 void EString::appendNumber( uint n, int base )
 {
-    EString s( fromNumber( n, base ) );
-
-    if ( n > 0 )
-        append( s );
-    else
-        append( "0" );
+    appendNumber( (int64)n, (uint)base );
 }
 
 /*! Ensures that there is at least \a num bytes available in this
@@ -482,10 +764,28 @@ void EString::reserve( uint num )
 
 void EString::reserve2( uint num )
 {
+    if ( num <= sizeof( ibuf ) ) {
+        // short strings fit in the inline block and never touch
+        // Allocator. reserve() guarantees that num >= length(), so
+        // the bytes fit.
+        if ( d != &id ) {
+            EStringData * freeable = 0;
+            if ( d && d->max )
+                freeable = d;
+            id.len = d ? d->len : 0;
+            if ( id.len )
+                memmove( ibuf, d->str, id.len );
+            d = &id;
+            if ( freeable )
+                Allocator::dealloc( freeable );
+        }
+        return;
+    }
+
     num = Allocator::rounded( num + sizeof( EStringData ) ) - sizeof( EStringData );
 
     EStringData * freeable = 0;
-    if ( d && d->max )
+    if ( d && d->max && d != &id )
         freeable = d;
 
     EStringData * nd = new( num ) EStringData( 0 );
@@ -512,7 +812,7 @@ void EString::reserve2( uint num )
 void EString::truncate( uint l )
 {
     if ( !l ) {
-        if ( d && d->max )
+        if ( d && d->max && d != &id )
             Allocator::dealloc( d );
         d = 0;
     }
@@ -555,6 +855,13 @@ EString EString::mid( uint start, uint num ) const
     if ( !num || start >= length() )
         return result;
 
+    if ( d == &id || num <= sizeof( result.ibuf ) ) {
+        // copy short results (and anything living in our inline
+        // block) instead of pinning this string's data
+        result.append( d->str + start, num );
+        return result;
+    }
+
     d->max = 0;
     result.d = new EStringData;
     result.d->str = d->str + start;
@@ -695,52 +1002,40 @@ bool EString::boring( Boring b ) const
 EString EString::simplified() const
 {
     // scan for the first nonwhitespace character
-    uint i = 0;
-    uint first = 0;
-    while ( i < length() && first == i ) {
-        char c = d->str[i];
-        if ( c == 9 || c == 10 || c == 13 || c == 32 )
-            first++;
-        i++;
-    }
+    uint len = length();
+    const char * s = data();
+    uint first = scanNonWhitespace( s, 0, len );
     // scan on to find the last nonwhitespace character and detect any
     // sequences of two or more whitespace characters within the
     // string.
     uint last = first;
-    uint spaces = 0;
     bool identity = true;
-    while ( identity && i < length() ) {
-        char c = d->str[i];
-        if ( c == 9 || c == 10 || c == 13 || c == 32 ) {
-            spaces++;
-        }
-        else {
-            if ( spaces > 1 )
-                identity = false;
-            spaces = 0;
-            last = i;
+    uint i = first;
+    while ( i < len ) {
+        uint j = scanWhitespace( s, i, len );
+        if ( j > i )
+            last = j - 1;
+        if ( j >= len )
+            break;
+        uint k = scanNonWhitespace( s, j, len );
+        if ( k < len && k - j > 1 ) {
+            identity = false;
+            break;
         }
-        i++;
+        i = k;
     }
     if ( identity )
         return mid( first, last+1-first );
 
     EString result;
-    result.reserve( length() );
-    i = 0;
-    spaces = 0;
-    while ( i < length() ) {
-        char c = d->str[i];
-        if ( c == 9 || c == 10 || c == 13 || c == 32 ) {
-            spaces++;
-        }
-        else {
-            if ( spaces && !result.isEmpty() )
-                result.append( ' ' );
-            spaces = 0;
-            result.append( c );
-        }
-        i++;
+    result.reserve( len );
+    i = first;
+    while ( i < len ) {
+        uint j = scanWhitespace( s, i, len );
+        result.append( s + i, j - i );
+        i = scanNonWhitespace( s, j, len );
+        if ( i < len )
+            result.append( ' ' );
     }
     return result;
 }
@@ -752,25 +1047,21 @@ EString EString::simplified() const
 
 EString EString::trimmed() const
 {
-    uint i = 0;
-    uint first = length();
-    uint last = 0;
-    while ( i < length() ) {
-        char c = d->str[i];
-        if ( c != 9 && c != 10 && c != 13 && c != 32 ) {
-            if ( i < first )
-                first = i;
-            if ( i > last )
-                last = i;
-        }
-        i++;
+    uint len = length();
+    const char * s = data();
+    uint first = scanNonWhitespace( s, 0, len );
+    if ( first >= len ) {
+        EString empty;
+        return empty;
     }
 
-    if ( last >= first )
-        return mid( first, last + 1 - first );
+    uint last = len - 1;
+    while ( last > first &&
+            ( s[last] == 9 || s[last] == 10 ||
+              s[last] == 13 || s[last] == 32 ) )
+        last--;
 
-    EString empty;
-    return empty;
+    return mid( first, last + 1 - first );
 }
 
 
@@ -894,6 +1185,25 @@ uint EString::number( bool * ok, uint base ) const
     uint n = 0;
 
     bool good = !isEmpty();
+
+    // decimal is overwhelmingly common, so it gets a loop with one
+    // range check and one overflow check per digit
+    if ( base == 10 ) {
+        while ( good && i < length() ) {
+            uint digit = d->str[i] - '0';
+            if ( digit > 9 || n > ( UINT_MAX - digit ) / 10 )
+                good = false;
+            else
+                n = 10 * n + digit;
+            i++;
+        }
+        if ( !good )
+            n = 0;
+        if ( ok )
+            *ok = good;
+        return n;
+    }
+
     while ( good && i < length() ) {
         if ( d->str[i] < '0' || d->str[i] > 'z' )
             good = false;
@@ -960,25 +1270,62 @@ EString EString::fromNumber( int64 n, uint base )
 
 
 
+// both digits of every number 0-99, so the decimal loop below can
+// emit two digits per division.
+
+static const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+
 /*! Converts \a n to a number in the \a base system and appends the
     result to this string. If \a n is 0, "0" is appended.
 
     Uses lower-case for digits above 9.
+
+    The digits are assembled in a stack buffer and appended in one
+    go, so this allocates at most once however big \a n is, and the
+    common decimal case needs only one division per two digits.
 */
 
 void EString::appendNumber( int64 n, uint base )
 {
-    int64 top = 1;
-    while ( top * base <= n )
-        top = base * top;
-    while ( top ) {
-        uint d = ( n / top ) % base;
-        char  c = '0' + d;
-        if ( d > 9 )
-            c = 'a' + d - 10;
-        append( c );
-        top = top / base;
+    char buf[66];
+    uint i = 66;
+    if ( base == 10 ) {
+        while ( n >= 100 ) {
+            uint p = ( n % 100 ) * 2;
+            n = n / 100;
+            buf[--i] = ::digitPairs[p+1];
+            buf[--i] = ::digitPairs[p];
+        }
+        if ( n >= 10 ) {
+            buf[--i] = ::digitPairs[n*2+1];
+            buf[--i] = ::digitPairs[n*2];
+        }
+        else {
+            buf[--i] = '0' + n;
+        }
     }
+    else {
+        do {
+            uint d = n % base;
+            n = n / base;
+            if ( d > 9 )
+                buf[--i] = 'a' + d - 10;
+            else
+                buf[--i] = '0' + d;
+        } while ( n > 0 );
+    }
+    append( buf + i, 66 - i );
 }
 
 
@@ -1162,6 +1509,36 @@ static char from64[128] =
 
 
 
+// four pre-shifted lookup tables, so that decoding a quad of base-64
+// characters is four loads and three ors. any character that cannot
+// occur in the middle of clean base-64 (including '=' and white
+// space) carries the high bit, which sends de64() to its slower,
+// forgiving loop.
+
+static uint * de64Quads = 0;
+
+static void buildDe64Quads()
+{
+    uint * t = (uint*)Allocator::alloc( 4 * 256 * sizeof( uint ), 0 );
+    Allocator::addEternal( t, "base-64 decoding tables" );
+    uint c = 0;
+    while ( c < 256 ) {
+        uint v = c < 128 ? (uint)from64[c] : 99;
+        if ( v < 64 ) {
+            t[c]       = v << 2;
+            t[256+c]   = ( v >> 4 ) | ( ( v & 15 ) << 12 );
+            t[512+c]   = ( ( v >> 2 ) << 8 ) | ( ( v & 3 ) << 22 );
+            t[768+c]   = v << 16;
+        }
+        else {
+            t[c] = t[256+c] = t[512+c] = t[768+c] = 0x80000000;
+        }
+        c++;
+    }
+    ::de64Quads = t;
+}
+
+
 /*! Decodes this string using the base-64 algorithm and returns the result. */
 
 EString EString::de64() const
@@ -1175,6 +1552,26 @@ EString EString::de64() const
     int m = 0;
     uint p = 0;
     bool done = false;
+    if ( !::de64Quads )
+        buildDe64Quads();
+    // decode four characters to three bytes per step while the input
+    // is clean; stop at the first quad containing '=', white space or
+    // anything else odd, and let the loop below sort that out.
+    while ( p + 4 <= length() ) {
+        const char * s = d->str + p;
+        uint w = ::de64Quads[(uint)s[0]] |
+                 ::de64Quads[256+(uint)s[1]] |
+                 ::de64Quads[512+(uint)s[2]] |
+                 ::de64Quads[768+(uint)s[3]];
+        if ( w & 0x80000000 )
+            break;
+        char * o = result.d->str + bp;
+        o[0] = w;
+        o[1] = w >> 8;
+        o[2] = w >> 16;
+        bp += 3;
+        p += 4;
+    }
     while ( p < length() && !done ) {
         uint c = d->str[p++];
         if ( c <= 'z' )
@@ -1221,6 +1618,26 @@ EString EString::de64() const
 static char to64[65] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+
+// encoding counterpart of de64Quads: maps twelve input bits to the
+// two output characters in one load.
+
+static char * e64Pairs = 0;
+
+static void buildE64Pairs()
+{
+    char * t = (char*)Allocator::alloc( 4096 * 2, 0 );
+    Allocator::addEternal( t, "base-64 encoding table" );
+    uint v = 0;
+    while ( v < 4096 ) {
+        t[2*v] = to64[v >> 6];
+        t[2*v+1] = to64[v & 63];
+        v++;
+    }
+    ::e64Pairs = t;
+}
+
+
 /*! Encodes this string using the base-64 algorithm and returns the
     result in lines of at most \a lineLength characters. If \a
     lineLength is not supplied, e64() returns a single line devoid of
@@ -1233,14 +1650,22 @@ EString EString::e64( uint lineLength ) const
     int l = length();
     int i = 0;
     EString r;
-    r.reserve( l*2 );
+    // room for the quads, a CRLF per quad at worst, and the padding
+    r.reserve( ( (uint)l + 2 ) / 3 * 6 + 6 );
     int p = 0;
     uint c = 0;
+    if ( !::e64Pairs )
+        buildE64Pairs();
     while ( i <= l-3 ) {
-        r.d->str[p++] = to64[ ((d->str[i]>>2))&63 ];
-        r.d->str[p++] = to64[ ((d->str[i]<<4)&48) + ((d->str[i+1]>>4)&15) ];
-        r.d->str[p++] = to64[ ((d->str[i+1]<<2)&60) + ((d->str[i+2]>>6)&3) ];
-        r.d->str[p++] = to64[ (d->str[i+2]&63) ];
+        uint n = ( (uint)d->str[i] << 16 ) |
+                 ( (uint)d->str[i+1] << 8 ) |
+                 (uint)d->str[i+2];
+        const char * hi = ::e64Pairs + 2 * ( n >> 12 );
+        const char * lo = ::e64Pairs + 2 * ( n & 4095 );
+        r.d->str[p++] = hi[0];
+        r.d->str[p++] = hi[1];
+        r.d->str[p++] = lo[0];
+        r.d->str[p++] = lo[1];
         i += 3;
         c += 4;
         if ( lineLength > 0 && c >= lineLength ) {
@@ -1274,6 +1699,31 @@ EString EString::e64( uint lineLength ) const
 }
 
 
+// returns the index of the first '=' or \a marker at or after i, or
+// len. Looks at eight bytes per step, using the usual zero-in-word
+// bit trick.
+
+static inline uint scanQP( const char * s, uint i, uint len, char marker )
+{
+    unsigned long long eq = 0x0101010101010101ULL * (uint)'=';
+    unsigned long long mk = 0x0101010101010101ULL * (uint)marker;
+    while ( i + 8 <= len ) {
+        unsigned long long x;
+        memcpy( &x, s + i, 8 );
+        unsigned long long a = x ^ eq;
+        unsigned long long b = x ^ mk;
+        if ( ( ( ( a - 0x0101010101010101ULL ) & ~a ) |
+               ( ( b - 0x0101010101010101ULL ) & ~b ) ) &
+             0x8080808080808080ULL )
+            break;
+        i += 8;
+    }
+    while ( i < len && s[i] != '=' && s[i] != marker )
+        i++;
+    return i;
+}
+
+
 /*! Decodes this string according to the quoted-printable algorithm,
     and returns the result. Errors are overlooked, to cope with all
     the mail-munging brokenware in the great big world.
@@ -1287,12 +1737,21 @@ EString EString::deQP( bool underscore ) const
     uint i = 0;
     EString r;
     r.reserve( length() );
+    char marker = underscore ? '_' : '=';
     while ( i < length() ) {
+        // copy the plain run up to the next '=' (or '_') wholesale
+        uint j = scanQP( d->str, i, length(), marker );
+        if ( j > i ) {
+            memmove( r.d->str + r.d->len, d->str + i, j - i );
+            r.d->len += j - i;
+            i = j;
+            if ( i >= length() )
+                break;
+        }
         if ( d->str[i] != '=' ) {
-            char c = d->str[i++];
-            if ( underscore && c == '_' )
-                c = ' ';
-            r.d->str[r.d->len++] = c;
+            // the underscore
+            r.d->str[r.d->len++] = ' ';
+            i++;
         }
         else {
             // are we looking at = followed by end-of-line?
@@ -1799,50 +2258,47 @@ EString EString::anonymised() const
 
 EString EString::crlf() const
 {
+    uint len = length();
+    const char * s = data();
     bool copy = true;
-    if ( length() < 2 ||
-         d->str[d->len-1] != 10 ||
-         d->str[d->len-2] != 13 )
+    if ( len < 2 || s[len-1] != 10 || s[len-2] != 13 )
         copy = false;
     uint i = 0;
-    while ( copy && i < d->len ) {
-        if ( d->str[i] == 13 && i < d->len && d->str[i+1] == 10 )
+    while ( copy && i < len ) {
+        i = scanCrLf( s, i, len );
+        if ( i >= len )
+            break;
+        if ( s[i] == 13 && i+1 < len && s[i+1] == 10 )
             i += 2;
-        else if ( d->str[i] == 13 || d->str[i] == 10 )
-            copy = false;
         else
-            i++;
+            copy = false;
     }
     if ( copy )
         return *this;
 
     EString r;
-    r.reserve( length() );
-    r.append( mid( 0, i ) );
+    r.reserve( len );
+    r.append( s, i );
     bool lf = false;
-    uint len = 0;
-    if ( d )
-        len = d->len;
     while ( i < len ) {
-        lf = false;
-        char c = d->str[i++];
-
-        if ( c == 10 ) {
-            lf = true;
+        uint j = scanCrLf( s, i, len );
+        if ( j > i ) {
+            r.append( s + i, j - i );
+            lf = false;
+            i = j;
+            if ( i >= len )
+                break;
         }
-        else if ( c == 13 ) {
-            lf = true;
-            if ( i < d->len && d->str[i] == 10 )
+
+        char c = s[i++];
+        if ( c == 13 ) {
+            if ( i < len && s[i] == 10 )
                 i++;
-            else if ( i < d->len-1 &&
-                      d->str[i] == 13 && d->str[i+1] == 10 )
+            else if ( i+1 < len && s[i] == 13 && s[i+1] == 10 )
                 i += 2;
         }
-
-        if ( lf )
-            r.append( "\r\n" );
-        else
-            r.append( c );
+        r.append( "\r\n" );
+        lf = true;
     }
     if ( !lf )
         r.append( "\r\n" );
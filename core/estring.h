@@ -14,8 +14,12 @@ private:
         setFirstNonPointer( &len );
     }
     EStringData( int );
+    // constructs the inline block inside an EString. that block is
+    // not a separate allocation, so it must not talk to Allocator.
+    EStringData( char * b, uint m ): str( b ), len( 0 ), max( m ) {}
 
     friend class EString;
+    friend class Buffer;
     friend bool operator==( const class EString &, const class EString & );
     friend bool operator==( const class EString &, const char * );
     void * operator new( size_t, uint );
@@ -150,6 +154,15 @@ public:
 
 private:
     EStringData * d;
+
+    // short strings are stored in this inline block instead of a
+    // separate allocation; d points to id when it is in use. the
+    // bytes then belong to this very object, so copying and slicing
+    // must copy them (see operator=() and mid()).
+    EStringData id;
+    char ibuf[24];
+
+    friend class Buffer;
 };
 
 
@@ -5,10 +5,13 @@
 #include "scope.h"
 #include "logger.h"
 #include "estring.h"
+#include "allocator.h"
 #include "configuration.h"
 
 // sprintf, fprintf
 #include <stdio.h>
+// va_list etc.
+#include <stdarg.h>
 // getpid()
 #include <sys/types.h>
 #include <unistd.h>
@@ -32,6 +35,41 @@ void log( const EString &m, Log::Severity s )
 }
 
 
+/*! Logs a message with severity \a s built from the printf-style
+    format \a fmt and its arguments, but only formats it if \a s
+    passes the configured log-level, so a discarded debug line costs
+    a comparison instead of string building. The compiler checks the
+    placeholders against the arguments.
+*/
+
+void log( Log::Severity s, const char * fmt, ... )
+{
+    if ( !Log::loggable( s ) )
+        return;
+
+    va_list ap;
+    char buf[512];
+    va_start( ap, fmt );
+    int n = vsnprintf( buf, sizeof( buf ), fmt, ap );
+    va_end( ap );
+    if ( n < 0 )
+        return;
+
+    EString m;
+    if ( (uint)n < sizeof( buf ) ) {
+        m.append( buf, n );
+    }
+    else {
+        char * big = (char *)Allocator::alloc( n + 1, 0 );
+        va_start( ap, fmt );
+        vsnprintf( big, n + 1, fmt, ap );
+        va_end( ap );
+        m.append( big, n );
+    }
+    log( m, s );
+}
+
+
 /*! \class Log log.h
     The Log class sends log messages to the Log server.
 
@@ -176,3 +214,14 @@ void Log::setLogLevel( Severity s )
 {
     logLevel = s;
 }
+
+
+/*! Returns true if a message of severity \a s would be logged, and
+    false if it would be discarded. Chatty call sites use this to
+    skip building debug messages that nobody will see.
+*/
+
+bool Log::loggable( Severity s )
+{
+    return s >= logLevel;
+}
@@ -24,6 +24,7 @@ public:
     bool isChildOf( Log * ) const;
 
     static void setLogLevel( Severity );
+    static bool loggable( Severity );
     static const char * severity( Severity );
     static bool disastersYet();
 
@@ -35,6 +36,8 @@ private:
 
 
 void log( const EString &, Log::Severity = Log::Info );
+void log( Log::Severity, const char *, ... )
+    __attribute__(( format( printf, 2, 3 ) ));
 
 
 #endif
@@ -15,6 +15,13 @@
     The class is optimised for fast retrieval. Inserting is a little
     slower.
 
+    Nodes small enough to be common are carved out of shared slabs
+    and recycled through free lists, so a big tree occupies a handful
+    of large allocations instead of one per node. Lookups chase
+    pointers within those slabs rather than all over the heap, and
+    garbage collection marks a few slabs instead of thousands of
+    nodes.
+
     There are three common public operations: insert(), find() and
     remove(). There's also a clear(), which is fast but relies on GC
     to tidy up slowly later.
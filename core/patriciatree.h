@@ -12,7 +12,11 @@ class PatriciaTree
     : public Garbage
 {
 public:
-    PatriciaTree(): root( 0 ) { }
+    PatriciaTree(): root( 0 ), slab( 0 ), slabUsed( 0 ) {
+        uint i = 0;
+        while ( i < Buckets )
+            freelist[i++] = 0;
+    }
     virtual ~PatriciaTree() {}
 
     class Node
@@ -25,6 +29,16 @@ public:
             setFirstNonPointer( &length );
         }
 
+        // for nodes carved out of a shared slab. a node can sit at
+        // the very start of its slab, and there setFirstNonPointer()
+        // would truncate the collector's scan of the whole slab,
+        // hiding every later node's pointers from mark(). so slab
+        // nodes leave the slab's scan-everything setting alone.
+        Node( bool ) : zero( 0 ), one( 0 ),
+                       parent( 0 ),
+                       data( 0 ), length( 0 ) {
+        }
+
         uint count() {
             uint c = 0;
             if ( data )
@@ -40,6 +54,10 @@ public:
             return Allocator::alloc( ownSize + extra );
         }
 
+        void * operator new( size_t, void * p ) {
+            return p;
+        }
+
     public: // really want private, but g++ 4.0.3 throws a fit
         friend class PatriciaTree;
         Node * zero;
@@ -248,6 +266,11 @@ public:
 
     void clear() {
         root = 0;
+        slab = 0;
+        slabUsed = 0;
+        uint i = 0;
+        while ( i < Buckets )
+            freelist[i++] = 0;
     }
 
     class Iterator
@@ -369,12 +392,46 @@ public:
     }
 
 private:
+    // small nodes are carved out of shared slabs, so that a big tree
+    // is a few large allocations rather than one per node. that makes
+    // lookups walk warmer cache lines and gives the collector far
+    // fewer objects to mark. freed nodes go on per-size free lists
+    // (linked through their zero pointers, the key length telling
+    // free() which list). oversized nodes are allocated one by one,
+    // as before.
+
+    enum { Buckets = 8, SlabSize = 16384 };
+
     virtual Node * node( uint x ) {
-        Node * n = new ( x ) Node;
-        return n;
+        uint b = ( x + 7 ) / 8;
+        if ( b >= Buckets )
+            return new ( x ) Node;
+        Node * n = freelist[b];
+        if ( n ) {
+            freelist[b] = n->zero;
+            return new ( (void*)n ) Node( true );
+        }
+        uint size = ( (uint)sizeof( Node ) + 8 * b + 7 ) & ~7U;
+        if ( !slab || slabUsed + size > (uint)SlabSize ) {
+            slab = (char*)Allocator::alloc( SlabSize );
+            slabUsed = 0;
+        }
+        n = (Node*)( slab + slabUsed );
+        slabUsed += size;
+        return new ( (void*)n ) Node( true );
     }
     virtual void free( Node * n ) {
-        Allocator::dealloc( n );
+        uint b = ( ( n->length + 7 ) / 8 + 7 ) / 8;
+        if ( b >= Buckets ) {
+            Allocator::dealloc( n );
+            return;
+        }
+        // zero the node so it doesn't keep dead objects alive
+        n->one = 0;
+        n->parent = 0;
+        n->data = 0;
+        n->zero = freelist[b];
+        freelist[b] = n;
     }
 
     Node * best( const char * k, uint l ) const {
@@ -426,6 +483,9 @@ private:
 
 private:
     Node * root;
+    Node * freelist[Buckets];
+    char * slab;
+    uint slabUsed;
 };
 
 
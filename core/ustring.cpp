@@ -211,6 +211,22 @@ void UString::append( const char * s )
 }
 
 
+/*! Appends the \a l ASCII characters starting at \a s to the end of
+    this string, reserving space just once. \a s may contain null
+    bytes.
+*/
+
+void UString::append( const char * s, uint l )
+{
+    if ( !s || !l )
+        return;
+    reserve( length() + l );
+    uint i = 0;
+    while ( i < l )
+        d->str[d->len++] = (uint)s[i++];
+}
+
+
 /*! Ensures that at least \a num characters are available for this
     string. Users of UString should generally not need to call this;
     it is called by append() etc. as needed.
@@ -55,6 +55,7 @@ public:
     void append( const UString & );
     void append( const uint );
     void append( const char * );
+    void append( const char *, uint );
 
     void reserve( uint );
     void truncate( uint = 0 );
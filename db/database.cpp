@@ -12,6 +12,7 @@
 #include "graph.h"
 #include "event.h"
 #include "query.h"
+#include "timer.h"
 #include "file.h"
 #include "log.h"
 
@@ -24,18 +25,44 @@
 static uint backendNumber;
 List< Query > *Database::queries;
 static GraphableNumber * queryQueueLength = 0;
+static GraphableNumber * transactionQueueLength = 0;
 static GraphableNumber * busyDbConnections = 0;
 static GraphableNumber * totalDbConnections = 0;
 static List< Database > *handles;
 static time_t lastExecuted;
 static time_t lastCreated;
+static uint retryDelay;
 static Database::User loginAs;
 static EString * username;
 static EString * password;
 static List<EventHandler> * whenIdle;
 
 
-static void newHandle()
+// updates the queue-depth gauges: the whole queue, and the subset
+// that is waiting to start or continue a transaction
+static void noteQueueLength( List< Query > * queries )
+{
+    if ( !queryQueueLength )
+        queryQueueLength = new GraphableNumber( "query-queue-length" );
+    if ( !transactionQueueLength )
+        transactionQueueLength =
+            new GraphableNumber( "transaction-queue-length" );
+
+    uint total = 0;
+    uint transacting = 0;
+    List< Query >::Iterator i( queries );
+    while ( i ) {
+        total++;
+        if ( i->transaction() )
+            transacting++;
+        ++i;
+    }
+    queryQueueLength->setValue( total );
+    transactionQueueLength->setValue( transacting );
+}
+
+
+static void newHandle( bool replica = false )
 {
     Scope x;
     if ( handles && !handles->isEmpty() ) {
@@ -45,10 +72,23 @@ static void newHandle()
         if ( l )
             x.setLog( l );
     }
-    (void)new Postgres;
+    (void)new Postgres( replica );
 }
 
 
+// fires a redial deferred by Database::reconnect()
+
+class ReconnectHelper
+    : public EventHandler
+{
+public:
+    void execute() {
+        if ( !EventLoop::global()->inShutdown() )
+            newHandle();
+    }
+};
+
+
 /*! \class Database database.h
     This class represents a connection to the database server.
 
@@ -61,8 +101,13 @@ static void newHandle()
     accepting queries into a common queue via submit().
 */
 
-Database::Database()
-    : Connection()
+/*! Constructs a database handle. If \a replica is true, the handle
+    talks to the read-only replica (db-replica-address) rather than
+    the main server.
+*/
+
+Database::Database( bool replica )
+    : Connection(), onReplica( replica )
 {
     number = ++::backendNumber;
     setType( Connection::DatabaseClient );
@@ -138,6 +183,9 @@ void Database::addInitialHandles( uint desired )
         newHandle();
         desired--;
     }
+
+    if ( replicaConfigured() )
+        newHandle( true );
 }
 
 
@@ -230,12 +278,12 @@ void Database::runQueue()
     int connecting = 0;
     int busy = 0;
 
-    if ( !queryQueueLength )
-        queryQueueLength = new GraphableNumber( "query-queue-length" );
     if ( !busyDbConnections )
         busyDbConnections = new GraphableNumber( "active-db-connections" );
 
-    // First, we give each idle handle a Query to process
+    // First, we give each wholly idle handle a Query to process, so
+    // that independent queries submitted together (e.g. a Fetcher's
+    // sub-queries) spread across the pool and execute in parallel
 
     Query * first = queries->firstElement();
 
@@ -253,7 +301,7 @@ void Database::runQueue()
         if ( st == Idle && it->usable() ) {
             it->processQueue();
             if ( queries->isEmpty() ) {
-                queryQueueLength->setValue( 0 );
+                noteQueueLength( queries );
                 busyDbConnections->setValue( busy );
                 return;
             }
@@ -265,7 +313,23 @@ void Database::runQueue()
         ++it;
     }
 
-    queryQueueLength->setValue( queries->count() );
+    // Whatever remains is pipelined behind queries already executing,
+    // but only once no handle is sitting entirely idle
+
+    List< Database >::Iterator p( handles );
+    while ( p && !queries->isEmpty() ) {
+        if ( p->state() == Idle && p->canPipeline() )
+            p->processQueue();
+        ++p;
+    }
+
+    if ( queries->isEmpty() ) {
+        noteQueueLength( queries );
+        busyDbConnections->setValue( busy );
+        return;
+    }
+
+    noteQueueLength( queries );
     busyDbConnections->setValue( busy );
 
     // If there's nothing to do, or we did get something done, then we
@@ -325,6 +389,8 @@ Database::State Database::state() const
 void Database::addHandle( Database * d )
 {
     handles->append( d );
+    // connecting evidently works, so the next redial can be prompt
+    ::retryDelay = 0;
     if ( !totalDbConnections )
         totalDbConnections = new GraphableNumber( "total-db-connections" );
     totalDbConnections->setValue( handles->count() );
@@ -345,9 +411,6 @@ void Database::removeHandle( Database * d )
     if ( !handles->isEmpty() )
         return;
 
-    if ( !EventLoop::global()->inShutdown() )
-        addInitialHandles( 3 );
-
     if ( server().protocol() == Endpoint::Unix &&
          !server().address().startsWith( File::root() ) )
         ::log( "All database handles closed; cannot create any new ones.",
@@ -355,6 +418,37 @@ void Database::removeHandle( Database * d )
 }
 
 
+/*! Schedules creation of a replacement for a database handle that
+    died unexpectedly, e.g. because the server was restarted.
+
+    The first replacement is dialled at once, so that a brief
+    database blip costs little more than the reconnection itself. If
+    connecting keeps failing, each redial waits twice as long as the
+    one before it, up to 32 seconds, so a dead server isn't hammered.
+    addHandle() resets the delay as soon as a connection succeeds.
+*/
+
+void Database::reconnect()
+{
+    if ( EventLoop::global()->inShutdown() )
+        return;
+
+    if ( server().protocol() == Endpoint::Unix &&
+         !server().address().startsWith( File::root() ) )
+        return;
+
+    if ( ::retryDelay )
+        (void)new Timer( new ReconnectHelper, ::retryDelay );
+    else
+        newHandle();
+
+    if ( !::retryDelay )
+        ::retryDelay = 1;
+    else if ( ::retryDelay < 32 )
+        ::retryDelay = ::retryDelay * 2;
+}
+
+
 /*! Returns the configured Database type, which may currently be only
     postgres.
 */
@@ -376,6 +470,19 @@ Endpoint Database::server()
 }
 
 
+/*! Returns an Endpoint representing the address of the read-only
+    replica (as specified by db-replica-address and db-replica-port).
+    The Endpoint may not be valid, and is meaningless unless
+    replicaConfigured() is true.
+*/
+
+Endpoint Database::replicaServer()
+{
+    return Endpoint( Configuration::DbReplicaAddress,
+                     Configuration::DbReplicaPort );
+}
+
+
 /*! Returns the address of the database server (db-address). */
 
 EString Database::address()
@@ -462,6 +569,74 @@ bool Database::usable() const
 }
 
 
+/*! Returns true if this Database handle is willing to accept more
+    queries even though earlier ones are still executing, i.e. to
+    pipeline. The default implementation always returns false;
+    subclasses may override that behaviour.
+*/
+
+bool Database::canPipeline() const
+{
+    return false;
+}
+
+
+/*! Returns true if this handle is reserved for plain queries, and
+    false if it may also pick up transaction work.
+
+    The first db-interactive-handles handles in the pool never take
+    on a transaction, so an IMAP search or fetch always finds a
+    handle even while imports and deliveries hold transactions open
+    on all the others. At least one handle is always left available
+    for transactions, whatever the configuration says.
+*/
+
+bool Database::interactiveOnly() const
+{
+    uint k = Configuration::scalar( Configuration::DbInteractiveHandles );
+    if ( !k || !handles )
+        return false;
+
+    uint n = handles->count();
+    if ( k >= n )
+        k = n - 1;
+
+    List< Database >::Iterator h( handles );
+    while ( h && k ) {
+        Database * c = h;
+        if ( c == this )
+            return true;
+        ++h;
+        k--;
+    }
+    return false;
+}
+
+
+/*! Returns true if this handle talks to a read-only replica, and
+    false if it talks to the main database server.
+
+    Replica handles process only queries for which Query::setReadOnly()
+    has been called, and never transactions. The flagged queries may
+    still be processed by an ordinary handle, e.g. if the replica is
+    slow or its handle has died, so a lone replica is a latency
+    optimisation, not a single point of failure.
+*/
+
+bool Database::replica() const
+{
+    return onReplica;
+}
+
+
+/*! Returns true if db-replica-address is set, and false otherwise. */
+
+bool Database::replicaConfigured()
+{
+    return !Configuration::text( Configuration::DbReplicaAddress ).isEmpty();
+}
+
+
 /*! Returns an nonzero positive integer which is unique to this
     database handler.
 */
@@ -704,7 +879,7 @@ void Database::cancelQuery( Query * q )
 
 uint Database::currentRevision()
 {
-    return 98;
+    return 105;
 }
 
 
@@ -712,17 +887,22 @@ uint Database::currentRevision()
     list contains just that transaction.
 
     If \a transactionOK is true, the list is permitted to start a
-    Transaction. If not, only standalone queries are considered.
+    Transaction. If not, only standalone queries are considered. If
+    \a readOnlyOnly is true, only queries flagged with
+    Query::setReadOnly() are considered (replica handles must not see
+    anything else).
 
     Returns an empty list if no suitable queries can be found.
 */
 
-List< Query > * Database::firstSubmittedQuery( bool transactionOK )
+List< Query > * Database::firstSubmittedQuery( bool transactionOK,
+                                               bool readOnlyOnly )
 {
     List<Query>::Iterator i( queries );
-    if ( !transactionOK )
-        while ( i && i->transaction() )
-            ++i;
+    while ( i &&
+            ( ( !transactionOK && i->transaction() ) ||
+              ( readOnlyOnly && !i->readOnly() ) ) )
+        ++i;
     List<Query> * r = new List<Query>();
     if ( i ) {
         r->append( i );
@@ -14,7 +14,7 @@ class Database
     : public Connection
 {
 public:
-    Database();
+    Database( bool = false );
 
     enum User {
         Superuser, DbOwner, DbUser
@@ -33,6 +33,10 @@ public:
     virtual void processQueue() = 0;
 
     virtual bool usable() const;
+    virtual bool canPipeline() const;
+    bool interactiveOnly() const;
+    bool replica() const;
+    static bool replicaConfigured();
 
     static uint numHandles();
     static uint handlesNeeded();
@@ -56,7 +60,8 @@ public:
 protected:
     static List< Query > *queries;
 
-    List< Query > * firstSubmittedQuery( bool transactionOK );
+    List< Query > * firstSubmittedQuery( bool transactionOK,
+                                         bool readOnlyOnly = false );
 
     void setState( State );
     State state() const;
@@ -66,8 +71,10 @@ protected:
     static void addHandle( Database * );
     static void removeHandle( Database * );
     static void addInitialHandles( uint = 3);
+    static void reconnect();
 
     static Endpoint server();
+    static Endpoint replicaServer();
     static EString address();
     static uint port();
 
@@ -82,6 +89,7 @@ protected:
 private:
     State st;
     uint number;
+    bool onReplica;
 };
 
 
@@ -18,6 +18,7 @@ class DatabaseSignalData
 public:
     DatabaseSignalData(): o( 0 ), l( new Log ) {}
     EString n;
+    EString p;
     EventHandler * o;
     Log * l;
 };
@@ -57,21 +58,38 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name, making \a payload (by default an empty string) available
+    via payload().
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
+        if ( name == s->d->n && s->d->o ) {
+            s->d->p = payload;
             s->d->o->notify();
+        }
     }
 }
 
 
+/*! Returns the payload of the most recent notification received for
+    this signal, or an empty string if there was none. The payload is
+    only advisory: notifications from before this process started
+    listening are always lost, so it must never carry information
+    that cannot safely be missed.
+*/
+
+EString DatabaseSignal::payload() const
+{
+    return d->p;
+}
+
+
 /*! This destructor is private, so noone can ever call it. Objects of
     this class are indestructible by nature.
 */
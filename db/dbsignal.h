@@ -14,7 +14,9 @@ class DatabaseSignal
 public:
     DatabaseSignal( const EString &, EventHandler * );
 
-    static void notifyAll( const EString & );
+    EString payload() const;
+
+    static void notifyAll( const EString &, const EString & = "" );
 
     static EStringList * names();
 
@@ -2,7 +2,9 @@
 
 #include "granter.h"
 
+#include "dict.h"
 #include "query.h"
+#include "estringlist.h"
 #include "transaction.h"
 
 
@@ -20,12 +22,15 @@ class GranterData
 {
 public:
     GranterData()
-        : t( 0 ), q( 0 )
+        : t( 0 ), q( 0 ), done( false )
     {}
 
     EString name;
     Transaction * t;
     Query * q;
+    Dict<EStringList> grants;
+    Dict<EStringList> revokes;
+    bool done;
 };
 
 
@@ -120,17 +125,46 @@ void Granter::execute()
                 grant.append( "update" );
         }
 
-        if ( !grant.isEmpty() )
-            d->t->enqueue( new Query( "grant " + grant.join( ", " ) +
-                                      " on " + name +
-                                      " to " + d->name.quoted(), 0 ) );
-        if ( !revoke.isEmpty() )
-            d->t->enqueue( new Query( "revoke " + revoke.join( ", " ) +
-                                      " on " + name +
-                                      " from " + d->name.quoted(), 0 ) );
+        // objects needing the same privileges are granted together,
+        // so that a fresh install issues a handful of grant
+        // statements rather than one per table.
+        if ( !grant.isEmpty() ) {
+            EStringList * tables = d->grants.find( grant.join( ", " ) );
+            if ( !tables ) {
+                tables = new EStringList;
+                d->grants.insert( grant.join( ", " ), tables );
+            }
+            tables->append( name );
+        }
+        if ( !revoke.isEmpty() ) {
+            EStringList * tables = d->revokes.find( revoke.join( ", " ) );
+            if ( !tables ) {
+                tables = new EStringList;
+                d->revokes.insert( revoke.join( ", " ), tables );
+            }
+            tables->append( name );
+        }
     }
     if ( !d->q->done() )
         return;
 
+    if ( !d->done ) {
+        d->done = true;
+        Dict<EStringList>::Iterator g( d->grants );
+        while ( g ) {
+            d->t->enqueue( new Query( "grant " + g.key() +
+                                      " on " + g->join( ", " ) +
+                                      " to " + d->name.quoted(), 0 ) );
+            ++g;
+        }
+        Dict<EStringList>::Iterator r( d->revokes );
+        while ( r ) {
+            d->t->enqueue( new Query( "revoke " + r.key() +
+                                      " on " + r->join( ", " ) +
+                                      " from " + d->name.quoted(), 0 ) );
+            ++r;
+        }
+    }
+
     d->t->commit();
 }
@@ -62,6 +62,11 @@ PgServerMessage::PgServerMessage( Buffer *b )
     t = (*b)[0];
 
     l = (uint)(((*b)[1]<<24)|((*b)[2]<<16)|((*b)[3]<<8)|((*b)[4])) - 4;
+
+    // with the whole frame in one vector, the decode functions stay
+    // on Buffer's fast paths and decodeString()/decodeByten() return
+    // shared slices of the network buffer instead of copies.
+    b->coalesce( 5 + l );
     b->remove( 5 );
 }
 
@@ -816,6 +821,40 @@ PgRowDescription::PgRowDescription( Buffer * b )
         // count the columns ourselves.
         col->column2 = c;
 
+        // the wire type depends only on the description, so we map it
+        // to a Column::Type once here instead of once per data row.
+        switch ( col->type ) {
+        case 16:    // BOOL
+            col->decoded = ::Column::Boolean;
+            break;
+        case 20:    // INT8
+            col->decoded = ::Column::Bigint;
+            break;
+        case 21:    // INT2
+        case 23:    // INT4
+            col->decoded = ::Column::Integer;
+            break;
+        case 17:    // BYTEA
+        case 18:    // CHAR
+        case 25:    // TEXT
+        case 1043:  // VARCHAR
+            col->decoded = ::Column::Bytes;
+            break;
+        case 1184:
+            col->decoded = ::Column::Timestamp;
+            break;
+        default:
+            if ( col->type == ::citextOid ) { // CITEXT
+                col->decoded = ::Column::Bytes;
+                break;
+            }
+            log( "PostgreSQL: Unknown field type " + fn( col->type ) +
+                 " for column " + col->name.quoted(),
+                 Log::Error );
+            col->decoded = ::Column::Unknown;
+            break;
+        }
+
         columns.append( col );
         names.insert( col->name.data(), 8 * col->name.length(),
                       &col->column2 );
@@ -862,6 +901,11 @@ void PgExecute::encodeData()
 
 /*! This function constructs a new PgDataRow based on the contents of
     the Buffer \a b, and the PgRowDescription \a d.
+
+    The column values are not decoded here; the Row keeps a reference
+    to the row's wire-format bytes and decodes them on first access,
+    so rows (e.g. in large search results) whose columns are never
+    looked at cost no more than this one slice of the input buffer.
 */
 
 PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
@@ -872,123 +916,10 @@ PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
         // Is this really "Syntax"?
         throw Syntax;
 
-    int i = 0;
-    Column *columns = new Column[c];
-    List< PgRowDescription::Column >::Iterator it( d->columns );
-    while ( it ) {
-        Column *cv = &columns[i];
-
-        switch ( it->type ) {
-        case 16:    // BOOL
-            cv->type = Column::Boolean;
-            break;
-        case 20:    // INT8
-            cv->type = Column::Bigint;
-            break;
-        case 21:    // INT2
-        case 23:    // INT4
-            cv->type = Column::Integer;
-            break;
-        case 17:    // BYTEA
-        case 18:    // CHAR
-        case 25:    // TEXT
-        case 1043:  // VARCHAR
-            cv->type = Column::Bytes;
-            break;
-        case 1184:
-            cv->type = Column::Timestamp;
-            break;
-        default:
-            if ( it->type == ::citextOid ) { // CITEXT
-                cv->type = Column::Bytes;
-                break;
-            }
-            log( "PostgreSQL: Unknown field type " + fn( it->type ) +
-                 " for column " + it->name.quoted(),
-                 Log::Error );
-            cv->type = Column::Unknown;
-            break;
-        }
-
-        int length = decodeInt32();
-        if ( length == -1 )
-            cv->type = Column::Null;
-
-        switch ( cv->type ) {
-        case Column::Unknown:
-            // we've just logged the error, but supplement it
-            if ( length > 0 )
-                log( "Unknown column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            break;
-        case Column::Boolean:
-            if ( length != 1 ) {
-                log( "Boolean column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
-            else {
-                cv->b = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-            }
-            break;
-        case Column::Integer:
-            switch ( length ) {
-            case 1:
-                cv->i = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-                break;
-            case 2:
-                cv->i = ((*buf)[0] << 8) | (*buf)[1];
-                buf->remove( 2 );
-                n += 2;
-                break;
-            case 4:
-                cv->i = ((*buf)[0] << 24) | ((*buf)[1] << 16) |
-                        ((*buf)[2] <<  8) | (*buf)[3];
-                buf->remove( 4 );
-                n += 4;
-                break;
-            default:
-                log( "Integer column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
-            break;
-        case Column::Bigint:
-            if ( length == 8 ) {
-                cv->bi = (((int64)(*buf)[0]) << 56) |
-                         (((int64)(*buf)[1]) << 48) |
-                         (((int64)(*buf)[2]) << 40) |
-                         (((int64)(*buf)[3]) << 32) |
-                         (((int64)(*buf)[4]) << 24) |
-                         (((int64)(*buf)[5]) << 16) |
-                         (((int64)(*buf)[6]) <<  8) |
-                         (*buf)[7];
-                buf->remove( 8 );
-                n += 8;
-            }
-            else
-                log( "Bigint column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            break;
-        case Column::Bytes:
-            cv->s = decodeByten( length );
-            break;
-        case Column::Timestamp:
-            cv->s = decodeByten( length );
-            break;
-        case Column::Null:
-            // nothing needed
-            break;
-        }
-
-        ++it;
-        i++;
-    }
+    EString bytes( decodeByten( l - 2 ) );
     end();
 
-    r = new Row( d, columns );
+    r = new Row( d, bytes );
 }
 
 
@@ -266,6 +266,7 @@ public:
     public:
         EString name;
         int table, column, type, size, mod, format, column2;
+        ::Column::Type decoded;
     };
 
     List<Column> columns;
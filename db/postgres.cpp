@@ -42,7 +42,9 @@ public:
           setSessionAuthorisation( false ),
           sendingCopy( false ), error( false ),
           keydata( 0 ),
-          description( 0 ), transaction( 0 ),
+          description( 0 ),
+          autoPreparedCount( 0 ), autoNameCounter( 0 ),
+          transaction( 0 ),
           needNotify( 0 ), backendPid( 0 )
         {}
 
@@ -60,8 +62,12 @@ public:
     PgRowDescription *description;
     Dict<Postgres> prepared;
     EStringList preparesPending;
+    Dict<EString> autoPrepared;
+    uint autoPreparedCount;
+    uint autoNameCounter;
 
     List< Query > queries;
+    List< Query > flightEnds;
     Transaction *transaction;
     Query * needNotify;
 
@@ -141,27 +147,33 @@ public:
 
 /*! Creates a Postgres object, initiates a TCP connection to the server,
     registers with the main loop, and adds this Database to the list of
-    available handles.
+    available handles. If \a replica is true, the connection goes to
+    the read-only replica (db-replica-address) instead of the main
+    server.
 */
 
-Postgres::Postgres()
-    : Database(), d( new PgData )
+Postgres::Postgres( bool replica )
+    : Database( replica ), d( new PgData )
 {
+    Endpoint srv( server() );
+    if ( replica )
+        srv = replicaServer();
     d->user = Database::user();
     struct passwd * p = getpwnam( d->user.cstr() );
     if ( p && getuid() != p->pw_uid ) {
         // Try to cooperate with ident authentication.
         uid_t e = geteuid();
         setreuid( 0, p->pw_uid );
-        connect( address(), port() );
+        connect( srv );
         setreuid( 0, e );
     }
     else {
-        connect( address(), port() );
+        connect( srv );
     }
 
-    log( "Connecting to PostgreSQL server at " +
-         address() + ":" + fn( port() ) + " "
+    log( "Connecting to PostgreSQL " +
+         EString( replica ? "replica" : "server" ) + " at " +
+         srv.address() + ":" + fn( srv.port() ) + " "
          "(backend " + fn( connectionNumber() ) + ", fd " + fn( fd() ) +
          ", user " + d->user + ")", Log::Debug );
 
@@ -178,9 +190,16 @@ Postgres::~Postgres()
 }
 
 
+static const uint maxPipelineDepth = 128;
+static const uint minCopyLines = 8;
+
+
 void Postgres::processQueue()
 {
-    if ( !d->queries.isEmpty() )
+    // We stream new Parse/Bind/Execute messages while earlier queries
+    // are still executing, and the backend responds to each in order.
+    // We just keep the number of outstanding queries bounded.
+    if ( d->queries.count() >= maxPipelineDepth )
         return;
 
     if ( d->sendingCopy )
@@ -191,7 +210,7 @@ void Postgres::processQueue()
            d->transaction->state() == Transaction::RolledBack ) )
         d->transaction = 0;
 
-    if ( !::listener && !d->transaction )
+    if ( !::listener && !d->transaction && !replica() )
         ::listener = this;
     if ( ::listener == this )
         sendListen();
@@ -201,7 +220,10 @@ void Postgres::processQueue()
         l = d->transaction->submittedQueries();
     }
     else {
-        if ( listener == this && numHandles() > 1 )
+        if ( replica() )
+            l = Database::firstSubmittedQuery( false, true );
+        else if ( ( listener == this && numHandles() > 1 ) ||
+                  interactiveOnly() )
             l = Database::firstSubmittedQuery( false );
         else
             l = Database::firstSubmittedQuery( true );
@@ -213,11 +235,34 @@ void Postgres::processQueue()
         }
     }
 
+    // Within a transaction, all queries submitted together form one
+    // flight with a single Sync at the end, so each injection stage
+    // costs one round trip instead of one per statement. Independent
+    // queries keep a Sync each, so that one bad query doesn't make
+    // the server discard its innocent neighbours' work.
+    bool batch = ( d->transaction != 0 );
+    Query * unsynced = 0;
     Query * q = l->shift();
     while ( q ) {
         q->setState( Query::Executing );
         if ( !d->error ) {
-            processQuery( q );
+            bool copy = ( q->inputLines() &&
+                          q->inputLines()->count() >= minCopyLines );
+            if ( copy && unsynced ) {
+                // nothing must reach the backend between a COPY and
+                // its data, so a copy ends the current flight and
+                // gets a Sync of its own
+                PgSync s;
+                s.enqueue( writeBuffer() );
+                d->flightEnds.append( unsynced );
+                unsynced = 0;
+            }
+            processQuery( q, !batch || copy );
+            // stop streaming until CopyInResponse arrives
+            if ( d->sendingCopy )
+                break;
+            if ( batch && !copy )
+                unsynced = q;
         }
         else {
             q->setError( "Database handle no longer usable." );
@@ -226,19 +271,68 @@ void Postgres::processQueue()
         q = l->shift();
     }
 
+    if ( unsynced ) {
+        PgSync s;
+        s.enqueue( writeBuffer() );
+        d->flightEnds.append( unsynced );
+    }
+
     if ( d->queries.isEmpty() )
         reactToIdleness();
 }
 
 
+static GraphableCounter * psHits = 0;
+static GraphableCounter * psMisses = 0;
+
+static const uint maxAutoPrepared = 512;
+
+
 /*! Sends whatever messages are required to make the backend process the
-    query \a q.
+    query \a q, followed by a Sync if \a sync is true. processQueue()
+    passes false for all but the last query of a batched transaction
+    flight, which then share a single Sync.
 */
 
-void Postgres::processQuery( Query * q )
+void Postgres::processQuery( Query * q, bool sync )
 {
     Scope x( q->log() );
     d->queries.append( q );
+
+    // COPY earns its keep only for big batches; a small one is better
+    // off as a multi-row INSERT, which doesn't have to wait for
+    // CopyInResponse before the data can be sent
+    if ( q->inputLines() ) {
+        if ( q->inputLines()->count() < minCopyLines )
+            q->rewriteCopyAsInsert();
+        else
+            d->sendingCopy = true;
+    }
+
+    // promote repeated unnamed statements to named prepared
+    // statements, so the server parses and plans each shape only once
+    // per handle
+    if ( q->name() == "" && !q->inputLines() ) {
+        if ( !psHits ) {
+            psHits = new GraphableCounter( "prepared-statement-hits" );
+            psMisses = new GraphableCounter( "prepared-statement-misses" );
+        }
+        EString text = queryString( q );
+        EString * n = d->autoPrepared.find( text );
+        if ( n ) {
+            psHits->tick();
+        }
+        else if ( d->autoPreparedCount < maxAutoPrepared ) {
+            n = new EString( "aox" );
+            n->appendNumber( ++d->autoNameCounter );
+            d->autoPrepared.insert( text, n );
+            d->autoPreparedCount++;
+            psMisses->tick();
+        }
+        if ( n )
+            q->setName( *n );
+    }
+
     EString s( "Sent " );
     if ( q->name() == "" ||
          !d->prepared.contains( q->name() ) )
@@ -264,14 +358,19 @@ void Postgres::processQuery( Query * q )
     PgExecute ex;
     ex.enqueue( writeBuffer() );
 
-    PgSync e;
-    e.enqueue( writeBuffer() );
+    if ( sync ) {
+        PgSync e;
+        e.enqueue( writeBuffer() );
+        d->flightEnds.append( q );
+    }
 
-    s.append( "execute for " );
-    s.append( q->description() );
-    s.append( " on backend " );
-    s.appendNumber( connectionNumber() );
-    ::log( s, Log::Debug );
+    if ( Log::loggable( Log::Debug ) ) {
+        s.append( "execute for " );
+        s.append( q->description() );
+        s.append( " on backend " );
+        s.appendNumber( connectionNumber() );
+        ::log( s, Log::Debug );
+    }
     recordExecution();
 }
 
@@ -355,6 +454,7 @@ void Postgres::react( Event e )
         }
         else if ( d->queries.isEmpty() &&
                   ::listener != this &&
+                  !replica() &&
                   server().protocol() != Endpoint::Unix &&
                   handlesNeeded() < numHandles() ) {
             log( "Closing idle database backend " + fn( connectionNumber() ) +
@@ -368,6 +468,13 @@ void Postgres::react( Event e )
         break;
     }
 
+    if ( !usable() && d->transaction && !d->sendingCopy &&
+         !d->queries.isEmpty() ) {
+        // resume streaming the transaction's remaining queries, e.g.
+        // once a COPY has received its CopyInResponse
+        processQueue();
+    }
+
     if ( usable() ) {
         processQueue();
         if ( d->queries.isEmpty() && !d->transaction ) {
@@ -479,8 +586,9 @@ void Postgres::backendStartup( char type )
 
     case 'K':
         d->keydata = new PgKeyData( readBuffer() );
-        log( "Postgres backend " + fn( connectionNumber() ) +
-             " has pid " + fn( d->keydata->pid() ), Log::Debug );
+        if ( Log::loggable( Log::Debug ) )
+            log( "Postgres backend " + fn( connectionNumber() ) +
+                 " has pid " + fn( d->keydata->pid() ), Log::Debug );
         d->backendPid = d->keydata->pid();
         break;
 
@@ -610,6 +718,8 @@ void Postgres::process( char type )
                     countQueries( q );
                 }
                 d->queries.shift();
+                if ( d->flightEnds.firstElement() == q )
+                    d->flightEnds.shift();
                 q->notify();
                 d->needNotify = 0;
             }
@@ -626,12 +736,15 @@ void Postgres::process( char type )
     case 'A':
         {
             PgNotificationResponse msg( readBuffer() );
-            EString s;
-            if ( !msg.source().isEmpty() )
-                s = " (" + msg.source() + ")";
-            log( "Received notify " + msg.name().quoted() +
-                 " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            if ( Log::loggable( Log::Debug ) ) {
+                EString s;
+                if ( !msg.source().isEmpty() )
+                    s = " (" + msg.source() + ")";
+                log( "Received notify " + msg.name().quoted() +
+                     " from server pid " + fn( msg.pid() ) + s,
+                     Log::Debug );
+            }
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -913,6 +1026,25 @@ void Postgres::serverMessage()
             s.append( " (" + msg.detail() + ")" );
         q->setError( m );
         q->notify();
+
+        // everything between the failed query and its flight's Sync
+        // is discarded by the server, so fail the rest of the flight
+        // too instead of waiting for replies that will never arrive
+        Query * end = d->flightEnds.firstElement();
+        if ( end ) {
+            d->flightEnds.shift();
+            while ( q != end && !d->queries.isEmpty() ) {
+                q = d->queries.shift();
+                pp = d->preparesPending.first();
+                if ( q->name() != "" && pp && *pp == q->name() ) {
+                    d->prepared.remove( q->name() );
+                    d->preparesPending.shift();
+                }
+                q->setError( "Discarded due to earlier error in the "
+                             "same transaction" );
+                q->notify();
+            }
+        }
     }
     else {
         ::log( "PostgreSQL server message could not be interpreted."
@@ -1038,6 +1170,10 @@ EString Postgres::mapped( const EString & s ) const
     and closing the connection after emptying the write buffer and
     notifying any pending queries of the failure.
 
+    Pending read-only queries which haven't returned anything yet are
+    resubmitted rather than notified, and Database::reconnect() is
+    asked to dial a replacement handle, so that a database restart is
+    a brief hiccup rather than a spray of user-visible errors.
 */
 
 void Postgres::error( const EString &s )
@@ -1052,15 +1188,28 @@ void Postgres::error( const EString &s )
     d->active = false;
     setState( Broken );
 
+    removeHandle( this );
+    Database::reconnect();
+
+    // a read-only query outside any transaction has no side effects,
+    // and if it hasn't returned any rows yet, its owner hasn't seen
+    // anything either, so it can quietly move to another handle
+    // instead of failing. each query moves at most once, lest a query
+    // which somehow breaks its handle should bounce around forever.
     List< Query >::Iterator q( d->queries );
     while ( q ) {
-        q->setError( s );
-        q->notify();
+        if ( q->readOnly() && !q->transaction() && !q->rows() &&
+             !q->retried() && !EventLoop::global()->inShutdown() ) {
+            q->setRetried();
+            submit( q );
+        }
+        else {
+            q->setError( s );
+            q->notify();
+        }
         ++q;
     }
 
-    removeHandle( this );
-
     writeBuffer()->remove( writeBuffer()->size() );
     Connection::setState( Closing );
 }
@@ -1119,8 +1268,24 @@ bool Postgres::usable() const
 }
 
 
+/*! Returns true if this handle is willing to stream further queries
+    behind the ones currently executing. Handles working for a
+    Transaction don't take unrelated queries, and a handle sending
+    COPY data can't interleave anything with it.
+*/
+
+bool Postgres::canPipeline() const
+{
+    return ( d->active && !d->startup && !d->error &&
+             !d->sendingCopy && !d->transaction &&
+             !( state() == Connecting || state() == Broken ) &&
+             d->queries.count() < maxPipelineDepth );
+}
+
+
 static GraphableCounter * goodQueries = 0;
 static GraphableCounter * badQueries = 0;
+static GraphableHistogram * queryTimes = 0;
 
 
 /*! Updates the statistics when \a q is done. */
@@ -1130,6 +1295,8 @@ void Postgres::countQueries( class Query * q )
     if ( !goodQueries ) {
         goodQueries = new GraphableCounter( "queries-executed" ); // bad name?
         badQueries = new GraphableCounter( "queries-failed" ); // bad name?
+        queryTimes = new GraphableHistogram( "query-duration-milliseconds",
+                                             "" );
     }
 
     if ( !q->failed() )
@@ -1138,8 +1305,7 @@ void Postgres::countQueries( class Query * q )
         badQueries->tick();
     ; // a query which fails but canFail is not counted anywhere.
 
-    // later also use GraphableDataSet to keep track of query
-    // execution times, but not right now.
+    queryTimes->addNumber( q->executionTime() );
 }
 
 
@@ -12,13 +12,14 @@ class Postgres
     : public Database
 {
 public:
-    Postgres();
+    Postgres( bool = false );
     ~Postgres();
 
     void processQueue();
     void react( Event );
 
     bool usable() const;
+    bool canPipeline() const;
 
     static uint version();
 
@@ -29,7 +30,7 @@ public:
 private:
     class PgData *d;
 
-    void processQuery( Query * );
+    void processQuery( Query *, bool = true );
     void authentication( char );
     void backendStartup( char );
     void process( char );
@@ -4,12 +4,15 @@
 
 #include "log.h"
 #include "utf.h"
+#include "array.h"
 #include "event.h"
+#include "graph.h"
 #include "scope.h"
 #include "estring.h"
 #include "ustring.h"
 #include "database.h"
 #include "eventloop.h"
+#include "configuration.h"
 #include "pgmessage.h"
 #include "integerset.h"
 #include "estringlist.h"
@@ -24,7 +27,9 @@ public:
         : state( Query::Inactive ), format( Query::Text ),
           values( new Query::InputLine ), inputLines( 0 ),
           transaction( 0 ), owner( 0 ), totalRows( 0 ),
-          canFail( false )
+          canFail( false ), readOnly( false ), retried( false ),
+          submitted( 0 ), executing( 0 ),
+          queueTime( 0 ), executionTime( 0 )
     {}
 
     Query::State state;
@@ -38,16 +43,89 @@ public:
 
     Transaction * transaction;
     EventHandler * owner;
-    List< Row > rows;
+    Array< Row > rows;
     uint totalRows;
 
     EString error;
 
     bool canFail;
     bool canBeSlow;
+    bool readOnly;
+    bool retried;
+
+    int64 submitted;
+    int64 executing;
+    uint queueTime;
+    uint executionTime;
 };
 
 
+// Logs the server's plan for a slow query, using a database handle of
+// its own so the slow query's transaction is not disturbed.
+
+class PlanLogger
+    : public EventHandler
+{
+public:
+    PlanLogger( Query * slow )
+        : q( new Query( "explain " + slow->string(), this ) )
+    {
+        List< Query::Value >::Iterator v( *slow->values() );
+        while ( v ) {
+            if ( v->length() == -1 )
+                q->bindNull( v->position() );
+            else
+                q->bind( v->position(), v->data(), v->format() );
+            ++v;
+        }
+        q->allowFailure();
+        q->execute();
+    }
+
+    void execute()
+    {
+        if ( !q->done() )
+            return;
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            EStringList * names = r->columnNames();
+            if ( !names->isEmpty() )
+                log( "Plan: " +
+                     r->getEString( names->firstElement()->cstr() ) );
+        }
+    }
+
+private:
+    Query * q;
+};
+
+
+/* This static helper logs \a q (whose internals are \a d) if
+   executing it took slow-query-threshold milliseconds or longer, and
+   if log-query-plans is enabled also asks the server to explain it.
+*/
+
+static void logIfSlow( Query * q, QueryData * d )
+{
+    uint limit = Configuration::scalar( Configuration::SlowQueryThreshold );
+    if ( !limit || d->executionTime < limit )
+        return;
+
+    EString m( "Slow query: " );
+    m.append( q->description() );
+    m.append( " (queued " );
+    m.appendNumber( d->queueTime );
+    m.append( "ms, executed " );
+    m.appendNumber( d->executionTime );
+    m.append( "ms)" );
+    ::log( m, Log::Info );
+
+    if ( Configuration::toggle( Configuration::LogQueryPlans ) &&
+         q->string().lower().startsWith( "select" ) )
+        (void)new PlanLogger( q );
+}
+
+
 /*! \class Query query.h
     This class represents a single database query.
 
@@ -145,6 +223,32 @@ Query::State Query::state() const
 void Query::setState( State s )
 {
     d->state = s;
+    if ( s == Submitted ) {
+        d->submitted = GraphableHistogram::milliTime();
+    }
+    else if ( s == Executing && !d->executing ) {
+        d->executing = GraphableHistogram::milliTime();
+        if ( d->submitted )
+            d->queueTime = (uint)( d->executing - d->submitted );
+    }
+    else if ( ( s == Completed || s == Failed ) && d->executing ) {
+        d->executionTime =
+            (uint)( GraphableHistogram::milliTime() - d->executing );
+        d->executing = 0;
+        if ( s == Completed )
+            logIfSlow( this, d );
+    }
+}
+
+
+/*! Returns the time in milliseconds from when this query was last
+    sent to the server until it completed or failed, or 0 if it hasn't
+    done both yet.
+*/
+
+uint Query::executionTime() const
+{
+    return d->executionTime;
 }
 
 
@@ -198,6 +302,54 @@ void Query::allowFailure()
 }
 
 
+/*! Returns true if setReadOnly() has been called for this Query, and
+    false otherwise.
+*/
+
+bool Query::readOnly() const
+{
+    return d->readOnly;
+}
+
+
+/*! If this function is called before execute(), the Query may be sent
+    to a read-only replica (db-replica-address) instead of the main
+    database server.
+
+    The caller promises two things: the query does not modify the
+    database, and its results remain acceptable if the replica lags a
+    little behind the main server. Queries belonging to a Transaction
+    are never sent to a replica, whatever this function says.
+*/
+
+void Query::setReadOnly()
+{
+    d->readOnly = true;
+}
+
+
+/*! Returns true if setRetried() has been called for this Query, and
+    false otherwise.
+*/
+
+bool Query::retried() const
+{
+    return d->retried;
+}
+
+
+/*! Notes that this Query has been resubmitted once because the
+    database handle processing it died. Postgres retries each
+    read-only query at most once, so a query which somehow breaks its
+    handle cannot bounce from handle to handle forever.
+*/
+
+void Query::setRetried()
+{
+    d->retried = true;
+}
+
+
 /*! Returns a pointer to the Transaction that this Query is associated
     with, or 0 if this Query is self-contained.
 */
@@ -309,24 +461,42 @@ void Query::bind( uint n, const UString &s )
 }
 
 
+static void appendNbo32( EString & s, uint n )
+{
+    s.append( (char)( n >> 24 ) );
+    s.append( (char)( n >> 16 ) );
+    s.append( (char)( n >>  8 ) );
+    s.append( (char)( n ) );
+}
+
+
 /*! \overload
 
-    This version binds each number in \a set as parameter \a n.
+    This version binds each number in \a set as parameter \a n, as a
+    single binary int4 array. The statement text stays the same no
+    matter how large \a set is, so the statement can be prepared once,
+    and the backend doesn't have to parse a long array literal.
 */
 
 void Query::bind( uint n, const class IntegerSet & set )
 {
-    if ( d->format == Text ) {
-        EString s( "{" );
-        s.append( set.csl() );
-        s.append( "}" );
-        bind( n, s );
-    }
-    else {
-        // XXX: Not implemented yet.
-        die( Invariant );
+    uint c = set.count();
+    EString t;
+    t.reserve( 20 + 8 * c );
+    appendNbo32( t, c ? 1 : 0 ); // number of dimensions
+    appendNbo32( t, 0 ); // no nulls
+    appendNbo32( t, 23 ); // element type int4
+    if ( c ) {
+        appendNbo32( t, c ); // dimension size
+        appendNbo32( t, 1 ); // lower bound
+        uint i = 1;
+        while ( i <= c ) {
+            appendNbo32( t, 4 ); // element length
+            appendNbo32( t, set.value( i ) );
+            i++;
+        }
     }
-
+    bind( n, t, Binary );
 }
 
 
@@ -445,6 +615,75 @@ void Query::submitLine()
 }
 
 
+/*! If this Query is a "copy ... from stdin" whose input lines have
+    been submitted with submitLine(), rewrites it as an equivalent
+    multi-row INSERT, binding all the lines' values to one statement.
+    Returns true on success and false if the query is left untouched.
+
+    Postgres uses this for small batches, where the round trip spent
+    waiting for CopyInResponse costs more than COPY saves.
+*/
+
+bool Query::rewriteCopyAsInsert()
+{
+    if ( !d->inputLines || d->inputLines->isEmpty() )
+        return false;
+
+    EString s( string().simplified() );
+    if ( !s.lower().startsWith( "copy " ) )
+        return false;
+    int f = s.lower().find( " from stdin" );
+    if ( f < 5 )
+        return false;
+    EString target = s.mid( 5, f - 5 );
+    if ( !target.contains( "(" ) )
+        return false;
+
+    // every line must bind the same number of columns
+    uint cols = 0;
+    List< InputLine >::Iterator l( d->inputLines );
+    while ( l ) {
+        if ( !cols )
+            cols = l->count();
+        if ( !l->count() || l->count() != cols )
+            return false;
+        ++l;
+    }
+
+    EString r( "insert into " );
+    r.append( target );
+    r.append( " values " );
+    InputLine * flat = new InputLine;
+    uint p = 0;
+    l = d->inputLines->first();
+    while ( l ) {
+        InputLine::Iterator v( (InputLine*)l );
+        if ( p )
+            r.append( "," );
+        r.append( "(" );
+        while ( v ) {
+            p++;
+            if ( p % cols != 1 && cols != 1 )
+                r.append( "," );
+            r.append( "$" );
+            r.appendNumber( p );
+            if ( v->length() < 0 )
+                flat->insert( new Value( p ) );
+            else
+                flat->insert( new Value( p, v->data(), v->format() ) );
+            ++v;
+        }
+        r.append( ")" );
+        ++l;
+    }
+
+    setString( r );
+    d->values = flat;
+    d->inputLines = 0;
+    return true;
+}
+
+
 /*! This function submits this Query to the Database for processing. The
     owner() of the query will be informed of any activity via notify().
 */
@@ -467,6 +706,17 @@ EString Query::name() const
 }
 
 
+/*! Names this query \a s, so that the server-side statement it is
+    parsed into can be reused. Postgres uses this to promote
+    often-repeated queries to named prepared statements.
+*/
+
+void Query::setName( const EString & s )
+{
+    d->name = s;
+}
+
+
 /*! This virtual function is expected to return the complete SQL query
     as a string. Subclasses may reimplement this function to compose a
     query from individual parameters, rather than requiring the entire
@@ -761,12 +1011,13 @@ Row *Query::nextRow()
 */
 
 
-/*! Creates a row of data based on the columns \a c, named as in \a
-    desc.
+/*! Creates a row of data from the wire-format bytes \a b, named and
+    typed as in \a desc. The column values are decoded lazily, on the
+    first call to one of the accessors.
 */
 
-Row::Row( const PgRowDescription * desc, Column * c )
-    : data( c ), layout( desc )
+Row::Row( const PgRowDescription * desc, const EString & b )
+    : data( 0 ), layout( desc ), bytes( b )
 {
 }
 
@@ -776,6 +1027,123 @@ extern "C" {
 };
 
 
+/*! This private helper decodes the row's wire-format bytes into a
+    Column array. It is called from fetch() on first access, so a row
+    whose columns are never looked at is never decoded at all.
+
+    String values are shared slices of the network buffer rather than
+    copies, so decoding a wide row costs one allocation for the array,
+    not one per column.
+*/
+
+void Row::decode() const
+{
+    Column * columns = new Column[layout->count];
+    uint i = 0;
+    uint p = 0;
+    uint e = bytes.length();
+    List< PgRowDescription::Column >::Iterator it( layout->columns );
+    while ( it ) {
+        Column * cv = &columns[i];
+        cv->type = it->decoded;
+
+        if ( p + 4 > e ) {
+            log( "Data row ended within length of column " +
+                 it->name.quoted(), Log::Error );
+            cv->type = Column::Null;
+            ++it;
+            i++;
+            continue;
+        }
+
+        uint length = ( (uint)(bytes[p]  ) << 24 ) |
+                      ( (uint)(bytes[p+1]) << 16 ) |
+                      ( (uint)(bytes[p+2]) <<  8 ) |
+                      ( (uint)(bytes[p+3])       );
+        p += 4;
+        if ( length == 0xffffffff ) {
+            cv->type = Column::Null;
+            length = 0;
+        }
+        else if ( p + length > e ) {
+            log( "Data row ended within value of column " +
+                 it->name.quoted(), Log::Error );
+            cv->type = Column::Null;
+            length = e - p;
+        }
+
+        switch ( cv->type ) {
+        case Column::Unknown:
+            // the unknown type was logged with the row description,
+            // but supplement that with the value
+            if ( length > 0 )
+                log( "Unknown column " + it->name.quoted() +
+                     " has value " + bytes.mid( p, length ).quoted() );
+            break;
+        case Column::Boolean:
+            if ( length != 1 )
+                log( "Boolean column " + it->name.quoted() +
+                     " has value " + bytes.mid( p, length ).quoted() );
+            else
+                cv->b = bytes[p];
+            break;
+        case Column::Integer:
+            switch ( length ) {
+            case 1:
+                cv->i = bytes[p];
+                break;
+            case 2:
+                cv->i = ( (uint)(bytes[p]) << 8 ) | (uint)(bytes[p+1]);
+                break;
+            case 4:
+                cv->i = ( (uint)(bytes[p]  ) << 24 ) |
+                        ( (uint)(bytes[p+1]) << 16 ) |
+                        ( (uint)(bytes[p+2]) <<  8 ) |
+                        ( (uint)(bytes[p+3])       );
+                break;
+            default:
+                log( "Integer column " + it->name.quoted() +
+                     " has value " + bytes.mid( p, length ).quoted() );
+            }
+            break;
+        case Column::Bigint:
+        case Column::Timestamp:
+            if ( length == 8 ) {
+                cv->bi = ( ((int64)(bytes[p]  ) << 56 ) |
+                           ((int64)(bytes[p+1]) << 48 ) |
+                           ((int64)(bytes[p+2]) << 40 ) |
+                           ((int64)(bytes[p+3]) << 32 ) |
+                           ((int64)(bytes[p+4]) << 24 ) |
+                           ((int64)(bytes[p+5]) << 16 ) |
+                           ((int64)(bytes[p+6]) <<  8 ) |
+                           ((int64)(bytes[p+7])       ) );
+                if ( cv->type == Column::Timestamp )
+                    // a binary timestamptz is microseconds since
+                    // 2000-01-01 00:00:00 UTC; we convert that to
+                    // unix time and discard the fractional second.
+                    cv->bi = cv->bi / 1000000 + 946684800;
+            }
+            else
+                log( "Eight-byte column " + it->name.quoted() +
+                     " has value " + bytes.mid( p, length ).quoted() );
+            break;
+        case Column::Bytes:
+            cv->s = bytes.mid( p, length );
+            break;
+        case Column::Null:
+            // nothing needed
+            break;
+        }
+
+        p += length;
+        ++it;
+        i++;
+    }
+
+    data = columns;
+}
+
+
 /*! This private helper returns the column named \a f, or a null
     pointer if \a f does not exist.
 
@@ -785,6 +1153,9 @@ extern "C" {
 
 const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
 {
+    if ( !data )
+        decode();
+
     int * x = layout->names.find( f, strlen( f ) * 8 );
     if ( !x ) {
         if ( warn )
@@ -862,6 +1233,22 @@ int64 Row::getBigint( const char * f ) const
 }
 
 
+/*! Returns the value of the timestamptz column named \a f as seconds
+    since the beginning of 1970, if it exists and is NOT NULL, and 0
+    otherwise.
+*/
+
+int64 Row::getTimestamp( const char * f ) const
+{
+    const Column * c = fetch( f, Column::Timestamp, true );
+    if ( !c )
+        return 0;
+    if ( c->type != Column::Timestamp )
+        return 0;
+    return c->bi;
+}
+
+
 /*! Returns the string value of the column named \a f i if it exists
     and is NOT NULL, and an empty string otherwise.
 */
@@ -33,12 +33,19 @@ public:
     State state() const;
     bool failed() const;
     bool done() const;
+    uint executionTime() const;
 
     void cancel();
 
     bool canFail() const;
     void allowFailure();
 
+    bool readOnly() const;
+    void setReadOnly();
+
+    bool retried() const;
+    void setRetried();
+
     Transaction *transaction() const;
     void setTransaction( Transaction * );
 
@@ -57,6 +64,7 @@ public:
     void bind( uint, const char * );
     void bindNull( uint );
     void submitLine();
+    bool rewriteCopyAsInsert();
 
     void execute();
 
@@ -93,6 +101,7 @@ public:
     };
 
     virtual EString name() const;
+    void setName( const EString & );
     virtual EString string() const;
     virtual void setString( const EString & );
 
@@ -145,11 +154,12 @@ class Row
     : public Garbage
 {
 public:
-    Row( const class PgRowDescription *, Column * );
+    Row( const class PgRowDescription *, const EString & );
 
     bool isNull( const char * ) const;
     int getInt( const char * ) const;
     int64 getBigint( const char * ) const;
+    int64 getTimestamp( const char * ) const;
     bool getBoolean( const char * ) const;
     EString getEString( const char * ) const;
     UString getUString( const char * ) const;
@@ -159,9 +169,11 @@ public:
     EStringList * columnNames() const;
 
 private:
-    const Column * data;
+    mutable const Column * data;
     const class PgRowDescription * layout;
+    EString bytes;
 
+    void decode() const;
     const Column * fetch( const char *, Column::Type, bool ) const;
 };
 
@@ -32,7 +32,8 @@ public:
           t( 0 ),
           result( 0 ), unparsed( 0 ), upgrade( false ), commit( true ),
           quid( 0 ), undel( 0 ), row( 0 ), lastMailbox( 0 ), count( 0 ),
-          uidnext( 0 ), nextmodseq( 0 ), granter( 0 )
+          uidnext( 0 ), nextmodseq( 0 ), granter( 0 ),
+          ciq( 0 ), civ( 0 )
     {
         schema = Configuration::text( Configuration::DbSchema );
         dbuser = Configuration::text( Configuration::DbUser ).quoted();
@@ -63,6 +64,11 @@ public:
     int64 nextmodseq;
 
     Granter * granter;
+
+    // index builds to run outside the transaction, concurrently
+    EStringList deferred;
+    Query * ciq;
+    Query * civ;
 };
 
 
@@ -351,12 +357,85 @@ void Schema::execute()
     }
 
     if ( d->state == 8 ) {
+        // now build whatever indexes the steps deferred. create index
+        // concurrently can't run inside a transaction, and deferring
+        // the builds means the upgrade transaction holds its
+        // exclusive locks only briefly, while the slow part runs
+        // against a live server.
+        if ( !d->deferred.isEmpty() &&
+             ( !d->upgrade || !d->commit || d->t->failed() ) ) {
+            EStringList::Iterator i( d->deferred );
+            while ( i ) {
+                d->l->log( "Not running: " + *i, Log::Significant );
+                ++i;
+            }
+            d->deferred.clear();
+        }
+        while ( true ) {
+            if ( d->ciq ) {
+                if ( !d->ciq->done() )
+                    return;
+                if ( d->ciq->failed() ) {
+                    EString name = d->ciq->string().section( " ", 4 );
+                    d->l->log( "Building index " + name + " failed: " +
+                               d->ciq->error(), Log::Error );
+                    d->l->log( "Please drop index " + name +
+                               " if it exists, and run: " +
+                               d->ciq->string(), Log::Error );
+                }
+                d->ciq = 0;
+            }
+            EString * s = d->deferred.shift();
+            if ( !s )
+                break;
+            d->l->log( "Building index " + s->section( " ", 4 ) +
+                       " without locking (this may take a while).",
+                       Log::Significant );
+            d->ciq = new Query( *s, this );
+            d->ciq->execute();
+        }
+        if ( d->upgrade && d->commit && !d->t->failed() ) {
+            // an interrupted or failed concurrent build leaves an
+            // invalid index behind, which occupies disk and slows
+            // writes without helping anyone. warn about any we see.
+            if ( !d->civ ) {
+                d->civ = new Query( "select c.relname::text as name "
+                                    "from pg_class c "
+                                    "join pg_index i on (c.oid=i.indexrelid) "
+                                    "where not i.indisvalid", this );
+                d->civ->execute();
+            }
+            if ( !d->civ->done() )
+                return;
+            while ( d->civ->hasResults() ) {
+                Row * r = d->civ->nextRow();
+                d->l->log( "Index " + r->getEString( "name" ) +
+                           " is invalid; please drop and recreate it.",
+                           Log::Error );
+            }
+        }
+        d->state = 9;
+    }
+
+    if ( d->state == 9 ) {
         d->state = 42;
         d->result->notify();
     }
 }
 
 
+/*! This private helper arranges for \a statement (a create index
+    concurrently command) to be run once the upgrade transaction has
+    committed, so the table remains available for reading and writing
+    while the index builds.
+*/
+
+void Schema::deferIndex( const EString & statement )
+{
+    d->deferred.append( statement );
+}
+
+
 /*! This private helper logs a \a description of the step currently
     being made.
 */
@@ -592,6 +671,20 @@ bool Schema::singleStep()
         c = stepTo97(); break;
     case 97:
         c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
+    case 104:
+        c = stepTo105(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4420,3 +4513,232 @@ bool Schema::stepTo98()
     d->t->enqueue( "alter table mailboxes add flag text" );
     return true;
 }
+
+
+/*! Add the bodystructures cache table. The Injector fills it for new
+    messages; older messages just miss the cache.
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding the bodystructures cache table." );
+    d->t->enqueue( "create table bodystructures ("
+                   "message integer not null primary key "
+                   "references messages(id) on delete cascade, "
+                   "envelope text, "
+                   "bodystructure text)" );
+    return true;
+}
+
+
+/*! Add the sort_keys table and fill it for existing messages. The
+    Injector computes a properly normalized base subject for new
+    messages; for old ones we settle for the raw subject, which is
+    what Sort used until now anyway.
+*/
+
+bool Schema::stepTo100()
+{
+    describeStep( "Adding and populating the sort_keys table "
+                  "(may take a while)." );
+    d->t->enqueue( "create table sort_keys ("
+                   "message integer not null primary key "
+                   "references messages(id) on delete cascade, "
+                   "subject text, "
+                   "sfrom text)" );
+    d->t->enqueue( "insert into sort_keys (message, subject, sfrom) "
+                   "select distinct on (m.id) m.id, hf.value, a.localpart "
+                   "from messages m "
+                   "left join header_fields hf on "
+                   "(hf.message=m.id and hf.part='' and hf.field=" +
+                   fn( HeaderField::Subject ) + ") "
+                   "left join address_fields af on "
+                   "(af.message=m.id and af.part='' and af.number=0 and "
+                   "af.field=" + fn( HeaderField::From ) + ") "
+                   "left join addresses a on (af.address=a.id)" );
+    return true;
+}
+
+
+/*! Add a change counter to mailboxes, so that the servers can refresh
+    just the changed rows instead of rereading the entire table
+    whenever any mailbox changes.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Adding a change counter to mailboxes." );
+    d->t->enqueue( "create sequence mailbox_change" );
+    d->t->enqueue( "alter table mailboxes add change bigint not null "
+                   "default nextval('mailbox_change')" );
+    d->t->enqueue( "create index mb_c on mailboxes(change)" );
+    d->t->enqueue( "create or replace function check_mailbox_update() "
+                   "returns trigger as $$"
+                   "declare address text;"
+                   "begin "
+                   "notify mailboxes_updated;"
+                   "if new.deleted='t' and old.deleted='f' then "
+                   "perform * from mailbox_messages where mailbox=new.id;"
+                   "if found then "
+                   "raise exception '% is not empty', new.name;"
+                   "end if;"
+                   "select a.localpart||'@'||a.domain into address "
+                   "from addresses a join aliases al on (a.id=al.address) "
+                   "where al.mailbox=new.id;"
+                   "if address is not null then "
+                   "raise exception '% used by alias %', new.name, address;"
+                   "end if;"
+                   "perform * from fileinto_targets where mailbox=new.id;"
+                   "if found then "
+                   "raise exception '% is used by sieve fileinto', new.name;"
+                   "end if;"
+                   "end if;"
+                   "new.change := nextval('mailbox_change');"
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    return true;
+}
+
+
+/*! Add the trigger-maintained mailbox_counts table, so that STATUS
+    can read message and unseen counts instead of counting rows.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding and populating the mailbox_counts table "
+                  "(may take a while)." );
+    d->t->enqueue( "create table mailbox_counts ("
+                   "mailbox integer not null primary key "
+                   "references mailboxes(id) on delete cascade, "
+                   "messages integer not null default 0, "
+                   "unseen integer not null default 0)" );
+    d->t->enqueue( "create function create_mailbox_counts() "
+                   "returns trigger as $$"
+                   "begin "
+                   "insert into mailbox_counts (mailbox) values (new.id);"
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_counts_create_trigger "
+                   "after insert on mailboxes for each "
+                   "row execute procedure create_mailbox_counts()" );
+    d->t->enqueue( "create function update_mailbox_counts() "
+                   "returns trigger as $$"
+                   "begin "
+                   "if tg_op = 'DELETE' then "
+                   "update mailbox_counts "
+                   "set messages=messages-1, "
+                   "unseen=unseen-(case when old.seen then 0 else 1 end) "
+                   "where mailbox=old.mailbox;"
+                   "return old;"
+                   "elsif tg_op = 'INSERT' then "
+                   "update mailbox_counts "
+                   "set messages=messages+1, "
+                   "unseen=unseen+(case when new.seen then 0 else 1 end) "
+                   "where mailbox=new.mailbox;"
+                   "if not found then "
+                   "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "values (new.mailbox, 1, "
+                   "case when new.seen then 0 else 1 end);"
+                   "end if;"
+                   "elsif old.seen <> new.seen then "
+                   "update mailbox_counts "
+                   "set unseen=unseen+(case when new.seen then -1 else 1 end) "
+                   "where mailbox=new.mailbox;"
+                   "end if;"
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_counts_trigger "
+                   "after insert or update or delete on mailbox_messages "
+                   "for each row execute procedure update_mailbox_counts()" );
+    d->t->enqueue( "insert into mailbox_counts (mailbox, messages, unseen) "
+                   "select m.id, count(mm.uid)::int, "
+                   "coalesce(sum(case when not mm.seen then 1 else 0 end),"
+                   "0)::int "
+                   "from mailboxes m "
+                   "left join mailbox_messages mm on (mm.mailbox=m.id) "
+                   "group by m.id" );
+    return true;
+}
+
+
+/*! Index messages.idate and date_fields.value, so that SEARCH
+    BEFORE/SINCE and SENTBEFORE/SENTSINCE (and date-based retention
+    policies) need not scan every message in a big mailbox.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Indexing message dates (after commit, concurrently)." );
+    deferIndex( "create index concurrently m_idate on messages(idate)" );
+    deferIndex( "create index concurrently df_v on date_fields(value)" );
+    return true;
+}
+
+
+/*! Index mailbox_messages on (mailbox, modseq), so that CONDSTORE
+    clients asking what changed since a known modseq (FETCH ...
+    CHANGEDSINCE) need not look at every message in the mailbox.
+*/
+
+bool Schema::stepTo104()
+{
+    describeStep( "Indexing modseq (after commit, concurrently)." );
+    deferIndex( "create index concurrently mm_ms on "
+                "mailbox_messages(mailbox,modseq)" );
+    return true;
+}
+
+
+/*! Add a size column to mailbox_counts and maintain it from the
+    update trigger, so that GETQUOTA/GETQUOTAROOT read a few small
+    rows instead of summing rfc822size over every message the user
+    owns.
+*/
+
+bool Schema::stepTo105()
+{
+    describeStep( "Tracking mailbox sizes (may take a while)." );
+    d->t->enqueue( "alter table mailbox_counts add size bigint "
+                   "not null default 0" );
+    d->t->enqueue( "create or replace function update_mailbox_counts() "
+                   "returns trigger as $$"
+                   "begin "
+                   "if tg_op = 'DELETE' then "
+                   "update mailbox_counts "
+                   "set messages=messages-1, "
+                   "unseen=unseen-(case when old.seen then 0 else 1 end), "
+                   "size=size-coalesce((select rfc822size from messages "
+                   "where id=old.message),0) "
+                   "where mailbox=old.mailbox;"
+                   "return old;"
+                   "elsif tg_op = 'INSERT' then "
+                   "update mailbox_counts "
+                   "set messages=messages+1, "
+                   "unseen=unseen+(case when new.seen then 0 else 1 end), "
+                   "size=size+coalesce((select rfc822size from messages "
+                   "where id=new.message),0) "
+                   "where mailbox=new.mailbox;"
+                   "if not found then "
+                   "insert into mailbox_counts (mailbox, messages, "
+                   "unseen, size) "
+                   "values (new.mailbox, 1, "
+                   "case when new.seen then 0 else 1 end, "
+                   "coalesce((select rfc822size from messages "
+                   "where id=new.message),0));"
+                   "end if;"
+                   "elsif old.seen <> new.seen then "
+                   "update mailbox_counts "
+                   "set unseen=unseen+(case when new.seen then -1 else 1 end) "
+                   "where mailbox=new.mailbox;"
+                   "end if;"
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "update mailbox_counts mc set size=c.size from "
+                   "(select mm.mailbox, sum(m.rfc822size::bigint) as size "
+                   "from mailbox_messages mm "
+                   "join messages m on (mm.message=m.id) "
+                   "group by mm.mailbox) c "
+                   "where mc.mailbox=c.mailbox" );
+    return true;
+}
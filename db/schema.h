@@ -25,6 +25,7 @@ public:
 private:
     class SchemaData *d;
     void fail( const EString &, Query * = 0 );
+    void deferIndex( const EString & );
     bool singleStep();
     bool stepTo2();
     bool stepTo3();
@@ -123,6 +124,13 @@ private:
     bool stepTo96();
     bool stepTo97();
     bool stepTo98();
+    bool stepTo99();
+    bool stepTo100();
+    bool stepTo101();
+    bool stepTo102();
+    bool stepTo103();
+    bool stepTo104();
+    bool stepTo105();
 
     void describeStep( const EString & );
 };
@@ -9,8 +9,11 @@
 #include "permissions.h"
 #include "logclient.h"
 #include "eventloop.h"
+#include "connection.h"
+#include "endpoint.h"
 #include "injector.h"
 #include "mailbox.h"
+#include "buffer.h"
 #include "query.h"
 #include "file.h"
 #include "user.h"
@@ -140,6 +143,160 @@ public:
 };
 
 
+// returns a dot-escaped copy of s with CRLF line endings and a final
+// dot-cr-lf, suitable for sending after the LMTP data command.
+
+static EString dotted( const EString & s )
+{
+    EString r;
+    uint i = 0;
+    bool sol = true;
+    while ( i < s.length() ) {
+        if ( s[i] == '\r' ) {
+            sol = true;
+            r.append( "\r\n" );
+            if ( s[i+1] == '\n' )
+                i++;
+        }
+        else if ( s[i] == '\n' ) {
+            sol = true;
+            r.append( "\r\n" );
+        }
+        else {
+            if ( sol && s[i] == '.' )
+                r.append( '.' );
+            r.append( s[i] );
+            sol = false;
+        }
+        i++;
+    }
+    if ( !sol )
+        r.append( "\r\n" );
+    r.append( ".\r\n" );
+    return r;
+}
+
+
+// Hands the message to the LMTP server inside a running
+// archiveopteryx, which holds warm database handles and does the
+// injection for us. This costs one socket round-trip per command
+// instead of a database login and a scan of the mailboxes table, so
+// it's the mode to use when the MTA runs aoxdeliver once per message.
+
+class LmtpRelay
+    : public Connection
+{
+public:
+    LmtpRelay( Injectee * message,
+               const EString & sender, const EString & recipient )
+        : Connection( Connection::socket(
+                          Endpoint( Configuration::LmtpAddress,
+                                    Configuration::LmtpPort ).protocol() ),
+                      Connection::SmtpClient ),
+          state( Banner ), m( message ), from( sender ), to( recipient )
+    {
+        Allocator::addEternal( this, "lmtp relay object" );
+        connect( Endpoint( Configuration::LmtpAddress,
+                           Configuration::LmtpPort ) );
+        EventLoop::global()->addConnection( this );
+        setTimeoutAfter( 60 );
+    }
+
+    enum State { Banner, Lhlo, MailFrom, RcptTo, Data, Body, Quit };
+
+    void react( Event e )
+    {
+        switch ( e ) {
+        case Read:
+            process();
+            break;
+        case Timeout:
+            quit( EX_TEMPFAIL, "LMTP server timed out" );
+            break;
+        case Connect:
+            break;
+        case Error:
+        case Close:
+            if ( state == Quit )
+                quit( 0, "" );
+            quit( EX_TEMPFAIL, "LMTP server closed the connection" );
+            break;
+        case Shutdown:
+            break;
+        }
+    }
+
+    void send( const EString & s )
+    {
+        enqueue( s + "\r\n" );
+        setTimeoutAfter( 60 );
+    }
+
+    void process()
+    {
+        Buffer * r = readBuffer();
+        while ( true ) {
+            EString * s = r->removeLine();
+            if ( !s )
+                return;
+            if ( (*s)[3] == '-' )
+                continue;
+            uint response = s->mid( 0, 3 ).number( 0 );
+            if ( response >= 400 ) {
+                if ( response < 500 )
+                    quit( EX_TEMPFAIL, "LMTP error: " + *s );
+                else if ( state == RcptTo )
+                    quit( EX_NOUSER, "LMTP error: " + *s );
+                else
+                    quit( EX_UNAVAILABLE, "LMTP error: " + *s );
+            }
+            switch ( state ) {
+            case Banner:
+                send( "lhlo " + Configuration::hostname() );
+                state = Lhlo;
+                break;
+            case Lhlo:
+                {
+                    EString mf = "mail from:<" + from + ">";
+                    if ( m->needsUnicode() )
+                        mf.append( " smtputf8" );
+                    send( mf );
+                }
+                state = MailFrom;
+                break;
+            case MailFrom:
+                send( "rcpt to:<" + to + ">" );
+                state = RcptTo;
+                break;
+            case RcptTo:
+                send( "data" );
+                state = Data;
+                break;
+            case Data:
+                enqueue( dotted( m->rfc822( !m->needsUnicode() ) ) );
+                setTimeoutAfter( 60 );
+                state = Body;
+                break;
+            case Body:
+                // LMTP sends one response per accepted recipient; we
+                // have exactly one
+                send( "quit" );
+                state = Quit;
+                break;
+            case Quit:
+                quit( 0, "" );
+                break;
+            }
+        }
+    }
+
+    State state;
+    Injectee * m;
+    EString from;
+    EString to;
+};
+
+
 int main( int argc, char *argv[] )
 {
     Scope global;
@@ -150,6 +307,7 @@ int main( int argc, char *argv[] )
     EString filename;
     int verbose = 0;
     bool error = false;
+    bool lmtp = false;
 
     int n = 1;
     while ( n < argc ) {
@@ -169,6 +327,10 @@ int main( int argc, char *argv[] )
                 }
                 break;
 
+            case 'l':
+                lmtp = true;
+                break;
+
             case 'v':
                 {
                     int i = 1;
@@ -198,9 +360,15 @@ int main( int argc, char *argv[] )
         n++;
     }
 
+    if ( lmtp && !mailbox.isEmpty() ) {
+        // LMTP can't express a target mailbox
+        error = true;
+    }
+
     if ( error || recipient.isEmpty() ) {
         fprintf( stderr,
-                 "Syntax: aoxdeliver [-v] [-f sender] recipient [filename]\n" );
+                 "Syntax: aoxdeliver [-v] [-l] [-f sender] "
+                 "recipient [filename]\n" );
         exit( -1 );
     }
 
@@ -234,13 +402,27 @@ int main( int argc, char *argv[] )
         fprintf( stderr, "Sending to <%s>\n", recipient.cstr() );
 
     EventLoop::setup();
-    Database::setup( 1 );
     Log * l = new Log;
     Allocator::addEternal( l, "delivery log" );
     global.setLog( l );
     Allocator::addEternal( new StderrLogger( "aoxdeliver", verbose ),
                            "log object" );
 
+    if ( lmtp ) {
+        // hand the message to the LMTP server in the resident
+        // archiveopteryx instead of opening our own database
+        // connection and reading the mailboxes table
+        EString to = recipient;
+        if ( !to.contains( '@' ) )
+            to = to + "@" + Configuration::hostname();
+        (void)new LmtpRelay( message, sender, to );
+        EventLoop::global()->start();
+        // LmtpRelay calls quit(); if we come this far, something is
+        // badly wrong
+        return EX_TEMPFAIL;
+    }
+
+    Database::setup( 1 );
     Configuration::report();
     Mailbox::setup();
     Deliverator * d = new Deliverator( message, mailbox, recipient );
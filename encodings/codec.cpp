@@ -5,6 +5,8 @@
 #include "estring.h"
 #include "ustring.h"
 #include "estringlist.h"
+#include "allocator.h"
+#include "dict.h"
 
 #include "cp.h"
 #include "koi.h"
@@ -193,6 +195,8 @@ static struct {
     { 0, 0 }
 };
 
+static Dict<const char> * aliases = 0;
+
 
 /*! Returns a list of all canonical codec names. Aliases are not
     included in the list.
@@ -226,16 +230,25 @@ Codec * Codec::byName( const EString & s )
 
     EString name = s.lower();
 
-    int i = 0;
-    // next loop can be replaced by a binary search - codecaliases is
-    // sorted by alias.
-    while ( codecaliases[i].alias &&
-            name != codecaliases[i].alias )
-        i++;
-    if ( codecaliases[i].alias )
-        name = codecaliases[i].name;
+    // a hash of the alias table, built on first use, so each lookup
+    // is a single probe instead of a scan: MIME parsing comes here
+    // for every charset parameter.
+    if ( !::aliases ) {
+        Dict<const char> * d = new Dict<const char>;
+        Allocator::addEternal( d, "codec aliases" );
+        int i = 0;
+        while ( codecaliases[i].alias ) {
+            d->insert( codecaliases[i].alias, codecaliases[i].name );
+            i++;
+        }
+        ::aliases = d;
+    }
+    const char * canonical = ::aliases->find( name );
+    if ( canonical )
+        name = canonical;
     else if ( name == "macroman" )
         name = "macintosh";
+    int i = 0;
 
     Codec * codec = 0;
 #include "codec-map.inc"
@@ -62,6 +62,7 @@ EString Cp932Codec::fromUnicode( const UString &u )
 UString Cp932Codec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     uint n = 0;
     while ( n < s.length() ) {
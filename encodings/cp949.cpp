@@ -74,6 +74,7 @@ EString Cp949Codec::fromUnicode( const UString &u )
 UString Cp949Codec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     uint n = 0;
     while ( n < s.length() ) {
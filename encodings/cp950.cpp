@@ -61,6 +61,7 @@ EString Cp950Codec::fromUnicode( const UString &u )
 UString Cp950Codec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     uint n = 0;
     while ( n < s.length() ) {
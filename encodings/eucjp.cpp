@@ -80,6 +80,7 @@ EString EucJpCodec::fromUnicode( const UString &u )
 UString EucJpCodec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     uint n = 0;
     while ( n < s.length() ) {
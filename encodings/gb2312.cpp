@@ -62,6 +62,7 @@ EString Gb2312Codec::fromUnicode( const UString &u )
 UString Gb2312Codec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     uint n = 0;
     while ( n < s.length() ) {
@@ -61,6 +61,7 @@ EString GbkCodec::fromUnicode( const UString &u )
 UString GbkCodec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     uint n = 0;
     while ( n < s.length() ) {
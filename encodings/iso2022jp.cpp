@@ -92,6 +92,7 @@ EString Iso2022JpCodec::fromUnicode( const UString &u )
 UString Iso2022JpCodec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     enum { ASCII, JIS } mode = ASCII;
 
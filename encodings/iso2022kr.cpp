@@ -93,6 +93,7 @@ EString Iso2022KrCodec::fromUnicode( const UString &u )
 UString Iso2022KrCodec::toUnicode( const EString &s )
 {
     UString u;
+    u.reserve( s.length() );
 
     enum { ASCII, KSC } mode = ASCII;
 
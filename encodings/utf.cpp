@@ -5,6 +5,9 @@
 #include "estring.h"
 #include "ustring.h"
 
+// memcpy
+#include <string.h>
+
 
 /*! \class Utf8Codec utf.h
     The Utf8Codec class implements the codec described in RFC 2279
@@ -123,6 +126,27 @@ UString Utf8Codec::toUnicode( const EString & s )
         int c = 0;
         if ( s[i] < 0x80 ) {
             // 0000 0000-0000 007F   0xxxxxxx
+            // handle a whole run of ASCII at once: check four bytes
+            // at a time for a high bit and bulk-append the run, so
+            // the all-ASCII common case never takes the per-character
+            // path at all
+            const char * b = s.data();
+            uint begin = i;
+            uint end = s.length();
+            while ( i + 4 <= end ) {
+                uint w;
+                memcpy( &w, b + i, 4 );
+                if ( w & 0x80808080u )
+                    break;
+                i += 4;
+            }
+            while ( i < end && !( b[i] & 0x80 ) )
+                i++;
+            if ( i > begin + 1 ) {
+                u.append( b + begin, i - begin );
+                continue;
+            }
+            i = begin;
             c = s[i];
             i += 1;
         }
@@ -66,6 +66,28 @@ UString HTML::asText( const UString &h )
                 else if ( t == "body" ) {
                     r.truncate();
                 }
+                else if ( t == "script" || t == "style" ) {
+                    /* code and stylesheets contain no indexable
+                       text; skip to the matching end tag without
+                       copying any of the content */
+                    uint j = i + 1;
+                    bool found = false;
+                    while ( !found && j < h.length() ) {
+                        if ( h[j] == '<' && h[j+1] == '/' ) {
+                            uint k = 0;
+                            while ( k < t.length() &&
+                                    ( h[j+2+k] | 0x20 ) == t[k] )
+                                k++;
+                            uint nc = h[j+2+k];
+                            if ( k == t.length() &&
+                                 !( nc < 128 && isalnum( nc ) ) )
+                                found = true;
+                        }
+                        if ( !found )
+                            j++;
+                    }
+                    i = j - 1;
+                }
                 sgml = tag = 0;
             }
             break;
@@ -198,7 +220,11 @@ UString HTML::asText( const UString &h )
                 dc.append( r, h[i] );
                 s.truncate();
             } else if ( tagname ) {
-                t.append( h[i] );
+                /* fold the name so <P>, <BR> etc. are recognized */
+                uint tc = h[i];
+                if ( tc >= 'A' && tc <= 'Z' )
+                    tc += 0x20;
+                t.append( tc );
             } else if ( !quoted && h[i] == '=' ) {
                 a.truncate();
             } else {
@@ -6,13 +6,17 @@
 #include "utf.h"
 #include "imap.h"
 #include "user.h"
+#include "dict.h"
+#include "graph.h"
 #include "buffer.h"
 #include "mailbox.h"
+#include "allocator.h"
 #include "integerset.h"
 #include "imapparser.h"
 #include "transaction.h"
 #include "imapsession.h"
 #include "mailboxgroup.h"
+#include "imapstructure.h"
 
 // Keep these alphabetical.
 #include "handlers/acl.h"
@@ -58,6 +62,49 @@
 class MailboxGroup;
 
 
+static Dict<GraphableHistogram> * commandTimes = 0;
+
+
+/* This static helper returns the histogram for stage \a family (e.g.
+   imap-command-duration-milliseconds) of the command named \a name,
+   creating it if necessary.
+*/
+
+static GraphableHistogram * commandHistogram( const char * family,
+                                              const EString & name )
+{
+    if ( !::commandTimes ) {
+        ::commandTimes = new Dict<GraphableHistogram>;
+        Allocator::addEternal( ::commandTimes,
+                               "command duration histograms" );
+    }
+    EString key( family );
+    key.append( "/" );
+    key.append( name );
+    GraphableHistogram * h = ::commandTimes->find( key );
+    if ( !h ) {
+        h = new GraphableHistogram( family,
+                                    "command=\"" + name + "\"" );
+        ::commandTimes->insert( key, h );
+    }
+    return h;
+}
+
+
+/* This static helper returns the number of milliseconds from \a from
+   to \a to, rounded to nearest.
+*/
+
+static long millisecondsBetween( const struct timeval & from,
+                                 const struct timeval & to )
+{
+    long elapsed =
+        ( to.tv_sec - from.tv_sec ) * 1000000 +
+        ( to.tv_usec - from.tv_usec );
+    return ( elapsed + 499 ) / 1000;
+}
+
+
 class CommandData
     : public Garbage
 {
@@ -77,7 +124,9 @@ public:
           checkedMailboxGroup( false ),
           transaction( 0 )
     {
-        (void)::gettimeofday( &started, 0 );
+        (void)::gettimeofday( &created, 0 );
+        started = created;
+        finished = created;
     }
 
     EString tag;
@@ -101,7 +150,9 @@ public:
 
     uint permittedStates;
 
+    struct timeval created;
     struct timeval started;
+    struct timeval finished;
 
     IMAP * imap;
     ImapSession * session;
@@ -453,6 +504,15 @@ void Command::setState( State s )
     d->state = s;
     switch( s ) {
     case Retired:
+        if ( d->name != "idle" ) {
+            struct timeval now;
+            (void)::gettimeofday( &now, 0 );
+            long emitted = millisecondsBetween( d->finished, now );
+            log( "Responses emitted " + fn( emitted ) +
+                 "ms after finishing", Log::Debug );
+            commandHistogram( "imap-command-emit-milliseconds",
+                              d->name )->addNumber( emitted );
+        }
         log( "Retired", Log::Debug );
         break;
     case Unparsed:
@@ -474,20 +534,26 @@ void Command::setState( State s )
         }
         break;
     case Finished:
+        (void)::gettimeofday( &d->finished, 0 );
         if ( d->name != "idle" ) {
-            struct timeval end;
-            (void)::gettimeofday( &end, 0 );
             long elapsed =
-                ( end.tv_sec - d->started.tv_sec ) * 1000000 +
-                ( end.tv_usec - d->started.tv_usec );
+                ( d->finished.tv_sec - d->started.tv_sec ) * 1000000 +
+                ( d->finished.tv_usec - d->started.tv_usec );
             Log::Severity level = Log::Debug;
             if ( elapsed > 3000 )
                 level = Log::Info;
             EString m;
             m.append( "Execution time " );
-            m.append( fn( ( elapsed + 499 ) / 1000 ) );
+            m.appendNumber( (int64)( ( elapsed + 499 ) / 1000 ) );
             m.append( "ms" );
             log( m, level );
+            commandHistogram( "imap-command-duration-milliseconds",
+                              d->name )->addNumber( ( elapsed + 499 ) / 1000 );
+            long waited = millisecondsBetween( d->created, d->started );
+            log( "Queued " + fn( waited ) + "ms before execution",
+                 Log::Debug );
+            commandHistogram( "imap-command-wait-milliseconds",
+                              d->name )->addNumber( waited );
         }
         log( "Finished", Log::Debug );
         break;
@@ -1153,34 +1219,12 @@ const EString Command::following() const
 
 EString Command::imapQuoted( const EString & s, const QuoteMode mode )
 {
-    // if we're asked for an nstring, NIL may do
-    if ( mode == NString && s.isEmpty() )
-        return "NIL";
-
-    // if the string is really boring and we can send an atom, we do
-    if ( mode == AString && s.boring() &&
-         !( s.length() == 3 && s.lower() == "nil" ) )
-        return s;
-
-    // will quoted do?
-    uint i = 0;
-    while ( i < s.length() &&
-            s[i] >= ' ' && s[i] < 128 &&
-            s[i] != '\\' && s[i] != '"' )
-        i++;
-    if ( i >= s.length() ) // yes
-        return s.quoted( '"' );
-
-    EString r;
-    r.reserve( s.length() + 20 );
-    // if there's a null byte, we need to send a literal8
-    if ( s.contains( 0 ) )
-        r.append( '~' );
-    r.append( '{' );
-    r.appendNumber( s.length() );
-    r.append( "}\r\n" );
-    r.append( s );
-    return r;
+    ImapStructure::QuoteMode m = ImapStructure::PlainString;
+    if ( mode == AString )
+        m = ImapStructure::AString;
+    else if ( mode == NString )
+        m = ImapStructure::NString;
+    return ImapStructure::quoted( s, m );
 }
 
 
@@ -158,6 +158,8 @@ void Acl::execute()
             d->q->bind( 1, d->mailbox->id() );
             d->q->bind( 2, d->authid );
             d->q->execute();
+            Query * n = new Query( "notify permissions_updated", 0 );
+            n->execute();
         }
         else if ( d->type == GetAcl ) {
             EString s;
@@ -255,6 +257,8 @@ void Acl::execute()
             }
 
             d->state = 4;
+            transaction()->enqueue(
+                new Query( "notify permissions_updated", 0 ) );
             transaction()->commit();
         }
     }
@@ -399,6 +399,9 @@ void Append::process( class Appendage * h )
     h->message = new Injectee;
     h->message->setInternalDate( h->date.unixTime() );
     h->message->parse( h->text );
+    // the message now owns its own copy of the text, so release ours;
+    // for a large literal this halves what we hold until injection.
+    h->text = EString();
     h->message->setFlags( d->mailbox, &h->flags );
     h->message->setAnnotations( d->mailbox, h->annotations );
     if ( !h->message->valid() ) {
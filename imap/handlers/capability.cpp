@@ -44,6 +44,7 @@
     RFC 5257: ANNOTATE-EXPERIMENT-1,
     RFC 5258: LISTEXT,
     RFC 5465: NOTIFY,
+    RFC 5819: LIST-STATUS,
     RFC 6154: SPECIAL-USE,
     RFC 6855: UTF=ACCEPT,
     RFC 7162: QRESYNC.
@@ -99,8 +100,10 @@ EString Capability::capabilities( IMAP * i, bool all )
     c.append( "ID" );
     if ( all || login )
         c.append( "IDLE" );
-    if ( all || login )
+    if ( all || login ) {
         c.append( "LIST-EXTENDED" );
+        c.append( "LIST-STATUS" );
+    }
     c.append( "LITERAL+" );
     if ( ( all || !login ) &&
          !SaslMechanism::allowed( SaslMechanism::Plain, i->hasTls() ) )
@@ -114,7 +117,7 @@ EString Capability::capabilities( IMAP * i, bool all )
     if ( all || login ) {
         if ( Configuration::toggle( Configuration::UseImapQuota ) )
             c.append( "QUOTA" );
-        //c.append( "QRESYNC" );
+        c.append( "QRESYNC" );
         c.append( "RIGHTS=ekntx" );
     }
     if ( all || !login )
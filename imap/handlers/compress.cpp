@@ -2,7 +2,6 @@
 
 #include "compress.h"
 
-#include "buffer.h"
 #include "imap.h"
 
 
@@ -44,12 +43,12 @@ void Compress::execute()
         return;
     }
 
-    Buffer * r = imap()->readBuffer();
-    Buffer * w = imap()->writeBuffer();
+    setState( Finished );
     emitResponses();
 
-    r->setCompression( Buffer::Decompressing );
-    w->setCompression( Buffer::Compressing );
-
-    setState( Finished );
+    // the deflating itself happens on a worker thread, so that one
+    // client downloading its whole mailbox doesn't cost everybody
+    // else a core. startCompression() flushes the OK first, so the
+    // client sees it uncompressed.
+    imap()->startCompression();
 }
@@ -138,13 +138,19 @@ void Copy::execute()
 
         Query * q;
 
+        // a copy that failed after creating t or s leaves them behind
+        // in the backend session, which belongs to a pooled database
+        // handle and outlives the transaction. clean up pessimistically.
+        transaction()->enqueue( new Query( "drop table if exists t", 0 ) );
+        transaction()->enqueue( new Query( "drop sequence if exists s", 0 ) );
+
         q = new Query( "create temporary table t ("
                        "mailbox integer,"
                        "uid integer,"
                        "message integer,"
                        "nuid integer,"
                        "seen boolean"
-                       ")", 0 );
+                       ") on commit drop", 0 );
         transaction()->enqueue( q );
 
         q = new Query( "create temporary sequence s start " + fn( d->toUid ),
@@ -218,8 +224,6 @@ void Copy::execute()
             transaction()->enqueue( q );
         }
 
-        transaction()->enqueue( new Query( "drop table t", 0 ) );
-
         Mailbox::refreshMailboxes( transaction() );
 
         transaction()->commit();
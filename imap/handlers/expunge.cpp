@@ -21,7 +21,8 @@ class ExpungeData
 public:
     ExpungeData()
         : uid( false ), commit( false ), modseq( 0 ), s( 0 ),
-          findUids( 0 ), findModseq( 0 ), expunge( 0 ), r( 0 )
+          findUids( 0 ), findModseq( 0 ), lockUids( 0 ), expunge( 0 ),
+          r( 0 )
     {}
 
     bool uid;
@@ -30,8 +31,10 @@ public:
     Session * s;
     Query * findUids;
     Query * findModseq;
+    Query * lockUids;
     Query * expunge;
     IntegerSet requested;
+    IntegerSet remaining;
     IntegerSet marked;
     RetentionSelector * r;
 };
@@ -109,14 +112,10 @@ void Expunge::execute()
         d->r->execute();
     }
 
-    if ( !transaction() ) {
-        setTransaction( new Transaction( this ) );
-
-        d->findModseq = new Query( "select nextmodseq from mailboxes "
-                                   "where id=$1 for update", this );
-        d->findModseq->bind( 1, d->s->mailbox()->id() );
-        transaction()->enqueue( d->findModseq );
-
+    if ( !d->findUids ) {
+        // a plain read to enumerate the candidates; each chunk below
+        // revalidates its share under lock, so we don't have to hold
+        // half a million row locks while we work
         d->findUids = new Query( "", this );
         d->findUids->bind( 1, d->s->mailbox()->id() );
         EString query( "select uid from mailbox_messages "
@@ -125,21 +124,14 @@ void Expunge::execute()
             query.append( " and uid=any($2)" );
             d->findUids->bind( 2, d->requested );
         }
-        query.append( " order by uid for update" );
+        query.append( " order by uid" );
         d->findUids->setString( query );
-        transaction()->enqueue( d->findUids );
-
-        transaction()->execute();
+        d->findUids->execute();
     }
 
     while ( d->findUids->hasResults() ) {
         Row * r = d->findUids->nextRow();
-        d->marked.add( r->getInt( "uid" ) );
-    }
-
-    if ( d->findModseq->hasResults() ) {
-        Row * r = d->findModseq->nextRow();
-        d->modseq = r->getBigint( "nextmodseq" );
+        d->remaining.add( r->getInt( "uid" ) );
     }
 
     if ( !d->findUids->done() )
@@ -148,13 +140,68 @@ void Expunge::execute()
     if ( !d->r->done() )
         return;
 
-    if ( d->marked.isEmpty() ) {
-        transaction()->commit();
+    if ( !transaction() && d->remaining.isEmpty() ) {
         finish();
         return;
     }
 
+    // expunge in chunks, each in a transaction of its own, so that
+    // expunging a huge mailbox neither holds one giant transaction
+    // nor blocks the event loop. each chunk yields whenever it waits
+    // for the database.
+
+    if ( !transaction() ) {
+        d->marked.clear();
+        uint n = 0;
+        while ( n < 4096 && !d->remaining.isEmpty() ) {
+            uint uid = d->remaining.smallest();
+            d->remaining.remove( uid );
+            d->marked.add( uid );
+            n++;
+        }
+
+        setTransaction( new Transaction( this ) );
+
+        d->findModseq = new Query( "select nextmodseq from mailboxes "
+                                   "where id=$1 for update", this );
+        d->findModseq->bind( 1, d->s->mailbox()->id() );
+        transaction()->enqueue( d->findModseq );
+
+        d->lockUids = new Query( "select uid from mailbox_messages "
+                                 "where mailbox=$1 and uid=any($2) "
+                                 "and deleted order by uid for update",
+                                 this );
+        d->lockUids->bind( 1, d->s->mailbox()->id() );
+        d->lockUids->bind( 2, d->marked );
+        transaction()->enqueue( d->lockUids );
+
+        transaction()->execute();
+    }
+
     if ( !d->expunge ) {
+        if ( !d->findModseq->done() || !d->lockUids->done() )
+            return;
+
+        if ( d->findModseq->hasResults() ) {
+            Row * r = d->findModseq->nextRow();
+            d->modseq = r->getBigint( "nextmodseq" );
+        }
+
+        // someone else may have expunged part of our chunk since the
+        // enumeration, so use what we managed to lock
+        d->marked.clear();
+        while ( d->lockUids->hasResults() ) {
+            Row * r = d->lockUids->nextRow();
+            d->marked.add( r->getInt( "uid" ) );
+        }
+
+        if ( d->marked.isEmpty() ) {
+            d->commit = true;
+            transaction()->commit();
+        }
+    }
+
+    if ( !d->expunge && !d->commit ) {
         log( "Expunge " + fn( d->marked.count() ) + " messages: " +
              d->marked.set() );
 
@@ -193,7 +240,7 @@ void Expunge::execute()
         transaction()->execute();
     }
 
-    if ( !d->expunge->done() )
+    if ( d->expunge && !d->expunge->done() )
         return;
 
     if ( !d->commit ) {
@@ -230,7 +277,22 @@ void Expunge::execute()
         return;
 
     if ( transaction()->failed() ||
-         transaction()->state() == Transaction::RolledBack )
+         transaction()->state() == Transaction::RolledBack ) {
         error( No, "Database error. Messages not expunged." );
+        finish();
+        return;
+    }
+
+    if ( !d->remaining.isEmpty() ) {
+        // this chunk is committed and announced; on to the next
+        setTransaction( 0 );
+        d->findModseq = 0;
+        d->lockUids = 0;
+        d->expunge = 0;
+        d->commit = false;
+        execute();
+        return;
+    }
+
     finish();
 }
@@ -3,6 +3,9 @@
 #include "fetch.h"
 
 #include "messagecache.h"
+#include "dynamicscache.h"
+#include "imapstructure.h"
+#include "cache.h"
 #include "imapsession.h"
 #include "transaction.h"
 #include "annotation.h"
@@ -58,8 +61,12 @@ public:
           internaldate( false ), rfc822size( false ),
           annotation( false ), modseq( false ),
           databaseId( false ), threadId( false ), vanished( false ),
+          implicit( false ), cachedDynamics( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          bodyWindow( 0 ), headerFields( 0 ),
+          headerElsewhere( false ), addressesElsewhere( false ),
+          partNumbersElsewhere( false ), structuresQuery( 0 ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
           annotationFetcher( 0 ), modseqFetcher( 0 )
     {}
@@ -90,6 +97,8 @@ public:
     bool databaseId;
     bool threadId;
     bool vanished;
+    bool implicit;
+    bool cachedDynamics;
     List<Section> sections;
 
     // and the sections imply that we...
@@ -98,6 +107,31 @@ public:
     bool needsBody;
     bool needsPartNumbers;
 
+    // if all the body sections are partial, how much of each part we
+    // need (0 means everything)
+    uint bodyWindow;
+
+    // if the client asked only for header.fields, which fields (null
+    // means all)
+    EStringList * headerFields;
+
+    // whether we need those even if the bodystructures cache serves
+    // ENVELOPE and BODYSTRUCTURE
+    bool headerElsewhere;
+    bool addressesElsewhere;
+    bool partNumbersElsewhere;
+
+    struct StructureData
+        : public Garbage
+    {
+    public:
+        StructureData() {}
+        EString envelope;
+        EString bodystructure;
+    };
+    Map<StructureData> structures;
+    Query * structuresQuery;
+
     EStringList entries;
     EStringList attribs;
 
@@ -167,6 +201,7 @@ Fetch::Fetch( bool f, bool a, bool v, const IntegerSet & set,
     d->changedSince = limit;
     d->modseq = i->clientSupports( IMAP::Condstore );
     d->vanished = v;
+    d->implicit = true;
     if ( t )
         setTransaction( t->subTransaction( this ) );
 
@@ -245,8 +280,16 @@ void Fetch::parse()
         while ( present( " " ) )
             parseFetchModifier();
         require( ")" );
+        if ( d->vanished && !( d->uid && d->changedSince ) )
+            error( Bad, "VANISHED is valid only with UID FETCH "
+                   "and CHANGEDSINCE" );
     }
     end();
+    // ENVELOPE and BODYSTRUCTURE can usually be served from the
+    // bodystructures cache; note what needs header data regardless
+    d->headerElsewhere = d->needsHeader || d->needsBody || d->body;
+    d->addressesElsewhere = d->needsAddresses || d->body;
+    d->partNumbersElsewhere = d->needsPartNumbers || d->body;
     if ( d->envelope ) {
         d->needsHeader = true;
         d->needsAddresses = true;
@@ -261,6 +304,57 @@ void Fetch::parse()
     }
     if ( d->needsBody )
         d->needsHeader = true; // Bodypart::asText() needs mime type etc
+    if ( d->needsBody ) {
+        // if the client wants only partial body data (as e.g. mail
+        // clients fetching previews of big attachments do), there's
+        // no need to retrieve more of each part than the largest
+        // window can show. rendering never shrinks the stored form,
+        // so a stored window of the same size is always enough.
+        bool partialOnly = true;
+        uint window = 0;
+        List<Section>::Iterator si( d->sections );
+        while ( si ) {
+            bool body = si->needsBody ||
+                        si->id == "rfc822" || si->id == "rfc822.text";
+            if ( body && si->partial &&
+                 si->offset < UINT_MAX - si->length ) {
+                if ( window < si->offset + si->length )
+                    window = si->offset + si->length;
+            }
+            else if ( body ) {
+                partialOnly = false;
+            }
+            ++si;
+        }
+        if ( partialOnly && window )
+            d->bodyWindow = window;
+    }
+    if ( ( d->needsHeader || d->needsAddresses ) &&
+         !d->envelope && !d->body && !d->bodystructure && !d->needsBody ) {
+        // if the client asked only for specific header fields (the
+        // typical list view does), the fetch can be restricted to
+        // those instead of dragging the whole header along
+        bool fieldsOnly = true;
+        EStringList * fields = new EStringList;
+        List<Section>::Iterator si( d->sections );
+        while ( si ) {
+            if ( si->id == "header.fields" ) {
+                EStringList::Iterator f( si->fields );
+                while ( f ) {
+                    fields->append( new EString( *f ) );
+                    ++f;
+                }
+            }
+            else {
+                fieldsOnly = false;
+            }
+            ++si;
+        }
+        if ( fieldsOnly && !fields->isEmpty() ) {
+            fields->removeDuplicates( false );
+            d->headerFields = fields;
+        }
+    }
     if ( !ok() )
         return;
     EStringList l;
@@ -451,7 +545,7 @@ Section * Fetch::parseSection( ImapParser * ip, bool binary )
     bool dot = false;
     if ( ip->nextChar() >= '0' && ip->nextChar() <= '9' ) {
         EString part;
-        part.append( fn( ip->nzNumber() ) );
+        part.appendNumber( ip->nzNumber() );
         while ( ip->nextChar() == '.' ) {
             ip->step();
             if ( ip->nextChar() >= '0' && ip->nextChar() <= '9' ) {
@@ -675,6 +769,12 @@ void Fetch::execute()
     if ( !d->peek && s->readOnly() )
         d->peek = true;
 
+    if ( d->state == 0 && d->implicit && !d->annotation && !d->vanished ) {
+        d->set = d->set.intersection( s->messages() );
+        if ( checkDynamicsCache() )
+            d->state = 1;
+    }
+
     if ( d->state == 0 ) {
         if ( !transaction() &&
              ( !d->peek ||
@@ -697,7 +797,26 @@ void Fetch::execute()
         Mailbox * mb = s->mailbox();
         if ( !d->those ) {
             d->set = d->set.intersection( session()->messages() );
-            if ( d->changedSince ) {
+            if ( d->changedSince &&
+                 !d->set.isEmpty() &&
+                 d->set.count() ==
+                 d->set.largest() - d->set.smallest() + 1 ) {
+                // the typical CONDSTORE client asks about 1:*. when
+                // the uid set is one contiguous range, say so, so
+                // that the (mailbox,modseq) index drives the plan
+                // instead of shipping every uid as an array.
+                d->those = new Query( "select uid, message "
+                                      "from mailbox_messages "
+                                      "where mailbox=$1 "
+                                      "and uid>=$2 and uid<=$3 "
+                                      "and modseq>$4",
+                                      this );
+                d->those->bind( 1, s->mailbox()->id() );
+                d->those->bind( 2, d->set.smallest() );
+                d->those->bind( 3, d->set.largest() );
+                d->those->bind( 4, d->changedSince );
+            }
+            else if ( d->changedSince ) {
                 d->those = new Query( "select uid, message "
                                       "from mailbox_messages "
                                       "where mailbox=$1 and uid=any($2) "
@@ -705,6 +824,7 @@ void Fetch::execute()
                                       this );
                 d->those->bind( 1, s->mailbox()->id() );
                 d->those->bind( 2, d->set );
+                d->those->bind( 3, d->changedSince );
             }
             else if ( d->modseq ||
                       d->needsAddresses || d->needsHeader ||
@@ -717,6 +837,14 @@ void Fetch::execute()
                     uint uid = s.smallest();
                     s.remove( uid );
                     Message * m = MessageCache::find( mb, uid );
+                    if ( m && d->bodyWindow && !m->hasBodies() )
+                        // we'd graft a partial body onto the cached
+                        // message, spoiling it for everyone else
+                        m = 0;
+                    if ( m && d->headerFields &&
+                         !( m->hasHeaders() && m->hasAddresses() ) )
+                        // likewise for a partial header
+                        m = 0;
                     if ( m )
                         d->messages.insert( uid, m );
                     if ( !m || !m->databaseId() || d->modseq )
@@ -732,8 +860,6 @@ void Fetch::execute()
                 }
             }
             if ( d->those ) {
-                if ( d->changedSince )
-                    d->those->bind( 3, d->changedSince );
                 if ( d->modseq ) {
                     if ( !d->peek ) {
                         // if we aren't peeking, then we have to lock
@@ -766,7 +892,10 @@ void Fetch::execute()
                 d->set.add( uid );
                 Message * m = d->messages.find( uid );
                 if ( !m ) {
-                    m = MessageCache::provide( mb, uid );
+                    if ( d->bodyWindow || d->headerFields )
+                        m = new Message;
+                    else
+                        m = MessageCache::provide( mb, uid );
                     d->messages.insert( uid, m );
                 }
                 m->setDatabaseId( r->getInt( "message" ) );
@@ -836,6 +965,44 @@ void Fetch::execute()
     }
 
     if ( d->state == 3 ) {
+        if ( ( d->envelope || d->bodystructure ) &&
+             !imap()->clientSupports( IMAP::Unicode ) ) {
+            // the cached serializations are in classic MIME format,
+            // so they can't serve unicode-aware clients
+            if ( !d->structuresQuery ) {
+                IntegerSet ids;
+                Map<Message>::Iterator i( d->messages );
+                while ( i ) {
+                    if ( i->databaseId() )
+                        ids.add( i->databaseId() );
+                    ++i;
+                }
+                if ( !ids.isEmpty() ) {
+                    d->structuresQuery
+                        = new Query( "select message, envelope, "
+                                     "bodystructure from bodystructures "
+                                     "where message=any($1)", this );
+                    d->structuresQuery->bind( 1, ids );
+                    enqueue( d->structuresQuery );
+                    if ( transaction() )
+                        transaction()->execute();
+                }
+            }
+            if ( d->structuresQuery ) {
+                while ( d->structuresQuery->hasResults() ) {
+                    Row * r = d->structuresQuery->nextRow();
+                    FetchData::StructureData * sd
+                        = new FetchData::StructureData;
+                    if ( !r->isNull( "envelope" ) )
+                        sd->envelope = r->getEString( "envelope" );
+                    if ( !r->isNull( "bodystructure" ) )
+                        sd->bodystructure = r->getEString( "bodystructure" );
+                    d->structures.insert( r->getInt( "message" ), sd );
+                }
+                if ( !d->structuresQuery->done() )
+                    return;
+            }
+        }
         d->state = 4;
         sendFetchQueries();
         if ( d->flags )
@@ -881,11 +1048,17 @@ void Fetch::sendFetchQueries()
     while ( i ) {
         Message * m = i;
         ++i;
-        if ( !m->hasAddresses() )
+        // a message whose serialized structure is cached doesn't need
+        // header data fetched just for ENVELOPE/BODYSTRUCTURE
+        bool cached = d->structures.find( m->databaseId() ) != 0;
+        if ( !m->hasAddresses() &&
+             !( cached && !d->addressesElsewhere ) )
             haveAddresses = false;
-        if ( !m->hasHeaders() )
+        if ( !m->hasHeaders() &&
+             !( cached && !d->headerElsewhere ) )
             haveHeader = false;
-        if ( !m->hasBytesAndLines() )
+        if ( !m->hasBytesAndLines() &&
+             !( cached && !d->partNumbersElsewhere ) )
             havePartNumbers = false;
         if ( !m->hasBodies() )
             haveBody = false;
@@ -895,18 +1068,28 @@ void Fetch::sendFetchQueries()
     }
 
     Fetcher * f = new Fetcher( l, this, imap() );
+    if ( d->headerFields )
+        f->setHeaderFields( *d->headerFields );
     if ( d->needsAddresses && !haveAddresses )
         f->fetch( Fetcher::Addresses );
     if ( d->needsHeader && !haveHeader )
         f->fetch( Fetcher::OtherHeader );
-    if ( d->needsBody && !haveBody )
+    if ( d->needsBody && !haveBody ) {
         f->fetch( Fetcher::Body );
+        if ( d->bodyWindow )
+            f->setBodyWindow( d->bodyWindow );
+    }
     if ( ( d->rfc822size || d->internaldate ||
            d->databaseId || d->threadId ) && !haveTrivia )
         f->fetch( Fetcher::Trivia );
     if ( d->needsPartNumbers && !havePartNumbers )
         f->fetch( Fetcher::PartNumbers );
     f->execute();
+
+    // if the client is walking the mailbox, warm the cache for its
+    // next command while this response is being sent. a client
+    // fetching partial previews doesn't want whole bodies read ahead.
+    session()->readAhead( d->set, d->needsBody && !d->bodyWindow );
 }
 
 
@@ -1124,12 +1307,21 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
         l.append( "FLAGS (" + flagList( uid ) + ")" );
     if ( d->internaldate )
         l.append( "INTERNALDATE " + internalDate( m ) );
-    if ( d->envelope )
-        l.append( "ENVELOPE " + envelope( m ) );
+    FetchData::StructureData * sd = d->structures.find( m->databaseId() );
+    if ( d->envelope ) {
+        if ( sd && !sd->envelope.isEmpty() )
+            l.append( "ENVELOPE " + sd->envelope );
+        else
+            l.append( "ENVELOPE " + envelope( m ) );
+    }
     if ( d->body )
         l.append( "BODY " + bodyStructure( m, false ) );
-    if ( d->bodystructure )
-        l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
+    if ( d->bodystructure ) {
+        if ( sd && !sd->bodystructure.isEmpty() )
+            l.append( "BODYSTRUCTURE " + sd->bodystructure );
+        else
+            l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
+    }
     if ( d->annotation )
         l.append( "ANNOTATION " + annotation( imap()->user(), uid,
                                               d->entries, d->attribs ) );
@@ -1190,154 +1382,12 @@ EString Fetch::internalDate( Message * m )
 }
 
 
-static EString hf( Header * f, HeaderField::Type t, bool unicodable )
-{
-    List<Address> * a = f->addresses( t );
-    if ( !a || a->isEmpty() )
-        return "NIL ";
-    EString r;
-    r.reserve( 50 );
-    r.append( "(" );
-    List<Address>::Iterator it( a );
-    while ( it ) {
-        r.append( "(" );
-        if ( it->type() == Address::EmptyGroup ) {
-            r.append( "NIL NIL " );
-            r.append( Command::imapQuoted( it->name( !unicodable ),
-                                           Command::NString ) );
-            r.append( " NIL)(NIL NIL NIL NIL" );
-        } else if ( it->type() == Address::Local ||
-                    it->type() == Address::Normal ) {
-            UString u = it->uname();
-            EString eu;
-            if ( u.isAscii() || unicodable )
-                eu = u.simplified().utf8();
-            else
-                eu = HeaderField::encodePhrase( u );
-            r.append( Command::imapQuoted( eu, Command::NString ) );
-            r.append( " NIL " );
-            if ( unicodable ||
-                 ( it->localpart().isAscii() && it->domain().isAscii() ) ) {
-                r.append( Command::imapQuoted( it->localpart().utf8(),
-                                               Command::NString ) );
-                r.append( " " );
-                if ( it->domain().isEmpty() )
-                    r.append( "\" \"" ); // RFC 3501, page 77 near bottom
-                else
-                    r.append( Command::imapQuoted( it->domain().utf8(),
-                                                   Command::NString ) );
-            }
-            else {
-                r.append( "noreply unicode-needed.invalid" );
-            }
-        }
-        r.append( ")" );
-        ++it;
-    }
-    r.append( ") " );
-    return r;
-}
-
-
 /*! Returns the IMAP envelope for \a m. */
 
 EString Fetch::envelope( Message * m )
 {
-    Header * h = m->header();
-
-    // envelope = "(" env-date SP env-subject SP env-from SP
-    //                env-sender SP env-reply-to SP env-to SP env-cc SP
-    //                env-bcc SP env-in-reply-to SP env-message-id ")"
-
-    EString r;
-    r.reserve( 300 );
-    r.append( "(" );
-
-    Date * date = h->date();
-    if ( date )
-        r.append( imapQuoted( date->rfc822(), NString ) );
-    else
-        r.append( "NIL" );
-    r.append( " " );
-
-    r.append( imapQuoted( h->subject(), NString ) + " " );
-    bool unicode = imap()->clientSupports( IMAP::Unicode );
-    r.append( hf( h, HeaderField::From, unicode ) );
-    r.append( hf( h, HeaderField::Sender, unicode ) );
-    r.append( hf( h, HeaderField::ReplyTo, unicode ) );
-    r.append( hf( h, HeaderField::To, unicode ) );
-    r.append( hf( h, HeaderField::Cc, unicode ) );
-    r.append( hf( h, HeaderField::Bcc, unicode ) );
-    r.append( imapQuoted( h->inReplyTo(), NString ) + " " );
-    r.append( imapQuoted( h->messageId(), NString ) );
-
-    r.append( ")" );
-    return r;
-}
-
-
-static EString parameterEString( MimeField *mf )
-{
-    EStringList *p = 0;
-
-    if ( mf )
-        p = mf->parameters();
-    if ( !mf || !p || p->isEmpty() )
-        return "NIL";
-
-    EStringList l;
-    EStringList::Iterator it( p );
-    while ( it ) {
-        l.append( Command::imapQuoted( *it ) );
-        l.append( Command::imapQuoted( mf->parameter( *it ) ) );
-        ++it;
-    }
-
-    EString r = l.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
-}
-
-
-static EString dispositionEString( ContentDisposition *cd )
-{
-    if ( !cd )
-        return "NIL";
-
-    EString s;
-    switch ( cd->disposition() ) {
-    case ContentDisposition::Inline:
-        s = "inline";
-        break;
-    case ContentDisposition::Attachment:
-        s = "attachment";
-        break;
-    }
-
-    return "(\"" + s + "\" " + parameterEString( cd ) + ")";
-}
-
-
-static EString languageEString( ContentLanguage *cl )
-{
-    if ( !cl )
-        return "NIL";
-
-    EStringList m;
-    const EStringList *l = cl->languages();
-    EStringList::Iterator it( l );
-    while ( it ) {
-        m.append( Command::imapQuoted( *it ) );
-        ++it;
-    }
-
-    if ( l->count() == 1 )
-        return *m.first();
-    EString r = m.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
+    return ImapStructure::envelope( m,
+                                    imap()->clientSupports( IMAP::Unicode ) );
 }
 
 
@@ -1348,153 +1398,8 @@ static EString languageEString( ContentLanguage *cl )
 
 EString Fetch::bodyStructure( Multipart * m, bool extended )
 {
-    EString r;
-    bool isSigned = false;
-    Multipart * ancestor = m;
-    while ( ancestor->parent() != NULL )
-        ancestor = ancestor->parent();
-    if ( ancestor->isMessage() ) {
-        Message *msg = (Message *)ancestor;
-        if ( msg->hasPGPsignedPart() ) {
-            ::log( "Fetch::bodyStructure - signed message", Log::Debug );
-            isSigned = true;
-        }
-    }
-
-    Header * hdr = m->header();
-    ContentType * ct = hdr->contentType();
-    if ( ct && ct->type() == "multipart" ) {
-        EStringList children;
-        List< Bodypart >::Iterator it( m->children() );
-        if ( ( m == ancestor ) && isSigned ) {  // if top level, consider raw part
-            if ( !extended ) {
-                log( "Fetch::bodyStructure - append raw part", Log::Debug );
-                children.append( bodyStructure( it, extended ) );
-                uint i;
-                for ( i = 1; i <= m->children()->count(); i++ )
-                    ++it;
-            } else {  // skip raw part
-                log( "Fetch::bodyStructure - skip raw part", Log::Debug );
-                ++it;
-            }
-        }
-        while ( it ) {
-            children.append( bodyStructure( it, extended ) );
-            ++it;
-        }
-
-        r = children.join( "" );
-        r.prepend( "(" );
-        r.append( " " );
-        r.append( imapQuoted( ct->subtype() ));
-
-        if ( extended ) {
-            r.append( " " );
-            r.append( parameterEString( ct ) );
-            r.append( " " );
-            r.append( dispositionEString( hdr->contentDisposition() ) );
-            r.append( " " );
-            r.append( languageEString( hdr->contentLanguage() ) );
-            r.append( " " );
-            r.append( imapQuoted( hdr->contentLocation(), NString ) );
-        }
-
-        r.append( ")" );
-    }
-    else {
-        r = singlePartStructure( (Bodypart*)m, extended );
-    }
-    return r;
-}
-
-
-/*! Returns the structure of the single-part bodypart \a mp.
-
-    If \a extended is true, extended BODYSTRUCTURE attributes are
-    included.
-*/
-
-EString Fetch::singlePartStructure( Multipart * mp, bool extended )
-{
-    EStringList l;
-
-    if ( !mp )
-        return "";
-
-    ContentType * ct = mp->header()->contentType();
-
-    if ( ct ) {
-        l.append( imapQuoted( ct->type() ) );
-        l.append( imapQuoted( ct->subtype() ) );
-    }
-    else {
-        // XXX: What happens to the default if this is a /digest?
-        l.append( "\"text\"" );
-        l.append( "\"plain\"" );
-    }
-
-    l.append( parameterEString( ct ) );
-    l.append( imapQuoted( mp->header()->messageId( HeaderField::ContentId ),
-                          NString ) );
-    l.append( imapQuoted( mp->header()->contentDescription(), NString ) );
-
-    if ( mp->header()->contentTransferEncoding() ) {
-        switch( mp->header()->contentTransferEncoding()->encoding() ) {
-        case EString::Binary:
-            l.append( "\"8BIT\"" ); // hm. is this entirely sound?
-            break;
-        case EString::Uuencode:
-            l.append( "\"x-uuencode\"" ); // should never happen
-            break;
-        case EString::Base64:
-            l.append( "\"BASE64\"" );
-            break;
-        case EString::QP:
-            l.append( "\"QUOTED-PRINTABLE\"" );
-            break;
-        }
-    }
-    else {
-        l.append( "\"7BIT\"" );
-    }
-
-    Bodypart * bp = 0;
-    if ( mp->isBodypart() )
-        bp = (Bodypart*)mp;
-    else if ( mp->isMessage() )
-        bp = ((Message*)mp)->children()->first();
-
-    if ( bp ) {
-        l.append( fn( bp->numEncodedBytes() ) );
-        if ( ct && ct->type() == "message" && ct->subtype() == "rfc822" ) {
-            // body-type-msg   = media-message SP body-fields SP envelope
-            //                   SP body SP body-fld-lines
-            l.append( envelope( bp->message() ) );
-            l.append( bodyStructure( bp->message(), extended ) );
-            l.append( fn ( bp->numEncodedLines() ) );
-        }
-        else if ( !ct || ct->type() == "text" ) {
-            // body-type-text  = media-text SP body-fields SP body-fld-lines
-            l.append( fn( bp->numEncodedLines() ) );
-        }
-    }
-
-    if ( extended ) {
-        EString md5;
-        HeaderField *f = mp->header()->field( HeaderField::ContentMd5 );
-        if ( f )
-            md5 = f->rfc822( false );
-
-        l.append( imapQuoted( md5, NString ) );
-        l.append( dispositionEString( mp->header()->contentDisposition() ) );
-        l.append( languageEString( mp->header()->contentLanguage() ) );
-        l.append( imapQuoted( mp->header()->contentLocation(), NString ) );
-    }
-
-    EString r = l.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
+    return ImapStructure::bodyStructure(
+        m, extended, imap()->clientSupports( IMAP::Unicode ) );
 }
 
 
@@ -1720,16 +1625,28 @@ void Fetch::pickup()
     if ( d->modseqFetcher && !d->modseqFetcher->done() )
         return;
 
+    if ( d->implicit && d->modseq && !d->annotation &&
+         !d->cachedDynamics ) {
+        d->cachedDynamics = true;
+        cacheDynamics();
+    }
+
     bool ok = true;
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
         uint uid = d->remaining.smallest();
         Message * m = d->messages.find( uid );
-        if ( d->needsAddresses && !m->hasAddresses() )
+        // as in sendFetchQueries(), cached structures stand in for
+        // header data needed only by ENVELOPE/BODYSTRUCTURE
+        bool cached = d->structures.find( m->databaseId() ) != 0;
+        if ( d->needsAddresses && !m->hasAddresses() &&
+             !( cached && !d->addressesElsewhere ) )
             ok = false;
-        if ( d->needsHeader && !m->hasHeaders() )
+        if ( d->needsHeader && !m->hasHeaders() &&
+             !( cached && !d->headerElsewhere ) )
             ok = false;
-        if ( d->needsPartNumbers && !m->hasBytesAndLines() )
+        if ( d->needsPartNumbers && !m->hasBytesAndLines() &&
+             !( cached && !d->partNumbersElsewhere ) )
             ok = false;
         if ( d->needsBody && !m->hasBodies() )
             ok = false;
@@ -1816,6 +1733,89 @@ Message * Fetch::message( uint uid ) const
 }
 
 
+/*! Looks for this fetch's dynamic data (flags and modseqs) in the
+    per-mailbox cache left behind by another session's implicit
+    fetch. Returns true and fills in the data if the cache covers all
+    of d->set, and false if any of it has to be fetched.
+*/
+
+bool Fetch::checkDynamicsCache()
+{
+    Mailbox * mb = session()->mailbox();
+
+    IntegerSet s( d->set );
+    while ( !s.isEmpty() ) {
+        uint uid = s.smallest();
+        s.remove( uid );
+        if ( !DynamicsCache::find( mb, uid ) )
+            return false;
+    }
+
+    s = d->set;
+    while ( !s.isEmpty() ) {
+        uint uid = s.smallest();
+        s.remove( uid );
+        DynamicsCacheEntry * e = DynamicsCache::find( mb, uid );
+        if ( e->modseq <= d->changedSince ) {
+            // the same filter the query would have applied
+            d->set.remove( uid );
+            continue;
+        }
+        Message * m = 0;
+        if ( d->bodyWindow || d->headerFields )
+            m = new Message;
+        else
+            m = MessageCache::provide( mb, uid );
+        m->setDatabaseId( e->message );
+        d->messages.insert( uid, m );
+        FetchData::DynamicData * dd = new FetchData::DynamicData;
+        dd->modseq = e->modseq;
+        EStringList::Iterator f( e->flags );
+        while ( f ) {
+            dd->flags.insert( f->lower(), new EString( *f ) );
+            ++f;
+        }
+        d->dynamics.insert( uid, dd );
+    }
+
+    log( "Serving implicit fetch for " + fn( d->set.count() ) +
+         " messages from the dynamics cache", Log::Debug );
+    d->cachedDynamics = true;
+    return true;
+}
+
+
+/*! Records the dynamic data this implicit fetch retrieved, so that
+    the other sessions watching the same mailbox can answer their
+    clients without queries of their own. Only called when the data
+    is complete, ie. when all the fetchers are done.
+*/
+
+void Fetch::cacheDynamics()
+{
+    Mailbox * mb = session()->mailbox();
+
+    IntegerSet s( d->set );
+    while ( !s.isEmpty() ) {
+        uint uid = s.smallest();
+        s.remove( uid );
+        FetchData::DynamicData * dd = d->dynamics.find( uid );
+        Message * m = d->messages.find( uid );
+        if ( !dd || !dd->modseq || !m || !m->databaseId() )
+            continue;
+        DynamicsCacheEntry * e = new DynamicsCacheEntry;
+        e->message = m->databaseId();
+        e->modseq = dd->modseq;
+        Dict<EString>::Iterator f( dd->flags );
+        while ( f ) {
+            e->flags.append( new EString( *f ) );
+            ++f;
+        }
+        DynamicsCache::insert( mb, uid, e );
+    }
+}
+
+
 /*! Sends a query to retrieve all flags. */
 
 void Fetch::sendFlagQuery()
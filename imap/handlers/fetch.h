@@ -43,6 +43,8 @@ private:
     void parseBody( bool );
     void parseAnnotation();
     void sendFetchQueries();
+    bool checkDynamicsCache();
+    void cacheDynamics();
     void sendFlagQuery();
     void sendAnnotationsQuery();
     void sendModSeqQuery();
@@ -50,7 +52,6 @@ private:
     EString internalDate( Message * );
     EString envelope( Message * );
     EString bodyStructure( Multipart *, bool );
-    EString singlePartStructure( Multipart *, bool );
 
     void pickup();
 
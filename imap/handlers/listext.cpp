@@ -9,6 +9,7 @@
 #include "imapparser.h"
 #include "address.h"
 #include "mailbox.h"
+#include "buffer.h"
 #include "query.h"
 #include "dict.h"
 #include "user.h"
@@ -20,19 +21,24 @@ class ListextData
 {
 public:
     ListextData():
-        selectQuery( 0 ), permissionsQuery( 0 ),
+        selectQuery( 0 ), permissionsQuery( 0 ), statusQuery( 0 ),
         reference( 0 ),
         state( 0 ),
         extended( false ),
         returnSubscribed( false ), returnChildren( false ),
-        returnSpecialUse( false ),
+        returnSpecialUse( false ), returnStatus( false ),
         selectSubscribed( false ), selectRemote( false ),
         selectRecursiveMatch( false ),
-        selectSpecialUse( false )
+        selectSpecialUse( false ),
+        statusMessages( false ), statusRecent( false ),
+        statusUidnext( false ), statusUidvalidity( false ),
+        statusUnseen( false ), statusModseq( false ),
+        statusQueried( false )
     {}
 
     Query * selectQuery;
     Query * permissionsQuery;
+    Query * statusQuery;
     Mailbox * reference;
     EString referenceName;
     UStringList patterns;
@@ -70,10 +76,30 @@ public:
     bool returnSubscribed;
     bool returnChildren;
     bool returnSpecialUse;
+    bool returnStatus;
     bool selectSubscribed;
     bool selectRemote;
     bool selectRecursiveMatch;
     bool selectSpecialUse;
+    bool statusMessages;
+    bool statusRecent;
+    bool statusUidnext;
+    bool statusUidvalidity;
+    bool statusUnseen;
+    bool statusModseq;
+    bool statusQueried;
+
+    class StatusItem
+        : public Garbage
+    {
+    public:
+        StatusItem(): messages( 0 ), unseen( 0 ), recent( 0 ) {}
+        uint messages;
+        uint unseen;
+        uint recent;
+    };
+
+    Map<StatusItem> statusItems;
 };
 
 
@@ -305,6 +331,35 @@ void Listext::execute()
     }
 
     if ( d->state == 2 ) {
+        if ( d->returnStatus && !d->statusQueried &&
+             ( d->statusMessages || d->statusUnseen || d->statusRecent ) ) {
+            // one aggregated query covers the counts for every listed
+            // mailbox, so a folder-tree refresh costs one round trip
+            // rather than one per mailbox
+            d->statusQueried = true;
+            IntegerSet ids;
+            List<ListextData::Response>::Iterator i( d->responses );
+            while ( i ) {
+                Mailbox * m = i->mailbox;
+                ++i;
+                if ( m->id() && !m->deleted() )
+                    ids.add( m->id() );
+            }
+            if ( !ids.isEmpty() ) {
+                d->statusQuery
+                    = new Query( "select mb.id, "
+                                 "mb.uidnext-mb.first_recent as recent, "
+                                 "coalesce(mc.messages,0)::int as messages, "
+                                 "coalesce(mc.unseen,0)::int as unseen "
+                                 "from mailboxes mb "
+                                 "left join mailbox_counts mc on "
+                                 "(mc.mailbox=mb.id) "
+                                 "where mb.id=any($1)", this );
+                d->statusQuery->bind( 1, ids );
+                d->statusQuery->execute();
+            }
+        }
+
         if ( !d->permissionsQuery ) {
             IntegerSet ids;
             List<ListextData::Response>::Iterator i( d->responses );
@@ -353,36 +408,64 @@ void Listext::execute()
                 }
             }
         }
+        while ( d->statusQuery && d->statusQuery->hasResults() ) {
+            Row * r = d->statusQuery->nextRow();
+            ListextData::StatusItem * si = new ListextData::StatusItem;
+            si->messages = r->getInt( "messages" );
+            si->unseen = r->getInt( "unseen" );
+            si->recent = r->getInt( "recent" );
+            d->statusItems.insert( r->getInt( "id" ), si );
+        }
         if ( d->permissionsQuery && !d->permissionsQuery->done() )
             return;
+        if ( d->statusQuery && !d->statusQuery->done() )
+            return;
         d->state = 3;
     }
 
     if ( d->state == 3 ) {
-        List<ListextData::Response>::Iterator i( d->responses );
-        while ( i ) {
-            Mailbox * m = i->mailbox;
-            if ( m->owner() == imap()->user()->id() ) {
-                respond( i->response );
+        // emit the responses in chunks, yielding to the event loop
+        // whenever the client has more unsent data than Fetcher
+        // tolerates, so that listing a six-digit number of mailboxes
+        // neither blocks the server nor buffers the entire response.
+        while ( !d->responses.isEmpty() ) {
+            if ( imap()->writeBuffer()->size() > 1024*1024 ) {
+                imap()->notifyOnDrain( this );
+                return;
             }
-            else {
-                EString r;
-                bool set = false;
-                while ( m && !set ) {
-                    ListextData::Permissions * p
-                        = d->permissions.find( m->id() );
-                    if ( p && !p->user.isEmpty() )
-                        r = p->user;
-                    else if ( p && !p->anyone.isEmpty() )
-                        r = p->anyone;
-                    if ( p && p->set )
-                        set = true;
-                    m = m->parent();
+            uint n = 0;
+            while ( n < 1024 && !d->responses.isEmpty() ) {
+                ListextData::Response * re = d->responses.shift();
+                n++;
+                Mailbox * m = re->mailbox;
+                bool visible = false;
+                if ( m->owner() == imap()->user()->id() ) {
+                    respond( re->response );
+                    visible = true;
+                }
+                else {
+                    EString r;
+                    bool set = false;
+                    while ( m && !set ) {
+                        ListextData::Permissions * p
+                            = d->permissions.find( m->id() );
+                        if ( p && !p->user.isEmpty() )
+                            r = p->user;
+                        else if ( p && !p->anyone.isEmpty() )
+                            r = p->anyone;
+                        if ( p && p->set )
+                            set = true;
+                        m = m->parent();
+                    }
+                    if ( r.contains( 'l' ) || !set ) {
+                        respond( re->response );
+                        visible = true;
+                    }
                 }
-                if ( r.contains( 'l' ) || !set )
-                    respond( i->response );
+                if ( visible && d->returnStatus )
+                    sendStatus( re->mailbox );
             }
-            ++i;
+            imap()->emitResponses();
         }
         finish();
     }
@@ -400,11 +483,43 @@ void Listext::addReturnOption( const EString & option )
         d->returnChildren = true;
     else if ( option == "special-use" )
         d->returnSpecialUse = true;
+    else if ( option == "status" ) {
+        // RFC 5819: "STATUS" SP "(" status-att *(SP status-att) ")"
+        d->returnStatus = true;
+        require( " (" );
+        addStatusItem( atom().lower() );
+        while ( present( " " ) )
+            addStatusItem( atom().lower() );
+        require( ")" );
+    }
     else
         error( Bad, "Unknown return option: " + option );
 }
 
 
+/*! Parses the status \a item requested via the RFC 5819 status return
+    option, or emits a suitable error. \a item must be lower-cased.
+*/
+
+void Listext::addStatusItem( const EString & item )
+{
+    if ( item == "messages" )
+        d->statusMessages = true;
+    else if ( item == "recent" )
+        d->statusRecent = true;
+    else if ( item == "uidnext" )
+        d->statusUidnext = true;
+    else if ( item == "uidvalidity" )
+        d->statusUidvalidity = true;
+    else if ( item == "unseen" )
+        d->statusUnseen = true;
+    else if ( item == "highestmodseq" )
+        d->statusModseq = true;
+    else
+        error( Bad, "Unknown STATUS item: " + item );
+}
+
+
 /*! Parses the selection \a option, or emits a suitable error. \a
     option must be lower-cased. */
 
@@ -478,6 +593,43 @@ void Listext::makeResponse( Row * row )
 }
 
 
+/*! Sends the RFC 5819 STATUS response for \a m, using the counts
+    harvested by the aggregated query and what the in-memory Mailbox
+    knows. Does nothing for mailboxes that cannot be selected.
+*/
+
+void Listext::sendStatus( Mailbox * m )
+{
+    if ( !m->id() || m->deleted() )
+        return;
+
+    ListextData::StatusItem * si = d->statusItems.find( m->id() );
+
+    EStringList status;
+    if ( d->statusMessages && si )
+        status.append( "MESSAGES " + fn( si->messages ) );
+    if ( d->statusRecent && si )
+        status.append( "RECENT " + fn( si->recent ) );
+    if ( d->statusUidnext )
+        status.append( "UIDNEXT " + fn( m->uidnext() ) );
+    if ( d->statusUidvalidity )
+        status.append( "UIDVALIDITY " + fn( m->uidvalidity() ) );
+    if ( d->statusUnseen && si )
+        status.append( "UNSEEN " + fn( si->unseen ) );
+    if ( d->statusModseq ) {
+        int64 hms = m->nextModSeq();
+        // as in Status: an empty mailbox has the same HMS before and
+        // after its first message
+        if ( hms > 1 )
+            hms--;
+        status.append( "HIGHESTMODSEQ " + fn( hms ) );
+    }
+
+    respond( "STATUS " + imapQuoted( m ) +
+             " (" + status.join( " " ) + ")" );
+}
+
+
 /*! Parses a reference name, and logs an error if something is wrong. */
 
 void Listext::reference()
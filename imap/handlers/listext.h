@@ -20,8 +20,10 @@ public:
 private:
     void addReturnOption( const EString & );
     void addSelectOption( const EString & );
+    void addStatusItem( const EString & );
 
     void makeResponse( class Row * );
+    void sendStatus( Mailbox * );
 
     void reference();
 
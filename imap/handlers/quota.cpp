@@ -17,6 +17,10 @@
     usually much bigger than the actual number of kilobytes used by
     the database for storing the mail (at one site by a factor of
     four), but it'll do for reporting usage.
+
+    The sums are maintained by triggers (see mailbox_counts), so
+    answering costs one small row per mailbox the user owns, not a
+    scan over all the messages.
 */
 
 void GetQuota::parse()
@@ -32,11 +36,10 @@ void GetQuota::parse()
 void GetQuota::execute()
 {
     if ( !q ) {
-        q = new Query( "select count(rfc822size) as c, "
-                       "coalesce(sum(rfc822size::bigint),0)::bigint/1024 as s "
-                       "from messages m"
-                       " join mailbox_messages mm on (m.id=mm.message)"
-                       " join mailboxes mb on (mm.mailbox=mb.id)"
+        q = new Query( "select coalesce(sum(mc.messages),0)::bigint as c, "
+                       "coalesce(sum(mc.size),0)::bigint/1024 as s "
+                       "from mailbox_counts mc"
+                       " join mailboxes mb on (mc.mailbox=mb.id)"
                        " where mb.owner=$1", this );
         q->bind( 1, imap()->user()->id() );
         q->execute();
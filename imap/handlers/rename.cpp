@@ -185,6 +185,8 @@ void Rename::execute()
             q->bind( 1, d->from->name() );
             q->bind( 2, imap()->user()->id() );
             transaction()->enqueue( q );
+            transaction()->enqueue(
+                new Query( "notify users_updated", 0 ) );
         }
     }
 
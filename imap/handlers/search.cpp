@@ -6,6 +6,10 @@
 #include "imapparser.h"
 #include "annotation.h"
 #include "integerset.h"
+#include "cache.h"
+#include "user.h"
+#include "dict.h"
+#include "map.h"
 #include "listext.h"
 #include "mailbox.h"
 #include "message.h"
@@ -36,7 +40,8 @@ public:
           firstmodseq( 1 ), lastmodseq( 1 ),
           returnModseq( false ),
           returnAll( false ), returnCount( false ),
-          returnMax( false ), returnMin( false )
+          returnMax( false ), returnMin( false ),
+          cacheModSeq( 0 )
     {}
 
     bool uid;
@@ -58,8 +63,35 @@ public:
     bool returnCount;
     bool returnMax;
     bool returnMin;
+
+    EString cacheKey;
+    int64 cacheModSeq;
+};
+
+
+class SearchCache
+    : public Cache
+{
+public:
+    SearchCache(): Cache( 5 ) {}
+
+    void clear() { results.clear(); }
+
+    class Result
+        : public Garbage
+    {
+    public:
+        Result(): Garbage(), nextModSeq( 0 ) {}
+        int64 nextModSeq;
+        IntegerSet matches;
+    };
+
+    // mailbox id -> canonical selector string -> result
+    Map< Dict<Result> > results;
 };
 
+static SearchCache * searchCache = 0;
+
 
 /*! \class Search search.h
     Finds messages matching some criteria (RFC 3501 section 6.4.4)
@@ -441,12 +473,43 @@ void Search::execute()
 
     if ( !d->query ) {
         considerCache();
+        if ( !d->done && !d->returnModseq && s &&
+             !d->root->usesRecent() && !d->root->timeSensitive() ) {
+            // clients repeat identical searches, e.g. a saved-search
+            // poll every 30 seconds; on a quiescent mailbox those can
+            // be answered from the result cache. \recent searches
+            // can't be: the selector compiles to this session's
+            // recent UIDs, while its string() (our cache key) and
+            // the mailbox's modseq see nothing session-specific.
+            // older/younger can't either: their SQL binds an
+            // absolute time computed at query-build time, but the
+            // key renders only the relative duration, and the mere
+            // passage of time doesn't bump the mailbox's modseq.
+            if ( !::searchCache )
+                ::searchCache = new SearchCache;
+            d->cacheKey = d->root->string();
+            if ( imap()->user() )
+                d->cacheKey.append( " u" + fn( imap()->user()->id() ) );
+            Dict<SearchCache::Result> * m
+                = ::searchCache->results.find( s->mailbox()->id() );
+            SearchCache::Result * r = 0;
+            if ( m )
+                r = m->find( d->cacheKey );
+            if ( r && r->nextModSeq == s->mailbox()->nextModSeq() ) {
+                log( "Answered search from the result cache",
+                     Log::Debug );
+                d->matches = r->matches;
+                d->done = true;
+            }
+        }
         if ( d->done ) {
             sendResponse();
             finish();
             return;
         }
 
+        if ( s )
+            d->cacheModSeq = s->mailbox()->nextModSeq();
         d->query = d->root->query( imap()->user(), s->mailbox(),
                                    s, this, false );
         d->query->execute();
@@ -475,6 +538,21 @@ void Search::execute()
         }
     }
 
+    if ( s && !d->cacheKey.isEmpty() &&
+         d->cacheModSeq == s->mailbox()->nextModSeq() ) {
+        // remember the result for repeats of the same search
+        Dict<SearchCache::Result> * m
+            = ::searchCache->results.find( s->mailbox()->id() );
+        if ( !m ) {
+            m = new Dict<SearchCache::Result>;
+            ::searchCache->results.insert( s->mailbox()->id(), m );
+        }
+        SearchCache::Result * r = new SearchCache::Result;
+        r->nextModSeq = d->cacheModSeq;
+        r->matches = d->matches;
+        m->insert( d->cacheKey, r );
+    }
+
     sendResponse();
     finish();
 }
@@ -228,6 +228,14 @@ void Select::execute()
             d->readOnly = true;
     }
 
+    if ( d->qresync && d->lastUidValidity != d->mailbox->uidvalidity() ) {
+        // the client's cached state belongs to another incarnation of
+        // this mailbox, so we can't use it for resynchronisation. the
+        // client will see the new UIDVALIDITY and discard its cache.
+        d->lastModSeq = 0;
+        d->knownUids.clear();
+    }
+
     if ( d->lastModSeq < 1 )
         d->lastModSeq = d->mailbox->nextModSeq() - 1;
 
@@ -240,13 +240,11 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
                  c->reverse );
         break;
     case From:
+        // the Injector precomputes the first From localpart per
+        // message, so no address_fields join is needed
         addJoin( t,
-                 "left join address_fields sfaf on "
-                 "(mm.message=sfaf.message and "
-                 " sfaf.part='' and sfaf.number=0 and"
-                 " sfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sfa on (sfaf.address=sfa.id) ",
-                 "sfa.localpart",
+                 "left join sort_keys sfk on (mm.message=sfk.message) ",
+                 "sfk.sfrom",
                  c->reverse );
         break;
     case DisplayFrom:
@@ -282,11 +280,11 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
                  c->reverse );
         break;
     case Subject:
+        // sort_keys holds the RFC 5256 base subject, computed at
+        // injection time
         addJoin( t,
-                 "left join header_fields sshf on "
-                 "(mm.message=sshf.message and sshf.field=" +
-                 fn( HeaderField::Subject ) + ") ",
-                 "sshf.value",
+                 "left join sort_keys ssk on (mm.message=ssk.message) ",
+                 "ssk.subject",
                  c->reverse );
         break;
     case To:
@@ -21,13 +21,12 @@ public:
         recent( false ), unseen( false ),
         modseq( false ),
         mailbox( 0 ),
-        unseenCount( 0 ), messageCount( 0 ), recentCount( 0 ),
+        counts( 0 ), recentCount( 0 ),
         cacheState( 0 )
         {}
     bool messages, uidnext, uidvalidity, recent, unseen, modseq;
     Mailbox * mailbox;
-    Query * unseenCount;
-    Query * messageCount;
+    Query * counts;
     Query * recentCount;
     uint cacheState;
 
@@ -189,10 +188,8 @@ void Status::execute()
 
     // second part. see if anything has happened, and feed the cache if
     // so. make sure we feed the cache at once.
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
+    if ( d->counts || d->recentCount ) {
+        if ( d->counts && !d->counts->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
@@ -200,12 +197,14 @@ void Status::execute()
     if ( !::cache )
         ::cache = new StatusData::StatusCache;
 
-    if ( d->unseenCount ) {
-        while ( d->unseenCount->hasResults() ) {
-            Row * r = d->unseenCount->nextRow();
+    if ( d->counts ) {
+        while ( d->counts->hasResults() ) {
+            Row * r = d->counts->nextRow();
             StatusData::CacheItem * ci =
                 ::cache->find( r->getInt( "mailbox" ) );
             if ( ci ) {
+                ci->hasMessages = true;
+                ci->messages = r->getInt( "messages" );
                 ci->hasUnseen = true;
                 ci->unseen = r->getInt( "unseen" );
             }
@@ -222,17 +221,6 @@ void Status::execute()
             }
         }
     }
-    if ( d->messageCount ) {
-        while ( d->messageCount->hasResults() ) {
-            Row * r = d->messageCount->nextRow();
-            StatusData::CacheItem * ci =
-                ::cache->find( r->getInt( "mailbox" ) );
-            if ( ci ) {
-                ci->hasMessages = true;
-                ci->messages = r->getInt( "messages" );
-            }
-        }
-    }
 
     // third part. are we processing the first command in a STATUS
     // loop? if so, see if we ought to preload the cache.
@@ -254,17 +242,20 @@ void Status::execute()
             }
             if ( mailboxes.count() < 3 )
                 d->cacheState = 3;
+            else
+                d->cacheState = 1;
         }
         if ( d->cacheState == 1 ) {
-            // state 1: send queries
-            if ( d->unseen ) {
-                d->unseenCount
-                    = new Query( "select mailbox, count(uid)::int as unseen "
-                                 "from mailbox_messages "
-                                 "where mailbox=any($1) and not seen "
-                                 "group by mailbox", this );
-                d->unseenCount->bind( 1, mailboxes );
-                d->unseenCount->execute();
+            // state 1: send queries. the triggers on mailbox_messages
+            // keep mailbox_counts up to date, so one indexed query
+            // covers both MESSAGES and UNSEEN for all the mailboxes.
+            if ( d->unseen || d->messages ) {
+                d->counts
+                    = new Query( "select mailbox, messages, unseen "
+                                 "from mailbox_counts "
+                                 "where mailbox=any($1)", this );
+                d->counts->bind( 1, mailboxes );
+                d->counts->execute();
             }
             if ( d->recent ) {
                 d->recentCount
@@ -274,35 +265,31 @@ void Status::execute()
                 d->recentCount->bind( 1, mailboxes );
                 d->recentCount->execute();
             }
-            if ( d->messages ) {
-                d->messageCount
-                    = new Query( "select count(*)::int as messages, mailbox "
-                                 "from mailbox_messages where mailbox=any($1) "
-                                 "group by mailbox", this );
-                d->messageCount->bind( 1, mailboxes );
-                d->messageCount->execute();
-            }
             d->cacheState = 2;
         }
         if ( d->cacheState == 2 ) {
-            // state 2: mark the cache as complete.
+            // state 2: once the rows have been harvested above, mark
+            // the cache as complete.
+            if ( d->counts && !d->counts->done() )
+                return;
+            if ( d->recentCount && !d->recentCount->done() )
+                return;
             IntegerSet mailboxes;
             List<Mailbox>::Iterator i( mailboxGroup()->contents() );
             while ( i ) {
                 StatusData::CacheItem * ci = ::cache->find( i->id() );
-                if ( ci && d->unseenCount )
+                if ( ci && d->counts ) {
                     ci->hasUnseen = true;
+                    ci->hasMessages = true;
+                }
                 if ( ci && d->recentCount )
                     ci->hasRecent = true;
-                if ( ci && d->messageCount )
-                    ci->hasMessages = true;
                 ++i;
             }
             // and drop the queries
             d->cacheState = 3;
-            d->unseenCount = 0;
+            d->counts = 0;
             d->recentCount = 0;
-            d->messageCount = 0;
         }
     }
 
@@ -310,14 +297,17 @@ void Status::execute()
     StatusData::CacheItem * i = ::cache->provide( d->mailbox );
 
     // fourth part: send individual queries if there's anything we need
-    if ( d->unseen && !d->unseenCount && !i->hasUnseen ) {
-        d->unseenCount
+    if ( !d->counts &&
+         ( ( d->unseen && !i->hasUnseen ) ||
+           ( d->messages && d->mailbox != current && !i->hasMessages ) ) ) {
+        d->counts
             = new Query( "select $1::int as mailbox, "
-                         "count(uid)::int as unseen "
-                         "from mailbox_messages "
-                         "where mailbox=$1 and not seen", this );
-        d->unseenCount->bind( 1, d->mailbox->id() );
-        d->unseenCount->execute();
+                         "coalesce((select messages from mailbox_counts "
+                         "where mailbox=$1),0)::int as messages, "
+                         "coalesce((select unseen from mailbox_counts "
+                         "where mailbox=$1),0)::int as unseen", this );
+        d->counts->bind( 1, d->mailbox->id() );
+        d->counts->execute();
     }
 
     if ( !d->recent ) {
@@ -338,28 +328,8 @@ void Status::execute()
         d->recentCount->execute();
     }
 
-    if ( !d->messages ) {
-        // we don't need to collect
-    }
-    else if ( d->mailbox == current ) {
-        // we'll pick it up
-    }
-    else if ( i->hasMessages ) {
-        // the cache has it
-    }
-    else if ( d->messages && !d->messageCount ) {
-        d->messageCount
-            = new Query( "select count(*)::int as messages, "
-                         "$1::int as mailbox "
-                         "from mailbox_messages where mailbox=$1", this );
-        d->messageCount->bind( 1, d->mailbox->id() );
-        d->messageCount->execute();
-    }
-
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
+    if ( d->counts || d->recentCount ) {
+        if ( d->counts && !d->counts->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
@@ -217,7 +217,7 @@ void Store::parse()
     if ( !ok() )
         return;
     EString l( "Store " );
-    l.append( fn( d->specified.count() ) );
+    l.appendNumber( d->specified.count() );
     switch( d->op ) {
     case StoreData::AddFlags:
         l.append( ": add flags " );
@@ -750,9 +750,6 @@ bool Store::addFlags()
     uint mailbox = d->session->mailbox()->id();
 
     bool work = false;
-    Query * q = new Query( "copy flags (mailbox, uid, flag) "
-                           "from stdin with binary", this );
-
     EStringList::Iterator it( d->flagNames );
     while ( it ) {
         IntegerSet s( d->s );
@@ -775,21 +772,23 @@ bool Store::addFlags()
             if ( p )
                 s.remove( *p );
             if ( !s.isEmpty() ) {
+                // one set-based insert per flag, binding the uid set
+                // as an array, instead of streaming a row per message
                 work = true;
-                int c = s.count();
-                while ( c ) {
-                    uint uid = s.value( c );
-                    c--;
-                    q->bind( 1, mailbox );
-                    q->bind( 2, uid );
-                    q->bind( 3, flag );
-                    q->submitLine();
-                }
+                d->changedUids.add( s );
+                Query * q = new Query( "insert into flags "
+                                       "(mailbox, uid, flag) "
+                                       "select mailbox, uid, $3 "
+                                       "from mailbox_messages "
+                                       "where mailbox=$1 and uid=any($2)",
+                                       0 );
+                q->bind( 1, mailbox );
+                q->bind( 2, s );
+                q->bind( 3, flag );
+                transaction()->enqueue( q );
             }
         }
     }
-    if ( work )
-        transaction()->enqueue( q );
 
     return work;
 }
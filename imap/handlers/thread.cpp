@@ -145,8 +145,10 @@ void Thread::execute()
         want->append( "message" );
         want->append( "m.idate" );
         want->append( "m.thread_root" );
-        want->append( "tmid.value as messageid" );
-        want->append( "tref.value as references" );
+        if ( d->threadAlg != ThreadData::Refs ) {
+            want->append( "tmid.value as messageid" );
+            want->append( "tref.value as references" );
+        }
         EString ts;
         if ( d->threadAlg == ThreadData::References ) {
             want->append( "tsubj.value as subject" );
@@ -159,23 +161,29 @@ void Thread::execute()
         d->find = d->s->query( imap()->user(),
                                d->session->mailbox(), d->session,
                                this, false, want );
-        EString j = d->find->string();
-
-        // we need to get the References and Message-Id fields as well
-        const char * x = "left join";
-        if ( !j.contains( x ) )
-            x = "where";
-        j.replace( x,
-                   "left join header_fields tref on"
-                   " (m.id=tref.message and"
-                   " tref.field=" + fn( HeaderField::References ) +
-                   " and tref.part='') "
-                   "left join header_fields tmid on"
-                   " (m.id=tmid.message and"
-                   " tmid.field=" + fn( HeaderField::MessageId ) +
-                   " and tmid.part='') " + ts + x );
-
-        d->find->setString( j );
+
+        // refs threads using just thread_root, which the Injector
+        // keeps up to date as messages arrive, so it doesn't need to
+        // look at any header fields
+        if ( d->threadAlg != ThreadData::Refs ) {
+            EString j = d->find->string();
+
+            // we need to get the References and Message-Id fields as well
+            const char * x = "left join";
+            if ( !j.contains( x ) )
+                x = "where";
+            j.replace( x,
+                       "left join header_fields tref on"
+                       " (m.id=tref.message and"
+                       " tref.field=" + fn( HeaderField::References ) +
+                       " and tref.part='') "
+                       "left join header_fields tmid on"
+                       " (m.id=tmid.message and"
+                       " tmid.field=" + fn( HeaderField::MessageId ) +
+                       " and tmid.part='') " + ts + x );
+
+            d->find->setString( j );
+        }
 
         d->find->execute();
         return;
@@ -188,16 +196,20 @@ void Thread::execute()
         n->idate = r->getInt( "idate" );
         if ( !r->isNull( "thread_root" ) )
             n->threadRoot = r->getInt( "thread_root" );
-        if ( !r->isNull( "references" ) )
-            n->references = r->getEString( "references" );
-        if ( !r->isNull( "messageid" ) )
-            n->messageId = r->getEString( "messageid" );
+        if ( d->threadAlg != ThreadData::Refs ) {
+            if ( !r->isNull( "references" ) )
+                n->references = r->getEString( "references" );
+            if ( !r->isNull( "messageid" ) )
+                n->messageId = r->getEString( "messageid" );
+        }
         if ( !r->isNull( "subject" ) )
             n->subject = Message::baseSubject( r->getUString( "subject" ) );
 
         d->result.append( n );
         if ( !n->messageId.isEmpty() )
             d->nodes.insert( n->messageId, n );
+        else if ( d->threadAlg == ThreadData::Refs )
+            d->nodes.insert( fn( n->uid ), n );
     }
 
     if ( !d->find->done() )
@@ -261,7 +273,7 @@ void Thread::execute()
         while ( i ) {
             ThreadData::Node * n = i;
             ++i;
-            if ( !n->parent ) {
+            if ( !n->parent && n->threadRoot ) {
                 ThreadData::Node * found = roots.find( n->threadRoot );
                 if ( !found )
                     roots.insert( n->threadRoot, n );
@@ -21,6 +21,10 @@
 #include "database.h"
 #include "eventmap.h"
 #include "command.h"
+#include "messagecache.h"
+#include "fetcher.h"
+#include "message.h"
+#include "server.h"
 #include "cache.h"
 #include "date.h"
 #include "user.h"
@@ -44,6 +48,7 @@ public:
           bytesArrived( 0 ),
           eventMap( new EventMap ),
           lastBadTime( 0 ),
+          started( (uint)::time( 0 ) ),
           nextOkTime( 0 )
     {
         uint i = 0;
@@ -86,6 +91,7 @@ public:
     EventMap * eventMap;
 
     uint lastBadTime;
+    uint started;
 
     class BadBouncer
         : public EventHandler
@@ -282,6 +288,7 @@ void IMAP::parse()
                 if ( n <= ImapParser::literalSizeLimit() ) {
                     d->readingLiteral = true;
                     d->literalSize = n;
+                    d->str.reserve( d->str.length() + n );
                     if ( !plus )
                         enqueue( "+ reading literal\r\n" );
                 }
@@ -294,12 +301,22 @@ void IMAP::parse()
             }
         }
         else if ( d->readingLiteral ) {
-            // Have we finished reading a complete literal?
-            if ( r->size() < d->literalSize )
+            // Consume the literal as it arrives, so that a large
+            // APPEND doesn't sit in the read buffer in full while
+            // d->str holds a second copy.
+            uint n = r->size();
+            if ( n > d->literalSize )
+                n = d->literalSize;
+            if ( n ) {
+                d->str.append( r->string( n ) );
+                r->remove( n );
+                d->literalSize -= n;
+            }
+
+            // Have we finished reading the complete literal?
+            if ( d->literalSize )
                 return;
 
-            d->str.append( r->string( d->literalSize ) );
-            r->remove( d->literalSize );
             d->readingLiteral = false;
         }
         else if ( d->reader ) {
@@ -382,7 +399,8 @@ void IMAP::addCommand()
     d->nextOkTime = time( 0 ) + 117;
 
     Scope x( cmd->log() );
-    if ( name.lower() != "login" && name.lower() != "authenticate" )
+    if ( Log::loggable( Log::Debug ) &&
+         name.lower() != "login" && name.lower() != "authenticate" )
         ::log( "First line: " + p->firstLine(), Log::Debug );
 }
 
@@ -461,6 +479,67 @@ bool IMAP::idle() const
 }
 
 
+// Most clients select the inbox and fetch the newest headers right
+// after authenticating. This helper runs during the remaining
+// negotiation round-trips, pulling the newest messages' envelope data
+// into the MessageCache so those predictable fetches hit warm cache.
+
+class InboxWarmer
+    : public EventHandler
+{
+public:
+    InboxWarmer( Mailbox * m )
+        : mailbox( m ), q( 0 ), fetcher( 0 ),
+          messages( new List<Message> )
+    {
+        setLog( new Log );
+        q = new Query( "select uid, message from mailbox_messages "
+                       "where mailbox=$1 order by uid desc limit 64",
+                       this );
+        q->bind( 1, mailbox->id() );
+        q->setReadOnly();
+        q->execute();
+    }
+
+    void execute()
+    {
+        if ( !q )
+            return;
+
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            Message * m = MessageCache::provide( mailbox,
+                                                 r->getInt( "uid" ) );
+            m->setDatabaseId( r->getInt( "message" ) );
+            if ( !( m->hasHeaders() && m->hasAddresses() &&
+                    m->hasTrivia() ) )
+                messages->append( m );
+        }
+
+        if ( !q->done() )
+            return;
+        q = 0;
+
+        if ( messages->isEmpty() )
+            return;
+
+        fetcher = new Fetcher( messages, this, 0 );
+        fetcher->fetch( Fetcher::Addresses );
+        fetcher->fetch( Fetcher::OtherHeader );
+        fetcher->fetch( Fetcher::Trivia );
+        fetcher->execute();
+        // once the fetcher finishes, the messages sit in the cache
+        // and there's nothing more to do
+    }
+
+private:
+    Mailbox * mailbox;
+    Query * q;
+    Fetcher * fetcher;
+    List<Message> * messages;
+};
+
+
 /*! Notifies the IMAP object that \a user was successfully
     authenticated by way of \a mechanism. This changes the state() of
     the IMAP object to Authenticated.
@@ -484,6 +563,11 @@ void IMAP::setUser( User * user, const EString & mechanism )
     if ( possiblyOutlook )
         setClientBug( Nat );
     setTimeoutAfter( 1860 );
+
+    if ( Server::useCache() &&
+         user->inbox() && user->inbox()->id() &&
+         Database::idleHandles() > 0 )
+        (void)new InboxWarmer( user->inbox() );
 }
 
 
@@ -527,8 +611,9 @@ void IMAP::runCommands()
 
     while ( d->runCommandsAgain ) {
         d->runCommandsAgain = false;
-        log( "IMAP::runCommands, " + fn( d->commands.count() ) + " commands",
-             Log::Debug );
+        if ( Log::loggable( Log::Debug ) )
+            log( "IMAP::runCommands, " + fn( d->commands.count() ) +
+                 " commands", Log::Debug );
 
         // run all currently executing commands once
         uint n = 0;
@@ -581,6 +666,29 @@ void IMAP::runCommands()
             return;
         }
 
+        // similarly, if imap-output-rate is set and this client has
+        // received more than its share, defer its next command until
+        // its average rate is back within the budget, so a single
+        // client looping on 1:* fetch can't monopolise the server.
+
+        uint rate = Configuration::scalar( Configuration::ImapOutputRate );
+        if ( rate && !d->commands.isEmpty() ) {
+            int64 allowed = (int64)rate *
+                            ( (int64)::time( 0 ) - d->started + 1 );
+            if ( bytesWritten() > allowed ) {
+                uint delay = ( bytesWritten() - allowed ) / rate + 1;
+                if ( delay > 16 )
+                    delay = 16;
+                log( "Delaying next IMAP command for " + fn( delay ) +
+                     " seconds (sent " +
+                     EString::humanNumber( bytesWritten() ) +
+                     " bytes, imap-output-rate is " + fn( rate ) + ")" );
+                (void)new Timer( new IMAPData::BadBouncer( this ), delay );
+                d->runningCommands = false;
+                return;
+            }
+        }
+
         // we may be able to start new commands.
         i = d->commands.first();
         Command * first = i;
@@ -599,9 +707,13 @@ void IMAP::runCommands()
         }
 
         // if we have a leading command, we can parse and execute
-        // followers in the same group.
+        // followers in the same group concurrently with it, so their
+        // database queries overlap. responses are still emitted in
+        // order above, since only the leading run of finished
+        // commands is emitted. the first follower in a different
+        // group blocks itself and everything after it.
         if ( first && first->group() ) {
-            while ( first && i && first->state() == i->state() ) {
+            while ( first && i ) {
                 Command * c = i;
                 Scope x( c->log() );
                 ++i;
@@ -873,9 +985,11 @@ void IMAP::emitResponses()
 
     bool any = false;
 
-    Buffer * w = writeBuffer();
+    // gather all the responses we can send into one string, so the
+    // write buffer receives a single append per dispatch instead of
+    // three per response
+    EString all;
     List<ImapResponse>::Iterator r( d->responses );
-    uint n = 0;
     while ( r ) {
         if ( !r->meaningful() ) {
             r->setSent();
@@ -883,10 +997,10 @@ void IMAP::emitResponses()
         else if ( !r->sent() && ( can || !r->changesMsn() ) ) {
             EString t = r->text();
             if ( !t.isEmpty() ) {
-                w->append( "* ", 2 );
-                w->append( t );
-                w->append( "\r\n", 2 );
-                n++;
+                all.reserve( all.length() + t.length() + 4 );
+                all.append( "* ", 2 );
+                all.append( t );
+                all.append( "\r\n", 2 );
             }
             r->setSent();
             any = true;
@@ -897,6 +1011,9 @@ void IMAP::emitResponses()
             ++r;
     }
 
+    if ( !all.isEmpty() )
+        writeBuffer()->append( all );
+
     if ( !any )
         return;
 
@@ -47,21 +47,22 @@ EString ImapParser::firstLine()
 
 EString ImapParser::tag()
 {
-    EString r;
-
-    char c = nextChar();
-    while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
-            c != '%' && c != '*' && c != '"' && c != '\\' && c != '+' )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        char c = str[j];
+        if ( !( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
+                c != '%' && c != '*' && c != '"' && c != '\\' && c != '+' ) )
+            break;
+        j++;
     }
+    step( j - i );
 
-    if ( r.isEmpty() )
+    if ( j == i )
         setError( "Expected IMAP tag, but saw: " + following().quoted() );
 
-    return r;
+    return str.mid( i, j - i );
 }
 
 
@@ -78,14 +79,18 @@ EString ImapParser::command()
     if ( present( "uid " ) )
         r.append( "uid " );
 
-    char c = nextChar();
-    while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
-            c != '%' && c != '*' && c != '"' && c != '\\' && c != ']' )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        char c = str[j];
+        if ( !( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
+                c != '%' && c != '*' && c != '"' && c != '\\' && c != ']' ) )
+            break;
+        j++;
     }
+    step( j - i );
+    r.append( str.data() + i, j - i );
 
     if ( r.isEmpty() || r == "uid " )
         setError( "Expected IMAP command name, but saw: '" +
@@ -117,22 +122,23 @@ uint ImapParser::nzNumber()
 
 EString ImapParser::atom()
 {
-    EString r;
-
-    char c = nextChar();
-    while ( c > ' ' && c < 127 &&
-            c != '(' && c != ')' && c != '{' && c != ']' &&
-            c != '"' && c != '\\' && c != '%' && c != '*' )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        char c = str[j];
+        if ( !( c > ' ' && c < 127 &&
+                c != '(' && c != ')' && c != '{' && c != ']' &&
+                c != '"' && c != '\\' && c != '%' && c != '*' ) )
+            break;
+        j++;
     }
+    step( j - i );
 
-    if ( r.isEmpty() )
+    if ( j == i )
         setError( "Expected IMAP atom, but saw: " + following() );
 
-    return r;
+    return str.mid( i, j - i );
 }
 
 
@@ -144,21 +150,22 @@ EString ImapParser::atom()
 
 EString ImapParser::listChars()
 {
-    EString r;
-
-    char c = nextChar();
-    while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
-            c != '"' && c != '\\' )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        char c = str[j];
+        if ( !( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
+                c != '"' && c != '\\' ) )
+            break;
+        j++;
     }
+    step( j - i );
 
-    if ( r.isEmpty() )
+    if ( j == i )
         setError( "Expected 1*list-char, but saw: " + following() );
 
-    return r;
+    return str.mid( i, j - i );
 }
 
 
@@ -189,6 +196,24 @@ EString ImapParser::quoted()
         return r;
     }
 
+    // most quoted strings contain no escapes and no 8-bit bytes, so
+    // they need neither unescaping nor utf-8 normalisation and can be
+    // sliced straight out of the buffer
+    uint i = pos() + 1;
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        c = str[j];
+        if ( c == '"' || c == '\\' || c >= 128 ||
+             c == 0 || c == 10 || c == 13 )
+            break;
+        j++;
+    }
+    if ( j < l && str[j] == '"' ) {
+        step( j + 1 - pos() );
+        return str.mid( i, j - i );
+    }
+
     step();
     c = nextChar();
     while ( c != '"' && c > 0 && c != 10 && c != 13 ) {
@@ -310,21 +335,24 @@ EString ImapParser::astring()
     if ( c == '"' || c == '{' )
         return string();
 
-    EString r;
-    while ( c > ' ' && c < 128 &&
-            c != '(' && c != ')' && c != '{' &&
-            c != '"' && c != '\\' &&
-            c != '%' && c != '*' )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        c = str[j];
+        if ( !( c > ' ' && c < 128 &&
+                c != '(' && c != ')' && c != '{' &&
+                c != '"' && c != '\\' &&
+                c != '%' && c != '*' ) )
+            break;
+        j++;
     }
+    step( j - i );
 
-    if ( r.isEmpty() )
+    if ( j == i )
         setError( "Expected astring, but saw: " + following() );
 
-    return r;
+    return str.mid( i, j - i );
 }
 
 
@@ -336,25 +364,27 @@ EString ImapParser::astring()
 
 EString ImapParser::listMailbox()
 {
-    EString r;
-
     char c = nextChar();
     if ( c == '"' || c == '{' )
         return string();
 
-    while ( c > ' ' &&
-            c != '(' && c != ')' && c != '{' &&
-            c != '"' && c != '\\' )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l ) {
+        c = str[j];
+        if ( !( c > ' ' &&
+                c != '(' && c != ')' && c != '{' &&
+                c != '"' && c != '\\' ) )
+            break;
+        j++;
     }
+    step( j - i );
 
-    if ( r.isEmpty() )
+    if ( j == i )
         setError( "Expected list-mailbox, but saw: " + following() );
 
-    return r;
+    return str.mid( i, j - i );
 }
 
 
@@ -386,24 +416,23 @@ EString ImapParser::flag()
 
 EString ImapParser::dotLetters( uint min, uint max )
 {
-    EString r;
-    uint i = 0;
-    char c = nextChar();
-    while ( i < max &&
-            ( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ||
-              ( c >= '0' && c <= '9' ) || ( c == '.' ) ) )
-    {
-        step();
-        r.append( c );
-        c = nextChar();
-        i++;
+    uint i = pos();
+    uint j = i;
+    uint l = str.length();
+    while ( j < l && j < i + max ) {
+        char c = str[j];
+        if ( !( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ||
+                ( c >= '0' && c <= '9' ) || ( c == '.' ) ) )
+            break;
+        j++;
     }
+    step( j - i );
 
-    if ( i < min )
-        setError( "Expected at least " + fn( min-i ) + " more "
+    if ( j - i < min )
+        setError( "Expected at least " + fn( min-(j-i) ) + " more "
                   "letters/digits/dots, but saw: " + following() );
 
-    return r;
+    return str.mid( i, j - i );
 }
 
 
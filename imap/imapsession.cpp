@@ -4,8 +4,11 @@
 
 #include "helperrowcreator.h"
 #include "handlers/fetch.h"
+#include "messagecache.h"
+#include "integerset.h"
 #include "command.h"
 #include "fetcher.h"
+#include "query.h"
 #include "mailbox.h"
 #include "message.h"
 #include "scope.h"
@@ -20,6 +23,7 @@ public:
     ImapSessionData(): i( 0 ), l( 0 ),
                        exists( 0 ), recent( 0 ),
                        uidnext( 0 ), nms( 0 ), cms( 0 ),
+                       readAhead( 0 ), readAheadNext( 0 ),
                        emitting( false ), unicode( false ),
                        existsResponse( 0 ), recentResponse( 0 ),
                        uidnextResponse( 0 ), highestModseqResponse( 0 ),
@@ -36,6 +40,8 @@ public:
     int64 cms;
     EStringList flags;
     List<int64> ignorable;
+    class ImapReadAhead * readAhead;
+    uint readAheadNext;
     bool emitting;
     bool unicode;
 
@@ -189,6 +195,74 @@ public:
 };
 
 
+class ImapReadAhead
+    : public EventHandler
+{
+public:
+    ImapReadAhead( ImapSession * session, const IntegerSet & uids,
+                   bool bodies )
+        : EventHandler(), s( session ), w( uids ), b( bodies ),
+          q( 0 ), f( 0 ), active( true )
+    {
+        execute();
+    }
+
+    void execute();
+
+    bool done() const { return !active; }
+
+private:
+    ImapSession * s;
+    IntegerSet w;
+    bool b;
+    Query * q;
+    Fetcher * f;
+    bool active;
+};
+
+
+void ImapReadAhead::execute()
+{
+    Scope x( log() );
+
+    if ( !q ) {
+        q = new Query( "select uid, message from mailbox_messages "
+                       "where mailbox=$1 and uid=any($2)", this );
+        q->bind( 1, s->mailbox()->id() );
+        q->bind( 2, w );
+        q->execute();
+    }
+
+    if ( !q->done() )
+        return;
+
+    if ( !f ) {
+        List<Message> * l = new List<Message>;
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            Message * m = MessageCache::provide( s->mailbox(),
+                                                r->getInt( "uid" ) );
+            m->setDatabaseId( r->getInt( "message" ) );
+            l->append( m );
+        }
+        if ( l->isEmpty() ) {
+            active = false;
+            return;
+        }
+        f = new Fetcher( l, this, s->imap() );
+        f->fetch( Fetcher::Addresses );
+        f->fetch( Fetcher::OtherHeader );
+        f->fetch( Fetcher::Trivia );
+        if ( b )
+            f->fetch( Fetcher::Body );
+        f->execute();
+    }
+
+    if ( f->done() )
+        active = false;
+}
+
+
 /*! \class ImapSession imapsession.h
     This class inherits from the Session class, and provides two
     IMAP-specific output functions.
@@ -366,6 +440,50 @@ void ImapSession::recordExpungedFetch( const IntegerSet & set )
 }
 
 
+/*! Records that the client just fetched \a fetched, and if the client
+    seems to be walking the mailbox sequentially, speculatively
+    fetches the next window of messages into the MessageCache while
+    the current response is still being written to the client. \a
+    bodies says whether the client wanted body data, too.
+
+    The next FETCH then finds its messages already cached and its
+    Fetcher has little or nothing left to do.
+*/
+
+void ImapSession::readAhead( const IntegerSet & fetched, bool bodies )
+{
+    if ( fetched.isEmpty() )
+        return;
+
+    uint expected = d->readAheadNext;
+    d->readAheadNext = fetched.largest() + 1;
+    if ( !expected || fetched.smallest() != expected )
+        return;
+    if ( d->readAhead && !d->readAhead->done() )
+        return;
+
+    const IntegerSet & all = messages();
+    uint i = all.index( fetched.largest() );
+    if ( !i )
+        return;
+    i++;
+
+    uint n = fetched.count();
+    if ( n > 256 )
+        n = 256;
+    IntegerSet w;
+    while ( n && i <= all.count() ) {
+        w.add( all.value( i ) );
+        i++;
+        n--;
+    }
+    if ( w.isEmpty() )
+        return;
+
+    d->readAhead = new ImapReadAhead( this, w, bodies );
+}
+
+
 /*! Records that no flag/annotation/modseq update is to be sent for \a
     ms. ImapSession may send one anyway, but tries to avoid it.
 */
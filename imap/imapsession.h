@@ -27,6 +27,8 @@ public:
 
     void recordExpungedFetch( const IntegerSet & );
 
+    void readAhead( const IntegerSet &, bool );
+
     void ignoreModSeq( int64 );
 
     void clearExpunged( uint );
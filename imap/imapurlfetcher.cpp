@@ -15,6 +15,7 @@
 #include "estringlist.h"
 #include "mailbox.h"
 #include "query.h"
+#include "dict.h"
 #include "md5.h"
 
 
@@ -23,7 +24,7 @@ struct UrlLink
 {
     UrlLink( ImapUrl * u )
         : url( u ), mailbox( 0 ), message( 0 ),
-          section( 0 ), permissions( 0 ), q( 0 )
+          section( 0 ), permissions( 0 )
     {}
 
     ImapUrl * url;
@@ -31,7 +32,6 @@ struct UrlLink
     Message * message;
     Section * section;
     Permissions * permissions;
-    Query * q;
 };
 
 
@@ -56,7 +56,8 @@ class IufData
 public:
     IufData()
         : state( 0 ), done( false ), urls( 0 ), owner( 0 ),
-          checker( 0 ), fetchers( 0 ), findIds( 0 ), unicodable( false )
+          checker( 0 ), fetchers( 0 ), findIds( 0 ), findKeys( 0 ),
+          unicodable( false )
     {}
 
     int state;
@@ -68,6 +69,7 @@ public:
     PermissionsChecker * checker;
     List<Fetcher> * fetchers;
     Query * findIds;
+    Query * findKeys;
     bool unicodable;
 };
 
@@ -195,22 +197,59 @@ void ImapUrlFetcher::execute()
             return;
         }
 
+        // one grouped query fetches the access keys for every
+        // (user,mailbox) pair the URLs touch, however many URLs a
+        // CATENATE submits.
+        Dict<Garbage> pairs;
+        uint n = 1;
+        EString a( "select userid, mailbox, key from access_keys "
+                   "where " );
         List<UrlLink>::Iterator it( d->urls );
         while ( it ) {
             if ( !it->url->urlauth().isEmpty() ) {
-                it->q = new Query( "select key from access_keys where "
-                                   "userid=$1 and mailbox=$2", this );
-                it->q->bind( 1, it->url->user()->id() );
-                it->q->bind( 2, it->mailbox->id() );
-                it->q->execute();
+                EString p = fn( it->url->user()->id() ) + ":" +
+                            fn( it->mailbox->id() );
+                if ( !pairs.contains( p ) ) {
+                    pairs.insert( p, new Garbage );
+                    if ( !d->findKeys )
+                        d->findKeys = new Query( "", this );
+                    else
+                        a.append( " or " );
+                    a.append( "(userid=$" );
+                    a.appendNumber( n );
+                    d->findKeys->bind( n, it->url->user()->id() );
+                    n++;
+                    a.append( " and mailbox=$" );
+                    a.appendNumber( n );
+                    d->findKeys->bind( n, it->mailbox->id() );
+                    n++;
+                    a.append( ")" );
+                }
             }
             ++it;
         }
+        if ( d->findKeys ) {
+            d->findKeys->setString( a );
+            d->findKeys->execute();
+        }
 
         d->state = 3;
     }
 
     if ( d->state == 3 ) {
+        if ( d->findKeys && !d->findKeys->done() )
+            return;
+
+        Dict<EString> keys;
+        if ( d->findKeys ) {
+            while ( d->findKeys->hasResults() ) {
+                Row * r = d->findKeys->nextRow();
+                keys.insert( fn( r->getInt( "userid" ) ) + ":" +
+                             fn( r->getInt( "mailbox" ) ),
+                             new EString( r->getEString( "key" ) ) );
+            }
+        }
+
         d->fetchers = new List<Fetcher>;
 
         List<MailboxSet> sets;
@@ -219,12 +258,11 @@ void ImapUrlFetcher::execute()
         while ( it ) {
             ImapUrl * url = it->url;
 
-            if ( it->q ) {
-                if ( !it->q->done() )
-                    return;
-
-                Row * r = it->q->nextRow();
-                if ( it->q->failed() || !r ) {
+            if ( !url->urlauth().isEmpty() ) {
+                EString * k =
+                    keys.find( fn( url->user()->id() ) + ":" +
+                               fn( it->mailbox->id() ) );
+                if ( ( d->findKeys && d->findKeys->failed() ) || !k ) {
                     setError( "invalid URL", url->orig() );
                     d->owner->execute();
                     return;
@@ -232,7 +270,7 @@ void ImapUrlFetcher::execute()
 
                 EString rump( url->rump() );
                 EString urlauth( url->urlauth() );
-                EString key( r->getEString( "key" ).de64() );
+                EString key( k->de64() );
 
                 if ( urlauth != "0" + MD5::HMAC( key, rump ).hex() ) {
                     setError( "invalid URL", url->orig() );
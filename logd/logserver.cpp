@@ -7,6 +7,8 @@
 #include "dict.h"
 #include "list.h"
 #include "file.h"
+#include "event.h"
+#include "timer.h"
 #include "eventloop.h"
 #include "log.h"
 
@@ -17,11 +19,80 @@
 // openlog, syslog
 #include <syslog.h>
 
+#include <zlib.h>
+
 
 static uint id;
 static File *logFile;
+static EString *pendingOutput;
 static Log::Severity logLevel;
 static bool useSyslog;
+static bool useGzip;
+static bool gzActive;
+static z_stream gzs;
+
+
+// Compresses s and writes the result to the log file, ending with a
+// sync flush so the file is readable with zcat up to the last flush
+// even while logd is running. If finish is true, the gzip stream is
+// finalised instead, as before log rotation.
+
+static void writeCompressed( const EString & s, bool finish )
+{
+    if ( !gzActive ) {
+        if ( finish )
+            return;
+        gzs.zalloc = 0;
+        gzs.zfree = 0;
+        gzs.opaque = 0;
+        // 15+16 selects gzip framing; level 6 trades a little CPU for
+        // the write bandwidth this mode exists to save
+        ::deflateInit2( &gzs, 6, Z_DEFLATED, 15+16, 8,
+                        Z_DEFAULT_STRATEGY );
+        gzActive = true;
+    }
+
+    gzs.next_in = (Bytef*)s.data();
+    gzs.avail_in = s.length();
+    int r = Z_OK;
+    do {
+        char out[16384];
+        gzs.next_out = (Bytef*)out;
+        gzs.avail_out = sizeof( out );
+        r = ::deflate( &gzs, finish ? Z_FINISH : Z_SYNC_FLUSH );
+        uint l = sizeof( out ) - gzs.avail_out;
+        if ( l ) {
+            EString c;
+            c.append( out, l );
+            logFile->write( c );
+        }
+    } while ( ( gzs.avail_in || !gzs.avail_out ) && r == Z_OK );
+
+    if ( finish ) {
+        ::deflateEnd( &gzs );
+        gzActive = false;
+    }
+}
+
+
+// Flushes buffered log output once a second when output() doesn't hit
+// its size threshold first.
+
+class LogFlusher
+    : public EventHandler
+{
+public:
+    LogFlusher(): timer( 0 ) {}
+
+    void execute() {
+        timer = 0;
+        LogServer::flush();
+    }
+
+    Timer * timer;
+};
+
+static LogFlusher * flusher;
 
 
 /*! \class LogServer logserver.h
@@ -73,6 +144,9 @@ void LogServer::react( Event e )
         // Timeout never should happen
     case Shutdown:
         output( 0, Log::Debug, "log server shutdown" );
+        flush();
+        if ( ::useGzip )
+            writeCompressed( EString(), true );
         break;
     case Connect:
     case Error:
@@ -191,15 +265,60 @@ void LogServer::output( EString tag, Log::Severity s,
     msg.append( line );
     msg.append( "\n" );
 
-    if ( logFile )
-        logFile->write( msg );
-    else
+    if ( logFile ) {
+        if ( !pendingOutput ) {
+            pendingOutput = new EString;
+            Allocator::addEternal( pendingOutput, "buffered log output" );
+        }
+        pendingOutput->append( msg );
+        if ( pendingOutput->length() >= 65536 ) {
+            flush();
+        }
+        else {
+            if ( !flusher ) {
+                flusher = new LogFlusher;
+                Allocator::addEternal( flusher, "log flush timer" );
+            }
+            if ( !flusher->timer )
+                flusher->timer = new Timer( flusher, 1 );
+        }
+    }
+    else {
         fprintf( stderr, "%s", msg.cstr() );
+    }
+}
+
+
+/*! Writes any buffered log lines to the log file. output() calls this
+    when the buffer reaches 64KB, and a timer calls it a second after
+    the first buffered line, so a busy client costs a write() per
+    second or per 64KB, not one per log line.
+*/
+
+void LogServer::flush()
+{
+    if ( flusher && flusher->timer ) {
+        delete flusher->timer;
+        flusher->timer = 0;
+    }
+    if ( !pendingOutput || pendingOutput->isEmpty() )
+        return;
+    if ( logFile ) {
+        if ( ::useGzip )
+            writeCompressed( *pendingOutput, false );
+        else
+            logFile->write( *pendingOutput );
+    }
+    pendingOutput->truncate();
 }
 
 
 /*! Tells all LogServer object to write log information to \a name
     from now on. (If the file has to be created, \a mode is used.)
+
+    If \a name ends with ".gz", the log is written gzip-compressed,
+    with a flush point per write so it can be read with zcat while
+    logd is running.
 */
 
 void LogServer::setLogFile( const EString &name, const EString &mode )
@@ -286,6 +405,7 @@ void LogServer::setLogFile( const EString &name, const EString &mode )
     else {
         l = new File( name, File::Append, m );
         useSyslog = false;
+        ::useGzip = name.endsWith( ".gz" );
     }
 
     if ( useSyslog )
@@ -361,6 +481,9 @@ void LogServer::reopen( int unused )
     if ( useSyslog )
         return;
 
+    flush();
+    if ( ::useGzip )
+        writeCompressed( EString(), true );
     File::unlink( logFile->name() );
     File * l = new File( logFile->name(), File::Append );
     if ( !l->valid() ) {
@@ -21,6 +21,7 @@ public:
     static void setLogLevel( const EString & );
 
     static void reopen( int );
+    static void flush();
 
     static Log::Severity severity( const EString & );
 
@@ -26,4 +26,5 @@ SelfLogger::SelfLogger()
 void SelfLogger::send( const EString & id, Log::Severity s, const EString & m )
 {
     ls->output( id, s, m );
+    LogServer::flush();
 }
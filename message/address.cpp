@@ -117,9 +117,14 @@ class AddressCache
     : public Cache
 {
 public:
-    AddressCache(): Cache( 8 ) {}
-    void clear() { step1.clear(); }
+    AddressCache(): Cache( 8 ), entries( 0 ) {}
+    void clear() { step1.clear(); entries = 0; }
+    uint size() const {
+        // a shared AddressData, its strings and its three dict slots
+        return entries * 200;
+    }
     UDict< UDict< UDict<AddressData> > > step1;
+    uint entries;
 };
 
 static AddressCache * cache = 0;
@@ -165,6 +170,7 @@ void Address::init( const UString &n, const UString &l, const UString &o )
                   d->domain.isEmpty() )
             d->type = Bounce;
         step3->insert( n, d );
+        ::cache->entries++;
     }
 }
 
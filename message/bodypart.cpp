@@ -14,6 +14,8 @@
 #include "mimefields.h"
 #include "log.h"
 
+#include <string.h> // memchr
+
 
 class BodypartData
     : public Garbage
@@ -22,7 +24,8 @@ public:
     BodypartData()
         : id( 0 ), number( 0 ), message( 0 ),
           numBytes( 0 ), numEncodedBytes(), numEncodedLines( 0 ),
-          hasText( false )
+          hasText( false ),
+          wireEncoding( EString::Binary ), hasWire( false )
     {}
 
     uint id;
@@ -38,6 +41,10 @@ public:
     UString text;
     bool hasText;
     EString error;
+
+    EString wire;
+    EString::Encoding wireEncoding;
+    bool hasWire;
 };
 
 
@@ -173,6 +180,7 @@ EString Bodypart::data() const
 void Bodypart::setData( const EString &s )
 {
     d->data = s;
+    d->hasWire = false;
 }
 
 
@@ -198,6 +206,51 @@ void Bodypart::setText( const UString &s )
 {
     d->hasText = true;
     d->text = s;
+    d->hasWire = false;
+}
+
+
+/*! Returns the wire form of this text part: text() converted to the
+    charset named by \a ct (or a guessed charset if \a ct names none)
+    and transfer-encoded with \a e.
+
+    The payload never changes once it has been parsed or fetched, so
+    the result is remembered; Fetch, Sieve and SmtpClient rendering
+    the same part all share one encoding pass and one set of bytes.
+*/
+
+EString Bodypart::encodedText( ContentType * ct, EString::Encoding e ) const
+{
+    if ( d->hasWire && d->wireEncoding == e )
+        return d->wire;
+
+    Codec * c = 0;
+    if ( ct && !ct->parameter( "charset" ).isEmpty() )
+        c = Codec::byName( ct->parameter( "charset" ) );
+    if ( !c )
+        c = Codec::byString( text() );
+
+    EString body = c->fromUnicode( text() );
+    d->wire = body.encoded( e, 72 );
+    d->wireEncoding = e;
+    d->hasWire = true;
+    return d->wire;
+}
+
+
+/*! Returns data() transfer-encoded with \a e. The result is
+    remembered, as for encodedText().
+*/
+
+EString Bodypart::encodedData( EString::Encoding e ) const
+{
+    if ( d->hasWire && d->wireEncoding == e )
+        return d->wire;
+
+    d->wire = d->data.encoded( e, 72 );
+    d->wireEncoding = e;
+    d->hasWire = true;
+    return d->wire;
 }
 
 
@@ -386,8 +439,17 @@ void Bodypart::parseMultipart( uint i, uint end,
                 i = j;
             }
         }
-        while ( i < end && rfc2822[i] != 13 && rfc2822[i] != 10 )
-            i++;
+        // skip to the end of the line. memchr runs at memory
+        // bandwidth, which matters when the parts are big.
+        if ( i < end ) {
+            const char * b = rfc2822.data();
+            const char * lf = (const char *)memchr( b + i, 10, end - i );
+            uint stop = lf ? lf - b : end;
+            const char * cr = (const char *)memchr( b + i, 13, stop - i );
+            if ( cr )
+                stop = cr - b;
+            i = stop;
+        }
         while ( i < end && ( rfc2822[i] == 13 || rfc2822[i] == 10 ) )
             i++;
     }
@@ -30,6 +30,9 @@ public:
     EString data() const;
     void setData( const EString & );
 
+    EString encodedText( ContentType *, EString::Encoding ) const;
+    EString encodedData( EString::Encoding ) const;
+
     Message * message() const;
     void setMessage( Message * );
 
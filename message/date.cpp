@@ -219,10 +219,15 @@ static const char * months[] = { "Jan", "Feb", "Mar", "Apr",
 static const char * weekdays[] = { "Mon", "Tue", "Wed", "Thu",
                                    "Fri", "Sat", "Sun" };
 
-// return 1-12 for january-december, or 0 for error
-static uint month( const EString & name )
+// return 1-12 for january-december based on the first three letters
+// of the name, or 0 for error
+static uint month( char m0, char m1, char m2 )
 {
     uint n = 0;
+    char name[3];
+    name[0] = m0;
+    name[1] = m1;
+    name[2] = m2;
     switch ( name[0] ) {
     case 'j': // "jan" "jun" "jul"
     case 'J':
@@ -277,6 +282,13 @@ static uint month( const EString & name )
 }
 
 
+// return 1-12 for january-december, or 0 for error
+static uint month( const EString & name )
+{
+    return month( name[0], name[1], name[2] );
+}
+
+
 // return true if this may possibly be a weekday.
 static bool weekday( const EString & name )
 {
@@ -295,6 +307,100 @@ static bool weekday( const EString & name )
 }
 
 
+static bool digit( char c )
+{
+    return c >= '0' && c <= '9';
+}
+
+
+// parses the well-formed RFC 2822 date-time production ("Tue, 13 Dec
+// 2003 14:15:16 +0100", weekday and seconds optional) into \a d in a
+// single scan without allocating. Returns false for anything else -
+// comments, zone names, two-digit years and all the other dialects -
+// which then goes to the tolerant parser.
+static bool wellFormed( const EString & s, DateData * d )
+{
+    uint i = 0;
+
+    while ( s[i] == ' ' || s[i] == '\t' )
+        i++;
+
+    // optional "Ddd, "
+    if ( s[i+3] == ',' ) {
+        i += 4;
+        while ( s[i] == ' ' || s[i] == '\t' )
+            i++;
+    }
+
+    // day: one or two digits
+    if ( !digit( s[i] ) )
+        return false;
+    d->day = s[i++] - '0';
+    if ( digit( s[i] ) )
+        d->day = d->day * 10 + s[i++] - '0';
+
+    if ( s[i++] != ' ' )
+        return false;
+    d->month = ::month( s[i], s[i+1], s[i+2] );
+    if ( !d->month )
+        return false;
+    i += 3;
+
+    // year: exactly four digits
+    if ( s[i++] != ' ' )
+        return false;
+    if ( !( digit( s[i] ) && digit( s[i+1] ) &&
+            digit( s[i+2] ) && digit( s[i+3] ) ) )
+        return false;
+    d->year = ( s[i] - '0' ) * 1000 + ( s[i+1] - '0' ) * 100 +
+              ( s[i+2] - '0' ) * 10 + ( s[i+3] - '0' );
+    i += 4;
+
+    // hh:mm[:ss]
+    if ( s[i++] != ' ' )
+        return false;
+    if ( !( digit( s[i] ) && digit( s[i+1] ) && s[i+2] == ':' &&
+            digit( s[i+3] ) && digit( s[i+4] ) ) )
+        return false;
+    d->hour = ( s[i] - '0' ) * 10 + ( s[i+1] - '0' );
+    d->minute = ( s[i+3] - '0' ) * 10 + ( s[i+4] - '0' );
+    i += 5;
+    if ( s[i] == ':' ) {
+        if ( !( digit( s[i+1] ) && digit( s[i+2] ) ) )
+            return false;
+        d->second = ( s[i+1] - '0' ) * 10 + ( s[i+2] - '0' );
+        i += 3;
+    }
+    if ( d->hour > 23 || d->minute > 59 || d->second > 60 )
+        return false;
+
+    // numeric zone, as strict as the tolerant parser: minutes 00-59,
+    // hours 00-29
+    if ( s[i++] != ' ' )
+        return false;
+    char sign = s[i];
+    if ( sign != '+' && sign != '-' )
+        return false;
+    if ( !( ( s[i+1] >= '0' && s[i+1] <= '2' ) && digit( s[i+2] ) &&
+            ( s[i+3] >= '0' && s[i+3] <= '5' ) && digit( s[i+4] ) ) )
+        return false;
+    d->tz = ( ( s[i+1] - '0' ) * 10 + ( s[i+2] - '0' ) ) * 60 +
+            ( s[i+3] - '0' ) * 10 + ( s[i+4] - '0' );
+    if ( sign == '-' ) {
+        d->tz = 0 - d->tz;
+        if ( d->tz == 0 )
+            d->minus0 = true;
+    }
+    i += 5;
+
+    // nothing but whitespace may remain; in particular a comment
+    // might name the zone, which the tolerant parser knows about
+    while ( s[i] == ' ' || s[i] == '\t' )
+        i++;
+    return i >= s.length();
+}
+
+
 /*! Sets this date object to reflect the RFC 2822-format date \a s. If
     there are any syntax errors, the date is set to be invalid.
 
@@ -308,6 +414,22 @@ void Date::setRfc822( const EString & s )
 
     d->reset();
 
+    // nearly all real-world dates use the well-formed production, so
+    // try a cheap single scan before the tolerant parser.
+    if ( ::wellFormed( s, d ) ) {
+        d->valid = true;
+        checkHarder();
+        if ( !d->valid )
+            return;
+        if ( d->tz < 14*60 && d->tz > -14*60 )
+            return;
+        // see the comment at the end of the tolerant parser
+        setUnixTime( unixTime() );
+        d->minus0 = true;
+        return;
+    }
+    d->reset();
+
     // we'll understand 2822, but a bit kinder.
 
     // perhaps this is all bad. perhaps we should scan the string for
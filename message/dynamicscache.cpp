@@ -0,0 +1,103 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "dynamicscache.h"
+
+#include "mailbox.h"
+#include "server.h"
+#include "map.h"
+
+
+static class DynamicsCache * c = 0;
+
+
+class DynamicsCacheMailbox
+    : public Garbage
+{
+public:
+    DynamicsCacheMailbox(): nextModSeq( 0 ) {}
+    int64 nextModSeq;
+    Map<DynamicsCacheEntry> byUid;
+};
+
+
+class DynamicsCacheData
+    : public Garbage
+{
+public:
+    Map<DynamicsCacheMailbox> byMailbox;
+};
+
+
+/*! \class DynamicsCache dynamicscache.h
+
+    The DynamicsCache caches each message's dynamic data (its flags
+    and modseq) per mailbox. When a message arrives in (or changes
+    within) a mailbox that many sessions have selected, each session
+    sends its own untagged FETCH, but there's no reason for each
+    session to run the same queries too. The first implicit fetch
+    records what it learned here and the sessions behind it read the
+    same data back; Selector::match() also consults it to answer flag
+    searches without a query.
+
+    A mailbox's entries are keyed on its nextmodseq and dropped as
+    soon as that moves, so find() never returns stale data.
+*/
+
+
+/*! Constructs an empty DynamicsCache. Should not be called directly,
+    only via insert() and find().
+*/
+
+DynamicsCache::DynamicsCache()
+    : Cache( 2 ), d( new DynamicsCacheData )
+{
+    // nothing
+}
+
+
+/*! Inserts \a e into the cache, such that a find( \a mb, \a uid )
+    will return it until the contents of \a mb change.
+*/
+
+void DynamicsCache::insert( class Mailbox * mb, uint uid,
+                            DynamicsCacheEntry * e )
+{
+    if ( !Server::useCache() )
+        return;
+    if ( !c )
+        c = new DynamicsCache;
+    DynamicsCacheMailbox * cm = c->d->byMailbox.find( mb->id() );
+    if ( cm && cm->nextModSeq != mb->nextModSeq() ) {
+        c->d->byMailbox.remove( mb->id() );
+        cm = 0;
+    }
+    if ( !cm ) {
+        cm = new DynamicsCacheMailbox;
+        cm->nextModSeq = mb->nextModSeq();
+        c->d->byMailbox.insert( mb->id(), cm );
+    }
+    cm->byUid.insert( uid, e );
+}
+
+
+/*! Looks for cached dynamic data for the message with \a uid in \a
+    mailbox and returns a pointer to it, or a null pointer if the
+    cache doesn't cover that message (or covers an older version of
+    the mailbox).
+*/
+
+DynamicsCacheEntry * DynamicsCache::find( class Mailbox * mailbox, uint uid )
+{
+    if ( !c )
+        return 0;
+    DynamicsCacheMailbox * cm = c->d->byMailbox.find( mailbox->id() );
+    if ( !cm || cm->nextModSeq != mailbox->nextModSeq() )
+        return 0;
+    return cm->byUid.find( uid );
+}
+
+
+void DynamicsCache::clear()
+{
+    d->byMailbox.clear();
+}
@@ -0,0 +1,38 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DYNAMICSCACHE_H
+#define DYNAMICSCACHE_H
+
+#include "cache.h"
+#include "estringlist.h"
+
+
+class DynamicsCacheEntry
+    : public Garbage
+{
+public:
+    DynamicsCacheEntry(): message( 0 ), modseq( 0 ) {}
+    uint message;
+    int64 modseq;
+    EStringList flags;
+};
+
+
+class DynamicsCache
+    : public Cache
+{
+private:
+    DynamicsCache();
+
+public:
+    static void insert( class Mailbox *, uint, DynamicsCacheEntry * );
+    static DynamicsCacheEntry * find( class Mailbox *, uint );
+
+    void clear();
+
+private:
+    class DynamicsCacheData * d;
+};
+
+
+#endif
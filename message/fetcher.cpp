@@ -15,7 +15,6 @@
 #include "buffer.h"
 #include "query.h"
 #include "scope.h"
-#include "timer.h"
 #include "utf.h"
 #include "map.h"
 #include "log.h"
@@ -25,6 +24,9 @@
 
 enum State { NotStarted, Fetching, Done };
 
+// bodypart content above this size arrives as several chunk rows
+static const uint bodypartChunk = 1024 * 1024;
+
 
 class FetcherData
     : public Garbage
@@ -43,6 +45,8 @@ public:
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
           partnumbers( 0 ),
+          bodyWindow( 0 ),
+          headerFieldNames( 0 ), addressFieldIds( 0 ),
           throttler( 0 )
     {}
 
@@ -134,6 +138,9 @@ public:
         bool isDone( Message * ) const;
     };
 
+    uint bodyWindow;
+    EStringList * headerFieldNames;
+    IntegerSet * addressFieldIds;
     Connection * throttler;
 };
 
@@ -364,7 +371,9 @@ void Fetcher::waitForEnd()
     else if ( d->throttler &&
               d->throttler->writeBuffer() &&
               d->throttler->writeBuffer()->size() > 1024*1024 ) {
-        (void)new Timer( this, 2 );
+        // resume as soon as the client catches up, rather than
+        // polling with a timer
+        d->throttler->notifyOnDrain( this );
     }
     else {
         prepareBatch();
@@ -541,39 +550,81 @@ void Fetcher::makeQueries()
     }
 
     if ( d->addresses ) {
-        q = new Query( "select af.message, "
-                       "af.part, af.position, af.field, af.number, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from address_fields af "
-                       "join addresses a on (af.address=a.id) "
-                       "where af.message=any($1) "
-                       "order by af.message, af.part, af.field, af.number",
-                       d->addresses );
+        EString s( "select af.message, "
+                   "af.part, af.position, af.field, af.number, "
+                   "a.name, a.localpart, a.domain "
+                   "from address_fields af "
+                   "join addresses a on (af.address=a.id) "
+                   "where af.message=any($1) " );
+        if ( d->addressFieldIds )
+            s.append( "and af.field=any($2) " );
+        s.append( "order by af.message, af.part, af.field, af.number" );
+        q = new Query( s, d->addresses );
+        if ( d->addressFieldIds )
+            q->bind( 2, *d->addressFieldIds );
         bindIds( q, 1, Addresses );
         submit( q );
         d->addresses->q = q;
     }
 
     if ( d->otherheader ) {
-        q = new Query( "select hf.message, hf.part, hf.position, "
-                       "fn.name, hf.value from header_fields hf "
-                       "join field_names fn on (hf.field=fn.id) "
-                       "where hf.message=any($1) "
-                       "order by hf.message, hf.part",
-                       d->otherheader );
+        EString s( "select hf.message, hf.part, hf.position, "
+                   "fn.name, hf.value from header_fields hf "
+                   "join field_names fn on (hf.field=fn.id) "
+                   "where hf.message=any($1) " );
+        if ( d->headerFieldNames )
+            s.append( "and fn.name=any($2) " );
+        s.append( "order by hf.message, hf.part" );
+        q = new Query( s, d->otherheader );
+        if ( d->headerFieldNames )
+            q->bind( 2, *d->headerFieldNames );
         bindIds( q, 1, OtherHeader );
         submit( q );
         d->otherheader->q = q;
     }
 
     if ( d->body ) {
-        q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
-                       "bp.bytes as rawbytes, pn.bytes, pn.lines "
-                       "from part_numbers pn "
-                       "left join bodyparts bp on (pn.bodypart=bp.id) "
-                       "where pn.message=any($1) "
-                       "order by pn.message, pn.part",
-                       d->body );
+        if ( d->bodyWindow ) {
+            q = new Query( "select pn.message, pn.part, "
+                           "substring(bp.text for $2) as text, "
+                           "substring(bp.data for $2) as data, "
+                           "bp.bytes as rawbytes, pn.bytes, pn.lines "
+                           "from part_numbers pn "
+                           "left join bodyparts bp on (pn.bodypart=bp.id) "
+                           "where pn.message=any($1) "
+                           "order by pn.message, pn.part",
+                           d->body );
+            q->bind( 2, d->bodyWindow );
+        }
+        else if ( Postgres::version() >= 90300 ) {
+            // a giant attachment is fetched as a series of chunk
+            // rows rather than one enormous row, so the database
+            // reads and sends the early chunks while we receive and
+            // buffer, instead of materialising the whole part on
+            // both sides before the first byte moves.
+            q = new Query( "select pn.message, pn.part, c.n, "
+                           "substring(bp.text from c.n*$2+1 for $2) as text, "
+                           "substring(bp.data from c.n*$2+1 for $2) as data, "
+                           "bp.bytes as rawbytes, pn.bytes, pn.lines "
+                           "from part_numbers pn "
+                           "left join bodyparts bp on (pn.bodypart=bp.id) "
+                           "left join lateral generate_series(0,"
+                           "(greatest(coalesce(octet_length(bp.data),"
+                           "length(bp.text),0),1)-1)/$2) as c(n) on true "
+                           "where pn.message=any($1) "
+                           "order by pn.message, pn.part, c.n",
+                           d->body );
+            q->bind( 2, bodypartChunk );
+        }
+        else {
+            q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
+                           "bp.bytes as rawbytes, pn.bytes, pn.lines "
+                           "from part_numbers pn "
+                           "left join bodyparts bp on (pn.bodypart=bp.id) "
+                           "where pn.message=any($1) "
+                           "order by pn.message, pn.part",
+                           d->body );
+        }
         bindIds( q, 1, Body );
         submit( q );
         d->body->q = q;
@@ -750,14 +801,32 @@ void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
         if ( !part.endsWith( ".rfc822" ) ) {
             Bodypart * bp = m->bodypart( part, true );
 
-            if ( !r->isNull( "data" ) )
-                bp->setData( r->getEString( "data" ) );
-            else if ( !r->isNull( "text" ) )
-                bp->setText( r->getUString( "text" ) );
+            if ( !r->isNull( "data" ) ) {
+                EString data( r->getEString( "data" ) );
+                while ( i && i->hasColumn( "n" ) && i->getInt( "n" ) > 0 ) {
+                    data.append( i->getEString( "data" ) );
+                    ++i;
+                }
+                bp->setData( data );
+            }
+            else if ( !r->isNull( "text" ) ) {
+                UString text( r->getUString( "text" ) );
+                while ( i && i->hasColumn( "n" ) && i->getInt( "n" ) > 0 ) {
+                    text.append( i->getUString( "text" ) );
+                    ++i;
+                }
+                bp->setText( text );
+            }
 
             if ( !r->isNull( "rawbytes" ) )
                 bp->setNumBytes( r->getInt( "rawbytes" ) );
         }
+        else {
+            // the content of a message/rfc822 part is rebuilt from
+            // its children, so its chunks are not interesting
+            while ( i && i->hasColumn( "n" ) && i->getInt( "n" ) > 0 )
+                ++i;
+        }
     }
 }
 
@@ -782,6 +851,9 @@ void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
         Row * r = i;
         ++i;
 
+        if ( r->hasColumn( "n" ) && r->getInt( "n" ) > 0 )
+            continue; // a later chunk of a large part, not a new part
+
         EString part = r->getEString( "part" );
 
         if ( part.endsWith( ".rfc822" ) ) {
@@ -904,6 +976,52 @@ bool Fetcher::fetching( Type t ) const
 }
 
 
+/*! Records that the owner will use at most \a bytes bytes of each
+    bodypart's rendered form, so there's no point in retrieving more
+    than that much of each part from the database. Useful for partial
+    FETCH of huge attachments.
+
+    A window of stored text/data always renders to at least as many
+    output bytes: substring() counts characters for text, no charset
+    encodes a character as less than one byte, and the content
+    transfer encodings never shrink their input.
+
+    Messages fetched this way have truncated bodyparts, so the caller
+    must keep them out of the MessageCache.
+*/
+
+void Fetcher::setBodyWindow( uint bytes )
+{
+    d->bodyWindow = bytes;
+}
+
+
+/*! Records that the owner needs only the header \a fields
+    (header-cased, as in BODY[HEADER.FIELDS (...)]) and restricts the
+    header and address queries accordingly, so a list-view sync
+    doesn't drag along DKIM signatures and other heavyweight fields
+    nobody asked for.
+
+    Messages fetched this way have incomplete headers, so the caller
+    must keep them out of the MessageCache.
+*/
+
+void Fetcher::setHeaderFields( const EStringList & fields )
+{
+    d->headerFieldNames = new EStringList;
+    d->addressFieldIds = new IntegerSet;
+    EStringList::Iterator i( fields );
+    while ( i ) {
+        uint t = HeaderField::fieldType( *i );
+        if ( t > 0 && t <= HeaderField::LastAddressField )
+            d->addressFieldIds->add( t );
+        else
+            d->headerFieldNames->append( new EString( *i ) );
+        ++i;
+    }
+}
+
+
 /*! Records that all queries done by this Fetcher should be performed
     within \a t. This can be useful e.g. if some messages may be
     locked by \a t, or if the retrieval is tied to \a t logically.
@@ -38,6 +38,9 @@ public:
     void fetch( Type );
     bool fetching( Type ) const;
 
+    void setBodyWindow( uint );
+    void setHeaderFields( const class EStringList & );
+
     void execute();
 
     bool done() const;
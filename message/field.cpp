@@ -11,7 +11,9 @@
 #include "addressfield.h"
 #include "ustringlist.h"
 #include "estringlist.h"
+#include "allocator.h"
 #include "parser.h"
+#include "dict.h"
 #include "utf.h"
 
 static struct {
@@ -54,6 +56,33 @@ static struct {
 };
 
 
+static Dict<HeaderField::Type> * fieldTypes = 0;
+
+
+/*! This file-local helper returns the Type corresponding to the
+    header-cased field name \a n, or Other if the name isn't one we
+    know. A dict lookup, so that the unknown names which dominate
+    DKIM- and ARC-laden headers don't scan the whole table and fail.
+*/
+
+static HeaderField::Type typeOfField( const EString & n )
+{
+    if ( !fieldTypes ) {
+        fieldTypes = new Dict<HeaderField::Type>;
+        Allocator::addEternal( fieldTypes, "header field types" );
+        uint i = 0;
+        while ( fieldNames[i].name ) {
+            fieldTypes->insert( fieldNames[i].name, &fieldNames[i].type );
+            i++;
+        }
+    }
+    HeaderField::Type * t = fieldTypes->find( n );
+    if ( t )
+        return *t;
+    return HeaderField::Other;
+}
+
+
 class HeaderFieldData
     : public Garbage
 {
@@ -87,12 +116,8 @@ public:
 
 HeaderField *HeaderField::fieldNamed( const EString &name )
 {
-    int i = 0;
     EString n = name.headerCased();
-    while ( fieldNames[i].name && n != fieldNames[i].name )
-        i++;
-
-    HeaderField::Type t = fieldNames[i].type;
+    HeaderField::Type t = typeOfField( n );
     HeaderField * hf = 0;
 
     switch ( t ) {
@@ -109,7 +134,7 @@ HeaderField *HeaderField::fieldNamed( const EString &name )
         if ( n == "List-Id" )
             hf = new ListIdField;
         else
-            hf = new HeaderField( fieldNames[i].type );
+            hf = new HeaderField( t );
         break;
 
     case From:
@@ -442,7 +467,7 @@ void HeaderField::parseText( const EString &s )
     }
 
     if ( ( !h && s.contains( "=?" ) && s.contains( "?=" ) ) ||
-         ( value().utf8().contains("=?") && value().utf8().contains("?=") ) ) {
+         ( value().contains( "=?" ) && value().contains( "?=" ) ) ) {
         // common: Subject: =?ISO-8859-1?q?foo bar baz?=
         // unusual, but seen: Subject: =?ISO-8859-1?q?foo bar?= baz
         EmailParser p1( s.simplified() );
@@ -470,7 +495,7 @@ void HeaderField::parseText( const EString &s )
         }
         EmailParser p2( tmp );
         UString t( p2.text().simplified() );
-        if ( p2.atEnd() && !t.utf8().contains( "?=" ) ) {
+        if ( p2.atEnd() && !t.contains( "?=" ) ) {
             setValue( t );
             h = true;
         }
@@ -665,12 +690,10 @@ uint HeaderField::fieldType( const EString & n )
     EString fn = n.headerCased();
     if ( fn.endsWith( ":" ) )
         fn.truncate( fn.length()-1 );
-    uint i = 0;
-    while ( fieldNames[i].name && fn != fieldNames[i].name )
-        i++;
-    if ( fieldNames[i].name )
-        return fieldNames[i].type;
-    return 0;
+    HeaderField::Type t = typeOfField( fn );
+    if ( t == Other )
+        return 0;
+    return t;
 }
 
 
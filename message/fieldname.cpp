@@ -0,0 +1,168 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "fieldname.h"
+
+#include "configuration.h"
+#include "allocator.h"
+#include "dbsignal.h"
+#include "query.h"
+#include "scope.h"
+#include "event.h"
+#include "dict.h"
+#include "map.h"
+#include "log.h"
+
+
+class FieldNameData
+    : public EventHandler
+{
+public:
+    FieldNameData( FieldName * owner )
+        : EventHandler(),
+          that( owner ), largest( 0 ), again( false ), q( 0 ) {}
+
+    void execute() { again = true; that->execute(); }
+
+    FieldName * that;
+    Dict<uint> byName;
+    Map<EString> byId;
+    uint largest;
+    bool again;
+
+    Query * q;
+};
+
+
+static FieldName * fieldNameWatcher = 0;
+
+
+/*! Constructs a FieldName cache. The new object will listen for new
+    field names continuously.
+*/
+
+FieldName::FieldName()
+    : EventHandler(), d( new FieldNameData( this ) )
+{
+    setLog( new Log );
+    (void)new DatabaseSignal( "field_names_extended", d );
+}
+
+
+/*! Updates the RAM cache from the database table. */
+
+void FieldName::execute()
+{
+    if ( !d->q ) {
+        d->again = false;
+        d->q = new Query( "select id, name from field_names where id > $1",
+                          this );
+        d->q->bind( 1, d->largest );
+        d->q->execute();
+    }
+
+    while ( d->q->hasResults() ) {
+        Row * r = d->q->nextRow();
+        EString name = r->getEString( "name" );
+        uint * id = (uint *)Allocator::alloc( sizeof(uint), 0 );
+        *id = r->getInt( "id" );
+        d->byName.insert( name, id );
+        d->byId.insert( *id, new EString( name ) );
+        if ( *id > d->largest )
+            d->largest = *id;
+    }
+    if ( !d->q->done() )
+        return;
+
+    d->q = 0;
+    if ( d->again ) {
+        d->again = false;
+        execute();
+    }
+}
+
+
+class FieldNameObliterator
+    : public EventHandler
+{
+public:
+    FieldNameObliterator(): EventHandler() {
+        setLog( new Log );
+        (void)new DatabaseSignal( "obliterated", this );
+    }
+    void execute() {
+        ::fieldNameWatcher->d->largest = 0;
+        ::fieldNameWatcher->d->byName.clear();
+        ::fieldNameWatcher->d->byId.clear();
+        ::fieldNameWatcher->d->again = true;
+        ::fieldNameWatcher->execute();
+    }
+};
+
+
+/*! \class FieldName fieldname.h
+    Maps header field names to ids using the field_names table.
+
+    The well-known header fields have fixed ids (see HeaderField), but
+    any other field a message uses gets a row in field_names, and
+    header_fields refers to it by id. This class caches that table in
+    RAM, just as Flag does for flag_names, so that the Injector does
+    not need to look up the same names for every batch it injects.
+*/
+
+
+/*! This function must be called once to set up and load the
+    field_names table. It is called lazily by id() and name().
+*/
+
+void FieldName::setup()
+{
+    if ( ::fieldNameWatcher )
+        return;
+
+    ::fieldNameWatcher = new FieldName;
+    ::fieldNameWatcher->execute();
+    if ( !Configuration::toggle( Configuration::Security ) )
+        (void)new FieldNameObliterator;
+}
+
+
+/*! Returns the id of the field with the given \a name, or 0 if the
+    field is not known. */
+
+uint FieldName::id( const EString & name )
+{
+    if ( !::fieldNameWatcher )
+        setup();
+
+    uint * p = ::fieldNameWatcher->d->byName.find( name );
+    if ( !p )
+        return 0;
+
+    return * p;
+}
+
+
+/*! Returns the name of the field with the given \a id, or an empty
+    string if the field is not known. */
+
+EString FieldName::name( uint id )
+{
+    if ( !::fieldNameWatcher )
+        setup();
+
+    EString * p = ::fieldNameWatcher->d->byId.find( id );
+    if ( p )
+        return *p;
+
+    return "";
+}
+
+
+/*! Returns the largest ID currently used by a field name. */
+
+uint FieldName::largestId()
+{
+    if ( ::fieldNameWatcher )
+        return ::fieldNameWatcher->d->largest;
+    return 0;
+}
@@ -0,0 +1,35 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef FIELDNAME_H
+#define FIELDNAME_H
+
+#include "estring.h"
+#include "event.h"
+
+
+class Query;
+
+
+class FieldName
+    : public EventHandler
+{
+private:
+    FieldName();
+
+public:
+    static void setup();
+
+    static EString name( uint );
+    static uint id( const EString & );
+
+    static uint largestId();
+
+    void execute();
+
+private:
+    friend class FieldNameObliterator;
+    class FieldNameData * d;
+};
+
+
+#endif
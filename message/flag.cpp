@@ -177,7 +177,7 @@ EString Flag::name( uint id )
 
 
 /*! Returns a list of all current known flags (except "\recent" of
-    course), sorted by the lowercase version of their names.
+    course), in no particular order.
 */
 
 EStringList Flag::allFlags()
@@ -186,7 +186,7 @@ EStringList Flag::allFlags()
         setup();
 
     EStringList r;
-    Map<uint>::Iterator i( ::flagWatcher->d->byName );
+    Dict<uint>::Iterator i( ::flagWatcher->d->byName );
     while ( i ) {
         r.append( ::flagWatcher->d->byId.find( *i ) );
         ++i;
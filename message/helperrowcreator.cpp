@@ -3,11 +3,14 @@
 #include "helperrowcreator.h"
 
 #include "dict.h"
+#include "cache.h"
 #include "scope.h"
+#include "dbsignal.h"
 #include "allocator.h"
 #include "transaction.h"
 #include "address.h"
 #include "query.h"
+#include "fieldname.h"
 #include "flag.h"
 #include "utf.h"
 
@@ -332,7 +335,7 @@ Query * FieldNameCreator::makeSelect()
     EStringList sl;
     EStringList::Iterator it( names );
     while ( it ) {
-        if ( !id( *it ) )
+        if ( !id( *it ) && !FieldName::id( *it ) )
             sl.append( *it );
         ++it;
     }
@@ -351,7 +354,7 @@ Query * FieldNameCreator::makeCopy()
     EStringList::Iterator it( names );
     uint count = 0;
     while ( it ) {
-        if ( !id( *it ) ) {
+        if ( !id( *it ) && !FieldName::id( *it ) ) {
             q->bind( 1, *it );
             q->submitLine();
             count++;
@@ -428,6 +431,86 @@ Query * AnnotationNameCreator::makeCopy()
 }
 
 
+// a process-wide cache of committed address IDs, so that concurrent
+// injections of the same correspondents (common under LMTP bursts)
+// don't each have to select the same rows. flags and field names have
+// the same need, but Flag and FieldName already cache those tables in
+// their entirety.
+
+class AddressIdCache
+    : public Cache
+{
+public:
+    AddressIdCache(): Cache( 4 ) {}
+
+    Dict<uint> ids;
+
+    void clear() { ids.clear(); }
+    uint size() const {
+        // a key is some fifty bytes, plus slot and id overhead
+        return ids.count() * 80;
+    }
+};
+
+static AddressIdCache * idCache = 0;
+
+
+// aox vacuum deletes unreferenced addresses rows, and a stale cached
+// id would make every injection for that correspondent violate its
+// foreign key until the server is restarted. vacuum therefore says
+// "notify addresses_updated", and we empty the cache on hearing it.
+
+class AddressCacheFlusher
+    : public EventHandler
+{
+public:
+    AddressCacheFlusher() {
+        (void)new DatabaseSignal( "addresses_updated", this );
+    }
+    void execute() {
+        if ( ::idCache )
+            ::idCache->clear();
+    }
+};
+
+
+/*! Records that the committed addresses row for \a address has id
+    \a id, so that the next AddressCreator in this process can use it
+    without asking the database.
+*/
+
+void AddressCreator::cacheId( Address * address, uint id )
+{
+    if ( !idCache ) {
+        idCache = new AddressIdCache;
+        (void)new AddressCacheFlusher;
+    }
+    uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
+    *tmp = id;
+    idCache->ids.insert( key( address ), tmp );
+}
+
+
+/*! Looks in the process-wide cache for addresses which some earlier
+    creator has already resolved, so makeSelect() has less to do.
+*/
+
+void AddressCreator::useCache()
+{
+    if ( !idCache )
+        return;
+    Dict<Address>::Iterator i( a );
+    while ( i ) {
+        if ( !i->id() ) {
+            uint * id = idCache->ids.find( key( i ) );
+            if ( id )
+                i->setId( *id );
+        }
+        ++i;
+    }
+}
+
+
 /*! \class AddressCreator helperrowcreator.h
 
     The AddressCreator ensures that a set of addresses exist in the
@@ -567,8 +650,15 @@ void AddressCreator::processSelect( Query * q )
                          r->getUString( "localpart" ),
                          r->getUString( "domain" ) );
         Address * our = a->find( key( c ) );
-        if ( our )
+        if ( our ) {
             our->setId( r->getInt( "id" ) );
+            // rows seen before we've inserted anything are committed,
+            // so other injectors may rely on them. rows seen later
+            // may be our own uncommitted inserts, which mustn't enter
+            // the shared cache until a later creator selects them.
+            if ( !inserted() && !insert )
+                cacheId( our, our->id() );
+        }
         else
             log( "Unexpected result from db: " + c->toString( false ) );
     }
@@ -629,6 +719,7 @@ static uint useTempTable = 30;
 void AddressCreator::execute()
 {
     Scope x( log() );
+    useCache();
     if ( !decided ) {
         uint c = 0;
         Dict<Address>::Iterator i( a );
@@ -104,6 +104,8 @@ private:
 
 private:
     uint param( Dict<uint> *, const EString &, uint &, Query * );
+    void cacheId( Address *, uint );
+    void useCache();
 
 private:
     Dict<Address> * a;
@@ -0,0 +1,387 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "imapstructure.h"
+
+#include "estringlist.h"
+#include "mimefields.h"
+#include "bodypart.h"
+#include "message.h"
+#include "ustring.h"
+#include "header.h"
+#include "field.h"
+#include "address.h"
+#include "date.h"
+#include "log.h"
+
+
+/*! \class ImapStructure imapstructure.h
+
+    The ImapStructure class serializes a parsed Message into the IMAP
+    ENVELOPE and BODY/BODYSTRUCTURE productions. The functions live
+    here rather than in the Fetch handler so that the Injector can
+    compute the same strings at injection time and store them in the
+    bodystructures table, where Fetch finds them with a single indexed
+    lookup.
+
+    Each function takes a flag saying whether the reader understands
+    unquoted unicode (RFC 6855); the cached forms are always computed
+    for classic MIME readers.
+*/
+
+
+/*! This helper returns \a s, quoted such that an IMAP client will
+    recover \a s. The quoted string fits the IMAP productions astring,
+    nstring or string, depending on \a mode. The default is string.
+
+    We avoid using the escape characters and unusual atoms. "\"" is a
+    legal one-character string. But we're easy on the poor client
+    parser, and we make life easy for ourselves too.
+*/
+
+EString ImapStructure::quoted( const EString & s, const QuoteMode mode )
+{
+    // if we're asked for an nstring, NIL may do
+    if ( mode == NString && s.isEmpty() )
+        return "NIL";
+
+    // if the string is really boring and we can send an atom, we do
+    if ( mode == AString && s.boring() &&
+         !( s.length() == 3 && s.lower() == "nil" ) )
+        return s;
+
+    // will quoted do?
+    uint i = 0;
+    while ( i < s.length() &&
+            s[i] >= ' ' && s[i] < 128 &&
+            s[i] != '\\' && s[i] != '"' )
+        i++;
+    if ( i >= s.length() ) // yes
+        return s.quoted( '"' );
+
+    EString r;
+    r.reserve( s.length() + 20 );
+    // if there's a null byte, we need to send a literal8
+    if ( s.contains( 0 ) )
+        r.append( '~' );
+    r.append( '{' );
+    r.appendNumber( s.length() );
+    r.append( "}\r\n" );
+    r.append( s );
+    return r;
+}
+
+
+static EString hf( Header * f, HeaderField::Type t, bool unicodable )
+{
+    List<Address> * a = f->addresses( t );
+    if ( !a || a->isEmpty() )
+        return "NIL ";
+    EString r;
+    r.reserve( 50 );
+    r.append( "(" );
+    List<Address>::Iterator it( a );
+    while ( it ) {
+        r.append( "(" );
+        if ( it->type() == Address::EmptyGroup ) {
+            r.append( "NIL NIL " );
+            r.append( ImapStructure::quoted( it->name( !unicodable ),
+                                             ImapStructure::NString ) );
+            r.append( " NIL)(NIL NIL NIL NIL" );
+        } else if ( it->type() == Address::Local ||
+                    it->type() == Address::Normal ) {
+            UString u = it->uname();
+            EString eu;
+            if ( u.isAscii() || unicodable )
+                eu = u.simplified().utf8();
+            else
+                eu = HeaderField::encodePhrase( u );
+            r.append( ImapStructure::quoted( eu, ImapStructure::NString ) );
+            r.append( " NIL " );
+            if ( unicodable ||
+                 ( it->localpart().isAscii() && it->domain().isAscii() ) ) {
+                r.append( ImapStructure::quoted( it->localpart().utf8(),
+                                                 ImapStructure::NString ) );
+                r.append( " " );
+                if ( it->domain().isEmpty() )
+                    r.append( "\" \"" ); // RFC 3501, page 77 near bottom
+                else
+                    r.append( ImapStructure::quoted( it->domain().utf8(),
+                                                     ImapStructure::NString ) );
+            }
+            else {
+                r.append( "noreply unicode-needed.invalid" );
+            }
+        }
+        r.append( ")" );
+        ++it;
+    }
+    r.append( ") " );
+    return r;
+}
+
+
+/*! Returns the IMAP envelope for \a m, assuming the reader
+    understands unquoted unicode if \a unicode is true.
+*/
+
+EString ImapStructure::envelope( Message * m, bool unicode )
+{
+    Header * h = m->header();
+
+    // envelope = "(" env-date SP env-subject SP env-from SP
+    //                env-sender SP env-reply-to SP env-to SP env-cc SP
+    //                env-bcc SP env-in-reply-to SP env-message-id ")"
+
+    EString r;
+    r.reserve( 300 );
+    r.append( "(" );
+
+    Date * date = h->date();
+    if ( date )
+        r.append( quoted( date->rfc822(), NString ) );
+    else
+        r.append( "NIL" );
+    r.append( " " );
+
+    r.append( quoted( h->subject(), NString ) + " " );
+    r.append( hf( h, HeaderField::From, unicode ) );
+    r.append( hf( h, HeaderField::Sender, unicode ) );
+    r.append( hf( h, HeaderField::ReplyTo, unicode ) );
+    r.append( hf( h, HeaderField::To, unicode ) );
+    r.append( hf( h, HeaderField::Cc, unicode ) );
+    r.append( hf( h, HeaderField::Bcc, unicode ) );
+    r.append( quoted( h->inReplyTo(), NString ) + " " );
+    r.append( quoted( h->messageId(), NString ) );
+
+    r.append( ")" );
+    return r;
+}
+
+
+static EString parameterEString( MimeField *mf )
+{
+    EStringList *p = 0;
+
+    if ( mf )
+        p = mf->parameters();
+    if ( !mf || !p || p->isEmpty() )
+        return "NIL";
+
+    EStringList l;
+    EStringList::Iterator it( p );
+    while ( it ) {
+        l.append( ImapStructure::quoted( *it ) );
+        l.append( ImapStructure::quoted( mf->parameter( *it ) ) );
+        ++it;
+    }
+
+    EString r = l.join( " " );
+    r.prepend( "(" );
+    r.append( ")" );
+    return r;
+}
+
+
+static EString dispositionEString( ContentDisposition *cd )
+{
+    if ( !cd )
+        return "NIL";
+
+    EString s;
+    switch ( cd->disposition() ) {
+    case ContentDisposition::Inline:
+        s = "inline";
+        break;
+    case ContentDisposition::Attachment:
+        s = "attachment";
+        break;
+    }
+
+    return "(\"" + s + "\" " + parameterEString( cd ) + ")";
+}
+
+
+static EString languageEString( ContentLanguage *cl )
+{
+    if ( !cl )
+        return "NIL";
+
+    EStringList m;
+    const EStringList *l = cl->languages();
+    EStringList::Iterator it( l );
+    while ( it ) {
+        m.append( ImapStructure::quoted( *it ) );
+        ++it;
+    }
+
+    if ( l->count() == 1 )
+        return *m.first();
+    EString r = m.join( " " );
+    r.prepend( "(" );
+    r.append( ")" );
+    return r;
+}
+
+
+/*! Returns either the IMAP BODY or BODYSTRUCTURE production for \a
+    m. If \a extended is true, BODYSTRUCTURE is returned. If it's
+    false, BODY. \a unicode says whether the reader understands
+    unquoted unicode.
+*/
+
+EString ImapStructure::bodyStructure( Multipart * m, bool extended,
+                                      bool unicode )
+{
+    EString r;
+    bool isSigned = false;
+    Multipart * ancestor = m;
+    while ( ancestor->parent() != NULL )
+        ancestor = ancestor->parent();
+    if ( ancestor->isMessage() ) {
+        Message *msg = (Message *)ancestor;
+        if ( msg->hasPGPsignedPart() ) {
+            ::log( "ImapStructure::bodyStructure - signed message",
+                   Log::Debug );
+            isSigned = true;
+        }
+    }
+
+    Header * hdr = m->header();
+    ContentType * ct = hdr->contentType();
+    if ( ct && ct->type() == "multipart" ) {
+        EStringList children;
+        List< Bodypart >::Iterator it( m->children() );
+        if ( ( m == ancestor ) && isSigned ) {  // if top level, consider raw part
+            if ( !extended ) {
+                ::log( "ImapStructure::bodyStructure - append raw part",
+                       Log::Debug );
+                children.append( bodyStructure( it, extended, unicode ) );
+                uint i;
+                for ( i = 1; i <= m->children()->count(); i++ )
+                    ++it;
+            } else {  // skip raw part
+                ::log( "ImapStructure::bodyStructure - skip raw part",
+                       Log::Debug );
+                ++it;
+            }
+        }
+        while ( it ) {
+            children.append( bodyStructure( it, extended, unicode ) );
+            ++it;
+        }
+
+        r = children.join( "" );
+        r.prepend( "(" );
+        r.append( " " );
+        r.append( quoted( ct->subtype() ));
+
+        if ( extended ) {
+            r.append( " " );
+            r.append( parameterEString( ct ) );
+            r.append( " " );
+            r.append( dispositionEString( hdr->contentDisposition() ) );
+            r.append( " " );
+            r.append( languageEString( hdr->contentLanguage() ) );
+            r.append( " " );
+            r.append( quoted( hdr->contentLocation(), NString ) );
+        }
+
+        r.append( ")" );
+    }
+    else {
+        r = singlePartStructure( m, extended, unicode );
+    }
+    return r;
+}
+
+
+/*! Returns the structure of the single-part bodypart \a mp.
+
+    If \a extended is true, extended BODYSTRUCTURE attributes are
+    included. \a unicode says whether the reader understands unquoted
+    unicode.
+*/
+
+EString ImapStructure::singlePartStructure( Multipart * mp, bool extended,
+                                            bool unicode )
+{
+    EStringList l;
+
+    if ( !mp )
+        return "";
+
+    ContentType * ct = mp->header()->contentType();
+
+    if ( ct ) {
+        l.append( quoted( ct->type() ) );
+        l.append( quoted( ct->subtype() ) );
+    }
+    else {
+        // XXX: What happens to the default if this is a /digest?
+        l.append( "\"text\"" );
+        l.append( "\"plain\"" );
+    }
+
+    l.append( parameterEString( ct ) );
+    l.append( quoted( mp->header()->messageId( HeaderField::ContentId ),
+                      NString ) );
+    l.append( quoted( mp->header()->contentDescription(), NString ) );
+
+    if ( mp->header()->contentTransferEncoding() ) {
+        switch( mp->header()->contentTransferEncoding()->encoding() ) {
+        case EString::Binary:
+            l.append( "\"8BIT\"" ); // hm. is this entirely sound?
+            break;
+        case EString::Uuencode:
+            l.append( "\"x-uuencode\"" ); // should never happen
+            break;
+        case EString::Base64:
+            l.append( "\"BASE64\"" );
+            break;
+        case EString::QP:
+            l.append( "\"QUOTED-PRINTABLE\"" );
+            break;
+        }
+    }
+    else {
+        l.append( "\"7BIT\"" );
+    }
+
+    Bodypart * bp = 0;
+    if ( mp->isBodypart() )
+        bp = (Bodypart*)mp;
+    else if ( mp->isMessage() )
+        bp = ((Message*)mp)->children()->first();
+
+    if ( bp ) {
+        l.append( fn( bp->numEncodedBytes() ) );
+        if ( ct && ct->type() == "message" && ct->subtype() == "rfc822" ) {
+            // body-type-msg   = media-message SP body-fields SP envelope
+            //                   SP body SP body-fld-lines
+            l.append( envelope( bp->message(), unicode ) );
+            l.append( bodyStructure( bp->message(), extended, unicode ) );
+            l.append( fn ( bp->numEncodedLines() ) );
+        }
+        else if ( !ct || ct->type() == "text" ) {
+            // body-type-text  = media-text SP body-fields SP body-fld-lines
+            l.append( fn( bp->numEncodedLines() ) );
+        }
+    }
+
+    if ( extended ) {
+        EString md5;
+        HeaderField *f = mp->header()->field( HeaderField::ContentMd5 );
+        if ( f )
+            md5 = f->rfc822( false );
+
+        l.append( quoted( md5, NString ) );
+        l.append( dispositionEString( mp->header()->contentDisposition() ) );
+        l.append( languageEString( mp->header()->contentLanguage() ) );
+        l.append( quoted( mp->header()->contentLocation(), NString ) );
+    }
+
+    EString r = l.join( " " );
+    r.prepend( "(" );
+    r.append( ")" );
+    return r;
+}
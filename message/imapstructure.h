@@ -0,0 +1,26 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef IMAPSTRUCTURE_H
+#define IMAPSTRUCTURE_H
+
+#include "estring.h"
+
+class Message;
+class Multipart;
+
+
+class ImapStructure
+{
+public:
+    enum QuoteMode {
+        AString, NString, PlainString
+    };
+    static EString quoted( const EString &, const QuoteMode = PlainString );
+
+    static EString envelope( Message *, bool );
+    static EString bodyStructure( Multipart *, bool, bool );
+    static EString singlePartStructure( Multipart *, bool, bool );
+};
+
+
+#endif
@@ -5,6 +5,7 @@
 #include "map.h"
 #include "dict.h"
 #include "flag.h"
+#include "fieldname.h"
 #include "query.h"
 #include "timer.h"
 #include "address.h"
@@ -15,6 +16,7 @@
 #include "datefield.h"
 #include "mimefields.h"
 #include "messagecache.h"
+#include "imapstructure.h"
 #include "helperrowcreator.h"
 #include "addressfield.h"
 #include "transaction.h"
@@ -129,7 +131,7 @@ public:
     HelperRowCreator * flagCreator;
     HelperRowCreator * annotationNameCreator;
 
-    Query * lockUidnext;
+    List<Query> * lockUidnext;
     Query * select;
     Query * insert;
 
@@ -393,8 +395,10 @@ void Injector::execute()
             insertDeliveries();
             insertThreadIndexes();
             next();
-            if ( !d->mailboxes.isEmpty() )
+            if ( !d->mailboxes.isEmpty() ) {
                 Mailbox::refreshMailboxes( d->transaction );
+                announceInjection();
+            }
             d->transaction->commit();
             break;
 
@@ -408,6 +412,7 @@ void Injector::execute()
             }
             else {
                 ::successes->tick();
+                cacheMessages();
             }
 
             next();
@@ -955,14 +960,16 @@ void Injector::convertThreadIndex()
             ante.add( r->getInt( "message" ) );
         }
 
+        uint ti = FieldName::id( "Thread-Index" );
+        if ( !ti && d->fieldNameCreator )
+            ti = d->fieldNameCreator->id( "Thread-Index" );
         d->findMessagesInOutlookThreads
             = new Query( "select message, field, value "
                          "from header_fields "
                          "where message=any($1) and part='' and ("
                          "field=" + fn ( HeaderField::MessageId ) + " or "
                          "field=" + fn ( HeaderField::References ) + " or "
-                         "field=" + fn ( d->fieldNameCreator->id(
-                                             "Thread-Index" ) ) + ") "
+                         "field=" + fn ( ti ) + ") "
                          "order by field desc",
                          this );
         d->findMessagesInOutlookThreads->bind( 1, ante );
@@ -1427,9 +1434,12 @@ void Injector::selectUids()
     // message.
     //
     // To protect against concurrent injection into the same
-    // mailboxes, we hold a write lock on the mailboxes during
-    // injection; thus, the Injectors try to acquire locks in the same
-    // order to avoid deadlock.
+    // mailboxes, we take and increment uidnext/nextmodseq in a single
+    // atomic update per mailbox, so the row lock is taken and the
+    // counters advanced in one exchange instead of a select-for-update
+    // followed by an update. The updates are enqueued in mailbox id
+    // order (Map iterates in key order); thus, the Injectors acquire
+    // their locks in the same order and avoid deadlock.
 
     if ( !d->lockUidnext ) {
         if ( d->mailboxes.isEmpty() ) {
@@ -1437,85 +1447,101 @@ void Injector::selectUids()
             return;
         }
 
-        IntegerSet ids;
+        d->lockUidnext = new List<Query>;
         Map<InjectorData::Mailbox>::Iterator mi( d->mailboxes );
         while ( mi ) {
-            ids.add( mi->mailbox->id() );
+            InjectorData::Mailbox * mb = mi;
+
+            // If we have sessions listening to the mailbox, they get
+            // to see the messages as \Recent, and first_recent moves
+            // along with uidnext. Otherwise, whoever opens the
+            // mailbox next will update first_recent.
+
+            List<Session>::Iterator si( mb->mailbox->sessions() );
+            Query * u;
+            if ( si )
+                u = new Query( "update mailboxes "
+                               "set uidnext=uidnext+$2,"
+                               "nextmodseq=nextmodseq+1,"
+                               "first_recent=case "
+                               "when first_recent=uidnext "
+                               "then first_recent+$2 "
+                               "else first_recent end "
+                               "where id=$1 "
+                               "returning id,uidnext-$2 as uidnext,"
+                               "nextmodseq-1 as nextmodseq,"
+                               "(first_recent=uidnext) as recentin",
+                               this );
+            else
+                u = new Query( "update mailboxes "
+                               "set uidnext=uidnext+$2,"
+                               "nextmodseq=nextmodseq+1 "
+                               "where id=$1 "
+                               "returning id,uidnext-$2 as uidnext,"
+                               "nextmodseq-1 as nextmodseq,"
+                               "false as recentin",
+                               this );
+            u->bind( 1, mb->mailbox->id() );
+            u->bind( 2, mb->messages.count() );
+            d->lockUidnext->append( u );
+            d->transaction->enqueue( u );
             ++mi;
         }
-
-        d->lockUidnext = new Query(
-            "select id,uidnext,nextmodseq,first_recent from mailboxes "
-            "where id=any($1) order by id for update", this );
-        d->lockUidnext->bind( 1, ids );
-        d->transaction->enqueue( d->lockUidnext );
         d->transaction->execute();
     }
 
-    while ( d->lockUidnext->hasResults() ) {
-        Row * r = d->lockUidnext->nextRow();
-        InjectorData::Mailbox * mb = d->mailboxes.find( r->getInt( "id" ) );
-        uint uidnext = r->getInt( "uidnext" );
-        int64 nextms = r->getBigint( "nextmodseq" );
-
-        if ( uidnext > 0x7ff00000 ) {
-            Log::Severity level = Log::Significant;
-            if ( uidnext > 0x7fffff00 )
-                level = Log::Error;
-            log( "Note: Mailbox " + mb->mailbox->name().ascii() +
-                 " only has " + fn ( 0x7fffffff - uidnext ) +
-                 " more usable UIDs. Please contact info@aox.org"
-                 " to resolve this problem.", level );
-        }
-
-        // Any messages in this mailbox are assigned consecutive uids
-        // starting with uidnext, but all of them get the same modseq.
-
-        uint n = 0;
-        List<Injectee>::Iterator it( mb->messages );
-        while ( it ) {
-            Injectee * m = it;
-            m->setUid( mb->mailbox, uidnext+n );
-            m->setModSeq( mb->mailbox, nextms );
-            n++;
-            ++it;
-        }
-        if ( n )
-            log( "Using UIDs " + fn( uidnext ) + "-" + fn( uidnext + n - 1 ) +
-                 " in mailbox " + mb->mailbox->name().utf8() );
+    bool done = true;
+    List<Query>::Iterator q( d->lockUidnext );
+    while ( q ) {
+        if ( !q->done() )
+            done = false;
+
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            InjectorData::Mailbox * mb =
+                d->mailboxes.find( r->getInt( "id" ) );
+            uint uidnext = r->getInt( "uidnext" );
+            int64 nextms = r->getBigint( "nextmodseq" );
+
+            if ( uidnext > 0x7ff00000 ) {
+                Log::Severity level = Log::Significant;
+                if ( uidnext > 0x7fffff00 )
+                    level = Log::Error;
+                log( "Note: Mailbox " + mb->mailbox->name().ascii() +
+                     " only has " + fn ( 0x7fffffff - uidnext ) +
+                     " more usable UIDs. Please contact info@aox.org"
+                     " to resolve this problem.", level );
+            }
 
-        // If we have sessions listening to the mailbox, then they get
-        // to see the messages as \Recent. Otherwise, whoever opens
-        // the mailbox next will update first_recent.
+            // Any messages in this mailbox are assigned consecutive
+            // uids starting with uidnext, but all of them get the
+            // same modseq.
 
-        bool recentIn = false;
-        if ( n && r->getInt( "uidnext" ) == r->getInt( "first_recent" ) ) {
-            List<Session>::Iterator si( mb->mailbox->sessions() );
-            if ( si ) {
-                recentIn = true;
-                si->addRecent( uidnext, n );
+            uint n = 0;
+            List<Injectee>::Iterator it( mb->messages );
+            while ( it ) {
+                Injectee * m = it;
+                m->setUid( mb->mailbox, uidnext+n );
+                m->setModSeq( mb->mailbox, nextms );
+                n++;
+                ++it;
+            }
+            if ( n )
+                log( "Using UIDs " + fn( uidnext ) + "-" +
+                     fn( uidnext + n - 1 ) +
+                     " in mailbox " + mb->mailbox->name().utf8() );
+
+            if ( n && r->getBoolean( "recentin" ) ) {
+                List<Session>::Iterator si( mb->mailbox->sessions() );
+                if ( si )
+                    si->addRecent( uidnext, n );
             }
         }
 
-        // Update uidnext and nextmodseq based on what we did above.
-
-        Query * u;
-        if ( recentIn )
-            u = new Query( "update mailboxes "
-                           "set uidnext=uidnext+$2,"
-                           "nextmodseq=nextmodseq+1,"
-                           "first_recent=first_recent+$2 "
-                           "where id=$1", 0 );
-        else
-            u = new Query( "update mailboxes "
-                           "set uidnext=uidnext+$2,nextmodseq=nextmodseq+1 "
-                           "where id=$1", 0 );
-        u->bind( 1, mb->mailbox->id() );
-        u->bind( 2, n );
-        d->transaction->enqueue( u );
+        ++q;
     }
 
-    if ( d->lockUidnext->done() )
+    if ( done )
         next();
 }
 
@@ -1550,6 +1576,12 @@ void Injector::insertMessages()
     Query * qw =
         new Query( "copy unparsed_messages (bodypart) "
                    "from stdin with binary", 0 );
+    Query * qs =
+        new Query( "copy bodystructures (message,envelope,bodystructure) "
+                   "from stdin with binary", 0 );
+    Query * qk =
+        new Query( "copy sort_keys (message,subject,sfrom) "
+                   "from stdin with binary", 0 );
 
     uint flags = 0;
     uint wrapped = 0;
@@ -1568,6 +1600,31 @@ void Injector::insertMessages()
         addPartNumber( qp, mid, "" );
         addHeader( qh, qa, qd, mid, "", m->header() );
 
+        // We also cache the serialized ENVELOPE and BODYSTRUCTURE, so
+        // that the IMAP server can send them without reassembling the
+        // message from its parts.
+
+        qs->bind( 1, mid );
+        qs->bind( 2, ImapStructure::envelope( m, false ) );
+        qs->bind( 3, ImapStructure::bodyStructure( m, true, false ) );
+        qs->submitLine();
+
+        // ... and the normalized sort keys, so that Sort can order by
+        // a single indexed table.
+
+        qk->bind( 1, mid );
+        HeaderField * sf = m->header()->field( HeaderField::Subject );
+        if ( sf )
+            qk->bind( 2, Message::baseSubject( sf->value().simplified() ) );
+        else
+            qk->bindNull( 2 );
+        List<Address> * fl = m->header()->addresses( HeaderField::From );
+        if ( fl && !fl->isEmpty() )
+            qk->bind( 3, fl->first()->localpart() );
+        else
+            qk->bindNull( 3 );
+        qk->submitLine();
+
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
         // don't need to inject them into the database again.
@@ -1648,6 +1705,8 @@ void Injector::insertMessages()
     d->transaction->enqueue( qh );
     d->transaction->enqueue( qa );
     d->transaction->enqueue( qd );
+    d->transaction->enqueue( qs );
+    d->transaction->enqueue( qk );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
@@ -1718,7 +1777,9 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
         }
         else {
             uint t = 0;
-            if ( d->fieldNameCreator )
+            if ( hf->type() == HeaderField::Other )
+                t = FieldName::id( hf->name() );
+            if ( !t && d->fieldNameCreator )
                 t = d->fieldNameCreator->id( hf->name() );
             if ( !t )
                 t = hf->type();
@@ -1900,6 +1961,68 @@ void Injector::insertDeliveries()
 }
 
 
+/*! Tells other interested server processes (e.g. an imapd in another
+    process or on a warm spare host, keeping its message cache hot)
+    that new messages are being injected, and where. The payload is a
+    comma-separated list of mailbox:uid pairs giving the first new UID
+    in each mailbox. The notification is enqueued in the injection
+    transaction, so it is only delivered if the injection commits.
+*/
+
+void Injector::announceInjection()
+{
+    EString payload;
+    Map<InjectorData::Mailbox>::Iterator mi( d->mailboxes );
+    while ( mi && payload.length() < 4000 ) {
+        InjectorData::Mailbox * mb = mi;
+        Injectee * m = mb->messages.firstElement();
+        if ( m && m->uid( mb->mailbox ) ) {
+            if ( !payload.isEmpty() )
+                payload.append( "," );
+            payload.appendNumber( mb->mailbox->id() );
+            payload.append( ":" );
+            payload.appendNumber( m->uid( mb->mailbox ) );
+        }
+        ++mi;
+    }
+    if ( payload.isEmpty() )
+        return;
+    d->transaction->enqueue(
+        new Query( "notify message_injected, '" + payload + "'", 0 ) );
+}
+
+
+/*! Inserts the newly injected messages into the MessageCache, keyed
+    by their new UIDs, for any target mailbox with an active session
+    in this process. An IDLE client told about the arrival tends to
+    FETCH at once, and this way that fetch finds the parsed message we
+    had in hand instead of paying a cold database read.
+
+    Mailboxes nobody is watching are skipped, so bulk imports don't
+    push genuinely hot messages out of the cache. Called only once
+    the injection transaction has committed, so the cache can never
+    get ahead of the database.
+*/
+
+void Injector::cacheMessages()
+{
+    List<Injectee>::Iterator it( d->messages );
+    while ( it ) {
+        Injectee * m = it;
+        ++it;
+        if ( !m->valid() )
+            continue;
+        List<Mailbox>::Iterator mb( m->mailboxes() );
+        while ( mb ) {
+            List<Session> * watchers = mb->sessions();
+            if ( watchers && !watchers->isEmpty() && m->uid( mb ) )
+                MessageCache::insert( mb, m->uid( mb ), m );
+            ++mb;
+        }
+    }
+}
+
+
 /*! Logs a little information about the messages to be injected, and a
     little more for the special case of a single message being injected
     into a single mailbox.
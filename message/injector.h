@@ -86,6 +86,8 @@ private:
     void selectUids();
     void insertMessages();
     void insertDeliveries();
+    void announceInjection();
+    void cacheMessages();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
     void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
     void addMailbox( Query *, Injectee *, Mailbox * );
@@ -5,6 +5,9 @@
 #include "mailbox.h"
 #include "address.h"
 #include "bodypart.h"
+#include "server.h"
+#include "cache.h"
+#include "map.h"
 #include "mimefields.h"
 #include "configuration.h"
 #include "annotation.h"
@@ -286,6 +289,93 @@ EString Message::error() const
 }
 
 
+// rendering the wire form of a big message costs a pass over every
+// bodypart, so when the same message is fetched repeatedly (POP RETR,
+// IMAP BODY[] of whatever attachment is making the rounds), we keep
+// the rendered text around for a while. messages are immutable once
+// they have a database id, so a cached rendering never goes stale,
+// and EString shares the bytes, so handing it out copies nothing.
+
+class WireEntry
+    : public Garbage
+{
+public:
+    WireEntry(): id( 0 ), avoidUtf8( false ), stamp( 0 ) {}
+    EString text;
+    uint id;
+    bool avoidUtf8;
+    uint stamp;
+};
+
+
+class WireCache
+    : public Cache
+{
+public:
+    WireCache(): Cache( 1 ), clock( 0 ) {}
+
+    // two maps, since a message renders differently with and
+    // without utf-8 permitted
+    Map<WireEntry> plain;
+    Map<WireEntry> ascii;
+    uint clock;
+
+    Map<WireEntry> & variant( bool avoidUtf8 ) {
+        return avoidUtf8 ? ascii : plain;
+    }
+
+    void clear() {
+        plain.clear();
+        ascii.clear();
+    }
+
+    uint size() const {
+        uint total = 0;
+        total += sizeOf( plain );
+        total += sizeOf( ascii );
+        return total;
+    }
+
+    static uint sizeOf( const Map<WireEntry> & m ) {
+        uint total = 0;
+        Map<WireEntry>::Iterator e( m );
+        while ( e ) {
+            total += 128 + e->text.length();
+            ++e;
+        }
+        return total;
+    }
+
+    void trim( uint target ) {
+        // order the entries by their use stamps, oldest first
+        Map<WireEntry> byAge;
+        uint total = 0;
+        addByAge( plain, byAge, total );
+        addByAge( ascii, byAge, total );
+        Map<WireEntry>::Iterator o( byAge );
+        while ( o && total > target ) {
+            WireEntry * w = o;
+            ++o;
+            variant( w->avoidUtf8 ).remove( w->id );
+            total -= 128 + w->text.length();
+        }
+    }
+
+    static void addByAge( Map<WireEntry> & m, Map<WireEntry> & byAge,
+                          uint & total ) {
+        Map<WireEntry>::Iterator e( m );
+        while ( e ) {
+            byAge.insert( e->stamp, e );
+            total += 128 + e->text.length();
+            ++e;
+        }
+    }
+};
+
+
+static WireCache * wireCache = 0;
+
+
 /*! Returns the message formatted in RFC 822 (actually 2822) format.
     The return value is a canonical expression of the message, not
     whatever was parsed.
@@ -296,6 +386,20 @@ EString Message::error() const
 
 EString Message::rfc822( bool avoidUtf8 ) const
 {
+    bool cacheable = Server::useCache() &&
+                     d->databaseId &&
+                     d->hasHeaders && d->hasBodies;
+    if ( cacheable ) {
+        if ( !::wireCache )
+            ::wireCache = new WireCache;
+        WireEntry * w =
+            ::wireCache->variant( avoidUtf8 ).find( d->databaseId );
+        if ( w ) {
+            w->stamp = ++::wireCache->clock;
+            return w->text;
+        }
+    }
+
     EString r;
     if ( d->rfc822Size )
         r.reserve( d->rfc822Size );
@@ -306,6 +410,15 @@ EString Message::rfc822( bool avoidUtf8 ) const
     r.append( crlf );
     r.append( body( avoidUtf8 ) );
 
+    if ( cacheable ) {
+        WireEntry * w = new WireEntry;
+        w->text = r;
+        w->id = d->databaseId;
+        w->avoidUtf8 = avoidUtf8;
+        w->stamp = ++::wireCache->clock;
+        ::wireCache->variant( avoidUtf8 ).insert( d->databaseId, w );
+    }
+
     return r;
 }
 
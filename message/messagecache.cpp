@@ -5,20 +5,46 @@
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
+#include "allocator.h"
 #include "map.h"
 
 #include <time.h> // time(0)
 
+#include <zlib.h>
+
 
 static class MessageCache * c = 0;
 
 
+class CachedMessage
+    : public Garbage
+{
+public:
+    CachedMessage(): message( 0 ), mailbox( 0 ), uid( 0 ), stamp( 0 ),
+                     rawLength( 0 ), databaseId( 0 ), threadId( 0 ),
+                     internalDate( 0 ), rfc822Size( 0 ) {}
+    Message * message;
+    uint mailbox;
+    uint uid;
+    uint stamp;
+    // when the message is demoted to the cold tier, message is null
+    // and the following fields describe its compressed form.
+    EString zipped;
+    uint rawLength;
+    uint databaseId;
+    uint threadId;
+    uint internalDate;
+    uint rfc822Size;
+};
+
+
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData(): Garbage(), clock( 0 ) {}
+    Map<Map<CachedMessage> > m;
+    uint clock;
 };
 
 
@@ -28,6 +54,19 @@ public:
   to clear out old Garbage. As a special feature, it can also cache
   messages a few seconds longer, although that should be used
   sparingly.
+
+  Each cached message carries a use stamp, so that when the cache
+  exceeds its share of the byte budget (see Cache::clearAllCaches()),
+  trim() can push the longest-unused messages out of the way and keep
+  the rest.
+
+  The cache has two tiers. Hot entries hold a parsed Message tree.
+  When trim() needs space it first demotes the longest-unused entries
+  to a cold tier, where only a zlib-compressed copy of the message
+  text remains; that is typically a small fraction of the parsed
+  tree, so the same byte budget covers many times as many messages.
+  A find() on a cold entry inflates and reparses the text, which is
+  much cheaper than refetching the message from the database.
 */
 
 
@@ -42,6 +81,97 @@ MessageCache::MessageCache()
 }
 
 
+// the rough cost of keeping a message cached: its text, plus a little
+// for the parsed headers and bodies. cold entries cost only their
+// compressed text.
+
+static uint cost( const CachedMessage * cm )
+{
+    if ( !cm->message )
+        return 256 + cm->zipped.length();
+    return 2048 + cm->message->rfc822Size();
+}
+
+
+// compresses raw quickly (zlib at level 1, since speed matters more
+// than ratio here), or returns an empty string on failure.
+
+static EString zip( const EString & raw )
+{
+    uLongf len = compressBound( raw.length() );
+    char * tmp = (char *)Allocator::alloc( len, 0 );
+    if ( ::compress2( (Bytef *)tmp, &len,
+                      (const Bytef *)raw.data(), raw.length(), 1 ) != Z_OK )
+        return EString();
+    EString r;
+    r.append( tmp, len );
+    return r;
+}
+
+
+// demotes cm to the cold tier, if its message can be rebuilt from its
+// text alone. partially fetched or oddball messages are left alone;
+// trim() evicts those instead.
+
+static void demote( CachedMessage * cm )
+{
+    Message * m = cm->message;
+    if ( !m )
+        return;
+    if ( !m->valid() || m->isWrapped() ||
+         !m->hasHeaders() || !m->hasAddresses() ||
+         !m->hasTrivia() || !m->hasBodies() || !m->hasBytesAndLines() )
+        return;
+    EString raw( m->rfc822( false ) );
+    if ( raw.isEmpty() )
+        return;
+    EString zipped( zip( raw ) );
+    if ( zipped.isEmpty() )
+        return;
+    cm->zipped = zipped;
+    cm->rawLength = raw.length();
+    cm->databaseId = m->databaseId();
+    cm->threadId = m->threadId();
+    cm->internalDate = m->internalDate();
+    cm->rfc822Size = m->rfc822Size();
+    cm->message = 0;
+}
+
+
+// rebuilds a parsed message from cm's cold form and makes cm hot
+// again. returns null (and leaves cm empty) if anything goes wrong.
+
+static Message * rehydrate( CachedMessage * cm )
+{
+    uLongf len = cm->rawLength;
+    char * tmp = (char *)Allocator::alloc( len, 0 );
+    int r = ::uncompress( (Bytef *)tmp, &len,
+                          (const Bytef *)cm->zipped.data(),
+                          cm->zipped.length() );
+    cm->zipped.truncate();
+    if ( r != Z_OK || len != cm->rawLength )
+        return 0;
+
+    Message * m = new Message;
+    EString raw;
+    raw.append( tmp, len );
+    m->parse( raw );
+    if ( !m->valid() )
+        return 0;
+    m->setDatabaseId( cm->databaseId );
+    m->setThreadId( cm->threadId );
+    m->setInternalDate( cm->internalDate );
+    m->setRfc822Size( cm->rfc822Size );
+    m->setHeadersFetched();
+    m->setAddressesFetched();
+    m->setTriviaFetched( true );
+    m->setBodiesFetched();
+    m->setBytesAndLinesFetched();
+    cm->message = m;
+    return m;
+}
+
+
 /*! Inserts \a m into the cache, such that a find( \a mb, \a uid )
     will find it.
 */
@@ -53,12 +183,21 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
         return;
     if ( !c )
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+    Map<CachedMessage> * mbcache = c->d->m.find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
+        mbcache = new Map<CachedMessage>;
         c->d->m.insert( mb->id(), mbcache );
     }
-    mbcache->insert( uid, m );
+    CachedMessage * cm = mbcache->find( uid );
+    if ( !cm ) {
+        cm = new CachedMessage;
+        cm->mailbox = mb->id();
+        cm->uid = uid;
+        mbcache->insert( uid, cm );
+    }
+    cm->message = m;
+    cm->zipped.truncate();
+    cm->stamp = ++c->d->clock;
 }
 
 
@@ -70,10 +209,19 @@ class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
     if ( !c )
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
-    if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+    Map<CachedMessage> * mbcache = c->d->m.find( mailbox->id() );
+    if ( !mbcache )
+        return 0;
+    CachedMessage * cm = mbcache->find( uid );
+    if ( !cm )
+        return 0;
+    if ( !cm->message && !cm->zipped.isEmpty() &&
+         !rehydrate( cm ) ) {
+        mbcache->remove( uid );
+        return 0;
+    }
+    cm->stamp = ++c->d->clock;
+    return cm->message;
 }
 
 
@@ -83,6 +231,72 @@ void MessageCache::clear()
 }
 
 
+/*! Returns the approximate number of bytes the cached messages keep
+    alive.
+*/
+
+uint MessageCache::size() const
+{
+    uint total = 0;
+    Map<Map<CachedMessage> >::Iterator mb( d->m );
+    while ( mb ) {
+        Map<CachedMessage>::Iterator e( *mb );
+        while ( e ) {
+            total += cost( e );
+            ++e;
+        }
+        ++mb;
+    }
+    return total;
+}
+
+
+/*! Demotes and, if need be, evicts the longest-unused messages until
+    the cache costs at most \a target bytes.
+*/
+
+void MessageCache::trim( uint target )
+{
+    // order the entries by their use stamps, oldest first
+    Map<CachedMessage> byAge;
+    uint total = 0;
+    Map<Map<CachedMessage> >::Iterator mb( d->m );
+    while ( mb ) {
+        Map<CachedMessage>::Iterator e( *mb );
+        while ( e ) {
+            byAge.insert( e->stamp, e );
+            total += cost( e );
+            ++e;
+        }
+        ++mb;
+    }
+
+    // first, demote parsed messages to the compressed cold tier,
+    // oldest first...
+    Map<CachedMessage>::Iterator o( byAge );
+    while ( o && total > target ) {
+        CachedMessage * cm = o;
+        ++o;
+        if ( cm->message ) {
+            total -= cost( cm );
+            demote( cm );
+            total += cost( cm );
+        }
+    }
+
+    // ...and if that wasn't enough, evict entries entirely.
+    Map<CachedMessage>::Iterator e( byAge );
+    while ( e && total > target ) {
+        CachedMessage * cm = e;
+        ++e;
+        Map<CachedMessage> * mbcache = d->m.find( cm->mailbox );
+        if ( mbcache )
+            mbcache->remove( cm->uid );
+        total -= cost( cm );
+    }
+}
+
+
 /*! Ensures that there is a message with \a mailbox and \a uid in the
     cache, and returns a pointer to it.
 */
@@ -18,6 +18,8 @@ public:
     static class Message * provide( class Mailbox *, uint );
 
     void clear();
+    uint size() const;
+    void trim( uint );
 
 private:
     class MessageCacheData * d;
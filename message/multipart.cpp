@@ -161,7 +161,7 @@ void Multipart::appendAnyPart( EString &r, const Bodypart * bp,
         bp->appendMultipart( r, avoidUtf8 );
     }
     else {
-        r.append( bp->data().encoded( e, 72 ) );
+        r.append( bp->encodedData( e ) );
     }
 }
 
@@ -175,22 +175,13 @@ void Multipart::appendAnyPart( EString &r, const Bodypart * bp,
 void Multipart::appendTextPart( EString & r, const Bodypart * bp,
                                 ContentType * ct ) const
 {
-    Codec * c = 0;
-
     EString::Encoding e = EString::Binary;
     ContentTransferEncoding * cte
         = bp->header()->contentTransferEncoding();
     if ( cte )
         e = cte->encoding();
 
-    if ( ct && !ct->parameter( "charset" ).isEmpty() )
-        c = Codec::byName( ct->parameter( "charset" ) );
-    if ( !c )
-        c = Codec::byString( bp->text() );
-
-    EString body = c->fromUnicode( bp->text() );
-
-    r.append( body.encoded( e, 72 ) );
+    r.append( bp->encodedText( ct, e ) );
 }
 
 
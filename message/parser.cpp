@@ -4,6 +4,8 @@
 
 #include "ustring.h"
 #include "codec.h"
+#include "cache.h"
+#include "dict.h"
 #include "utf.h"
 
 
@@ -306,6 +308,27 @@ EString EmailParser::mimeValue()
 }
 
 
+// cache of decoded encoded-words. mailing-list traffic repeats the
+// same subjects and display-names across thousands of messages, so
+// a repeated word costs a dictionary probe instead of a charset
+// conversion. keyed by the raw bytes plus the syntax type.
+
+static class EncodedWordCache
+    : public Cache
+{
+public:
+    EncodedWordCache(): Cache( 8 ) {}
+
+    Dict<UString> words;
+
+    void clear() {
+        words.clear();
+    }
+} * ewCache = 0;
+
+static const uint maxCachedWords = 4096;
+
+
 /*! Steps past a MIME encoded-word (as defined in RFC 2047) and returns
     its decoded unicode representation, or an empty string if the cursor
     does not point to a valid encoded-word. The caller is responsible
@@ -320,7 +343,7 @@ UString EmailParser::encodedWord( EncodedText type )
 {
     // encoded-word = "=?" charset '?' encoding '?' encoded-text "?="
 
-    //uint start = pos();
+    uint start = pos();
 
     UString r;
     EString charset;
@@ -405,6 +428,14 @@ UString EmailParser::encodedWord( EncodedText type )
         return r;
     }
 
+    if ( !::ewCache )
+        ::ewCache = new EncodedWordCache;
+    EString raw = str.mid( start, pos() - start );
+    raw.append( (char)( '0' + type ) );
+    UString * cached = ::ewCache->words.find( raw );
+    if ( cached )
+        return *cached;
+
     if ( encoding == EString::QP )
         r = cs->toUnicode( text.deQP( true ) );
     else
@@ -427,6 +458,9 @@ UString EmailParser::encodedWord( EncodedText type )
         }
     }
 
+    if ( ::ewCache->words.count() < maxCachedWords )
+        ::ewCache->words.insert( raw, new UString( r ) );
+
     return r;
 }
 
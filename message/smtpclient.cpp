@@ -28,7 +28,9 @@ public:
           wbt( 0 ), wbs( 0 ),
           enhancedstatuscodes( false ),
           unicode( false ),
-          size( false )
+          size( false ),
+          pipelining( false ), pipelined( false ),
+          rcptCount( 0 ), discard( 0 )
     {}
 
     enum State { Invalid,
@@ -52,6 +54,10 @@ public:
     bool enhancedstatuscodes;
     bool unicode;
     bool size;
+    bool pipelining;
+    bool pipelined;
+    uint rcptCount;
+    uint discard;
     Timer * closeTimer;
     class TimerCloser
         : public EventHandler
@@ -75,19 +81,25 @@ public:
 */
 
 /*! Constructs an SMTP client which will immediately connect to \a
-    address and introduce itself, and then wait politely for something
-    to do.
+    address port \a port and introduce itself, and then wait politely
+    for something to do.
+
+    If \a address resolves to several addresses, connection attempts
+    to them are staggered in parallel and the first one to succeed
+    wins, so one dead smarthost address does not hold up the mail.
 */
 
-SmtpClient::SmtpClient( const Endpoint & address )
-    : Connection( Connection::socket( address.protocol() ),
-                  Connection::SmtpClient ),
-      d( new SmtpClientData )
+SmtpClient::SmtpClient( const EString & address, uint port )
+    : Connection(), d( new SmtpClientData )
 {
-    connect( address );
+    setType( Connection::SmtpClient );
+    if ( address[0] == '/' )
+        connect( Endpoint( address, port ) );
+    else
+        connect( address, port );
     EventLoop::global()->addConnection( this );
     setTimeoutAfter( 4 );
-    log( "Connecting to " + address.string() );
+    log( "Connecting to " + address + " port " + fn( port ) );
     d->timerCloser = new SmtpClientData::TimerCloser( this );
 }
 
@@ -181,6 +193,15 @@ void SmtpClient::parse()
             return;
         extendTimeout( 10 );
         log( "Received: " + *s, Log::Debug );
+        if ( d->discard ) {
+            // responses to commands we pipelined after one that
+            // failed; the server rejects them all, and we only need
+            // to count them off before sending anything else
+            d->discard--;
+            if ( !d->discard )
+                sendCommand();
+            continue;
+        }
         bool ok = false;
         uint response = s->mid( 0, 3 ).number( &ok );
         if ( !ok ) {
@@ -291,6 +312,24 @@ void SmtpClient::sendCommand()
         }
 
         d->state = SmtpClientData::MailFrom;
+        if ( d->pipelining ) {
+            // RFC 2920: send the entire envelope and data as one
+            // group, so the envelope costs a single round trip
+            // instead of one per command. the responses arrive in
+            // order, and the state machine consumes them one by one.
+            d->pipelined = true;
+            d->rcptCount = 0;
+            List<Recipient>::Iterator i( d->dsn->recipients() );
+            while ( i ) {
+                if ( i->action() == Recipient::Unknown ) {
+                    send.append( "\r\nrcpt to:<" +
+                                 i->finalRecipient()->lpdomain() + ">" );
+                    d->rcptCount++;
+                }
+                ++i;
+            }
+            send.append( "\r\ndata" );
+        }
         break;
 
     case SmtpClientData::MailFrom:
@@ -312,12 +351,21 @@ void SmtpClient::sendCommand()
                 send = "data";
                 d->state = SmtpClientData::Data;
             }
+            else if ( d->pipelined ) {
+                // the server is about to reject the data command we
+                // already sent, and handleFailure() deals with that
+                d->state = SmtpClientData::Data;
+            }
             else {
                 finish( "4.5.0" );
                 send = "rset";
                 d->state = SmtpClientData::Rset;
             }
         }
+        if ( d->pipelined )
+            // the commands went out with mail from, so we only had
+            // to move the response cursor along
+            send.truncate();
         break;
 
     case SmtpClientData::Body:
@@ -520,6 +568,11 @@ void SmtpClient::handleFailure( const EString & line )
             d->rcptTo->setAction( Recipient::Delayed, status );
     }
     else {
+        uint discard = 0;
+        if ( d->pipelined && d->state == SmtpClientData::MailFrom )
+            // we pipelined the rcpt and data commands after mail
+            // from, so their rejections are already on the way
+            discard = d->rcptCount + 1;
         List<Recipient>::Iterator i;
         if ( d->dsn )
             i = d->dsn->recipients();
@@ -533,6 +586,11 @@ void SmtpClient::handleFailure( const EString & line )
             ++i;
         }
         d->state = SmtpClientData::Error;
+        if ( discard ) {
+            // parse() calls sendCommand() once they've all arrived
+            d->discard = discard;
+            return;
+        }
     }
     sendCommand();
 }
@@ -618,6 +676,8 @@ void SmtpClient::finish( const char * status )
     d->dotted.truncate();
     d->owner = 0;
     d->log = 0;
+    d->pipelined = false;
+    d->rcptCount = 0;
 }
 
 
@@ -637,6 +697,9 @@ void SmtpClient::recordExtension( const EString & line )
     if ( w == "enhancedstatuscodes" ) {
         d->enhancedstatuscodes = true;
     }
+    else if ( w == "pipelining" ) {
+        d->pipelining = true;
+    }
     else if ( w == "smtputf8" ) {
         d->unicode = true;
     }
@@ -694,9 +757,9 @@ SmtpClient * SmtpClient::provide()
     if ( c )
         return c;
 
-    Endpoint e( Configuration::SmartHostAddress,
-                Configuration::SmartHostPort );
-    return new SmtpClient( e );
+    return new SmtpClient(
+        Configuration::text( Configuration::SmartHostAddress ),
+        Configuration::scalar( Configuration::SmartHostPort ) );
 }
 
 
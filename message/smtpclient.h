@@ -18,7 +18,7 @@ class SmtpClient
     : public Connection
 {
 public:
-    SmtpClient( const Endpoint & );
+    SmtpClient( const EString &, uint );
 
     void react( Event );
 
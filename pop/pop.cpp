@@ -420,6 +420,20 @@ void POP::runCommands()
         d->commands->take( it );
     if ( it )
         it->execute();
+
+    // while the first command runs, start fetching what the next few
+    // will need, so a pipelining client's retrievals overlap instead
+    // of costing one database round trip each. responses are still
+    // written strictly in order, by execute().
+    List< PopCommand >::Iterator pf( d->commands );
+    uint ahead = 0;
+    if ( pf )
+        ++pf;
+    while ( pf && ahead < 4 ) {
+        pf->prefetch();
+        ++pf;
+        ahead++;
+    }
 }
 
 
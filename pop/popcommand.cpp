@@ -29,6 +29,7 @@ public:
           m( 0 ), r( 0 ),
           user( 0 ), mailbox( 0 ), permissions( 0 ),
           session( 0 ), sentFetch( false ), started( false ),
+          prefetched( false ),
           message( 0 ), n( 0 ), findIds( 0 ), map( 0 )
     {}
 
@@ -47,6 +48,7 @@ public:
     IntegerSet set;
     bool sentFetch;
     bool started;
+    bool prefetched;
     Message * message;
     int n;
 
@@ -455,14 +457,19 @@ bool PopCommand::session()
             uint uid = s.smallest();
             s.remove( uid );
             Message * m = MessageCache::provide( d->mailbox, uid );
-            if ( !m->databaseId() )
+            if ( !m->databaseId() || !m->hasTrivia() )
                 r.add( uid );
             d->map->insert( uid, m );
         }
         if ( !r.isEmpty() ) {
-            d->findIds = new Query( "select message, uid "
-                                    "from mailbox_messages "
-                                    "where mailbox=$1 and uid=any($2)",
+            // fetch the sizes along with the message ids, so that
+            // the stat/list/uidl sequence a polling client sends
+            // can be answered without any further queries
+            d->findIds = new Query( "select mm.uid, m.id as message, "
+                                    "m.idate, m.rfc822size, m.thread_root "
+                                    "from mailbox_messages mm "
+                                    "join messages m on (mm.message=m.id) "
+                                    "where mm.mailbox=$1 and mm.uid=any($2)",
                                     this );
             d->findIds->bind( 1, d->mailbox->id() );
             d->findIds->bind( 2, r );
@@ -474,8 +481,16 @@ bool PopCommand::session()
     while ( d->findIds && d->findIds->hasResults() ) {
         Row * r = d->findIds->nextRow();
         Message * m = d->map->find( r->getInt( "uid" ) );
-        if ( m )
+        if ( m ) {
             m->setDatabaseId( r->getInt( "message" ) );
+            m->setInternalDate( r->getInt( "idate" ) );
+            m->setRfc822Size( r->getInt( "rfc822size" ) );
+            if ( r->isNull( "thread_root" ) )
+                m->setThreadId( 0 );
+            else
+                m->setThreadId( r->getInt( "thread_root" ) );
+            m->setTriviaFetched( true );
+        }
     }
 
     d->session->clearUnannounced();
@@ -608,6 +623,80 @@ bool PopCommand::list()
 }
 
 
+// receives completion notice for a prefetch on behalf of a command
+// still waiting in the queue, and lets the queue runner decide what
+// (if anything) can run now
+
+class PopPrefetchHelper
+    : public EventHandler
+{
+public:
+    PopPrefetchHelper( POP * p ): pop( p ) {}
+    void execute() { pop->runCommands(); }
+private:
+    POP * pop;
+};
+
+
+/*! Starts fetching what this command will need from the database, if
+    it is a RETR or TOP command that hasn't run yet. POP::runCommands()
+    calls this for commands waiting behind the one being executed, so
+    that a pipelining client's fetches overlap instead of costing one
+    database round trip each.
+
+    The queued command must not own the prefetch Fetcher: completion
+    calls the owner's execute(), and a queued RETR's execute() would
+    write its response ahead of its turn. The Fetcher's owner is a
+    helper which just pokes POP::runCommands(); retr() re-checks
+    hasHeaders()/hasBodies() when the command reaches the head.
+
+    All parsing, error handling and response emission stays in retr(),
+    which runs once the command reaches the head of the queue; this
+    function gives wrong or unfetchable arguments to retr() untouched.
+*/
+
+void PopCommand::prefetch()
+{
+    if ( d->prefetched || d->started )
+        return;
+    if ( d->cmd != Retr && d->cmd != Top )
+        return;
+
+    ::Session * s = d->pop->session();
+    if ( !s )
+        return;
+
+    bool ok = false;
+    uint msn = 0;
+    if ( d->args->firstElement() )
+        msn = d->args->firstElement()->number( &ok );
+    if ( !ok || msn < 1 || msn > s->count() )
+        return;
+
+    Message * m = d->pop->message( s->uid( msn ) );
+    if ( !m )
+        return;
+
+    bool headerOnly = false;
+    if ( d->cmd == Top ) {
+        EStringList::Iterator a( *d->args );
+        ++a;
+        if ( a )
+            headerOnly = ( a->number( &ok ) == 0 && ok );
+    }
+
+    d->prefetched = true;
+    Fetcher * f = new Fetcher( m, new PopPrefetchHelper( d->pop ) );
+    if ( !m->hasBodies() && !headerOnly )
+        f->fetch( Fetcher::Body );
+    if ( !m->hasHeaders() )
+        f->fetch( Fetcher::OtherHeader );
+    if ( !m->hasAddresses() )
+        f->fetch( Fetcher::Addresses );
+    f->execute();
+}
+
+
 /*! Handles both the RETR (if \a lines is false) and TOP (if \a lines
     is true) commands.
 */
@@ -649,17 +738,23 @@ bool PopCommand::retr( bool lines )
         }
 
         d->started = true;
-        Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
-            f->fetch( Fetcher::Body );
-        if ( !d->message->hasHeaders() )
-            f->fetch( Fetcher::OtherHeader );
-        if ( !d->message->hasAddresses() )
-            f->fetch( Fetcher::Addresses );
-        f->execute();
+        if ( !d->prefetched ) {
+            Fetcher * f = new Fetcher( d->message, this );
+            if ( !d->message->hasBodies() && !( lines && d->n == 0 ) )
+                f->fetch( Fetcher::Body );
+            if ( !d->message->hasHeaders() )
+                f->fetch( Fetcher::OtherHeader );
+            if ( !d->message->hasAddresses() )
+                f->fetch( Fetcher::Addresses );
+            f->execute();
+        }
     }
 
-    if ( !( d->message->hasBodies() &&
+    // top n 0 is what polling clients send for every message; it
+    // needs only the header, so don't wait for (or fetch) the body
+    bool headerOnly = lines && d->n == 0;
+
+    if ( !( ( d->message->hasBodies() || headerOnly ) &&
             d->message->hasHeaders() &&
             d->message->hasAddresses() ) )
         return false;
@@ -673,7 +768,10 @@ bool PopCommand::retr( bool lines )
     }
 
     Buffer * b = new Buffer;
-    b->append( d->message->rfc822( true ) ); // XXX always downgrades
+    if ( headerOnly )
+        b->append( d->message->header()->asText( true ) + "\r\n" );
+    else
+        b->append( d->message->rfc822( true ) ); // XXX always downgrades
 
     int ln = d->n;
     bool header = true;
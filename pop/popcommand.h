@@ -23,6 +23,7 @@ public:
     void execute();
     void finish();
     bool done();
+    void prefetch();
 
 private:
     class PopCommandData * d;
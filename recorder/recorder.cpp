@@ -5,6 +5,7 @@
 #include "file.h"
 #include "event.h"
 #include "scope.h"
+#include "timer.h"
 #include "buffer.h"
 #include "listener.h"
 #include "resolver.h"
@@ -13,6 +14,15 @@
 
 #include <stdio.h> // fprintf, printf
 #include <stdlib.h> // exit
+#include <sys/time.h> // gettimeofday
+
+
+static uint nowMs()
+{
+    struct timeval t;
+    gettimeofday( &t, 0 );
+    return t.tv_sec * 1000 + t.tv_usec / 1000;
+}
 
 
 class RecorderData
@@ -20,11 +30,12 @@ class RecorderData
 {
 public:
     RecorderData()
-        : client( 0 ), server( 0 ), log( 0 )
+        : client( 0 ), server( 0 ), log( 0 ), started( nowMs() )
     {}
     RecorderClient * client;
     RecorderServer * server;
     File * log;
+    uint started;
     EString toServer;
     EString toClient;
 
@@ -52,6 +63,11 @@ void RecorderData::dump( Direction dir )
     if ( !lines )
         return;
     EString f;
+    // a comment with the time since the session started, so that a
+    // replay can compare its own timing against the recording
+    f.append( "# +" );
+    f.appendNumber( nowMs() - started );
+    f.append( "\n" );
     if ( dir == ToClient )
         f.append( "receive " );
     else
@@ -202,6 +218,225 @@ void RecorderClient::react( Event e )
 static Endpoint * ep;
 
 
+class ReplayBlock
+    : public Garbage
+{
+public:
+    ReplayBlock(): send( false ), at( 0 ), count( 0 ) {}
+    bool send;
+    uint at;
+    uint count;
+    EString text;
+};
+
+
+class ReplayData
+    : public Garbage
+{
+public:
+    ReplayData()
+        : blocks( 0 ), speed( 0 ), expect( 0 ),
+          startedAt( 0 ), sentAt( 0 ), sentRecordedAt( 0 ),
+          expectedAt( 0 ), exchanges( 0 ),
+          totalReplay( 0 ), totalRecorded( 0 )
+    {}
+    List<ReplayBlock> * blocks;
+    uint speed;
+    uint expect;
+    uint startedAt;
+    uint sentAt;
+    uint sentRecordedAt;
+    uint expectedAt;
+    uint exchanges;
+    uint totalReplay;
+    uint totalRecorded;
+};
+
+
+class ReplayPacer
+    : public EventHandler
+{
+public:
+    ReplayPacer( ReplayClient * r, uint s ): c( r ) {
+        (void)new Timer( this, s );
+    }
+    void execute() { c->step(); }
+    ReplayClient * c;
+};
+
+
+/*! \class ReplayClient recorder.h
+
+    The ReplayClient class feeds the client half of a recorded
+    session back to a server, waits for the recorded number of
+    response lines after each send, and reports how long each
+    exchange took, next to how long it took when it was recorded.
+
+    Recordings made before timestamp comments existed replay fine,
+    but only the replay's own timing can be reported for them.
+*/
+
+
+/*! Constructs a client that replays \a blocks against ::ep. If \a
+    speed is nonzero, sending is paced to that percentage of the
+    recorded speed; if zero, the session is replayed flat out.
+*/
+
+ReplayClient::ReplayClient( List<ReplayBlock> * blocks, uint speed )
+    : Connection(), d( new ReplayData )
+{
+    d->blocks = blocks;
+    d->speed = speed;
+    d->startedAt = nowMs();
+    d->sentAt = d->startedAt;
+    connect( *ep );
+    EventLoop::global()->addConnection( this );
+    step();
+}
+
+
+void ReplayClient::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        if ( d->expect )
+            consume();
+        break;
+    case Connect:
+        break;
+    default:
+        if ( d->expect || !d->blocks->isEmpty() ) {
+            fprintf( stderr,
+                     "Connection lost with %d blocks left to replay\n",
+                     d->blocks->count() );
+            exit( 1 );
+        }
+        break;
+    }
+}
+
+
+/*! Works through the recorded blocks: sends client data (pacing it
+    if so configured) and arms the line counter for server data,
+    until a receive block has to wait for the network.
+*/
+
+void ReplayClient::step()
+{
+    while ( !d->expect ) {
+        ReplayBlock * b = d->blocks->firstElement();
+        if ( !b ) {
+            report();
+            return;
+        }
+        if ( b->send && d->speed ) {
+            uint target = d->startedAt + b->at * 100 / d->speed;
+            uint now = nowMs();
+            if ( target > now + 999 ) {
+                (void)new ReplayPacer( this, ( target - now ) / 1000 );
+                return;
+            }
+        }
+        d->blocks->shift();
+        if ( b->send ) {
+            enqueue( b->text );
+            d->sentAt = nowMs();
+            d->sentRecordedAt = b->at;
+        }
+        else {
+            d->expect = b->count;
+            d->expectedAt = b->at;
+            consume();
+        }
+    }
+}
+
+
+/*! Counts received lines against the current receive block, and
+    reports the completed exchange once the last one arrives.
+*/
+
+void ReplayClient::consume()
+{
+    while ( d->expect ) {
+        EString * l = readBuffer()->removeLine();
+        if ( !l )
+            return;
+        d->expect--;
+    }
+
+    uint r = nowMs() - d->sentAt;
+    d->exchanges++;
+    d->totalReplay += r;
+    if ( d->expectedAt > d->sentRecordedAt ) {
+        uint rec = d->expectedAt - d->sentRecordedAt;
+        d->totalRecorded += rec;
+        printf( "%d: replay %dms, recorded %dms, delta %+dms\n",
+                d->exchanges, r, rec, (int)r - (int)rec );
+    }
+    else {
+        printf( "%d: replay %dms\n", d->exchanges, r );
+    }
+    step();
+}
+
+
+/*! Prints the summary and shuts the event loop down. */
+
+void ReplayClient::report()
+{
+    printf( "Replayed %d exchanges in %dms",
+            d->exchanges, nowMs() - d->startedAt );
+    if ( d->totalRecorded )
+        printf( " (recorded waits totalled %dms, delta %+dms)",
+                d->totalRecorded,
+                (int)d->totalReplay - (int)d->totalRecorded );
+    printf( "\n" );
+    close();
+    EventLoop::global()->stop();
+}
+
+
+/*! Parses \a lines, the text of a recording, into replayable
+    blocks. Timestamp comments apply to the block that follows
+    them; other comments and the end marker are ignored.
+*/
+
+static List<ReplayBlock> * parse( EStringList * lines )
+{
+    List<ReplayBlock> * r = new List<ReplayBlock>;
+    uint at = 0;
+    EStringList::Iterator l( lines );
+    while ( l ) {
+        EString s = l->simplified();
+        ++l;
+        if ( s.startsWith( "# +" ) ) {
+            at = s.mid( 3 ).number( 0 );
+        }
+        else if ( s.startsWith( "send " ) || s.startsWith( "receive " ) ) {
+            ReplayBlock * b = new ReplayBlock;
+            b->send = s.startsWith( "send " );
+            b->at = at;
+            uint n = s.section( " ", 2 ).number( 0 );
+            b->count = n;
+            while ( n && l ) {
+                if ( b->send ) {
+                    EString t = *l;
+                    while ( t.endsWith( "\n" ) || t.endsWith( "\r" ) )
+                        t.truncate( t.length() - 1 );
+                    b->text.append( t );
+                    b->text.append( "\r\n" );
+                }
+                ++l;
+                n--;
+            }
+            r->append( b );
+        }
+    }
+    return r;
+}
+
+
 int main( int argc, char ** argv )
 {
     Scope global;
@@ -209,6 +444,72 @@ int main( int argc, char ** argv )
 
     const char * error = 0;
     bool ok = true;
+
+    if ( argc >= 2 && EString( argv[1] ) == "replay" ) {
+        if ( argc < 5 || argc > 6 ) {
+            error = "Wrong number of arguments";
+            ok = false;
+        }
+
+        uint port = 0;
+        if ( ok ) {
+            port = EString( argv[3] ).number( &ok );
+            if ( !ok )
+                error = "Could not parse the server's port number";
+        }
+
+        if ( ok ) {
+            EStringList l = Resolver::resolve( argv[2] );
+            if ( l.isEmpty() ) {
+                ok = false;
+                error = ( EString( "Cannot resolve " ) + argv[2] +
+                          ": " + Resolver::errors().join( ", " ) ).cstr();
+            }
+            else {
+                ep = new Endpoint( *l.first(), port );
+                Allocator::addEternal( ep, "target server endpoint" );
+                if ( !ep->valid() ) {
+                    ok = false;
+                    error = "Invalid server address";
+                }
+            }
+        }
+
+        uint speed = 0;
+        if ( ok && argc == 6 ) {
+            speed = EString( argv[5] ).number( &ok );
+            if ( !ok )
+                error = "Could not parse the replay speed";
+        }
+
+        File * f = 0;
+        if ( ok ) {
+            f = new File( argv[4], File::Read );
+            if ( !f->valid() ) {
+                ok = false;
+                error = "Could not read the recording";
+            }
+        }
+
+        if ( !ok ) {
+            fprintf( stderr,
+                     "Error: %s\n"
+                     "Usage: recorder replay address port file [speed]\n"
+                     "       Address/port: The server to replay against.\n"
+                     "       File: A file written by the recorder.\n"
+                     "       Speed: Percentage of recorded speed"
+                     " (default: flat out).\n",
+                     error );
+            exit( 1 );
+        }
+
+        global.setLog( new Log );
+        ReplayClient * c = new ReplayClient( parse( f->lines() ), speed );
+        Allocator::addEternal( c, "replay client" );
+        EventLoop::global()->start();
+        return 0;
+    }
+
     if ( argc != 5 ) {
         error = "Wrong number of arguments";
         ok = false;
@@ -265,7 +566,8 @@ int main( int argc, char ** argv )
                  "       First port: The recorder's own port.\n"
                  "       Address: The IP address of the server to forward to.\n"
                  "       Second port: The server port to forward to.\n"
-                 "       Filebase: The filename base (.<blah> is added).\n",
+                 "       Filebase: The filename base (.<blah> is added).\n"
+                 "   or: recorder replay address port file [speed]\n",
                  error );
         exit( 1 );
     }
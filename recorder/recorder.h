@@ -6,6 +6,7 @@
 #include "connection.h"
 
 #include "endpoint.h"
+#include "list.h"
 
 
 class RecorderServer
@@ -36,4 +37,21 @@ private:
 };
 
 
+class ReplayClient
+    : public Connection
+{
+public:
+    ReplayClient( List<class ReplayBlock> *, uint );
+
+    void react( Event );
+    void step();
+
+private:
+    void consume();
+    void report();
+
+    class ReplayData * d;
+};
+
+
 #endif
@@ -3,9 +3,11 @@
 #include "ldaprelay.h"
 
 #include "configuration.h"
+#include "allocator.h"
 #include "eventloop.h"
 #include "mechanism.h"
 #include "buffer.h"
+#include "list.h"
 #include "user.h"
 
 
@@ -16,7 +18,8 @@ public:
     LdapRelayData()
         : mechanism( 0 ),
           state( LdapRelay::Working ),
-          haveReadType( false ), responseLength( 0 )
+          haveReadType( false ), responseLength( 0 ),
+          reusable( false ), pooled( false )
         {}
 
     SaslMechanism * mechanism;
@@ -24,9 +27,17 @@ public:
     LdapRelay::State state;
     bool haveReadType;
     uint responseLength;
+    bool reusable;
+    bool pooled;
 };
 
 
+// relays which have delivered a complete bind response and are
+// waiting to serve the next authentication.
+
+static List<LdapRelay> * idleRelays = 0;
+
+
 /*! \class LdapRelay ldaprelay.h
 
     The LdapRelay class helps Mechanism relay SASL challenges and
@@ -61,6 +72,84 @@ LdapRelay::LdapRelay( SaslMechanism * mechanism )
 }
 
 
+/*! Returns a relay ready to verify whatever \a mechanism needs:
+    either an idle one from the pool, which is already connected to
+    the LDAP server and sends its bind request at once, or failing
+    that a newly constructed one. The pool's size is set by
+    ldap-pool-size.
+*/
+
+LdapRelay * LdapRelay::acquire( SaslMechanism * mechanism )
+{
+    if ( !::idleRelays ) {
+        ::idleRelays = new List<LdapRelay>;
+        Allocator::addEternal( ::idleRelays, "idle ldap relays" );
+    }
+
+    LdapRelay * r = ::idleRelays->shift();
+    while ( r && ( !r->valid() ||
+                   r->Connection::state() != Connection::Connected ) )
+        r = ::idleRelays->shift();
+
+    if ( !r )
+        return new LdapRelay( mechanism );
+
+    r->reuse( mechanism );
+    return r;
+}
+
+
+/*! Prepares this pooled relay to verify whatever \a mechanism needs,
+    and sends the bind request at once, saving the TCP setup that a
+    new relay would need. RFC 4511 permits any number of consecutive
+    binds on one connection.
+*/
+
+void LdapRelay::reuse( SaslMechanism * mechanism )
+{
+    d->mechanism = mechanism;
+    d->state = Working;
+    d->haveReadType = false;
+    d->responseLength = 0;
+    d->reusable = false;
+    d->pooled = false;
+    setTimeoutAfter( 30 );
+    bind();
+}
+
+
+/*! Returns this relay to the idle pool if the bind response arrived
+    intact and there's room, and closes it otherwise. Pooled relays
+    stay connected for at most ldap-idle-time seconds.
+*/
+
+void LdapRelay::release()
+{
+    // whatever remains of the response is of no interest, and must
+    // not confuse the parser during the next authentication.
+    Buffer * r = readBuffer();
+    r->remove( r->size() );
+
+    if ( d->reusable && valid() &&
+         Connection::state() == Connection::Connected &&
+         ::idleRelays &&
+         ::idleRelays->count() <
+         Configuration::scalar( Configuration::LdapPoolSize ) )
+    {
+        d->mechanism = 0;
+        d->pooled = true;
+        setTimeoutAfter( Configuration::scalar(
+                             Configuration::LdapIdleTime ) );
+        ::idleRelays->append( this );
+        return;
+    }
+
+    if ( d->reusable )
+        unbind();
+    setState( Closing );
+}
+
+
 /*! Reacts to incoming packets from the LDAP server, changes the
     object's state, and eventually notifies the Mechanism. \a e is as
     for Connection::react().
@@ -68,6 +157,17 @@ LdapRelay::LdapRelay( SaslMechanism * mechanism )
 
 void LdapRelay::react( Event e )
 {
+    if ( d->pooled ) {
+        // an idle pooled connection has nothing to tell us. if it
+        // speaks, times out or closes, we just get rid of it.
+        if ( ::idleRelays )
+            ::idleRelays->remove( this );
+        d->pooled = false;
+        if ( e != Shutdown )
+            setState( Closing );
+        return;
+    }
+
     if ( d->state != Working )
         return;
 
@@ -99,8 +199,9 @@ void LdapRelay::react( Event e )
     if ( d->state == Working )
         return;
 
-    setState( Closing );
-    d->mechanism->execute();
+    SaslMechanism * m = d->mechanism;
+    release();
+    m->execute();
 }
 
 
@@ -228,6 +329,7 @@ void LdapRelay::parse()
     }
     uint resultCode = (*r)[2];
     r->remove( 3 );
+    d->reusable = true;
     if ( resultCode != 0 )
         fail( "LDAP server refused authentication with result code " +
               fn( resultCode ) );
@@ -255,8 +357,8 @@ void LdapRelay::parse()
     if ( !e.isEmpty() )
         log( "Note: LDAP server returned error message: " + e );
 
-    if ( d->state != BindFailed )
-        unbind();
+    // release() decides whether to unbind and close or to keep the
+    // connection for the next authentication.
 }
 
 
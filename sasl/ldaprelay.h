@@ -15,6 +15,8 @@ class LdapRelay
 public:
     LdapRelay( SaslMechanism * );
 
+    static LdapRelay * acquire( SaslMechanism * );
+
     void react( Event );
 
     enum State { Working,
@@ -34,6 +36,8 @@ private:
 
     void fail( const EString & );
     void succeed();
+    void reuse( SaslMechanism * );
+    void release();
 };
 
 
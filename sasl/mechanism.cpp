@@ -10,11 +10,16 @@
 #include "ldaprelay.h"
 #include "mailbox.h"
 #include "scope.h"
+#include "dbsignal.h"
+#include "cache.h"
 #include "graph.h"
 #include "query.h"
+#include "dict.h"
 #include "user.h"
 #include "utf.h"
 
+#include <time.h> // time(0)
+
 // Supported authentication mechanisms, for create().
 // (Keep these alphabetical.)
 #include "anonymous.h"
@@ -49,6 +54,87 @@ public:
 };
 
 
+// remembers authentication failures, so that abusive traffic is
+// absorbed in RAM instead of being amplified into database load:
+// logins that are known not to exist, and a token bucket per client
+// address which runs dry when too many of its attempts fail.
+
+class AuthFailures
+    : public Cache
+{
+public:
+    AuthFailures(): Cache( 2 ) {}
+    void clear() { nonexistent.clear(); buckets.clear(); }
+
+    class Bucket
+        : public Garbage
+    {
+    public:
+        Bucket(): tokens( 16 ), stamp( (uint)::time( 0 ) ) {}
+        uint tokens;
+        uint stamp;
+    };
+
+    // returns the bucket for address, refilled with one token per
+    // second since it was last seen, up to a burst of 16.
+    Bucket * bucket( const EString & address ) {
+        Bucket * b = buckets.find( address );
+        if ( !b ) {
+            b = new Bucket;
+            buckets.insert( address, b );
+        }
+        uint now = (uint)::time( 0 );
+        if ( now > b->stamp ) {
+            b->tokens += now - b->stamp;
+            if ( b->tokens > 16 )
+                b->tokens = 16;
+            b->stamp = now;
+        }
+        return b;
+    }
+
+    Dict<Garbage> nonexistent;
+    Dict<Bucket> buckets;
+};
+
+static AuthFailures * authFailures = 0;
+
+
+// forgets the nonexistent logins when someone changes the users
+// table, since one of them may just have been created.
+
+class AuthFailureFlusher
+    : public EventHandler
+{
+public:
+    AuthFailureFlusher() {
+        (void)new DatabaseSignal( "users_updated", this );
+    }
+    void execute() {
+        if ( ::authFailures )
+            ::authFailures->nonexistent.clear();
+    }
+};
+
+
+// returns true if the attempt to log in as login from address should
+// be refused without consulting the database, and false otherwise.
+
+static bool throttled( const UString & login, const EString & address )
+{
+    if ( !::authFailures ) {
+        ::authFailures = new AuthFailures;
+        (void)new AuthFailureFlusher;
+        return false;
+    }
+    if ( ::authFailures->nonexistent.contains( login.utf8().lower() ) )
+        return true;
+    if ( !::authFailures->bucket( address )->tokens )
+        return true;
+    return false;
+}
+
+
 /*! \class SaslMechanism mechanism.h
     A generic SASL authentication mechanism (RFC 2222)
 
@@ -299,6 +385,15 @@ void SaslMechanism::execute()
     if ( state() == AwaitingResponse )
         return;
 
+    if ( state() == Authenticating && !d->user &&
+         throttled( d->login, d->connection->peer().address() ) ) {
+        log( "Refusing authentication attempt by " + d->login.utf8() +
+             " from " + d->connection->peer().address() +
+             " without database lookup", Log::Info );
+        setState( Failed );
+        tick();
+    }
+
     if ( state() == Authenticating ) {
         if ( !d->user  ) {
             d->user = new User;
@@ -360,6 +455,24 @@ void SaslMechanism::tick()
         anonLogins = new GraphableCounter( "anonymous-logins" );
     }
 
+    if ( !::authFailures ) {
+        ::authFailures = new AuthFailures;
+        (void)new AuthFailureFlusher;
+    }
+
+    EString peer = d->connection->peer().address();
+    if ( d->state == Failed ) {
+        AuthFailures::Bucket * b = ::authFailures->bucket( peer );
+        if ( b->tokens )
+            b->tokens--;
+        if ( d->user && d->user->state() == User::Nonexistent )
+            ::authFailures->nonexistent.insert( d->login.utf8().lower(),
+                                                new Garbage );
+    }
+    else {
+        ::authFailures->bucket( peer )->tokens = 16;
+    }
+
     if ( d->state == Failed )
         loginFailures->tick();
     else if ( d->user->login() == "anonymous" &&
@@ -402,7 +515,7 @@ void SaslMechanism::verify()
         }
     }
     else if ( d->user && !d->user->ldapdn().isEmpty() ) {
-        d->ldapRelay = new LdapRelay( this );
+        d->ldapRelay = LdapRelay::acquire( this );
     }
     else if ( storedSecret().isEmpty() || storedSecret() == secret() ) {
         setState( Succeeded );
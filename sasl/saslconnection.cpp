@@ -81,6 +81,13 @@ void SaslConnection::close()
 
     logged = true;
 
+    // record what this client cost us, so an abusive one can be
+    // identified from the log alone
+    log( "Client " + client.address() + " (" + u->login().utf8() +
+         ") read " + EString::humanNumber( bytesWritten() ) +
+         " bytes, sent " + EString::humanNumber( bytesRead() ) +
+         " bytes in " + fn( (uint)time( 0 ) - s ) + " seconds" );
+
     Query * q = new Query(
         "insert into connections "
         "(username,address,port,mechanism,authfailures,"
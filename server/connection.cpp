@@ -3,18 +3,23 @@
 #include "connection.h"
 
 #include "tlsthread.h"
+#include "deflatethread.h"
 
 #include "log.h"
 #include "file.h"
+#include "event.h"
 #include "user.h"
+#include "session.h"
 #include "scope.h"
 #include "query.h"
+#include "list.h"
 #include "buffer.h"
 #include "estring.h"
 #include "endpoint.h"
 #include "eventloop.h"
 #include "allocator.h"
 #include "resolver.h"
+#include "graph.h"
 #include "user.h"
 
 // errno
@@ -26,6 +31,8 @@
 // sockaddr_in, sockaddr_in6, IPPROTO_TCP
 #include <netinet/in.h>
 #include <sys/socket.h>
+// TCP_CORK
+#include <netinet/tcp.h>
 // time
 #include <time.h>
 
@@ -36,25 +43,33 @@ class ConnectionData
 public:
     ConnectionData()
         : r( 0 ), w( 0 ),
-          tls( 0 ), l( 0 ), session( 0 ),
+          tls( 0 ), deflater( 0 ), l( 0 ), session( 0 ),
           fd( -1 ), timeout( 0 ),
-          wbt( 0 ), wbs( 0 ),
+          wbt( 0 ), wbs( 0 ), drainNotify( 0 ), in( 0 ), out( 0 ),
+          sndbuf( 0 ), corked( 0 ),
           state( Connection::Invalid ),
           type( Connection::Client ),
-          pending( false )
+          pending( false ),
+          worker( UINT_MAX )
     {}
 
     Buffer *r, *w;
     TlsThread * tls;
+    DeflateThread * deflater;
     Log *l;
     Session * session;
     int fd;
     uint timeout;
     uint wbt, wbs;
+    List<EventHandler> * drainNotify;
+    int64 in, out;
+    uint sndbuf;
+    int corked; // 0 not corked, 1 corked, -1 socket cannot cork
     Connection::State state;
 
     Connection::Type type;
     bool pending;
+    uint worker;
     Endpoint self, peer;
     Connection::Event event;
 };
@@ -299,14 +314,34 @@ Connection::Type Connection::type() const
 }
 
 
-/*! Returns a single-line text string describing this connection. The
-    string is intended for debugging.
+/*! Records that this connection belongs to worker process \a w. The
+    initial value is UINT_MAX, meaning that the connection is shared
+    by all processes.
 
-    Subclasses may reimplement this if this implementation is
-    insufficient.
+    Listeners bound with SO_REUSEPORT are created once per worker
+    before forking; after the fork each worker keeps only the
+    listeners tagged with its own index.
 */
 
-EString Connection::description() const
+void Connection::setWorker( uint w )
+{
+    d->worker = w;
+}
+
+
+/*! Returns whatever setWorker() recorded, or UINT_MAX. */
+
+uint Connection::worker() const
+{
+    return d->worker;
+}
+
+
+/*! Returns a short name for this connection's type(), e.g. "IMAP
+    server", without any per-connection detail.
+*/
+
+EString Connection::typeName() const
 {
     EString r;
     switch( d->type ) {
@@ -368,6 +403,20 @@ EString Connection::description() const
         r = "ManageSieve server";
         break;
     }
+    return r;
+}
+
+
+/*! Returns a single-line text string describing this connection. The
+    string is intended for debugging.
+
+    Subclasses may reimplement this if this implementation is
+    insufficient.
+*/
+
+EString Connection::description() const
+{
+    EString r = typeName();
     Endpoint her = peer();
     Endpoint me = self();
 
@@ -527,16 +576,42 @@ void Connection::close()
     setState( Invalid );
     d->session = 0;
     EventLoop::global()->removeConnection( this );
+    if ( d->drainNotify ) {
+        // wake everyone waiting for the buffer to drain, so they can
+        // see that this connection is dead and stop producing output
+        List<EventHandler> * l = d->drainNotify;
+        d->drainNotify = 0;
+        while ( !l->isEmpty() )
+            l->shift()->notify();
+    }
 }
 
 
+static GraphableCounter * flushes = 0;
+static GraphableNumber * dbOutput = 0;
+static GraphableNumber * clientInput = 0;
+static GraphableNumber * clientOutput = 0;
+static GraphableCounter * accepts = 0;
+
+
 /*! Reads waiting input from the connected socket. Does nothing in
     case the Connection isn't valid(). */
 
 void Connection::read()
 {
-    if ( valid() )
-        d->r->read( d->fd );
+    if ( !valid() )
+        return;
+    uint before = d->r->size();
+    d->r->read( d->fd );
+    if ( d->r->size() > before ) {
+        uint n = d->r->size() - before;
+        d->in += n;
+        if ( type() != DatabaseClient ) {
+            if ( !clientInput )
+                clientInput = new GraphableNumber( "client-input-bytes" );
+            clientInput->setValue( clientInput->lastValue() + n );
+        }
+    }
 }
 
 
@@ -548,8 +623,31 @@ void Connection::write()
     if ( !valid() )
         return;
 
+    uint before = d->w->size();
+    adjustBuffering( before );
     d->w->write( d->fd );
     uint wbs = d->w->size();
+    if ( wbs < before ) {
+        d->out += before - wbs;
+        // count flushes that actually wrote something, so we can see
+        // how many writev() calls we make relative to the work done
+        if ( !flushes )
+            flushes = new GraphableCounter( "buffer-flushes" );
+        flushes->tick();
+        // track total database traffic separately; aoximport reports
+        // it per injected message
+        if ( type() == DatabaseClient ) {
+            if ( !dbOutput )
+                dbOutput = new GraphableNumber( "db-output-bytes" );
+            dbOutput->setValue( dbOutput->lastValue() + before - wbs );
+        }
+        else {
+            if ( !clientOutput )
+                clientOutput = new GraphableNumber( "client-output-bytes" );
+            clientOutput->setValue( clientOutput->lastValue() +
+                                    before - wbs );
+        }
+    }
     if ( wbs && !d->wbs ) {
         d->wbt = time( 0 );
         d->wbs = wbs;
@@ -568,6 +666,111 @@ void Connection::write()
         d->wbt = 0;
         d->wbs = 0;
     }
+#if defined( TCP_CORK )
+    if ( d->corked > 0 && !wbs ) {
+        // pull the cork once everything queued has been handed to the
+        // kernel, so the final partial segment goes out at once
+        int i = 0;
+        ::setsockopt( d->fd, IPPROTO_TCP, TCP_CORK, &i, sizeof( int ) );
+        d->corked = 0;
+    }
+#endif
+    if ( d->drainNotify && wbs < 131072 ) {
+        // a notified handler may call notifyOnDrain() again; that
+        // starts a fresh list, left alone until the next drain
+        List<EventHandler> * l = d->drainNotify;
+        d->drainNotify = 0;
+        while ( !l->isEmpty() )
+            l->shift()->notify();
+    }
+}
+
+
+/*! This private helper tunes the socket to suit a write of \a queued
+    bytes.
+
+    If \a queued exceeds the send buffer size requested so far, the
+    buffer is grown (in powers of two, up to 4MB), so that bulk
+    responses such as a big FETCH can fill high
+    bandwidth-delay-product links instead of stalling on a default
+    sized buffer. The kernel clamps the value to wmem_max; the buffer
+    is never shrunk again.
+
+    A bulk write is also bracketed with TCP_CORK where the OS provides
+    it: while more than a full segment is queued, the kernel may send
+    only full-size segments, so the alternation of short literal
+    headers and long literal bodies in the write buffer cannot produce
+    runt packets. write() pulls the cork when the buffer drains.
+
+    TLS and compressed connections write to a socketpair, and the real
+    socket is owned by a worker thread, so they are left alone.
+*/
+
+void Connection::adjustBuffering( uint queued )
+{
+    if ( d->tls || d->deflater )
+        return;
+
+    if ( queued > 65536 && queued > d->sndbuf ) {
+        uint target = d->sndbuf ? d->sndbuf : 65536;
+        while ( target < queued && target < 4*1024*1024 )
+            target += target;
+        d->sndbuf = target;
+        int v = (int)target;
+        ::setsockopt( d->fd, SOL_SOCKET, SO_SNDBUF, &v, sizeof( int ) );
+    }
+
+#if defined( TCP_CORK )
+    if ( !d->corked && queued > 16384 ) {
+        int i = 1;
+        if ( ::setsockopt( d->fd, IPPROTO_TCP, TCP_CORK,
+                           &i, sizeof( int ) ) < 0 )
+            d->corked = -1; // unix socket or other corkless transport
+        else
+            d->corked = 1;
+    }
+#endif
+}
+
+
+/*! Arranges for \a h to be notified once this Connection's write
+    buffer has drained to a modest size, or once the connection dies,
+    whichever comes first. Any number of handlers can wait at once
+    (e.g. two throttled Fetchers on the same connection); each is
+    notified once and then forgotten.
+
+    Producers which can generate output much faster than a slow
+    client reads it use this to pause until the socket catches up,
+    instead of buffering everything in RAM.
+*/
+
+void Connection::notifyOnDrain( EventHandler * h )
+{
+    if ( !d->drainNotify )
+        d->drainNotify = new List<EventHandler>;
+    if ( !d->drainNotify->find( h ) )
+        d->drainNotify->append( h );
+}
+
+
+/*! Returns the number of bytes read from the peer over the lifetime
+    of this Connection.
+*/
+
+int64 Connection::bytesRead() const
+{
+    return d->in;
+}
+
+
+/*! Returns the number of bytes written to the peer over the lifetime
+    of this Connection. Useful for identifying and restraining
+    clients that make the server do too much work.
+*/
+
+int64 Connection::bytesWritten() const
+{
+    return d->out;
 }
 
 
@@ -665,6 +868,58 @@ bool Connection::hasTls() const
 }
 
 
+/*! Starts COMPRESS=DEFLATE processing on this connection, in the
+    same way startTls() starts TLS: our fd is swapped for one end of
+    a socketpair, and a worker thread runs zlib between the other end
+    and whatever we were talking to before (the client socket, or the
+    TLS layer). Anything in the write buffer should be flushed before
+    this is called, since it would otherwise be compressed too.
+*/
+
+void Connection::startCompression()
+{
+    if ( d->deflater || !valid() )
+        return;
+
+    write();
+
+    log( "Starting deflate compression for client " + peer().string(),
+         Log::Debug );
+
+    int sv[2];
+    int r = ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
+    if ( r < 0 ) {
+        log( "Cannot create more FDs", Log::Error );
+        close();
+        return;
+    }
+
+    DeflateThread * t = new DeflateThread();
+    if ( t->broken() ) {
+        log( "Cannot create more threads", Log::Error );
+        close();
+        ::close( sv[0] );
+        ::close( sv[1] );
+        return;
+    }
+
+    int flags = fcntl( sv[0], F_GETFL, 0 );
+    if ( flags < 0 )
+        die( FD );
+    flags = flags | O_NDELAY;
+    if ( fcntl( sv[0], F_SETFL, flags ) < 0 )
+        die( FD );
+    if ( fcntl( sv[1], F_SETFL, flags ) < 0 )
+        die( FD );
+
+    t->setClientFD( d->fd );
+    t->setServerFD( sv[0] );
+    d->fd = sv[1];
+
+    d->deflater = t;
+}
+
+
 /*! Listens to the specified endpoint \a e. If the operation succeeds,
     the connection enters the Listening state. If not, -1 is returned,
     and the connection state is unchanged.
@@ -689,6 +944,13 @@ int Connection::listen( const Endpoint &e, bool silent )
     if ( !e.inherited() ) {
         int i = 1;
         ::setsockopt( d->fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof (int) );
+#if defined( SO_REUSEPORT )
+        // so each worker process can bind its own listening socket to
+        // the same port, and the kernel balances accepts across them
+        if ( e.protocol() != Endpoint::Unix )
+            ::setsockopt( d->fd, SOL_SOCKET, SO_REUSEPORT,
+                          &i, sizeof (int) );
+#endif
 
         if ( e.protocol() == Endpoint::Unix )
             unlink( File::chrooted( e.address() ).cstr() );
@@ -778,6 +1040,11 @@ int Connection::accept()
     struct sockaddr_storage l;
 
     int s = ::accept( fd(), (sockaddr *)&l, &len );
+    if ( s >= 0 ) {
+        if ( !accepts )
+            accepts = new GraphableCounter( "accepted-connections" );
+        accepts->tick();
+    }
     return s;
 }
 
@@ -1063,6 +1330,8 @@ void Connection::substitute( Connection * other, Event event )
 
 void Connection::setSession( class Session * session )
 {
+    if ( d->session && d->session != session )
+        d->session->snapshot();
     d->session = session;
 }
 
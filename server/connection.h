@@ -8,6 +8,7 @@
 
 class User;
 class Buffer;
+class EventHandler;
 
 
 class Connection
@@ -56,14 +57,22 @@ public:
 
     Buffer * writeBuffer() const;
     Buffer * readBuffer() const;
+    void notifyOnDrain( EventHandler * );
+    int64 bytesRead() const;
+    int64 bytesWritten() const;
     Endpoint self() const;
     Endpoint peer() const;
     void setType( Type );
     Type type() const;
+    EString typeName() const;
     virtual EString description() const;
 
+    void setWorker( uint );
+    uint worker() const;
+
     void startTls();
     bool hasTls() const;
+    void startCompression();
 
     virtual void close();
     virtual void read();
@@ -106,6 +115,9 @@ protected:
     void substitute( Connection *, Event );
     void init( int );
 
+private:
+    void adjustBuffering( uint );
+
 private:
     class ConnectionData *d;
 };
@@ -0,0 +1,632 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "deflatethread.h"
+
+#include "log.h"
+#include "list.h"
+#include "estring.h"
+#include "allocator.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+#include <poll.h>
+
+#include <zlib.h>
+
+
+static const int bs = 32768;
+
+
+class DeflateWorker;
+
+
+class DeflateThreadData
+    : public Garbage
+{
+public:
+    DeflateThreadData()
+        : Garbage(),
+          ctrb( 0 ),
+          ctrbo( 0 ), ctrbs( 0 ),
+          ctwb( 0 ),
+          ctwbo( 0 ), ctwbs( 0 ),
+          ctfd( -1 ),
+          zrb( 0 ),
+          zrbo( 0 ), zrbs( 0 ),
+          zwb( 0 ),
+          zwbo( 0 ), zwbs( 0 ),
+          zfd( -1 ),
+          worker( 0 ), next( 0 ), prev( 0 ),
+          crct( false ), cwct( false ), crz( false ), cwz( false ),
+          ctgone( false ), zgone( false ),
+          finish( false ), done( false ), broken( false )
+        {}
+
+    // clear-text read buffer, ie. data coming from aox to be deflated
+    char * ctrb;
+    // the offset at which cleartext data starts
+    int ctrbo;
+    // and the buffer size (if ...o=...s, the buffer contains no data)
+    int ctrbs;
+    // clear-text write buffer, ie. inflated data going to aox
+    char * ctwb;
+    int ctwbo;
+    int ctwbs;
+    // the cleartext fd, ie. the fd for talking to aox
+    int ctfd;
+    // compressed read buffer, ie. data coming from the peer
+    char * zrb;
+    int zrbo;
+    int zrbs;
+    // compressed write buffer, ie. data going to the peer
+    char * zwb;
+    int zwbo;
+    int zwbs;
+    int zfd;
+
+    // one zlib stream per direction
+    z_stream out;
+    z_stream in;
+
+    // the worker that serves this session, and its session chain
+    DeflateWorker * worker;
+    DeflateThreadData * next;
+    DeflateThreadData * prev;
+
+    // what the worker's last poll() said about our file descriptors
+    bool crct;
+    bool cwct;
+    bool crz;
+    bool cwz;
+
+    bool ctgone;
+    bool zgone;
+    bool finish;
+    bool done;
+    bool broken;
+};
+
+
+static void * deflaterTrampoline( void * t );
+
+
+/*! \class DeflateWorker deflatethread.cpp
+    A single thread serving many COMPRESS=DEFLATE sessions.
+
+    Each worker runs a poll() loop just like TlsWorker's, shuffling
+    bytes between the socketpair to aox, zlib and the client socket
+    for every session assigned to it. A pipe is used to wake the
+    worker when the main thread adds a session, supplies a file
+    descriptor or closes a session. It must be poll(), not select():
+    the client fds can be far above FD_SETSIZE, and FD_SET would
+    write outside the fd_set.
+
+    This class is not part of the Garbage world: workers are created
+    once and never freed, and the worker thread must not allocate
+    using Allocator, which is single-threaded. The pollfd array grows
+    with realloc().
+*/
+
+class DeflateWorker
+{
+public:
+    DeflateWorker();
+
+    void add( DeflateThreadData * );
+    void wakeup();
+    void run();
+
+    bool broken() const { return failed; }
+
+private:
+    void step( DeflateThreadData * );
+    void shutdown( DeflateThreadData * );
+    void pollFor( int, bool, bool, DeflateThreadData *, bool );
+
+    // which session's fd a pollfd entry watches, and whether it's the
+    // compressed (client) or cleartext (aox) one
+    struct Target {
+        DeflateThreadData * session;
+        bool z;
+    };
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int wakeRead;
+    int wakeWrite;
+    DeflateThreadData * sessions;
+    struct pollfd * fds;
+    Target * targets;
+    uint nfds;
+    uint maxfds;
+    bool failed;
+};
+
+
+static void * deflaterTrampoline( void * t )
+{
+    ((DeflateWorker*)t)->run();
+    return 0;
+}
+
+
+/*! Creates a worker and starts its thread. If thread or pipe creation
+    fails, broken() returns true and the worker must not be used.
+*/
+
+DeflateWorker::DeflateWorker()
+    : wakeRead( -1 ), wakeWrite( -1 ), sessions( 0 ),
+      fds( 0 ), targets( 0 ), nfds( 0 ), maxfds( 0 ), failed( false )
+{
+    pthread_mutex_init( &mutex, 0 );
+
+    int p[2];
+    if ( ::pipe( p ) < 0 ) {
+        failed = true;
+        return;
+    }
+    wakeRead = p[0];
+    wakeWrite = p[1];
+    (void)::fcntl( wakeRead, F_SETFL,
+                   ::fcntl( wakeRead, F_GETFL, 0 ) | O_NDELAY );
+
+    if ( pthread_create( &thread, 0, deflaterTrampoline, (void*)this ) ) {
+        ::close( wakeRead );
+        ::close( wakeWrite );
+        failed = true;
+    }
+}
+
+
+/*! Assigns the session \a s to this worker and wakes the worker up.
+    Called by the main thread only.
+*/
+
+void DeflateWorker::add( DeflateThreadData * s )
+{
+    pthread_mutex_lock( &mutex );
+    s->worker = this;
+    s->next = sessions;
+    s->prev = 0;
+    if ( sessions )
+        sessions->prev = s;
+    sessions = s;
+    pthread_mutex_unlock( &mutex );
+    wakeup();
+}
+
+
+/*! Interrupts the worker's poll(), so that it notices new sessions,
+    new file descriptors or a close. May be called from any thread.
+*/
+
+void DeflateWorker::wakeup()
+{
+    char c = 'w';
+    int n = ::write( wakeWrite, &c, 1 );
+    n = n; // and if the pipe is full, the worker is awake already
+}
+
+
+/*! Closes the session \a s, unlinks it from this worker and marks it
+    done, so that the main thread may eventually free it.
+*/
+
+void DeflateWorker::shutdown( DeflateThreadData * s )
+{
+    if ( s->zfd >= 0 )
+        ::close( s->zfd );
+    if ( s->ctfd >= 0 )
+        ::close( s->ctfd );
+    ::deflateEnd( &s->out );
+    ::inflateEnd( &s->in );
+    if ( s->prev )
+        s->prev->next = s->next;
+    else
+        sessions = s->next;
+    if ( s->next )
+        s->next->prev = s->prev;
+    s->next = 0;
+    s->prev = 0;
+    s->worker = 0;
+    s->done = true;
+}
+
+
+/*! Performs one round of file descriptor and zlib processing for the
+    session \a s, based on what the last poll() said.
+*/
+
+void DeflateWorker::step( DeflateThreadData * s )
+{
+    // are our read buffers empty, and poll said we can read? if
+    // so, try to read
+    if ( s->crct ) {
+        s->ctrbs = ::read( s->ctfd, s->ctrb, bs );
+        if ( s->ctrbs <= 0 ) {
+            s->ctgone = true;
+            s->ctrbs = 0;
+        }
+        s->crct = false;
+    }
+    if ( s->crz ) {
+        s->zrbs = ::read( s->zfd, s->zrb, bs );
+        if ( s->zrbs <= 0 ) {
+            s->zgone = true;
+            s->zrbs = 0;
+        }
+        s->crz = false;
+    }
+    if ( s->ctgone && s->zgone ) {
+        // if both file descriptors are gone, there's nothing left
+        // to do
+        s->finish = true;
+    }
+    if ( s->ctgone && s->zwbs == 0 && s->ctrbs == 0 ) {
+        // if the cleartext one is gone and we have nothing left to
+        // deflate, finish
+        s->finish = true;
+    }
+    if ( s->zgone && s->ctwbs == 0 && s->zrbs == 0 ) {
+        // if the compressed one is gone and we have nothing left to
+        // inflate, finish
+        s->finish = true;
+    }
+
+    // is there something in our write buffers, and poll() told
+    // us we can write it?
+    if ( s->cwct ) {
+        int n = ::write( s->ctfd,
+                         s->ctwb + s->ctwbo,
+                         s->ctwbs - s->ctwbo );
+        if ( n <= 0 ) {
+            // poll said we could, but we couldn't. parachute time.
+            s->finish = true;
+        }
+        else {
+            s->ctwbo += n;
+            if ( s->ctwbo == s->ctwbs ) {
+                s->ctwbs = 0;
+                s->ctwbo = 0;
+            }
+        }
+        s->cwct = false;
+    }
+    if ( s->cwz ) {
+        int n = ::write( s->zfd,
+                         s->zwb + s->zwbo,
+                         s->zwbs - s->zwbo );
+        if ( n <= 0 ) {
+            s->finish = true;
+        }
+        else {
+            s->zwbo += n;
+            if ( s->zwbo == s->zwbs ) {
+                s->zwbs = 0;
+                s->zwbo = 0;
+            }
+        }
+        s->cwz = false;
+    }
+
+    // we've served file descriptors. now for zlib. a sync flush per
+    // round is what Buffer::append() did too, and it's what keeps
+    // the client from waiting for data stuck inside zlib.
+    if ( s->ctrbs > 0 && s->zwbs == 0 ) {
+        s->out.next_in = (Bytef*)( s->ctrb + s->ctrbo );
+        s->out.avail_in = s->ctrbs - s->ctrbo;
+        s->out.next_out = (Bytef*)s->zwb;
+        s->out.avail_out = bs;
+        int r = ::deflate( &s->out, Z_SYNC_FLUSH );
+        if ( r != Z_OK && r != Z_BUF_ERROR )
+            s->finish = true;
+        s->ctrbo = s->ctrbs - s->out.avail_in;
+        if ( s->ctrbo >= s->ctrbs ) {
+            s->ctrbo = 0;
+            s->ctrbs = 0;
+        }
+        s->zwbo = 0;
+        s->zwbs = bs - s->out.avail_out;
+    }
+    if ( s->zrbs > 0 && s->ctwbs == 0 ) {
+        s->in.next_in = (Bytef*)( s->zrb + s->zrbo );
+        s->in.avail_in = s->zrbs - s->zrbo;
+        s->in.next_out = (Bytef*)s->ctwb;
+        s->in.avail_out = bs;
+        int r = ::inflate( &s->in, Z_SYNC_FLUSH );
+        if ( r != Z_OK && r != Z_BUF_ERROR )
+            s->finish = true;
+        s->zrbo = s->zrbs - s->in.avail_in;
+        if ( s->zrbo >= s->zrbs ) {
+            s->zrbo = 0;
+            s->zrbs = 0;
+        }
+        s->ctwbo = 0;
+        s->ctwbs = bs - s->in.avail_out;
+    }
+}
+
+
+/*! Adds an entry for \a fd to the pollfd array, asking for
+    readability if \a pr and writability if \a pw, and remembers that
+    the entry belongs to session \a s (to its compressed fd if \a z,
+    else to its cleartext fd). Grows the array with realloc(), since
+    Allocator is off-limits on this thread.
+*/
+
+void DeflateWorker::pollFor( int fd, bool pr, bool pw,
+                             DeflateThreadData * s, bool z )
+{
+    if ( nfds == maxfds ) {
+        uint m = maxfds * 2;
+        if ( m < 64 )
+            m = 64;
+        fds = (struct pollfd *)
+              ::realloc( fds, m * sizeof( struct pollfd ) );
+        targets = (Target *)::realloc( targets, m * sizeof( Target ) );
+        maxfds = m;
+    }
+    fds[nfds].fd = fd;
+    fds[nfds].events = 0;
+    if ( pr )
+        fds[nfds].events |= POLLIN;
+    if ( pw )
+        fds[nfds].events |= POLLOUT;
+    fds[nfds].revents = 0;
+    targets[nfds].session = s;
+    targets[nfds].z = z;
+    nfds++;
+}
+
+
+/*! The worker's main loop: processes every session, builds one big
+    pollfd array and sleeps in poll() until there's something to do.
+    Never returns.
+*/
+
+void DeflateWorker::run()
+{
+    while ( true ) {
+        pthread_mutex_lock( &mutex );
+
+        // map the last poll()'s results back onto the sessions.
+        // entry 0 is the wakeup pipe, handled below.
+        uint i = 1;
+        while ( i < nfds ) {
+            DeflateThreadData * s = targets[i].session;
+            bool pr = fds[i].revents & ( POLLIN|POLLERR|POLLHUP );
+            bool pw = fds[i].revents & ( POLLOUT|POLLERR|POLLHUP );
+            if ( targets[i].z ) {
+                s->crz = pr && s->crz;
+                s->cwz = pw && s->cwz;
+            }
+            else {
+                s->crct = pr && s->crct;
+                s->cwct = pw && s->cwct;
+            }
+            i++;
+        }
+
+        nfds = 0;
+        pollFor( wakeRead, true, false, 0, false );
+
+        DeflateThreadData * s = sessions;
+        while ( s ) {
+            DeflateThreadData * n = s->next;
+
+            if ( !s->broken )
+                step( s );
+
+            if ( s->broken || s->finish ) {
+                shutdown( s );
+                s = n;
+                continue;
+            }
+
+            // what do we want poll() to look for?
+            bool any = false;
+            bool rct = false;
+            bool wct = false;
+            bool rz = false;
+            bool wz = false;
+            if ( s->ctfd >= 0 ) {
+                rct = ( s->ctrbs == 0 );
+                wct = ( s->ctwbs > 0 );
+                if ( rct || wct ) {
+                    pollFor( s->ctfd, rct, wct, s, false );
+                    any = true;
+                }
+            }
+            if ( s->zfd >= 0 ) {
+                rz = ( s->zrbs == 0 );
+                wz = ( s->zwbs > 0 );
+                if ( rz || wz ) {
+                    pollFor( s->zfd, rz, wz, s, true );
+                    any = true;
+                }
+            }
+            if ( s->ctfd >= 0 && s->zfd >= 0 && !any ) {
+                // we aren't going to read, we can't write. no point
+                // in prolonging the agony.
+                shutdown( s );
+            }
+            else if ( any ) {
+                s->crct = rct;
+                s->cwct = wct;
+                s->crz = rz;
+                s->cwz = wz;
+            }
+
+            s = n;
+        }
+
+        pthread_mutex_unlock( &mutex );
+
+        int n = ::poll( fds, nfds, 4000 );
+        if ( n < 0 ) {
+            i = 0;
+            while ( i < nfds )
+                fds[i++].revents = 0;
+        }
+        if ( n > 0 && ( fds[0].revents & POLLIN ) ) {
+            char buf[16];
+            while ( ::read( wakeRead, buf, 16 ) == 16 )
+                ;
+            fds[0].revents = 0;
+        }
+    }
+}
+
+
+static uint numWorkers = 0;
+static DeflateWorker ** workers = 0;
+static uint nextWorker = 0;
+
+static List<DeflateThread> * liveSessions = 0;
+
+
+/*! This private helper creates the worker pool. Deflating is pure
+    CPU, so there's no point in having more workers than cores.
+*/
+
+void DeflateThread::createWorkers()
+{
+    long cores = ::sysconf( _SC_NPROCESSORS_ONLN );
+    numWorkers = 4;
+    if ( cores > 0 && (uint)cores < numWorkers )
+        numWorkers = cores;
+
+    workers = new DeflateWorker *[numWorkers];
+    uint i = 0;
+    uint n = 0;
+    while ( i < numWorkers ) {
+        DeflateWorker * w = new DeflateWorker;
+        if ( !w->broken() )
+            workers[n++] = w;
+        i++;
+    }
+    numWorkers = n;
+
+    liveSessions = new List<DeflateThread>;
+    Allocator::addEternal( liveSessions, "deflate sessions" );
+}
+
+
+/*! \class DeflateThread deflatethread.h
+    Manages COMPRESS=DEFLATE processing for a single connection.
+
+    This is TlsThread's little sibling: the event loop thread swaps
+    its fd for one end of a socketpair, and a small pool of worker
+    threads runs zlib between the socketpair and the client socket,
+    so that compressing a fast bulk download doesn't stall every
+    other client.
+*/
+
+
+/*! Constructs a DeflateThread and assigns it to a worker. The zlib
+    parameters match what Buffer::setCompression() used, ie. raw
+    deflate as RFC 4978 demands.
+*/
+
+DeflateThread::DeflateThread()
+    : d( new DeflateThreadData )
+{
+    if ( !workers )
+        createWorkers();
+
+    // while a worker serves a session, the main thread has to keep
+    // the session alive for the collector. forget sessions the
+    // workers are done with.
+    List<DeflateThread>::Iterator it( liveSessions );
+    while ( it ) {
+        DeflateThread * t = it;
+        ++it;
+        if ( t->d->done )
+            liveSessions->remove( t );
+    }
+
+    if ( !numWorkers ) {
+        log( "Cannot create deflate worker threads" );
+        d->broken = true;
+        return;
+    }
+
+    d->out.zalloc = 0;
+    d->out.zfree = 0;
+    d->out.opaque = 0;
+    if ( ::deflateInit2( &d->out, 9, Z_DEFLATED,
+                         -15, 9, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        d->broken = true;
+        return;
+    }
+    d->in.zalloc = 0;
+    d->in.zfree = 0;
+    d->in.opaque = 0;
+    if ( ::inflateInit2( &d->in, -15 ) != Z_OK ) {
+        ::deflateEnd( &d->out );
+        d->broken = true;
+        return;
+    }
+
+    d->ctrb = (char*)Allocator::alloc( bs, 0 );
+    d->ctwb = (char*)Allocator::alloc( bs, 0 );
+    d->zrb = (char*)Allocator::alloc( bs, 0 );
+    d->zwb = (char*)Allocator::alloc( bs, 0 );
+
+    liveSessions->append( this );
+    workers[nextWorker]->add( d );
+    nextWorker = ( nextWorker + 1 ) % numWorkers;
+}
+
+
+/*! Records that \a fd should be used for cleartext communication with
+    the main aox thread. The worker will close \a fd when it's done.
+*/
+
+void DeflateThread::setServerFD( int fd )
+{
+    d->ctfd = fd;
+    if ( d->worker )
+        d->worker->wakeup();
+}
+
+
+/*! Records that \a fd should be used for compressed communication
+    with the client (or with the TLS layer, if there is one). The
+    worker will close \a fd when it's done.
+*/
+
+void DeflateThread::setClientFD( int fd )
+{
+    d->zfd = fd;
+    if ( d->worker )
+        d->worker->wakeup();
+}
+
+
+/*! Returns true if this DeflateThread is broken somehow, and false if
+    it's in working order.
+*/
+
+bool DeflateThread::broken() const
+{
+    return d->broken;
+}
+
+
+/*! Causes this DeflateThread object to stop doing anything, in a
+    great hurry and without flushing anything to the client. The
+    worker closes the file descriptors as soon as it wakes up.
+*/
+
+void DeflateThread::close()
+{
+    d->broken = true;
+    if ( d->worker )
+        d->worker->wakeup();
+}
@@ -0,0 +1,28 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DEFLATETHREAD_H
+#define DEFLATETHREAD_H
+
+#include "global.h"
+
+
+class DeflateThread
+    : public Garbage
+{
+public:
+    DeflateThread();
+
+    void setServerFD( int );
+    void setClientFD( int );
+
+    bool broken() const;
+
+    void close();
+
+private:
+    static void createWorkers();
+
+    class DeflateThreadData * d;
+};
+
+#endif
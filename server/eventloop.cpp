@@ -10,6 +10,8 @@
 #include "scope.h"
 #include "timer.h"
 #include "graph.h"
+#include "dict.h"
+#include "map.h"
 #include "event.h"
 #include "list.h"
 #include "log.h"
@@ -32,6 +34,17 @@
 // memset (for FD_* under OpenBSD)
 #include <string.h>
 
+#if defined( __linux__ )
+#define EVENTLOOP_EPOLL
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+#elif defined( __FreeBSD__ ) || defined( __OpenBSD__ ) || \
+      defined( __NetBSD__ ) || defined( __APPLE__ )
+#define EVENTLOOP_KQUEUE
+// kqueue, kevent
+#include <sys/event.h>
+#endif
+
 
 static bool freeMemorySoon;
 
@@ -45,16 +58,65 @@ class LoopData
 public:
     LoopData()
         : log( new Log ), startup( false ),
-          stop( false ), limit( 16 * 1024 * 1024 )
-    {}
+          stop( false ), timerHeap( 0 ), numTimers( 0 ), maxTimers( 0 ),
+          limit( 16 * 1024 * 1024 )
+    {
+#if defined( EVENTLOOP_EPOLL )
+        pollfd = ::epoll_create( 1024 );
+#elif defined( EVENTLOOP_KQUEUE )
+        pollfd = ::kqueue();
+#endif
+    }
 
     Log *log;
     bool startup;
     bool stop;
     List< Connection > connections;
-    List< Timer > timers;
+
+    // the armed timers, in a binary min-heap on expiry time, so the
+    // next deadline is at the root no matter how many idle
+    // connections hold timeouts. entries are invalidated lazily: a
+    // timer that has been disarmed or rearmed no longer matches the
+    // deadline recorded for it, and firstTimer() discards such
+    // entries when they surface.
+    struct ArmedTimer {
+        uint deadline;
+        Timer * timer;
+    };
+    ArmedTimer * timerHeap;
+    uint numTimers;
+    uint maxTimers;
+
+    void armTimer( Timer * );
+    void takeTimer();
+    Timer * firstTimer();
+
     uint limit;
 
+#if defined( EVENTLOOP_EPOLL ) || defined( EVENTLOOP_KQUEUE )
+    // One Interest exists per registered fd; it remembers what we
+    // last told the kernel, so each pass issues syscalls only for
+    // fds whose desired events actually changed.
+    class Interest
+        : public Garbage
+    {
+    public:
+        Interest(): c( 0 ), events( 0 ), ready( 0 ) {}
+        Connection * c;
+        uint events;
+        uint ready;
+    };
+
+    static const uint Readable = 1;
+    static const uint Writable = 2;
+
+    int pollfd;
+    Map<Interest> interest;
+
+    void updateInterest( Connection *, bool, bool );
+    void forgetFd( int );
+#endif
+
     class Stopper
         : public EventHandler
     {
@@ -77,6 +139,188 @@ public:
 };
 
 
+/*! Records that \a t wants to fire at its current timeout(), growing
+    the heap if necessary. Armed, disarmed and rearmed again, a timer
+    briefly occupies two heap entries; the stale one is discarded by
+    firstTimer().
+*/
+
+void LoopData::armTimer( Timer * t )
+{
+    if ( numTimers == maxTimers ) {
+        uint m = maxTimers * 2;
+        if ( m < 64 )
+            m = 64;
+        ArmedTimer * h =
+            (ArmedTimer*)Allocator::alloc( m * sizeof( ArmedTimer ) );
+        uint i = 0;
+        while ( i < numTimers ) {
+            h[i] = timerHeap[i];
+            i++;
+        }
+        timerHeap = h;
+        maxTimers = m;
+    }
+
+    uint deadline = t->timeout();
+    uint i = numTimers++;
+    while ( i > 0 && timerHeap[(i-1)/2].deadline > deadline ) {
+        timerHeap[i] = timerHeap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    timerHeap[i].deadline = deadline;
+    timerHeap[i].timer = t;
+}
+
+
+/*! Removes the heap's root entry, if any. */
+
+void LoopData::takeTimer()
+{
+    if ( !numTimers )
+        return;
+    numTimers--;
+    if ( !numTimers )
+        return;
+
+    ArmedTimer last = timerHeap[numTimers];
+    uint i = 0;
+    while ( true ) {
+        uint c = 2 * i + 1;
+        if ( c >= numTimers )
+            break;
+        if ( c + 1 < numTimers &&
+             timerHeap[c+1].deadline < timerHeap[c].deadline )
+            c++;
+        if ( timerHeap[c].deadline >= last.deadline )
+            break;
+        timerHeap[i] = timerHeap[c];
+        i = c;
+    }
+    timerHeap[i] = last;
+}
+
+
+/*! Returns the armed timer with the earliest deadline, or a null
+    pointer if there is none. Discards any stale entries that have
+    made their way to the root.
+*/
+
+Timer * LoopData::firstTimer()
+{
+    while ( numTimers ) {
+        ArmedTimer & a = timerHeap[0];
+        if ( a.timer->active() && a.timer->timeout() == a.deadline )
+            return a.timer;
+        takeTimer();
+    }
+    return 0;
+}
+
+
+#if defined( EVENTLOOP_EPOLL ) || defined( EVENTLOOP_KQUEUE )
+
+/*! Tells the kernel that we want to hear about readability (\a r) and
+    writability (\a w) on the fd belonging to \a c, provided that
+    differs from what the kernel already knows.
+*/
+
+void LoopData::updateInterest( Connection * c, bool r, bool w )
+{
+    int fd = c->fd();
+    if ( fd < 0 || pollfd < 0 )
+        return;
+
+    uint events = 0;
+    if ( r )
+        events |= Readable;
+    if ( w )
+        events |= Writable;
+
+    Interest * i = interest.find( fd );
+    if ( i && i->c == c && i->events == events )
+        return;
+
+    if ( !i ) {
+        i = new Interest;
+        interest.insert( fd, i );
+    }
+
+#if defined( EVENTLOOP_EPOLL )
+    struct epoll_event ev;
+    memset( &ev, 0, sizeof( ev ) );
+    ev.data.fd = fd;
+    if ( events & Readable )
+        ev.events |= EPOLLIN;
+    if ( events & Writable )
+        ev.events |= EPOLLOUT;
+    if ( !events ) {
+        (void)::epoll_ctl( pollfd, EPOLL_CTL_DEL, fd, &ev );
+    }
+    else if ( i->c != c || !i->events ) {
+        // a new fd, or an old number newly reused
+        if ( ::epoll_ctl( pollfd, EPOLL_CTL_ADD, fd, &ev ) < 0 &&
+             errno == EEXIST )
+            (void)::epoll_ctl( pollfd, EPOLL_CTL_MOD, fd, &ev );
+    }
+    else {
+        (void)::epoll_ctl( pollfd, EPOLL_CTL_MOD, fd, &ev );
+    }
+#elif defined( EVENTLOOP_KQUEUE )
+    struct kevent kev[2];
+    uint n = 0;
+    uint old = ( i->c == c ) ? i->events : 0;
+    if ( ( events & Readable ) != ( old & Readable ) )
+        EV_SET( &kev[n++], fd, EVFILT_READ,
+                ( events & Readable ) ? EV_ADD : EV_DELETE, 0, 0, 0 );
+    if ( ( events & Writable ) != ( old & Writable ) )
+        EV_SET( &kev[n++], fd, EVFILT_WRITE,
+                ( events & Writable ) ? EV_ADD : EV_DELETE, 0, 0, 0 );
+    if ( n )
+        (void)::kevent( pollfd, kev, n, 0, 0, 0 );
+#endif
+
+    i->c = c;
+    i->events = events;
+    if ( !events ) {
+        interest.remove( fd );
+        i->ready = 0;
+    }
+}
+
+
+/*! Forgets everything we have told the kernel about \a fd. Closing an
+    fd deregisters it from both epoll and kqueue, so this only has to
+    tidy our own bookkeeping.
+*/
+
+void LoopData::forgetFd( int fd )
+{
+    if ( fd < 0 )
+        return;
+    Interest * i = interest.find( fd );
+    if ( !i )
+        return;
+    interest.remove( fd );
+#if defined( EVENTLOOP_EPOLL )
+    struct epoll_event ev;
+    memset( &ev, 0, sizeof( ev ) );
+    (void)::epoll_ctl( pollfd, EPOLL_CTL_DEL, fd, &ev );
+#elif defined( EVENTLOOP_KQUEUE )
+    struct kevent kev[2];
+    uint n = 0;
+    if ( i->events & Readable )
+        EV_SET( &kev[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, 0 );
+    if ( i->events & Writable )
+        EV_SET( &kev[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0 );
+    if ( n )
+        (void)::kevent( pollfd, kev, n, 0, 0, 0 );
+#endif
+}
+
+#endif
+
+
 /*! \class EventLoop eventloop.h
     This class dispatches event notifications to a list of Connections.
 
@@ -152,6 +396,9 @@ void EventLoop::removeConnection( Connection * c )
 
     if ( d->connections.remove( c ) == 0 )
         return;
+#if defined( EVENTLOOP_EPOLL ) || defined( EVENTLOOP_KQUEUE )
+    d->forgetFd( c->fd() );
+#endif
     setConnectionCounts();
 
     // if this is a server, with external connections, and we just
@@ -186,6 +433,8 @@ List< Connection > *EventLoop::connections() const
 
 
 static GraphableNumber * sizeinram = 0;
+static GraphableHistogram * dispatchTime = 0;
+static Dict<GraphableHistogram> * dispatchTimes = 0;
 
 static const uint gcDelay = 30;
 
@@ -196,6 +445,7 @@ void EventLoop::start()
 {
     Scope x( d->log );
     time_t gc = time(0);
+    uint sizeAfterGc = 0;
     bool haveLoggedStartup = false;
 
     log( "Starting event loop", Log::Debug );
@@ -211,6 +461,35 @@ void EventLoop::start()
         Connection * c;
 
         uint timeout = gcDelay;
+
+#if defined( EVENTLOOP_EPOLL ) || defined( EVENTLOOP_KQUEUE )
+        // Adjust the kernel's interest set where it no longer matches
+        // what each connection wants. Most passes change nothing.
+
+        List< Connection >::Iterator it( d->connections );
+        while ( it ) {
+            c = it;
+            ++it;
+
+            int fd = c->fd();
+            if ( fd < 0 ) {
+                removeConnection( c );
+            }
+            else if ( c->type() == Connection::Listener && inStartup() ) {
+                // we don't accept new connections until we've
+                // completed startup
+                d->updateInterest( c, false, false );
+            }
+            else {
+                d->updateInterest( c, true,
+                                   c->canWrite() ||
+                                   c->state() == Connection::Connecting ||
+                                   c->state() == Connection::Closing );
+                if ( c->timeout() > 0 && c->timeout() < timeout )
+                    timeout = c->timeout();
+            }
+        }
+#else
         int maxfd = -1;
 
         fd_set r, w;
@@ -244,15 +523,13 @@ void EventLoop::start()
                     timeout = c->timeout();
             }
         }
+#endif
 
         // Figure out whether any timers need attention soon
 
-        List< Timer >::Iterator t( d->timers );
-        while ( t ) {
-            if ( t->active() && t->timeout() < timeout )
-                timeout = t->timeout();
-            ++t;
-        }
+        Timer * t = d->firstTimer();
+        if ( t && t->timeout() < timeout )
+            timeout = t->timeout();
 
         // Look for interesting input
 
@@ -269,12 +546,54 @@ void EventLoop::start()
         if ( tv.tv_sec < 1 )
             tv.tv_usec = 200000;
 
-        if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
+        // is this pass an idle timeout, with no client waiting for us?
+        bool idle = true;
+
+#if defined( EVENTLOOP_EPOLL )
+        struct epoll_event results[1024];
+        int n = ::epoll_wait( d->pollfd, results, 1024,
+                              tv.tv_sec * 1000 + tv.tv_usec / 1000 );
+        if ( n > 0 )
+            idle = false;
+        while ( n > 0 ) {
+            n--;
+            LoopData::Interest * i = d->interest.find( results[n].data.fd );
+            if ( i ) {
+                if ( results[n].events & ( EPOLLIN|EPOLLERR|EPOLLHUP ) )
+                    i->ready |= LoopData::Readable;
+                if ( results[n].events & ( EPOLLOUT|EPOLLERR|EPOLLHUP ) )
+                    i->ready |= LoopData::Writable;
+            }
+        }
+#elif defined( EVENTLOOP_KQUEUE )
+        struct kevent results[1024];
+        struct timespec ts;
+        ts.tv_sec = tv.tv_sec;
+        ts.tv_nsec = tv.tv_usec * 1000;
+        int n = ::kevent( d->pollfd, 0, 0, results, 1024, &ts );
+        if ( n > 0 )
+            idle = false;
+        while ( n > 0 ) {
+            n--;
+            LoopData::Interest * i = d->interest.find( results[n].ident );
+            if ( i ) {
+                if ( results[n].filter == EVFILT_READ )
+                    i->ready |= LoopData::Readable;
+                else if ( results[n].filter == EVFILT_WRITE )
+                    i->ready |= LoopData::Writable;
+            }
+        }
+#else
+        int n = select( maxfd+1, &r, &w, 0, &tv );
+        if ( n > 0 )
+            idle = false;
+        if ( n < 0 ) {
             // r and w are undefined. we clear them, and dispatch()
             // won't jump to conclusions
             FD_ZERO( &r );
             FD_ZERO( &w );
         }
+#endif
         time_t now = time( 0 );
 
         // Graph our size before processing events
@@ -282,17 +601,23 @@ void EventLoop::start()
             sizeinram = new GraphableNumber( "memory-used" );
         sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
 
+        // ... and how long each pass over the timers and connections
+        // takes, since a ready connection waits that long before its
+        // event is dispatched
+        if ( !dispatchTime )
+            dispatchTime =
+                new GraphableHistogram( "eventloop-dispatch-milliseconds",
+                                        "" );
+        int64 dispatchStart = GraphableHistogram::milliTime();
+
         // Any interesting timers?
 
-        if ( !d->timers.isEmpty() ) {
-            uint now = time( 0 );
-            t = d->timers.first();
-            while ( t ) {
-                Timer * tmp = t;
-                ++t;
-                if ( tmp->active() && tmp->timeout() <= now )
-                    tmp->execute();
-            }
+        t = d->firstTimer();
+        while ( t && t->timeout() <= (uint)now ) {
+            idle = false;
+            d->takeTimer();
+            t->execute();
+            t = d->firstTimer();
         }
 
         // Figure out what each connection cares about.
@@ -303,9 +628,21 @@ void EventLoop::start()
             ++it;
             int fd = c->fd();
             if ( fd >= 0 ) {
+#if defined( EVENTLOOP_EPOLL ) || defined( EVENTLOOP_KQUEUE )
+                bool canr = false;
+                bool canw = false;
+                LoopData::Interest * i = d->interest.find( fd );
+                if ( i && i->c == c ) {
+                    canr = i->ready & LoopData::Readable;
+                    canw = i->ready & LoopData::Writable;
+                    i->ready = 0;
+                }
+                dispatch( c, canr, canw, now );
+#else
                 dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
                 FD_CLR( fd, &r );
                 FD_CLR( fd, &w );
+#endif
             }
             else {
                 removeConnection( c );
@@ -315,6 +652,8 @@ void EventLoop::start()
         // Graph our size after processing all the events too
 
         sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+        dispatchTime->addNumber(
+            (uint)( GraphableHistogram::milliTime() - dispatchStart ) );
 
         // Collect garbage if someone asks for it, or if we've passed
         // the memory usage goal. This has to be at the end of the
@@ -341,10 +680,18 @@ void EventLoop::start()
                     uint period = gcDelay >> factor;
                     if ( (uint)(now - gc) > period )
                         ::freeMemorySoon = true;
+
+                    // if this pass was an idle timeout, nobody is
+                    // waiting for us, so collecting now is free.
+                    // better to collect in the trough than to wait
+                    // for the period to expire during a busy spell.
+                    else if ( idle && a > sizeAfterGc + 131072 )
+                        ::freeMemorySoon = true;
                 }
             }
             if ( ::freeMemorySoon ) {
                 freeMemory();
+                sizeAfterGc = Allocator::inUse() + Allocator::allocated();
                 gc = time( 0 );
                 ::freeMemorySoon = false;
             }
@@ -421,6 +768,7 @@ void EventLoop::freeMemory()
 
 void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
 {
+    int64 began = GraphableHistogram::milliTime();
     int dummy1;
     socklen_t dummy2;
     dummy2 = sizeof(dummy1);
@@ -524,6 +872,26 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
         c->close();
     if ( !c->valid() )
         removeConnection( c );
+
+    // attribute the time spent to the connection's type, and name the
+    // offender if it stalled everyone else noticeably
+    long elapsed = (long)( GraphableHistogram::milliTime() - began );
+    if ( !::dispatchTimes ) {
+        ::dispatchTimes = new Dict<GraphableHistogram>;
+        Allocator::addEternal( ::dispatchTimes,
+                               "dispatch time histograms" );
+    }
+    EString tn( c->typeName() );
+    GraphableHistogram * h = ::dispatchTimes->find( tn );
+    if ( !h ) {
+        h = new GraphableHistogram( "connection-dispatch-milliseconds",
+                                    "type=\"" + tn + "\"" );
+        ::dispatchTimes->insert( tn, h );
+    }
+    h->addNumber( elapsed );
+    if ( elapsed >= 1000 )
+        d->log->log( "Dispatch took " + fn( elapsed ) + "ms for " +
+                     c->description(), Log::Info );
 }
 
 
@@ -596,6 +964,32 @@ void EventLoop::closeAllExceptListeners()
 }
 
 
+/*! Severs this event loop from its parent process after fork().
+
+    An epoll or kqueue instance is shared with the parent across
+    fork(), not copied the way select()'s fd_sets are: every event
+    would wake both processes, and an epoll_ctl() in one would mutate
+    the interest list the other polls. Each forked child must
+    therefore create its own kernel event queue and register its fds
+    afresh, which forgetting the old Interest map makes the next
+    start() pass do.
+*/
+
+void EventLoop::afterFork()
+{
+#if defined( EVENTLOOP_EPOLL ) || defined( EVENTLOOP_KQUEUE )
+    if ( d->pollfd >= 0 )
+        ::close( d->pollfd );
+#if defined( EVENTLOOP_EPOLL )
+    d->pollfd = ::epoll_create( 1024 );
+#elif defined( EVENTLOOP_KQUEUE )
+    d->pollfd = ::kqueue();
+#endif
+    d->interest.clear();
+#endif
+}
+
+
 /*! Flushes the write buffer of all connections. */
 
 void EventLoop::flushAll()
@@ -661,24 +1055,24 @@ void EventLoop::shutdown()
 
 
 /*! Records that \a t exists, so that the event loop will process \a
-    t.
+    t. If \a t is already armed, the entry for its old deadline
+    becomes stale and is discarded when it reaches the front.
 */
 
 void EventLoop::addTimer( Timer * t )
 {
-    d->timers.append( t );
+    d->armTimer( t );
 }
 
 
 /*! Forgets that \a t exists. The event loop will henceforth never
-    call \a t.
+    call \a t. (The heap entry is dropped lazily; what stops the
+    callback is that \a t no longer matches it.)
 */
 
 void EventLoop::removeTimer( Timer * t )
 {
-    List<Timer>::Iterator i( d->timers.find( t ) );
-    if ( i )
-        d->timers.take( i );
+    t = t;
 }
 
 static GraphableNumber * imapgraph = 0;
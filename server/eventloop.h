@@ -24,6 +24,8 @@ public:
     void closeAllExceptListeners();
     void flushAll();
 
+    void afterFork();
+
     void dispatch( Connection *, bool, bool, uint );
 
     bool inStartup() const;
@@ -4,35 +4,98 @@
 
 #include "allocator.h"
 #include "eventloop.h"
+#include "estringlist.h"
+#include "configuration.h"
 #include "list.h"
+#include "log.h"
 
 #include <time.h> // time()
+#include <sys/time.h> // gettimeofday
+#include <sys/mman.h> // mmap
+#include <fcntl.h> // open
+#include <unistd.h> // ftruncate, close
+#include <string.h> // memset, memmove
+#include <errno.h>
 
 
 static List<GraphableNumber> * numbers = 0;
+static List<GraphableHistogram> * histograms = 0;
 
 
 static const uint graphableHistorySize = 960; // 15 minutes and a little bit
 
 
+// the persistent part of a series: what setValue() writes and the
+// accessors read. lives either on the garbage-collected heap or, if
+// statistics-file is set, in the memory-mapped file, so that history
+// survives a restart with no write syscalls at all.
+
+struct SeriesHistory
+{
+    char name[56];
+    uint min;
+    uint max;
+    uint values[::graphableHistorySize];
+};
+
+
 class GraphableNumberData
     : public Garbage
 {
 public:
-    GraphableNumberData(): min( 0 ), max( 0 ) {
-        uint i = 0;
-        while ( i < graphableHistorySize )
-            values[i++] = 0;
-        setFirstNonPointer( &min );
-    }
+    GraphableNumberData(): h( 0 ) {}
     EString name;
-    // no pointers after this line
-    uint min;
-    uint max;
-    uint values[::graphableHistorySize];
+    SeriesHistory * h;
 };
 
 
+static SeriesHistory * fileSlots = 0;
+
+static const uint maxPersistedSeries = 256;
+
+static const uint historyFileMagic = 0x61784748; // "axGH"
+
+
+struct HistoryFileHeader
+{
+    uint magic;
+    uint version;
+    uint slots;
+    uint unused;
+};
+
+
+// returns the slot for name in the mapped statistics file, claiming
+// a free one if necessary, or null if there is no file, the name
+// doesn't fit, or all slots are taken.
+
+static SeriesHistory * persistentHistory( const EString & name )
+{
+    if ( !::fileSlots || name.length() > 55 )
+        return 0;
+
+    SeriesHistory * unclaimed = 0;
+    uint i = 0;
+    while ( i < ::maxPersistedSeries ) {
+        SeriesHistory * s = ::fileSlots + i;
+        if ( !s->name[0] ) {
+            if ( !unclaimed )
+                unclaimed = s;
+        }
+        else if ( name == s->name ) {
+            return s;
+        }
+        i++;
+    }
+
+    if ( !unclaimed )
+        return 0;
+    memmove( unclaimed->name, name.data(), name.length() );
+    unclaimed->name[name.length()] = 0;
+    return unclaimed;
+}
+
+
 /*! \class GraphableNumber graph.h
 
     The GraphableNumber class keeps track of past values of a number,
@@ -53,6 +116,11 @@ GraphableNumber::GraphableNumber( const EString & name )
     : d( new GraphableNumberData )
 {
     d->name = name;
+    d->h = persistentHistory( name );
+    if ( !d->h ) {
+        d->h = (SeriesHistory*)Allocator::alloc( sizeof( SeriesHistory ), 0 );
+        memset( d->h, 0, sizeof( SeriesHistory ) );
+    }
     if ( !numbers ) {
         numbers = new List<GraphableNumber>;
         Allocator::addEternal( numbers, "numbers for statistics" );
@@ -67,16 +135,16 @@ GraphableNumber::GraphableNumber( const EString & name )
 
 void GraphableNumber::clearOldHistory( uint t )
 {
-    if ( d->min < t - 2 * graphableHistorySize )
-        d->min = t;
-    while ( d->min < t + 1 - graphableHistorySize )
-        d->values[d->min++%graphableHistorySize] = 0;
-    if ( d->max < d->min )
-        d->max = d->min;
-    while ( d->max < t ) {
-        d->values[(d->max+1)%graphableHistorySize] =
-            d->values[d->max%graphableHistorySize];
-        d->max++;
+    if ( d->h->min < t - 2 * graphableHistorySize )
+        d->h->min = t;
+    while ( d->h->min < t + 1 - graphableHistorySize )
+        d->h->values[d->h->min++%graphableHistorySize] = 0;
+    if ( d->h->max < d->h->min )
+        d->h->max = d->h->min;
+    while ( d->h->max < t ) {
+        d->h->values[(d->h->max+1)%graphableHistorySize] =
+            d->h->values[d->h->max%graphableHistorySize];
+        d->h->max++;
     }
 }
 
@@ -89,7 +157,7 @@ void GraphableNumber::setValue( uint v )
 {
     uint t = (uint)time( 0 );
     clearOldHistory( t );
-    d->values[t%graphableHistorySize] = v;
+    d->h->values[t%graphableHistorySize] = v;
 }
 
 
@@ -98,13 +166,13 @@ void GraphableNumber::setValue( uint v )
 uint GraphableNumber::maximumSince( uint t ) const
 {
     uint max = 0;
-    if ( t < d->min )
-        t = d->min;
-    if ( t > d->max )
-        t = d->max;
-    while ( t <= d->max ) {
-        if ( d->values[t%graphableHistorySize] > max )
-            max = d->values[t%graphableHistorySize];
+    if ( t < d->h->min )
+        t = d->h->min;
+    if ( t > d->h->max )
+        t = d->h->max;
+    while ( t <= d->h->max ) {
+        if ( d->h->values[t%graphableHistorySize] > max )
+            max = d->h->values[t%graphableHistorySize];
         t++;
     }
     return max;
@@ -116,13 +184,13 @@ uint GraphableNumber::maximumSince( uint t ) const
 uint GraphableNumber::minimumSince( uint t ) const
 {
     uint min = UINT_MAX;
-    if ( t < d->min )
-        t = d->min;
-    if ( t > d->max )
-        t = d->max;
-    while ( t <= d->max ) {
-        if ( d->values[t%graphableHistorySize] < min )
-            min = d->values[t%graphableHistorySize];
+    if ( t < d->h->min )
+        t = d->h->min;
+    if ( t > d->h->max )
+        t = d->h->max;
+    while ( t <= d->h->max ) {
+        if ( d->h->values[t%graphableHistorySize] < min )
+            min = d->h->values[t%graphableHistorySize];
         t++;
     }
     return min;
@@ -135,12 +203,12 @@ uint GraphableNumber::averageSince( uint t ) const
 {
     uint s = 0;
     uint n = 0;
-    if ( t < d->min )
-        t = d->min;
-    if ( t > d->max )
-        t = d->max;
-    while ( t <= d->max ) {
-        s += d->values[t%graphableHistorySize];
+    if ( t < d->h->min )
+        t = d->h->min;
+    if ( t > d->h->max )
+        t = d->h->max;
+    while ( t <= d->h->max ) {
+        s += d->h->values[t%graphableHistorySize];
         n++;
         t++;
     }
@@ -155,7 +223,7 @@ uint GraphableNumber::averageSince( uint t ) const
 
 uint GraphableNumber::lastValue() const
 {
-    return d->values[d->max%graphableHistorySize];
+    return d->h->values[d->h->max%graphableHistorySize];
 }
 
 
@@ -163,7 +231,7 @@ uint GraphableNumber::lastValue() const
 
 uint GraphableNumber::oldestTime() const
 {
-    return d->min;
+    return d->h->min;
 }
 
 
@@ -171,7 +239,7 @@ uint GraphableNumber::oldestTime() const
 
 uint GraphableNumber::youngestTime() const
 {
-    return d->max;
+    return d->h->max;
 }
 
 
@@ -179,9 +247,9 @@ uint GraphableNumber::youngestTime() const
 
 uint GraphableNumber::value( uint t )
 {
-    if ( t < d->min || t > d->max )
+    if ( t < d->h->min || t > d->h->max )
         return 0;
-    return d->values[t%graphableHistorySize];
+    return d->h->values[t%graphableHistorySize];
 }
 
 
@@ -193,6 +261,86 @@ EString GraphableNumber::name() const
 }
 
 
+/*! Returns a pointer to the GraphableNumber called \a name, or a
+    null pointer if no such object has been created yet.
+*/
+
+GraphableNumber * GraphableNumber::named( const EString & name )
+{
+    List<GraphableNumber>::Iterator i( numbers );
+    while ( i && i->name() != name )
+        ++i;
+    return i;
+}
+
+
+/*! Maps the statistics-file into memory, so that series histories
+    survive a restart. Called by Server::secure() while the server
+    can still open files. If statistics-file is unset or cannot be
+    mapped, history simply stays in process memory as before.
+
+    Steady-state updates are plain stores into the mapping; the
+    kernel writes the pages back on its own schedule, so recording
+    costs no syscalls at all.
+*/
+
+void GraphableNumber::setupPersistence()
+{
+    EString file = Configuration::text( Configuration::StatisticsFile );
+    if ( file.isEmpty() )
+        return;
+
+    uint size = sizeof( HistoryFileHeader ) +
+                ::maxPersistedSeries * sizeof( SeriesHistory );
+    int fd = ::open( file.cstr(), O_RDWR|O_CREAT, 0600 );
+    if ( fd >= 0 && ::ftruncate( fd, size ) < 0 ) {
+        ::close( fd );
+        fd = -1;
+    }
+    void * m = MAP_FAILED;
+    if ( fd >= 0 ) {
+        m = ::mmap( 0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+        // the mapping survives close()
+        ::close( fd );
+    }
+    if ( m == MAP_FAILED ) {
+        ::log( "Cannot map statistics-file " + file +
+               " (error " + fn( errno ) + ")", Log::Error );
+        return;
+    }
+
+    HistoryFileHeader * h = (HistoryFileHeader*)m;
+    if ( h->magic != ::historyFileMagic ||
+         h->version != 1 ||
+         h->slots != ::maxPersistedSeries ) {
+        // a new or incompatible file starts from nothing
+        memset( m, 0, size );
+        h->magic = ::historyFileMagic;
+        h->version = 1;
+        h->slots = ::maxPersistedSeries;
+    }
+    ::fileSlots = (SeriesHistory *)( h + 1 );
+
+    // series created before this point have heap history; move them
+    // into the file, keeping whatever the file already holds unless
+    // the heap copy is the only one with data.
+    List<GraphableNumber>::Iterator i( ::numbers );
+    while ( i ) {
+        SeriesHistory * s = persistentHistory( i->name() );
+        if ( s ) {
+            if ( !s->max && i->d->h->max ) {
+                s->min = i->d->h->min;
+                s->max = i->d->h->max;
+                memmove( s->values, i->d->h->values,
+                         sizeof( s->values ) );
+            }
+            i->d->h = s;
+        }
+        ++i;
+    }
+}
+
+
 /*! \class GraphableCounter graph.h
 
     The GraphableCounter class provides a tick counter; you can tell
@@ -200,12 +348,15 @@ EString GraphableNumber::name() const
 */
 
 
-/*! Constructs an empty counter and registers it as \a name. */
+/*! Constructs an empty counter and registers it as \a name. Or not
+    quite empty: if statistics-file preserved the counter's history
+    across a restart, counting resumes from the last recorded value.
+*/
 
 GraphableCounter::GraphableCounter( const EString & name )
     : GraphableNumber( name )
 {
-    setValue( 0 );
+    setValue( lastValue() );
 }
 
 
@@ -263,6 +414,151 @@ void GraphableDataSet::addNumber( uint n )
 }
 
 
+static const uint graphableBuckets = 15;
+
+
+class GraphableHistogramData
+    : public Garbage
+{
+public:
+    GraphableHistogramData(): count( 0 ), sum( 0 ) {
+        uint i = 0;
+        while ( i < graphableBuckets )
+            counts[i++] = 0;
+        setFirstNonPointer( &count );
+    }
+    EString name;
+    EString label;
+    // no pointers after this line
+    uint count;
+    int64 sum;
+    uint counts[::graphableBuckets];
+};
+
+
+/*! \class GraphableHistogram graph.h
+
+    The GraphableHistogram class counts observations (typically
+    durations in milliseconds) into exponential buckets, so that
+    MetricsDumper can export percentile-friendly histograms instead of
+    the averages GraphableNumber provides.
+
+    As for GraphableNumber, objects of this class register themselves
+    on creation and cannot be deleted.
+*/
+
+
+/*! Constructs a histogram called \a name. If \a label is nonempty, it
+    must be a Prometheus label pair such as command="fetch", and is
+    attached to each exported sample.
+*/
+
+GraphableHistogram::GraphableHistogram( const EString & name,
+                                        const EString & label )
+    : d( new GraphableHistogramData )
+{
+    d->name = name;
+    d->label = label;
+    if ( !histograms ) {
+        histograms = new List<GraphableHistogram>;
+        Allocator::addEternal( histograms, "histograms for statistics" );
+    }
+    histograms->append( this );
+}
+
+
+/*! Counts \a v into the appropriate bucket. */
+
+void GraphableHistogram::addNumber( uint v )
+{
+    d->count++;
+    d->sum += v;
+    uint i = 0;
+    while ( i < graphableBuckets ) {
+        if ( v <= threshold( i ) )
+            d->counts[i]++;
+        i++;
+    }
+}
+
+
+/*! Returns the name supplied to this object's constructor. */
+
+EString GraphableHistogram::name() const
+{
+    return d->name;
+}
+
+
+/*! Returns the label supplied to this object's constructor, which may
+    be an empty string.
+*/
+
+EString GraphableHistogram::label() const
+{
+    return d->label;
+}
+
+
+/*! Returns the number of buckets. Observations bigger than the last
+    threshold() are counted only by count().
+*/
+
+uint GraphableHistogram::buckets() const
+{
+    return graphableBuckets;
+}
+
+
+/*! Returns the upper bound of bucket \a i. The bounds are powers of
+    two, 1 up to 16384.
+*/
+
+uint GraphableHistogram::threshold( uint i ) const
+{
+    return 1 << i;
+}
+
+
+/*! Returns the number of observations no bigger than threshold( \a i ). */
+
+uint GraphableHistogram::bucketValue( uint i ) const
+{
+    if ( i >= graphableBuckets )
+        return d->count;
+    return d->counts[i];
+}
+
+
+/*! Returns the total number of observations. */
+
+uint GraphableHistogram::count() const
+{
+    return d->count;
+}
+
+
+/*! Returns the sum of all observations. */
+
+int64 GraphableHistogram::sum() const
+{
+    return d->sum;
+}
+
+
+/*! Returns the current time in milliseconds, for use with
+    addNumber().
+*/
+
+int64 GraphableHistogram::milliTime()
+{
+    struct timeval tv;
+    if ( ::gettimeofday( &tv, 0 ) < 0 )
+        return 0;
+    return ((int64)tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+
 /*! \class GraphDumper graph.h
     This Connection subclass is responsible for transferring statistics
     en masse to any client that asks.
@@ -315,3 +611,136 @@ void GraphDumper::react( Event )
 {
     setState( Closing );
 }
+
+
+/* This static helper maps a statistics name such as buffer-flushes to
+   a Prometheus metric name such as aox_buffer_flushes.
+*/
+
+static EString metricName( const EString & name )
+{
+    EString r( "aox_" );
+    uint i = 0;
+    while ( i < name.length() ) {
+        char c = name[i];
+        if ( ( c >= 'a' && c <= 'z' ) ||
+             ( c >= 'A' && c <= 'Z' ) ||
+             ( c >= '0' && c <= '9' ) )
+            r.append( c );
+        else
+            r.append( '_' );
+        i++;
+    }
+    return r.lower();
+}
+
+
+/*! \class MetricsDumper graph.h
+
+    This Connection subclass exports all GraphableNumber and
+    GraphableHistogram instruments in the Prometheus text format, so
+    that a scraper can alert on e.g. p99 fetch latency.
+*/
+
+/*! Dumps an HTTP response containing current metrics on the socket \a
+    fd and closes it at once, in the same manner as GraphDumper. The
+    scraper's request is not read; every request receives the same
+    response.
+*/
+
+MetricsDumper::MetricsDumper( int fd )
+    : Connection( fd, Connection::GraphDumper )
+{
+    EventLoop::global()->addConnection( this );
+
+    EString b;
+    b.reserve( 4096 );
+
+    List<GraphableNumber>::Iterator i( numbers );
+    while ( i ) {
+        b.append( metricName( i->name() ) );
+        b.append( " " );
+        b.appendNumber( i->lastValue() );
+        b.append( "\n" );
+        ++i;
+    }
+
+    // histograms sharing a name (e.g. one per IMAP command) form a
+    // single metric family, and prometheus wants each family's
+    // samples grouped under one TYPE line
+    EStringList families;
+    List<GraphableHistogram>::Iterator h( histograms );
+    while ( h ) {
+        families.append( new EString( h->name() ) );
+        ++h;
+    }
+    families.removeDuplicates();
+
+    EStringList::Iterator f( families );
+    while ( f ) {
+        EString n( metricName( *f ) );
+        b.append( "# TYPE " );
+        b.append( n );
+        b.append( " histogram\n" );
+        List<GraphableHistogram>::Iterator h( histograms );
+        while ( h ) {
+            if ( h->name() == *f ) {
+                EString l( h->label() );
+                if ( !l.isEmpty() )
+                    l.append( "," );
+                uint j = 0;
+                while ( j < h->buckets() ) {
+                    b.append( n );
+                    b.append( "_bucket{" );
+                    b.append( l );
+                    b.append( "le=\"" );
+                    b.appendNumber( h->threshold( j ) );
+                    b.append( "\"} " );
+                    b.appendNumber( h->bucketValue( j ) );
+                    b.append( "\n" );
+                    j++;
+                }
+                b.append( n );
+                b.append( "_bucket{" );
+                b.append( l );
+                b.append( "le=\"+Inf\"} " );
+                b.appendNumber( h->count() );
+                b.append( "\n" );
+
+                b.append( n );
+                b.append( "_sum" );
+                if ( !h->label().isEmpty() )
+                    b.append( "{" + h->label() + "}" );
+                b.append( " " );
+                b.appendNumber( h->sum() );
+                b.append( "\n" );
+
+                b.append( n );
+                b.append( "_count" );
+                if ( !h->label().isEmpty() )
+                    b.append( "{" + h->label() + "}" );
+                b.append( " " );
+                b.appendNumber( h->count() );
+                b.append( "\n" );
+            }
+            ++h;
+        }
+        ++f;
+    }
+
+    EString r( "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Connection: close\r\n"
+               "Content-Length: " );
+    r.appendNumber( b.length() );
+    r.append( "\r\n\r\n" );
+    r.append( b );
+    enqueue( r );
+    setTimeoutAfter( 0 );
+}
+
+
+void MetricsDumper::react( Event )
+{
+    setState( Closing );
+}
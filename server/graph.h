@@ -24,6 +24,10 @@ public:
     uint youngestTime() const;
     uint value( uint );
 
+    static GraphableNumber * named( const EString & );
+
+    static void setupPersistence();
+
 private:
     class GraphableNumberData * d;
     void clearOldHistory( uint );
@@ -53,6 +57,29 @@ private:
 };
 
 
+class GraphableHistogram
+    : public Garbage
+{
+public:
+    GraphableHistogram( const EString &, const EString & );
+
+    void addNumber( uint );
+
+    EString name() const;
+    EString label() const;
+    uint buckets() const;
+    uint threshold( uint ) const;
+    uint bucketValue( uint ) const;
+    uint count() const;
+    int64 sum() const;
+
+    static int64 milliTime();
+
+private:
+    class GraphableHistogramData * d;
+};
+
+
 class GraphDumper
     : public Connection
 {
@@ -63,4 +90,14 @@ public:
 };
 
 
+class MetricsDumper
+    : public Connection
+{
+public:
+    MetricsDumper( int );
+
+    void react( Event );
+};
+
+
 #endif
@@ -8,39 +8,7 @@
 
 static inline uint bitsSet( uint b )
 {
-    uint r = 0;
-    while ( b ) {
-        switch ( b & 15 ) {
-        case 0:
-            r += 0;
-            break;
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-            r += 1;
-            break;
-        case 3:
-        case 5:
-        case 6:
-        case 9:
-        case 10:
-        case 12:
-            r += 2;
-            break;
-        case 7:
-        case 11:
-        case 13:
-        case 14:
-            r += 3;
-            break;
-        case 15:
-            r += 4;
-            break;
-        }
-        b >>= 4;
-    }
-    return r;
+    return __builtin_popcount( b );
 };
 
 
@@ -178,24 +146,36 @@ void IntegerSet::add( uint n1, uint n2 )
     }
 
     uint n = n1;
-    uint s = n - (n%BlockSize);
-    SetData::Block * b = d->b.find( s );
-    if ( !b ) {
-        b = new SetData::Block( s );
-        d->b.insert( s, b );
-    }
-    b->insert( n );
-    while ( n < n2 ) {
-        ++n;
-        if ( s != n - (n%BlockSize) ) {
-            s = n - (n%BlockSize);
-            b = d->b.find( s );
-            if ( !b ) {
-                b = new SetData::Block( s );
-                d->b.insert( s, b );
-            }
+    while ( n <= n2 && n >= n1 ) {
+        uint s = n - (n%BlockSize);
+        SetData::Block * b = d->b.find( s );
+        if ( !b ) {
+            b = new SetData::Block( s );
+            d->b.insert( s, b );
+        }
+        else if ( !b->count ) {
+            // the count may be stale; make it exact so it can be
+            // updated incrementally below
+            b->recount();
+        }
+        uint e = n2 - s;
+        if ( e >= BlockSize )
+            e = BlockSize - 1;
+        // set bits n-s through e a whole word at a time
+        uint i = ( n - s ) / BitsPerUint;
+        uint j = e / BitsPerUint;
+        while ( i <= j ) {
+            uint mask = 0xffffffff;
+            if ( i == ( n - s ) / BitsPerUint )
+                mask &= 0xffffffff << ( (n-s) % BitsPerUint );
+            if ( i == j )
+                mask &= ~( 0xfffffffe << ( e % BitsPerUint ) );
+            uint old = b->contents[i];
+            b->contents[i] = old | mask;
+            b->count += bitsSet( mask & ~old );
+            i++;
         }
-        b->insert( n );
+        n = s + BlockSize;
     }
 }
 
@@ -244,9 +224,7 @@ uint IntegerSet::largest() const
     while ( i && !b->contents[i] )
         i--;
     uint x = b->contents[i];
-    uint j = BitsPerUint-1;
-    while ( !(x & 1 << j) )
-        j--;
+    uint j = BitsPerUint - 1 - __builtin_clz( x );
     return b->start + i * BitsPerUint + j;
 }
 
@@ -302,12 +280,12 @@ uint IntegerSet::value( uint index ) const
         n++;
         bs = bitsSet( i->contents[n] );
     }
+    uint w = i->contents[n];
     uint j = 0;
-    while ( c < index && j < BitsPerUint ) {
-        if ( i->contents[n] & ( 1 << j ) )
-            c++;
-        if ( c < index )
-            j++;
+    while ( c < index && w ) {
+        j = __builtin_ctz( w );
+        w &= w - 1;
+        c++;
     }
     return i->start + n*BitsPerUint + j;
 }
@@ -472,6 +450,77 @@ void IntegerSet::clear()
 }
 
 
+// walks a set block by block, producing each contiguous range in
+// turn. this is a generator, so huge sets can be measured and
+// emitted without building any intermediate representation.
+
+class RangeWalker
+{
+public:
+    RangeWalker( Map<SetData::Block> * blocks )
+        : it( *blocks ), n( 0 ), v( it ? it->start : 0 ),
+          b( it ? it->contents[0] : 0 ), s( 0 ), e( 0 ) {}
+
+    bool next( uint & start, uint & end ) {
+        while ( it ) {
+            while ( b ) {
+                uint j = __builtin_ctz( b );
+                b &= b - 1;
+                if ( !e ) {
+                    s = v + j;
+                    e = s;
+                }
+                else if ( e + 1 < v + j ) {
+                    start = s;
+                    end = e;
+                    s = v + j;
+                    e = s;
+                    return true;
+                }
+                else {
+                    e = v + j;
+                }
+            }
+            n++;
+            v += BitsPerUint;
+            if ( n >= ArraySize ) {
+                ++it;
+                n = 0;
+                if ( it )
+                    v = it->start;
+            }
+            if ( it )
+                b = it->contents[n];
+        }
+        if ( !e )
+            return false;
+        start = s;
+        end = e;
+        e = 0;
+        return true;
+    }
+
+private:
+    Map<SetData::Block>::Iterator it;
+    uint n;
+    uint v;
+    uint b;
+    uint s;
+    uint e;
+};
+
+
+static uint digits( uint n )
+{
+    uint d = 1;
+    while ( n >= 10 ) {
+        n /= 10;
+        d++;
+    }
+    return d;
+}
+
+
 static void addRange( EString & r, uint s, uint e )
 {
     if ( !r.isEmpty() )
@@ -497,42 +546,27 @@ static void addRange( EString & r, uint s, uint e )
 EString IntegerSet::set() const
 {
     EString r;
-    r.reserve( 2222 );
     uint s = 0;
     uint e = 0;
 
-    Map<SetData::Block>::Iterator it( d->b );
-    while ( it ) {
-        uint v = it->start;
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !e ) {
-                            s = v + j;
-                            e = s;
-                        }
-                        else if ( e + 1 < v + j ) {
-                            addRange( r, s, e );
-                            s = v + j;
-                            e = s;
-                        }
-                        else {
-                            e = v + j;
-                        }
-                    }
-                    j++;
-                }
-            }
-            n++;
-            v += BitsPerUint;
-        }
-        ++it;
+    // measure the result first, so that even a set with very many
+    // ranges is emitted into a single exactly-sized allocation
+    // instead of being grown and copied repeatedly.
+    uint bytes = 0;
+    RangeWalker m( &d->b );
+    while ( m.next( s, e ) ) {
+        if ( bytes )
+            bytes++;
+        bytes += digits( s );
+        if ( e > s )
+            bytes += 1 + digits( e );
     }
-    if ( e )
+    if ( !bytes )
+        return r;
+
+    r.reserve( bytes );
+    RangeWalker w( &d->b );
+    while ( w.next( s, e ) )
         addRange( r, s, e );
     return r;
 }
@@ -551,17 +585,13 @@ EString IntegerSet::csl() const
     while ( it ) {
         uint n = 0;
         while ( n < ArraySize ) {
-            uint j = 0;
             uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !r.isEmpty() )
-                            r.append( ',' );
-                        r.appendNumber( it->start + n * BitsPerUint + j );
-                    }
-                    j++;
-                }
+            while ( b ) {
+                uint j = __builtin_ctz( b );
+                b &= b - 1;
+                if ( !r.isEmpty() )
+                    r.append( ',' );
+                r.appendNumber( it->start + n * BitsPerUint + j );
             }
             n++;
         }
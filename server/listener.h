@@ -47,11 +47,23 @@ public:
         if ( state() == Closing )
             return;
 
-        int s = accept();
-        if ( s >= 0 ) {
+        // accept everything the kernel has queued, so a reconnect
+        // storm drains in one pass instead of one connection per
+        // event loop iteration. the cap keeps a huge storm from
+        // starving timers and established connections; anything
+        // beyond it just keeps the fd readable for the next pass.
+        uint n = 0;
+        while ( n < 64 ) {
+            int s = accept();
+            if ( s < 0 )
+                break;
             Connection * c = new T(s);
             c->setState( Connected );
+            n++;
         }
+        if ( n > 1 )
+            log( "Accepted " + fn( n ) + " connections in one pass",
+                 Log::Debug );
     }
 
     static void create( const EString &svc, bool use,
@@ -107,30 +119,64 @@ public:
                     bool silent = false;
                     if ( any6 && *it == "0.0.0.0" )
                         silent = true;
-                    Listener<T> * l = new Listener<T>( e, svc, silent );
-                    if ( l->state() != Listening ) {
-                        delete l;
-                        l = 0;
-                        if ( silent ) {
-                            // if we listen on all addresses using
-                            // ipv6 syntax, some platforms also listen
-                            // to all ipv4 addresses, and an explicit
-                            // ipv4 listen will fail. ignore that
-                            // silently.
-                            ::log( "Assuming that listening on all IPv6 "
-                                   "addresses also listens on IPv4." );
-                            setAny6ListensTo4( true );
+                    // with several worker processes, each gets its own
+                    // SO_REUSEPORT socket, so the kernel balances
+                    // accepts instead of waking every worker
+                    uint workers = 1;
+#if defined( SO_REUSEPORT )
+                    if ( e.protocol() != Endpoint::Unix &&
+                         !e.inherited() )
+                        workers = Configuration::scalar(
+                            Configuration::ServerProcesses );
+                    if ( !workers )
+                        workers = 1;
+#endif
+                    Listener<T> * first = 0;
+                    uint w = 0;
+                    while ( w < workers ) {
+                        Listener<T> * l =
+                            new Listener<T>( e, svc, silent || w > 0 );
+                        if ( l->state() != Listening ) {
+                            delete l;
+                            l = 0;
+                            if ( w > 0 ) {
+                                // the kernel accepted SO_REUSEPORT but
+                                // won't bind twice; share the first
+                                // socket among all workers instead
+                                first->setWorker( UINT_MAX );
+                                break;
+                            }
+                            else if ( silent ) {
+                                // if we listen on all addresses using
+                                // ipv6 syntax, some platforms also
+                                // listen to all ipv4 addresses, and an
+                                // explicit ipv4 listen will
+                                // fail. ignore that silently.
+                                ::log( "Assuming that listening on all "
+                                       "IPv6 addresses also listens "
+                                       "on IPv4." );
+                                setAny6ListensTo4( true );
+                                break;
+                            }
+                            else {
+                                ::log( "Cannot listen for " + svc +
+                                       " on " + *it,
+                                       Log::Disaster );
+                                break;
+                            }
                         }
                         else {
-                            ::log( "Cannot listen for " + svc + " on " + *it,
-                                   Log::Disaster );
+                            if ( workers > 1 )
+                                l->setWorker( w );
+                            if ( !w ) {
+                                first = l;
+                                ::log( "Started: " + l->description() );
+                                c++;
+                                if ( *it == "::" )
+                                    any6 = true;
+                            }
                         }
-                    }
-                    else {
-                        ::log( "Started: " + l->description() );
-                        c++;
-                        if ( *it == "::" )
-                            any6 = true;
+                        w++;
                     }
                 }
                 else {
@@ -87,6 +87,7 @@ public:
 
 
 static List<MailboxReader> * readers = 0;
+static int64 largestChange = 0;
 
 
 MailboxReader::MailboxReader( EventHandler * ev, int64 c )
@@ -97,13 +98,15 @@ MailboxReader::MailboxReader( EventHandler * ev, int64 c )
         Allocator::addEternal( ::readers, "active mailbox readers" );
     }
     ::readers->append( this );
-    q = new Query( "select m.id, m.name, m.deleted, m.owner, "
-                   "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag "
-                   //"m.change " // better: m.change
-                   "from mailboxes m ",
-                   //"where change>=$1"
-                   this );
-    c = c; //query->bind( 1, c );
+    EString s( "select m.id, m.name, m.deleted, m.owner, "
+               "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag, "
+               "m.change "
+               "from mailboxes m" );
+    if ( c )
+        s.append( " where m.change>=$1" );
+    q = new Query( s, this );
+    if ( c )
+        q->bind( 1, c );
     if ( !::mailboxes )
         Mailbox::setup();
 }
@@ -145,6 +148,9 @@ void MailboxReader::execute() {
             m->setFlag( r->getEString( "flag" ) );
         else
             m->setFlag( "" );
+
+        if ( r->getBigint( "change" ) > ::largestChange )
+            ::largestChange = r->getBigint( "change" );
     }
 
     if ( !q->done() || done )
@@ -193,9 +199,11 @@ public:
             t = new Timer( this, 2 );
         }
         else {
-            // time's out, time to work
+            // time's out, time to work. read only the rows changed
+            // since the last read; a row may be reread if it has the
+            // largest change value seen so far, but that's cheap.
             t = 0;
-            m = new MailboxReader( 0, 0 );
+            m = new MailboxReader( 0, ::largestChange );
             m->q->execute();
         }
     }
@@ -220,6 +228,7 @@ public:
             ::mailboxes->clear();
             ::mailboxesByName->clear();
             ::wiped = true;
+            ::largestChange = 0;
             (void)Mailbox::root();
             mr = new MailboxReader( this, 0 );
             mr->q->execute();
@@ -670,6 +679,7 @@ Query * Mailbox::remove( Transaction * t )
     t->enqueue( q );
 
     t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+    t->enqueue( new Query( "notify permissions_updated", 0 ) );
 
     return q;
 }
@@ -4,9 +4,12 @@
 
 #include "integerset.h"
 #include "estringlist.h"
+#include "dbsignal.h"
 #include "mailbox.h"
+#include "cache.h"
 #include "event.h"
 #include "query.h"
+#include "dict.h"
 #include "user.h"
 
 
@@ -49,6 +52,40 @@ public:
 };
 
 
+// caches the rights string computed from the permissions table, keyed
+// by login and mailbox id, so that steady-state right checks don't
+// need a database round trip.
+
+class PermissionsCache
+    : public Cache
+{
+public:
+    PermissionsCache(): Cache( 4 ) {}
+    void clear() { byKey.clear(); }
+
+    Dict<EString> byKey;
+};
+
+static PermissionsCache * rightsCache = 0;
+
+
+// clears the cached rights whenever this or any other process
+// modifies the permissions table.
+
+class PermissionsCacheFlusher
+    : public EventHandler
+{
+public:
+    PermissionsCacheFlusher() {
+        (void)new DatabaseSignal( "permissions_updated", this );
+    }
+    void execute() {
+        if ( ::rightsCache )
+            ::rightsCache->clear();
+    }
+};
+
+
 /*! \class Permissions permissions.h
     This class provides RFC 2086 access control lists.
 
@@ -183,7 +220,23 @@ void Permissions::execute()
             d->allowed[Read] = true;
         }
 
-        // For everyone else, we have to check.
+        // For everyone else, we have to check, but perhaps we've
+        // checked recently and still remember the answer.
+        if ( !::rightsCache ) {
+            ::rightsCache = new PermissionsCache;
+            (void)new PermissionsCacheFlusher;
+        }
+
+        EString * cached =
+            ::rightsCache->byKey.find( d->user->login().utf8() + ":" +
+                                       fn( d->mailbox->id() ) );
+        if ( cached ) {
+            allow( *cached );
+            d->ready = true;
+            d->owner = 0;
+            return;
+        }
+
         d->q = new Query( "select * from permissions "
                           "where mailbox=any($1) and "
                           "(identifier=$2 or"
@@ -226,10 +279,15 @@ void Permissions::execute()
             p.append( r->getEString( "rights" ) );
     }
 
+    EString granted;
     if ( p.isEmpty() )
-        allow( "l" );
+        granted = "l";
     else
-        allow( p.join( "" ) ); // ooooh.
+        granted = p.join( "" ); // ooooh.
+    allow( granted );
+    ::rightsCache->byKey.insert( d->user->login().utf8() + ":" +
+                                 fn( d->mailbox->id() ),
+                                 new EString( granted ) );
 
     d->ready = true;
     d->owner->execute();
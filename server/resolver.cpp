@@ -19,15 +19,29 @@
 #include "allocator.h"
 #include "configuration.h"
 
+// time
+#include <time.h>
+
+
+class ResolverCacheItem
+    : public Garbage
+{
+public:
+    ResolverCacheItem(): results( 0 ), expires( 0 ) {}
+    EStringList * results;
+    uint expires;
+};
+
 
 class ResolverData
     : public Garbage
 {
 public:
     EStringList errors;
-    Dict<EStringList> names;
+    Dict<ResolverCacheItem> names;
     EString reply;
     EString host;
+    uint ttl;
     bool bad;
 };
 
@@ -35,8 +49,11 @@ public:
 /*! \class Resolver resolver.h
 
     The Resolver class performs DNS lookups and caches the results
-    until the process exits. It does not consider the TTLs on the DNS
-    results.
+    for as long as the smallest TTL on the answers permits (no less
+    than a minute and no more than a day). Lookups that fail are also
+    cached, for a minute, so a broken name doesn't make every caller
+    wait for a timeout. The underlying query still blocks the event
+    loop, but at most once per name per TTL instead of on every call.
 
     The only public functions are resolve(), which does a cache lookup
     and failing that, a DNS lookup, and errors(), which returns a list
@@ -105,13 +122,34 @@ EStringList Resolver::resolve( const EString & name )
     else if ( !r->d->host.isEmpty() ) {
         // it's a domain name. we use res_search() since getnameinfo()
         // had such bad karma when we tried it.
+        ResolverCacheItem * ci = r->d->names.find( r->d->host );
+        uint now = (uint)time( 0 );
+        if ( ci && now < ci->expires )
+            return *ci->results;
+        r->d->ttl = UINT_MAX;
         if ( use6 )
             r->query( T_AAAA, results );
         if ( use4 )
             r->query( T_A, results );
-        if ( results->isEmpty() && r->d->names.contains( r->d->host ) )
-            return *r->d->names.find( r->d->host );
-        r->d->names.insert( r->d->host, results );
+        if ( results->isEmpty() && ci && !ci->results->isEmpty() ) {
+            // the refresh failed; serve the old answer for another
+            // minute rather than forgetting a name which worked
+            ci->expires = now + 60;
+            return *ci->results;
+        }
+        if ( !ci ) {
+            ci = new ResolverCacheItem;
+            r->d->names.insert( r->d->host, ci );
+        }
+        ci->results = results;
+        uint ttl = r->d->ttl;
+        if ( results->isEmpty() )
+            ttl = 60;
+        else if ( ttl < 60 )
+            ttl = 60;
+        else if ( ttl > 86400 )
+            ttl = 86400;
+        ci->expires = now + ttl;
     }
     return *results;
 }
@@ -245,8 +283,12 @@ void Resolver::query( uint type, EStringList * results )
         EString n = readString( p );
         EString a;
         uint type = ( d->reply[p] << 8 ) + d->reply[p+1];
+        uint ttl = ( d->reply[p+4] << 24 ) + ( d->reply[p+5] << 16 ) +
+                   ( d->reply[p+6] << 8 ) + d->reply[p+7];
         uint rdlength = ( d->reply[p+8] << 8 ) + d->reply[p+9];
         p += 10;
+        if ( ttl < d->ttl )
+            d->ttl = ttl;
         if ( type == T_A ) {
             if ( rdlength == 4 ) {
                 uint i = 0;
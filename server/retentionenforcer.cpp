@@ -0,0 +1,204 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "retentionenforcer.h"
+
+#include "log.h"
+#include "query.h"
+#include "scope.h"
+#include "timer.h"
+#include "dbsignal.h"
+#include "selector.h"
+#include "allocator.h"
+#include "transaction.h"
+#include "estringlist.h"
+
+// a full pass per day is plenty; retention is measured in days
+#define RETENTIONINTERVAL 86400
+// each chunk moves at most this many messages in one transaction
+#define RETENTIONCHUNK 1000
+// and we pause this long between chunks, so vacuums can keep up
+#define RETENTIONPAUSE 10
+
+
+static RetentionEnforcer * re = 0;
+
+
+class RetentionEnforcerData
+    : public Garbage
+{
+public:
+    RetentionEnforcerData()
+        : r( 0 ), t( 0 ), found( 0 ), timer( 0 )
+    {}
+
+    RetentionSelector * r;
+    Transaction * t;
+    Query * found;
+    Timer * timer;
+};
+
+
+/*! \class RetentionEnforcer retentionenforcer.h
+
+    The RetentionEnforcer class applies 'delete' retention policies
+    inside the running server, so expired mail goes away without an
+    operator running aox vacuum. It does the same move to
+    deleted_messages that Vacuum does, but in small chunked
+    transactions with pauses in between, so it neither bloats the WAL
+    nor blocks autovacuum, and the age conditions use the index on
+    messages.idate.
+
+    Each archiveopteryx process has only one instance of this class,
+    which is created by RetentionEnforcer::setup().
+*/
+
+RetentionEnforcer::RetentionEnforcer()
+    : d( new RetentionEnforcerData )
+{
+    setLog( new Log );
+}
+
+
+void RetentionEnforcer::execute()
+{
+    Scope x( log() );
+
+    if ( d->t ) {
+        if ( !d->t->done() )
+            return;
+
+        uint found = d->found->rows();
+        Transaction * t = d->t;
+        d->t = 0;
+        d->r = 0;
+        if ( t->failed() ) {
+            // most likely a deadlock with a concurrent expunge; the
+            // messages are still expired, so try again next pass
+            log( "Retention chunk failed: " + t->error(), Log::Error );
+            d->timer = new Timer( this, RETENTIONINTERVAL );
+            return;
+        }
+        if ( found >= RETENTIONCHUNK ) {
+            // there's probably more; rest a little, then rebuild the
+            // policies and do the next chunk
+            d->timer = new Timer( this, RETENTIONPAUSE );
+            return;
+        }
+        log( "Retention pass done" );
+        d->timer = new Timer( this, RETENTIONINTERVAL );
+        return;
+    }
+
+    if ( !d->r ) {
+        delete d->timer;
+        d->timer = 0;
+        d->r = new RetentionSelector( (Transaction *)0, this );
+        d->r->execute();
+    }
+
+    if ( !d->r->done() )
+        return;
+
+    if ( !d->r->deletes() ) {
+        d->r = 0;
+        d->timer = new Timer( this, RETENTIONINTERVAL );
+        return;
+    }
+
+    Selector * s = new Selector( Selector::And );
+    s->add( d->r->deletes() );
+    if ( d->r->retains() ) {
+        Selector * n = new Selector( Selector::Not );
+        s->add( n );
+        n->add( d->r->retains() );
+    }
+    s->simplify();
+
+    // this is the same dance as in aox vacuum, except that the
+    // staging table is capped at RETENTIONCHUNK rows
+
+    EStringList wanted;
+    wanted.append( "mailbox" );
+    wanted.append( "uid" );
+
+    d->t = new Transaction( this );
+
+    d->t->enqueue( new Query( "create temporary table s ("
+                              "mailbox integer, "
+                              "uid integer )", 0 ) );
+
+    d->found = s->query( 0, 0, 0, this, false, &wanted, false );
+    d->found->setString( "insert into s (mailbox,uid) " +
+                         d->found->string() +
+                         " limit " + fn( RETENTIONCHUNK ) );
+    d->t->enqueue( d->found );
+
+    d->t->enqueue( new Query( "select nextmodseq from mailboxes "
+                              "join s on (mailboxes.id=s.mailbox) "
+                              "order by id "
+                              "for update", 0 ) );
+
+    d->t->enqueue( new Query( "insert into deleted_messages "
+                              "(mailbox, uid, message,"
+                              " modseq, deleted_by, reason) "
+                              "select s.mailbox, s.uid, mm.message,"
+                              " m.nextmodseq, null, 'Retention policy' "
+                              "from s "
+                              "join mailbox_messages mm"
+                              " using (mailbox,uid) "
+                              "join mailboxes m on (s.mailbox=m.id)",
+                              0 ) );
+
+    d->t->enqueue( new Query( "update mailboxes "
+                              "set nextmodseq=nextmodseq+1 "
+                              "where id in (select mailbox from s)",
+                              0 ) );
+
+    d->t->enqueue( new Query( "drop table s", 0 ) );
+
+    d->t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+
+    d->t->commit();
+}
+
+
+/*! Called when the retention policies change, so enforcement starts
+    soon instead of at the end of the daily timer.
+*/
+
+void RetentionEnforcer::wake()
+{
+    if ( d->t || ( d->r && !d->r->done() ) )
+        return;
+    delete d->timer;
+    d->r = 0;
+    d->timer = new Timer( this, RETENTIONPAUSE );
+}
+
+
+class RetentionWaker
+    : public EventHandler
+{
+public:
+    RetentionWaker(): EventHandler() {}
+    void execute() { if ( ::re ) ::re->wake(); }
+};
+
+
+/*! Creates the single RetentionEnforcer and arranges for it to run
+    once the database is otherwise idle, and again whenever someone
+    changes the retention policies. This function expects to be called
+    from ::main().
+*/
+
+void RetentionEnforcer::setup()
+{
+    if ( ::re )
+        return;
+
+    ::re = new RetentionEnforcer;
+    Allocator::addEternal( ::re, "retention enforcer" );
+    Database::notifyWhenIdle( ::re );
+    (void)new DatabaseSignal( "retention_policies_updated",
+                              new RetentionWaker );
+}
@@ -0,0 +1,25 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef RETENTIONENFORCER_H
+#define RETENTIONENFORCER_H
+
+#include "event.h"
+
+
+class RetentionEnforcer
+    : public EventHandler
+{
+public:
+    RetentionEnforcer();
+
+    void execute();
+    void wake();
+
+    static void setup();
+
+private:
+    class RetentionEnforcerData * d;
+};
+
+
+#endif
@@ -8,8 +8,11 @@
 #include "flag.h"
 #include "date.h"
 #include "cache.h"
+#include "message.h"
 #include "session.h"
 #include "mailbox.h"
+#include "messagecache.h"
+#include "dynamicscache.h"
 #include "allocator.h"
 #include "estringlist.h"
 #include "configuration.h"
@@ -569,6 +572,7 @@ Query * Selector::query( User * user, Mailbox * mailbox,
         (void)new RetuningDetector;
 
     d->query = new Query( owner );
+    d->query->setReadOnly();
     d->user = user;
     d->session = session;
     d->placeholder = 0;
@@ -2001,6 +2005,10 @@ EString Selector::debugString() const
     against this condition, provided the match is reasonably simple and
     quick, and returns either Yes, No, or (if the match is difficult,
     expensive or depends on data that isn't available) Punt.
+
+    Flags and sizes can often be answered from the DynamicsCache and
+    MessageCache, so a search for e.g. unseen messages just after a
+    flag fetch need not touch the database at all.
 */
 
 Selector::MatchResult Selector::match( Session * s, uint uid )
@@ -2033,7 +2041,30 @@ Selector::MatchResult Selector::match( Session * s, uint uid )
                 return Yes;
             return No;
         }
-        return Punt;
+        // an implicit fetch may have left this message's flags in
+        // the dynamics cache, in which case there's no need to ask
+        // the database
+        DynamicsCacheEntry * e = DynamicsCache::find( s->mailbox(), uid );
+        if ( !e )
+            return Punt;
+        EString w( d->s8.lower() );
+        EStringList::Iterator f( e->flags );
+        while ( f ) {
+            if ( f->lower() == w )
+                return Yes;
+            ++f;
+        }
+        return No;
+    }
+    else if ( ( d->a == Smaller || d->a == Larger ) && d->f == Rfc822Size ) {
+        Message * m = MessageCache::find( s->mailbox(), uid );
+        if ( !m || !m->hasTrivia() )
+            return Punt;
+        if ( d->a == Smaller && m->rfc822Size() < d->n )
+            return Yes;
+        if ( d->a == Larger && m->rfc822Size() > d->n )
+            return Yes;
+        return No;
     }
     else if ( d->a == Not ) {
         MatchResult sub = d->children->first()->match( s, uid );
@@ -2594,6 +2625,28 @@ bool Selector::usesModseq() const
 }
 
 
+/*! Returns true if this Selector refers to the \recent flag, and
+    false if not. \recent is special: it compiles to the current
+    session's recent UIDs (see whereFlags()), so the same selector
+    means different things in different sessions, and changes to it
+    don't show up in modseq.
+*/
+
+bool Selector::usesRecent() const
+{
+    if ( d->f == Flags && d->s8 == "\\recent" )
+        return true;
+    List< Selector >::Iterator i( d->children );
+    while ( i ) {
+        Selector * c = i;
+        ++i;
+        if ( c->usesRecent() )
+            return true;
+    }
+    return false;
+}
+
+
 /*! Returns the 8-bit string supplied to some constructors, or an
     empty string if none has been specified.
 */
@@ -80,6 +80,7 @@ public:
     bool dynamic() const;
     bool timeSensitive() const;
     bool usesModseq() const;
+    bool usesRecent() const;
 
     EString stringArgument() const;
     UString ustringArgument() const;
@@ -48,6 +48,7 @@
 #include "allocator.h"
 #include "resolver.h"
 #include "entropy.h"
+#include "graph.h"
 #include "query.h"
 
 
@@ -342,6 +343,22 @@ static void shutdownLoop( int )
 }
 
 
+static void drainLoop( int )
+{
+    Server::killChildren( SIGTERM );
+    // stop listening at once, but give established connections time
+    // to wind up their current work. a freshly started server can
+    // bind the same ports right away (SO_REUSEPORT, and we close our
+    // listeners before it retries anyway), so clients that arrive
+    // during the drain talk to the new server while the old one
+    // finishes with the clients it has. the event loop exits as soon
+    // as the last client is gone.
+    if ( EventLoop::global() )
+        EventLoop::global()->stop( 25 );
+    (void)alarm( 40 );
+}
+
+
 static void dumpCoreAndGoOn( int )
 {
     if ( fork() )
@@ -356,6 +373,16 @@ static void dumpCoreAndGoOn( int )
 }
 
 
+static uint workerIndex = 0;
+
+
+static void dumpMemoryUsage( int )
+{
+    Allocator::requestUsageDump();
+    EventLoop::freeMemorySoon();
+}
+
+
 /*! Called by signal handling to kill any children started in fork(). */
 
 void Server::killChildren( int signal )
@@ -389,9 +416,12 @@ void Server::loop()
     sa.sa_handler = SIG_IGN;
     ::sigaction( SIGHUP, &sa, 0 );
 
-    // sigint and sigterm both should stop the server
+    // sigint stops the server quickly; sigterm (what init systems
+    // send on restart) drains established connections first, so
+    // upgrades don't cut off clients in mid-command
     sa.sa_handler = shutdownLoop;
     ::sigaction( SIGINT, &sa, 0 );
+    sa.sa_handler = drainLoop;
     ::sigaction( SIGTERM, &sa, 0 );
 
     // sigpipe happens if we're writing to an already-closed fd. we'll
@@ -403,6 +433,11 @@ void Server::loop()
     sa.sa_handler = dumpCoreAndGoOn;
     ::sigaction( SIGUSR1, &sa, 0 );
 
+    // a custom signal to log memory usage by allocation root at the
+    // next garbage collection (see aox show memory)
+    sa.sa_handler = dumpMemoryUsage;
+    ::sigaction( SIGUSR2, &sa, 0 );
+
     // a custom signal to die, quickly, for last-resort exit
     sa.sa_handler = ::killChildrenAndExit;
     ::sigaction( SIGALRM, &sa, 0 );
@@ -479,6 +514,14 @@ void Server::secure()
              Log::Disaster );
         exit( 1 );
     }
+
+    // map the statistics history file, if any, while we can still
+    // open files. only the main single-process server does this;
+    // logd and forked worker siblings would fight over the file.
+    if ( d->name == "archiveopteryx" &&
+         Configuration::scalar( Configuration::ServerProcesses ) < 2 )
+        GraphableNumber::setupPersistence();
+
     bool security = Configuration::toggle( Configuration::Security );
     if ( !security ) {
         if ( getuid() == 0 || geteuid() == 0 )
@@ -725,6 +768,7 @@ void Server::maintainChildren()
         }
         // add new children in each empty slot
         c = d->children->first();
+        uint slot = 0;
         while ( c && d->mainProcess ) {
             if ( !*c ) {
                 *c = ::fork();
@@ -739,9 +783,11 @@ void Server::maintainChildren()
                 else {
                     // a child. fork() must return.
                     d->mainProcess = false;
+                    ::workerIndex = slot;
                 }
             }
             ++c;
+            slot++;
         }
         // wait() on the children, and look for rapid death syndrome
         if ( d->mainProcess ) {
@@ -779,7 +825,25 @@ void Server::maintainChildren()
     // the mother never gets this far: by this time, we know we should
     // serve users.
     d->children = 0;
+    // the kernel event queue is shared with the mother and the other
+    // workers across fork(); get our own before touching anything
+    EventLoop::global()->afterFork();
     EventLoop::global()->closeAllExceptListeners();
+    if ( children > 1 ) {
+        // each worker keeps only its own SO_REUSEPORT listeners; the
+        // rest belong to its siblings. untagged listeners are shared.
+        List<Connection>::Iterator i( EventLoop::global()->connections() );
+        while ( i ) {
+            Connection * c = i;
+            ++i;
+            if ( c->type() == Connection::Listener &&
+                 c->worker() != UINT_MAX &&
+                 c->worker() != ::workerIndex ) {
+                EventLoop::global()->removeConnection( c );
+                c->close();
+            }
+        }
+    }
     log( "Process " + fn( getpid() ) + " started" );
     if ( Configuration::toggle( Configuration::UseStatistics ) ) {
         uint port = Configuration::scalar( Configuration::StatisticsPort );
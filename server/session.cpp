@@ -5,6 +5,7 @@
 #include "transaction.h"
 #include "integerset.h"
 #include "allocator.h"
+#include "cache.h"
 #include "selector.h"
 #include "mailbox.h"
 #include "message.h"
@@ -39,6 +40,37 @@ public:
 };
 
 
+// The last-known state of each mailbox, stored when a session on it
+// ends and used to answer an unchanged re-select from memory. Some
+// clients re-select their mailboxes all the time, and there's no
+// reason to scan mailbox_messages again if neither uidnext nor
+// nextmodseq has moved since the last session ended.
+
+class SessionSnapshot
+    : public Garbage
+{
+public:
+    SessionSnapshot(): uidnext( 0 ), nextModSeq( 0 ) {}
+    uint uidnext;
+    int64 nextModSeq;
+    IntegerSet msns;
+    IntegerSet recent;
+};
+
+
+class SessionStateCache
+    : public Cache
+{
+public:
+    SessionStateCache(): Cache( 2 ) {}
+    void clear() { byMailbox.clear(); }
+
+    Map<SessionSnapshot> byMailbox;
+};
+
+static SessionStateCache * stateCache = 0;
+
+
 /*! \class Session session.h
     This class contains all data associated with the single use of a
     Mailbox, such as the number of messages visible, etc. Subclasses
@@ -65,6 +97,20 @@ Session::Session( Mailbox * m, bool readOnly )
         d->msns.add( other->d->unannounced );
         d->msns.remove( other->d->expunges );
     }
+    else if ( m->ordinary() && ::stateCache ) {
+        SessionSnapshot * snap = ::stateCache->byMailbox.find( m->id() );
+        if ( snap &&
+             snap->uidnext == m->uidnext() &&
+             snap->nextModSeq == m->nextModSeq() ) {
+            // an unchanged re-select. starting from the snapshot
+            // lets the SessionInitialiser see that there's nothing
+            // to fetch.
+            d->uidnext = snap->uidnext;
+            d->nextModSeq = snap->nextModSeq;
+            d->msns.add( snap->msns );
+            d->recent.add( snap->recent );
+        }
+    }
     (void)new SessionInitialiser( m, 0, this );
 }
 
@@ -77,6 +123,33 @@ Session::~Session()
 }
 
 
+/*! Records this session's state in a per-mailbox cache, so that a
+    later SELECT of the same mailbox can start from the snapshot
+    instead of scanning mailbox_messages, provided the mailbox hasn't
+    changed in the meantime. Called when the session ends.
+*/
+
+void Session::snapshot()
+{
+    if ( !d->mailbox->ordinary() || d->mailbox->deleted() )
+        return;
+    if ( !initialised() )
+        return;
+
+    SessionSnapshot * snap = new SessionSnapshot;
+    snap->uidnext = d->uidnext;
+    snap->nextModSeq = d->nextModSeq;
+    snap->msns.add( d->msns );
+    snap->msns.add( d->unannounced );
+    snap->msns.remove( d->expunges );
+    snap->recent = d->recent.intersection( snap->msns );
+
+    if ( !::stateCache )
+        ::stateCache = new SessionStateCache;
+    ::stateCache->byMailbox.insert( d->mailbox->id(), snap );
+}
+
+
 /*! Returns true if this Session has updated itself from the database.
 */
 
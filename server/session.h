@@ -28,6 +28,7 @@ public:
 
     bool initialised() const;
     bool isEmpty() const;
+    void snapshot();
 
     Mailbox * mailbox() const;
     bool readOnly() const;
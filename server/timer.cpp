@@ -62,6 +62,8 @@ Timer::Timer( class EventHandler * owner, uint delay )
 Timer::~Timer()
 {
     EventLoop::global()->removeTimer( this );
+    // the event loop spots disarmed timers by their zero timeout
+    d->timeout = 0;
 }
 
 
@@ -111,6 +113,8 @@ void Timer::execute()
         // if we can't make the required frequency, get as close as we can
         if ( d->timeout <= now )
             d->timeout = now + 1;
+        // rearm for the new deadline
+        EventLoop::global()->addTimer( this );
     }
     else {
         d->timeout = 0;
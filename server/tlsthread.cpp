@@ -3,21 +3,48 @@
 #include "tlsthread.h"
 
 #include "file.h"
+#include "list.h"
+#include "timer.h"
+#include "event.h"
 #include "estring.h"
 #include "allocator.h"
 #include "configuration.h"
 
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <pthread.h>
+#include <poll.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifdef TLS_TX
+#define TLSTHREAD_KTLS
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+#endif
 
 
 static const int bs = 32768;
 
 
+class TlsWorker;
+
+
 class TlsThreadData
     : public Garbage
 {
@@ -35,8 +62,16 @@ public:
           encwb( 0 ),
           encwbo( 0 ), encwbs( 0 ),
           encfd( -1 ),
-          networkBio( 0 ), sslBio( 0 ), thread( 0 ),
-          broken( false )
+          networkBio( 0 ), sslBio( 0 ),
+          worker( 0 ), next( 0 ), prev( 0 ),
+          crct( false ), cwct( false ), crenc( false ), cwenc( false ),
+          ctgone( false ), encgone( false ),
+          finish( false ), done( false ), broken( false ),
+#ifdef TLSTHREAD_KTLS
+          ktls( false ), ktlsTried( false )
+#else
+          ktls( false ), ktlsTried( true )
+#endif
         {}
 
     SSL * ssl;
@@ -68,21 +103,714 @@ public:
     // where openssl reads/writes ditto
     BIO * sslBio;
 
-    pthread_t thread;
+    // the worker that serves this session, and its session chain
+    TlsWorker * worker;
+    TlsThreadData * next;
+    TlsThreadData * prev;
+
+    // what the worker's last poll() said about our file descriptors
+    bool crct;
+    bool cwct;
+    bool crenc;
+    bool cwenc;
+
+    bool ctgone;
+    bool encgone;
+    bool finish;
+    bool done;
     bool broken;
+
+    // true once the kernel encrypts outgoing data for us
+    bool ktls;
+    bool ktlsTried;
+};
+
+
+static void * workerTrampoline( void * t );
+static bool sslErrorSeriousness( SSL *, int );
+
+
+/*! \class TlsWorker tlsthread.cpp
+    A single thread serving many TLS sessions.
+
+    Each worker runs a poll() loop much like the one EventLoop runs
+    for plaintext connections, shuffling bytes between the socketpair
+    to aox, OpenSSL's memory BIOs and the client socket for every
+    session assigned to it. (It must be poll(), not select(): the
+    client fds can be far above FD_SETSIZE on the busy servers this
+    pool exists for, and FD_SET would write outside the fd_set.) A
+    pipe is used to wake the worker when the main thread adds a
+    session, supplies a file descriptor or closes a session.
+
+    This class is not part of the Garbage world: workers are created
+    once and never freed, and the worker thread must not allocate
+    using Allocator, which is single-threaded. The pollfd array grows
+    with realloc().
+*/
+
+class TlsWorker
+{
+public:
+    TlsWorker();
+
+    void add( TlsThreadData * );
+    void wakeup();
+    void run();
+
+    bool broken() const { return failed; }
+
+private:
+    void step( TlsThreadData * );
+    void shutdown( TlsThreadData * );
+    void pollFor( int, bool, bool, TlsThreadData *, bool );
+
+    // which session's fd a pollfd entry watches, and whether it's the
+    // encrypted (client) or cleartext (aox) one
+    struct Target {
+        TlsThreadData * session;
+        bool enc;
+    };
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int wakeRead;
+    int wakeWrite;
+    TlsThreadData * sessions;
+    struct pollfd * fds;
+    Target * targets;
+    uint nfds;
+    uint maxfds;
+    bool failed;
 };
 
 
-static void * trampoline( void * t )
+static void * workerTrampoline( void * t )
 {
-    ((TlsThread*)t)->start();
+    ((TlsWorker*)t)->run();
     return 0;
 }
 
 
+/*! Creates a worker and starts its thread. If thread or pipe creation
+    fails, broken() returns true and the worker must not be used.
+*/
+
+TlsWorker::TlsWorker()
+    : wakeRead( -1 ), wakeWrite( -1 ), sessions( 0 ),
+      fds( 0 ), targets( 0 ), nfds( 0 ), maxfds( 0 ), failed( false )
+{
+    pthread_mutex_init( &mutex, 0 );
+
+    int p[2];
+    if ( ::pipe( p ) < 0 ) {
+        failed = true;
+        return;
+    }
+    wakeRead = p[0];
+    wakeWrite = p[1];
+    (void)::fcntl( wakeRead, F_SETFL,
+                   ::fcntl( wakeRead, F_GETFL, 0 ) | O_NDELAY );
+
+    if ( pthread_create( &thread, 0, workerTrampoline, (void*)this ) ) {
+        ::close( wakeRead );
+        ::close( wakeWrite );
+        failed = true;
+    }
+}
+
+
+/*! Assigns the session \a s to this worker and wakes the worker up.
+    Called by the main thread only.
+*/
+
+void TlsWorker::add( TlsThreadData * s )
+{
+    pthread_mutex_lock( &mutex );
+    s->worker = this;
+    s->next = sessions;
+    s->prev = 0;
+    if ( sessions )
+        sessions->prev = s;
+    sessions = s;
+    pthread_mutex_unlock( &mutex );
+    wakeup();
+}
+
+
+/*! Interrupts the worker's poll(), so that it notices new sessions,
+    new file descriptors or a close. May be called from any thread.
+*/
+
+void TlsWorker::wakeup()
+{
+    char c = 'w';
+    int n = ::write( wakeWrite, &c, 1 );
+    n = n; // and if the pipe is full, the worker is awake already
+}
+
+
+/*! Closes the session \a s, unlinks it from this worker and marks it
+    done, so that the main thread may eventually free it.
+*/
+
+void TlsWorker::shutdown( TlsThreadData * s )
+{
+    if ( s->encfd >= 0 )
+        ::close( s->encfd );
+    if ( s->ctfd >= 0 )
+        ::close( s->ctfd );
+    ::SSL_free( s->ssl );
+    s->ssl = 0;
+    if ( s->prev )
+        s->prev->next = s->next;
+    else
+        sessions = s->next;
+    if ( s->next )
+        s->next->prev = s->prev;
+    s->next = 0;
+    s->prev = 0;
+    s->worker = 0;
+    s->done = true;
+}
+
+
+#ifdef TLSTHREAD_KTLS
+
+/*! This helper computes \a outlen bytes of the TLS 1.2 pseudorandom
+    function (with SHA-256) into \a out, keyed with the \a slen-byte
+    \a secret and seeded with \a label and the \a seedlen-byte \a
+    seed. We need it to recompute the connection's key block when
+    handing encryption over to the kernel.
+*/
+
+static void tls12Prf( const unsigned char * secret, uint slen,
+                      const char * label,
+                      const unsigned char * seed, uint seedlen,
+                      unsigned char * out, uint outlen )
+{
+    unsigned char ls[256];
+    uint lslen = strlen( label );
+    memcpy( ls, label, lslen );
+    memcpy( ls + lslen, seed, seedlen );
+    lslen += seedlen;
+
+    unsigned char a[EVP_MAX_MD_SIZE];
+    unsigned int alen = 0;
+    HMAC( EVP_sha256(), secret, slen, ls, lslen, a, &alen );
+
+    uint done = 0;
+    while ( done < outlen ) {
+        unsigned char buf[EVP_MAX_MD_SIZE + sizeof( ls )];
+        memcpy( buf, a, alen );
+        memcpy( buf + alen, ls, lslen );
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int mdlen = 0;
+        HMAC( EVP_sha256(), secret, slen, buf, alen + lslen, md, &mdlen );
+        uint n = mdlen;
+        if ( n > outlen - done )
+            n = outlen - done;
+        memcpy( out + done, md, n );
+        done += n;
+        HMAC( EVP_sha256(), secret, slen, a, alen, a, &alen );
+    }
+}
+
+
+/*! This helper tries to hand encryption of outgoing data on session
+    \a s over to the kernel, so that bulk downloads go straight from
+    our buffer to the NIC instead of through OpenSSL and back. It can
+    do that only on Linux, only for TLS 1.2 with AES-128-GCM, and
+    only right after the handshake, while the server has sent exactly
+    one encrypted record (its Finished message). If anything is not to
+    its liking it just returns, and the session keeps encrypting in
+    userspace.
+*/
+
+static void enableKtls( TlsThreadData * s )
+{
+    if ( SSL_version( s->ssl ) != TLS1_2_VERSION )
+        return;
+    const SSL_CIPHER * cipher = SSL_get_current_cipher( s->ssl );
+    if ( !cipher || SSL_CIPHER_get_cipher_nid( cipher ) != NID_aes_128_gcm )
+        return;
+
+    SSL_SESSION * session = SSL_get_session( s->ssl );
+    if ( !session )
+        return;
+
+    unsigned char master[48];
+    if ( SSL_SESSION_get_master_key( session, master,
+                                     sizeof( master ) ) !=
+         sizeof( master ) )
+        return;
+
+    // the key block is PRF( master, "key expansion",
+    // server_random + client_random )
+    unsigned char seed[64];
+    if ( SSL_get_server_random( s->ssl, seed, 32 ) != 32 ||
+         SSL_get_client_random( s->ssl, seed + 32, 32 ) != 32 )
+        return;
+
+    // for an AEAD cipher the block is the two 16-byte write keys
+    // followed by the two 4-byte implicit nonces
+    unsigned char block[40];
+    tls12Prf( master, sizeof( master ), "key expansion",
+              seed, sizeof( seed ), block, sizeof( block ) );
+
+    // we're the server, and have sent one encrypted record: Finished
+    unsigned char seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    struct tls12_crypto_info_aes_gcm_128 ci;
+    memset( &ci, 0, sizeof( ci ) );
+    ci.info.version = TLS_1_2_VERSION;
+    ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy( ci.key, block + 16, TLS_CIPHER_AES_GCM_128_KEY_SIZE );
+    memcpy( ci.salt, block + 36, TLS_CIPHER_AES_GCM_128_SALT_SIZE );
+    memcpy( ci.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE );
+    memcpy( ci.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE );
+
+    if ( setsockopt( s->encfd, IPPROTO_TCP, TCP_ULP, "tls", 3 ) < 0 )
+        return;
+    if ( setsockopt( s->encfd, SOL_TLS, TLS_TX, &ci, sizeof( ci ) ) < 0 )
+        return;
+
+    // once the kernel holds the send keys, openssl must not write
+    // any more records, so renegotiation is out of the question
+    SSL_set_options( s->ssl, SSL_OP_NO_RENEGOTIATION );
+    s->ktls = true;
+}
+
+#endif
+
+
+/*! Performs one round of file descriptor and OpenSSL processing for
+    the session \a s, based on what the last poll() said. This is
+    the same work the dedicated per-connection thread used to do in
+    its loop body.
+*/
+
+void TlsWorker::step( TlsThreadData * s )
+{
+    // are our read buffers empty, and poll said we can read? if
+    // so, try to read
+    if ( s->crct ) {
+        s->ctrbs = ::read( s->ctfd, s->ctrb, bs );
+        if ( s->ctrbs <= 0 ) {
+            s->ctgone = true;
+            s->ctrbs = 0;
+        }
+        s->crct = false;
+    }
+    if ( s->crenc ) {
+        s->encrbs = ::read( s->encfd, s->encrb, bs );
+        if ( s->encrbs <= 0 ) {
+            s->encgone = true;
+            s->encrbs = 0;
+        }
+        s->crenc = false;
+    }
+    if ( s->ctgone && s->encgone ) {
+        // if both file descriptors are gone, there's nothing left
+        // to do. but maybe we try anyway.
+        s->finish = true;
+    }
+    if ( s->ctgone && s->encwbs == 0 && s->ctrbs == 0 ) {
+        // if the cleartext one is gone and we have nothing to
+        // write to enc, finish
+        s->finish = true;
+    }
+    if ( s->encgone && s->ctwbs == 0 ) {
+        // if the encfd is gone and we have nothing to write to ct,
+        // finish
+        s->finish = true;
+    }
+
+    // is there something in our write buffers, and poll() told
+    // us we can write it?
+    if ( s->cwct ) {
+        int n = ::write( s->ctfd,
+                         s->ctwb + s->ctwbo,
+                         s->ctwbs - s->ctwbo );
+        if ( n <= 0 ) {
+            // select said we could, but we couldn't. parachute time.
+            s->finish = true;
+        }
+        else {
+            s->ctwbo += n;
+            if ( s->ctwbo == s->ctwbs ) {
+                s->ctwbs = 0;
+                s->ctwbo = 0;
+            }
+        }
+        s->cwct = false;
+    }
+    if ( s->cwenc && s->ktls && s->encwbs == 0 && s->ctrbs > 0 ) {
+        // the kernel encrypts for us, so cleartext from aox goes
+        // straight from our buffer to the client socket
+        int n = ::write( s->encfd,
+                         s->ctrb + s->ctrbo,
+                         s->ctrbs - s->ctrbo );
+        if ( n <= 0 ) {
+            s->finish = true;
+        }
+        else {
+            s->ctrbo += n;
+            if ( s->ctrbo == s->ctrbs ) {
+                s->ctrbs = 0;
+                s->ctrbo = 0;
+            }
+        }
+        s->cwenc = false;
+    }
+    if ( s->cwenc ) {
+        int n = ::write( s->encfd,
+                         s->encwb + s->encwbo,
+                         s->encwbs - s->encwbo );
+        if ( n <= 0 ) {
+            s->finish = true;
+        }
+        else {
+            s->encwbo += n;
+            if ( s->encwbo == s->encwbs ) {
+                s->encwbs = 0;
+                s->encwbo = 0;
+            }
+        }
+        s->cwenc = false;
+    }
+
+    // we've served file descriptors. now for glorious openssl.
+    if ( s->encrbs > 0 && s->encrbo < s->encrbs ) {
+        int n = BIO_write( s->networkBio,
+                           s->encrb + s->encrbo,
+                           s->encrbs - s->encrbo );
+        if ( n > 0 )
+            s->encrbo += n;
+        if ( s->encrbo >= s->encrbs ) {
+            s->encrbo = 0;
+            s->encrbs = 0;
+        }
+    }
+#ifdef TLSTHREAD_KTLS
+    // right after the handshake, with the server's Finished message
+    // flushed and nothing else in flight, the kernel can take over
+    // outgoing encryption. we get one shot at this.
+    if ( !s->ktlsTried && SSL_is_init_finished( s->ssl ) &&
+         s->encwbs == 0 && BIO_ctrl_pending( s->networkBio ) == 0 ) {
+        s->ktlsTried = true;
+        enableKtls( s );
+    }
+#endif
+
+    // until we've decided whether the kernel takes over outgoing
+    // encryption, app data must not go through SSL_write: the
+    // sequence numbers only line up right after the handshake.
+    // SSL_read below still drives the handshake forward.
+    if ( s->ktlsTried && !s->ktls &&
+         s->ctrbs > 0 && s->ctrbo < s->ctrbs ) {
+        int n = SSL_write( s->ssl,
+                           s->ctrb + s->ctrbo,
+                           s->ctrbs - s->ctrbo );
+        if ( n > 0 )
+            s->ctrbo += n;
+        else if ( n < 0 && !s->finish )
+            s->finish = sslErrorSeriousness( s->ssl, n );
+        if ( s->ctrbo >= s->ctrbs ) {
+            s->ctrbo = 0;
+            s->ctrbs = 0;
+        }
+    }
+    if ( s->ctwbs == 0 ) {
+        s->ctwbs = SSL_read( s->ssl, s->ctwb, bs );
+        if ( s->ctwbs < 0 ) {
+            if ( !s->finish )
+                s->finish = sslErrorSeriousness( s->ssl, s->ctwbs );
+            s->ctwbs = 0;
+        }
+    }
+    if ( s->encwbs == 0 ) {
+        s->encwbs = BIO_read( s->networkBio, s->encwb, bs );
+        if ( s->encwbs < 0 )
+            s->encwbs = 0;
+    }
+}
+
+
+/*! Adds an entry for \a fd to the pollfd array, asking for
+    readability if \a pr and writability if \a pw, and remembers that
+    the entry belongs to session \a s (to its encrypted fd if \a enc,
+    else to its cleartext fd). Grows the array with realloc(), since
+    Allocator is off-limits on this thread.
+*/
+
+void TlsWorker::pollFor( int fd, bool pr, bool pw,
+                         TlsThreadData * s, bool enc )
+{
+    if ( nfds == maxfds ) {
+        uint m = maxfds * 2;
+        if ( m < 64 )
+            m = 64;
+        fds = (struct pollfd *)
+              ::realloc( fds, m * sizeof( struct pollfd ) );
+        targets = (Target *)::realloc( targets, m * sizeof( Target ) );
+        maxfds = m;
+    }
+    fds[nfds].fd = fd;
+    fds[nfds].events = 0;
+    if ( pr )
+        fds[nfds].events |= POLLIN;
+    if ( pw )
+        fds[nfds].events |= POLLOUT;
+    fds[nfds].revents = 0;
+    targets[nfds].session = s;
+    targets[nfds].enc = enc;
+    nfds++;
+}
+
+
+/*! The worker's main loop: processes every session, builds one big
+    pollfd array and sleeps in poll() until there's something to do.
+    Never returns.
+*/
+
+void TlsWorker::run()
+{
+    while ( true ) {
+        pthread_mutex_lock( &mutex );
+
+        // map the last poll()'s results back onto the sessions.
+        // entry 0 is the wakeup pipe, handled below.
+        uint i = 1;
+        while ( i < nfds ) {
+            TlsThreadData * s = targets[i].session;
+            bool pr = fds[i].revents & ( POLLIN|POLLERR|POLLHUP );
+            bool pw = fds[i].revents & ( POLLOUT|POLLERR|POLLHUP );
+            if ( targets[i].enc ) {
+                s->crenc = pr && s->crenc;
+                s->cwenc = pw && s->cwenc;
+            }
+            else {
+                s->crct = pr && s->crct;
+                s->cwct = pw && s->cwct;
+            }
+            i++;
+        }
+
+        nfds = 0;
+        pollFor( wakeRead, true, false, 0, false );
+
+        TlsThreadData * s = sessions;
+        while ( s ) {
+            TlsThreadData * n = s->next;
+
+            if ( !s->broken )
+                step( s );
+
+            if ( s->broken || s->finish ) {
+                shutdown( s );
+                s = n;
+                continue;
+            }
+
+            // what do we want poll() to look for?
+            bool any = false;
+            bool rct = false;
+            bool wct = false;
+            bool renc = false;
+            bool wenc = false;
+            if ( s->ctfd >= 0 ) {
+                rct = ( s->ctrbs == 0 );
+                wct = ( s->ctwbs > 0 );
+                if ( rct || wct ) {
+                    pollFor( s->ctfd, rct, wct, s, false );
+                    any = true;
+                }
+            }
+            if ( s->encfd >= 0 ) {
+                renc = ( s->encrbs == 0 );
+                wenc = ( s->encwbs > 0 || ( s->ktls && s->ctrbs > 0 ) );
+                if ( renc || wenc ) {
+                    pollFor( s->encfd, renc, wenc, s, true );
+                    any = true;
+                }
+            }
+            if ( s->ctfd >= 0 && s->encfd >= 0 && !any ) {
+                // we aren't going to read, we can't write. no point
+                // in prolonging the agony.
+                shutdown( s );
+            }
+            else if ( any ) {
+                s->crct = rct;
+                s->cwct = wct;
+                s->crenc = renc;
+                s->cwenc = wenc;
+            }
+
+            s = n;
+        }
+
+        pthread_mutex_unlock( &mutex );
+
+        // wait for a few seconds at most, just in case openssl is
+        // acting behind our back.
+        int n = ::poll( fds, nfds, 4000 );
+        if ( n < 0 ) {
+            i = 0;
+            while ( i < nfds )
+                fds[i++].revents = 0;
+        }
+        if ( n > 0 && ( fds[0].revents & POLLIN ) ) {
+            char buf[16];
+            while ( ::read( wakeRead, buf, 16 ) == 16 )
+                ;
+            fds[0].revents = 0;
+        }
+    }
+}
+
+
 static SSL_CTX * ctx = 0;
 
 
+// a session-ticket key. clients resuming with a ticket protected by
+// the current or the previous key skip the asymmetric handshake; the
+// previous key lets tickets survive one rotation.
+
+struct TicketKey {
+    unsigned char name[16];
+    unsigned char hmac[32];
+    unsigned char aes[16];
+};
+
+static TicketKey currentTicketKey;
+static TicketKey previousTicketKey;
+static pthread_mutex_t ticketMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// how long each ticket key is used for new tickets. tickets remain
+// usable for twice this, since the previous key is still accepted.
+static const uint ticketKeyLifetime = 3600;
+
+
+/*! This private helper makes a fresh ticket key the current one. The
+    old current key is kept, so recently issued tickets still resume.
+    Called at startup and then periodically from the rotation timer on
+    the main thread; the mutex keeps the workers' handshakes safe.
+*/
+
+static void rotateTicketKey()
+{
+    TicketKey fresh;
+    RAND_bytes( fresh.name, sizeof( fresh.name ) );
+    RAND_bytes( fresh.hmac, sizeof( fresh.hmac ) );
+    RAND_bytes( fresh.aes, sizeof( fresh.aes ) );
+
+    pthread_mutex_lock( &ticketMutex );
+    previousTicketKey = currentTicketKey;
+    currentTicketKey = fresh;
+    pthread_mutex_unlock( &ticketMutex );
+}
+
+
+/*! This callback is invoked by OpenSSL on the worker threads, to
+    protect a new session ticket (\a enc is 1) or unprotect the one a
+    resuming client presented (\a enc is 0). \a name, \a iv, \a ectx
+    and \a hctx are filled in or checked as OpenSSL requires; \a ssl
+    is unused. Tickets under the previous key are accepted but
+    reissued under the current one.
+*/
+
+static int ticketKeyCallback( SSL * ssl, unsigned char * name,
+                              unsigned char * iv, EVP_CIPHER_CTX * ectx,
+                              HMAC_CTX * hctx, int enc )
+{
+    ssl = ssl;
+
+    pthread_mutex_lock( &ticketMutex );
+    TicketKey cur = currentTicketKey;
+    TicketKey prev = previousTicketKey;
+    pthread_mutex_unlock( &ticketMutex );
+
+    if ( enc ) {
+        if ( !RAND_bytes( iv, 16 ) )
+            return -1;
+        memcpy( name, cur.name, 16 );
+        EVP_EncryptInit_ex( ectx, EVP_aes_128_cbc(), 0, cur.aes, iv );
+        HMAC_Init_ex( hctx, cur.hmac, sizeof( cur.hmac ), EVP_sha256(), 0 );
+        return 1;
+    }
+
+    TicketKey * k = 0;
+    int r = 0;
+    if ( !memcmp( name, cur.name, 16 ) ) {
+        k = &cur;
+        r = 1;
+    }
+    else if ( !memcmp( name, prev.name, 16 ) ) {
+        // an older ticket; accept it, but issue a new one
+        k = &prev;
+        r = 2;
+    }
+    else {
+        // an unknown key, presumably rotated away long ago. the
+        // client gets a full handshake and a fresh ticket.
+        return 0;
+    }
+
+    HMAC_Init_ex( hctx, k->hmac, sizeof( k->hmac ), EVP_sha256(), 0 );
+    EVP_DecryptInit_ex( ectx, EVP_aes_128_cbc(), 0, k->aes, iv );
+    return r;
+}
+
+
+/*! \class TicketKeyRotator tlsthread.cpp
+    Rotates the session-ticket key once an hour.
+*/
+
+class TicketKeyRotator
+    : public EventHandler
+{
+public:
+    TicketKeyRotator() {
+        Timer * t = new Timer( this, ticketKeyLifetime );
+        t->setRepeating( true );
+    }
+    void execute() {
+        rotateTicketKey();
+    }
+};
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+// older OpenSSL leaves locking to the application. the shared session
+// cache and the reference-counted SSL_CTX are touched from all the
+// workers, so we have to provide the locks.
+
+static pthread_mutex_t * cryptoLocks = 0;
+
+static void cryptoLockingCallback( int mode, int n, const char *, int )
+{
+    if ( mode & CRYPTO_LOCK )
+        pthread_mutex_lock( &cryptoLocks[n] );
+    else
+        pthread_mutex_unlock( &cryptoLocks[n] );
+}
+
+static unsigned long cryptoIdCallback()
+{
+    return (unsigned long)pthread_self();
+}
+
+#endif
+
+
+static uint numWorkers = 0;
+static TlsWorker ** workers = 0;
+static uint nextWorker = 0;
+
+static List<TlsThread> * liveSessions = 0;
+
+
 /*! Perform any OpenSSL initialisation needed to enable us to create
     TlsThreads later.
 */
@@ -92,6 +820,18 @@ void TlsThread::setup()
     SSL_load_error_strings();
     SSL_library_init();
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if ( !cryptoLocks ) {
+        int n = CRYPTO_num_locks();
+        cryptoLocks = new pthread_mutex_t[n];
+        int i = 0;
+        while ( i < n )
+            pthread_mutex_init( &cryptoLocks[i++], 0 );
+        CRYPTO_set_id_callback( cryptoIdCallback );
+        CRYPTO_set_locking_callback( cryptoLockingCallback );
+    }
+#endif
+
     ctx = ::SSL_CTX_new( SSLv23_server_method() );
     long options = SSL_OP_ALL
         // also try to pick the same ciphers suites more often
@@ -122,11 +862,60 @@ void TlsThread::setup()
 
     // we don't ask for a client cert
     SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
+
+    // remember sessions, so reconnecting clients can resume instead
+    // of doing the asymmetric handshake all over again...
+    SSL_CTX_set_session_id_context( ctx, (const unsigned char*)"aox", 3 );
+    SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_SERVER );
+    SSL_CTX_sess_set_cache_size( ctx, 20480 );
+
+    // ...and hand out session tickets, so they can resume even
+    // without server-side state. both keys start out fresh.
+    rotateTicketKey();
+    rotateTicketKey();
+    SSL_CTX_set_tlsext_ticket_key_cb( ctx, ticketKeyCallback );
+}
+
+
+/*! This private helper creates the worker pool. It has to run later
+    than setup(), since setup() is called before the server forks and
+    the workers must belong to the surviving process.
+*/
+
+void TlsThread::createWorkers()
+{
+    long cores = ::sysconf( _SC_NPROCESSORS_ONLN );
+    numWorkers = 4;
+    if ( cores > 0 && (uint)cores < numWorkers )
+        numWorkers = cores;
+
+    workers = new TlsWorker *[numWorkers];
+    uint i = 0;
+    uint n = 0;
+    while ( i < numWorkers ) {
+        TlsWorker * w = new TlsWorker;
+        if ( !w->broken() )
+            workers[n++] = w;
+        i++;
+    }
+    numWorkers = n;
+
+    liveSessions = new List<TlsThread>;
+    Allocator::addEternal( liveSessions, "tls sessions" );
+
+    // the rotation timer has to be created here rather than in
+    // setup(), for the same reason as the workers.
+    Allocator::addEternal( new TicketKeyRotator, "ticket key rotator" );
 }
 
 
 /*! \class TlsThread tlsthread.h
-    Creates and manages a thread for TLS processing using openssl
+    Manages TLS processing for a single connection using openssl.
+
+    Despite the name, a TlsThread no longer owns a thread: all TLS
+    sessions are served by a small pool of worker threads, so twenty
+    thousand TLS connections cost a handful of threads rather than
+    twenty thousand.
 */
 
 
@@ -142,12 +931,35 @@ TlsThread::TlsThread( bool asClient )
 {
     if ( !ctx )
         setup();
+    if ( !workers )
+        createWorkers();
+
+    // while a worker serves a session, the main thread has to keep
+    // the session alive for the collector. forget sessions the
+    // workers are done with.
+    List<TlsThread>::Iterator it( liveSessions );
+    while ( it ) {
+        TlsThread * t = it;
+        ++it;
+        if ( t->d->done )
+            liveSessions->remove( t );
+    }
+
+    if ( !numWorkers ) {
+        log( "Cannot create TLS worker threads" );
+        d->broken = true;
+        return;
+    }
 
     d->ssl = ::SSL_new( ctx );
-    if ( asClient )
+    if ( asClient ) {
         SSL_set_connect_state( d->ssl );
-    else
+        // kernel offload assumes we're the server
+        d->ktlsTried = true;
+    }
+    else {
         SSL_set_accept_state( d->ssl );
+    }
 
     if ( !BIO_new_bio_pair( &d->sslBio, bs, &d->networkBio, bs ) ) {
         // an error. hm?
@@ -159,13 +971,9 @@ TlsThread::TlsThread( bool asClient )
     d->encrb = (char*)Allocator::alloc( bs, 0 );
     d->encwb = (char*)Allocator::alloc( bs, 0 );
 
-    int r = pthread_create( &d->thread, 0, trampoline, (void*)this );
-    if ( r ) {
-        log( "pthread_create returned nonzero (" + fn( r ) + ")" );
-        d->broken = true;
-        ::SSL_free( d->ssl );
-        d->ssl = 0;
-    }
+    liveSessions->append( this );
+    workers[nextWorker]->add( d );
+    nextWorker = ( nextWorker + 1 ) % numWorkers;
 }
 
 
@@ -176,212 +984,19 @@ TlsThread::TlsThread( bool asClient )
 
 TlsThread::~TlsThread()
 {
-    ::SSL_free( d->ssl );
-    d->ssl = 0;
-}
-
-
-/*! Starts negotiating and does everything after that. This is run in
-    the separate thread.
-
-*/
-
-void TlsThread::start()
-{
-    bool crct = false;
-    bool crenc = false;
-    bool cwct = false;
-    bool cwenc = false;
-    bool ctgone = false;
-    bool encgone = false;
-    bool finish = false;
-    while ( !finish && !d->broken ) {
-        // are our read buffers empty, and select said we can read? if
-        // so, try to read
-        if ( crct ) {
-            d->ctrbs = ::read( d->ctfd, d->ctrb, bs );
-            if ( d->ctrbs <= 0 ) {
-                ctgone = true;
-                d->ctrbs = 0;
-            }
-        }
-        if ( crenc ) {
-            d->encrbs = ::read( d->encfd, d->encrb, bs );
-            if ( d->encrbs <= 0 ) {
-                encgone = true;
-                d->encrbs = 0;
-            }
-        }
-        if ( ctgone && encgone ) {
-            // if both file descriptors are gone, there's nothing left
-            // to do. but maybe we try anyway.
-            finish = true;
-        }
-        if ( ctgone && d->encwbs == 0 ) {
-            // if the cleartext one is gone and we have nothing to
-            // write to enc, finish
-            finish = true;
-        }
-        if ( encgone && d->ctwbs == 0 ) {
-            // if the encfd is gone and we have nothing to write to ct,
-            // finish
-            finish = true;
-        }
-
-        // is there something in our write buffers, and select() told
-        // us we can write it?
-        if ( cwct ) {
-            int r = ::write( d->ctfd,
-                             d->ctwb + d->ctwbo,
-                             d->ctwbs - d->ctwbo );
-            if ( r <= 0 ) {
-                // select said we could, but we couldn't. parachute time.
-                finish = true;
-            }
-            else {
-                d->ctwbo += r;
-                if ( d->ctwbo == d->ctwbs ) {
-                    d->ctwbs = 0;
-                    d->ctwbo = 0;
-                }
-            }
-        }
-        if ( cwenc ) {
-            int r = ::write( d->encfd,
-                             d->encwb + d->encwbo,
-                             d->encwbs - d->encwbo );
-            if ( r <= 0 ) {
-                finish = true;
-            }
-            else {
-                d->encwbo += r;
-                if ( d->encwbo == d->encwbs ) {
-                    d->encwbs = 0;
-                    d->encwbo = 0;
-                }
-            }
-        }
-
-        // we've served file descriptors. now for glorious openssl.
-        if ( d->encrbs > 0 && d->encrbo < d->encrbs ) {
-            int r = BIO_write( d->networkBio,
-                               d->encrb + d->encrbo,
-                               d->encrbs - d->encrbo );
-            if ( r > 0 )
-                d->encrbo += r;
-            if ( d->encrbo >= d->encrbs ) {
-                d->encrbo = 0;
-                d->encrbs = 0;
-            }
-        }
-        if ( d->ctrbs > 0 && d->ctrbo < d->ctrbs ) {
-            int r = SSL_write( d->ssl,
-                               d->ctrb + d->ctrbo,
-                               d->ctrbs - d->ctrbo );
-            if ( r > 0 )
-                d->ctrbo += r;
-            else if ( r < 0 && !finish )
-                finish = sslErrorSeriousness( r );
-            if ( d->ctrbo >= d->ctrbs ) {
-                d->ctrbo = 0;
-                d->ctrbs = 0;
-            }
-        }
-        if ( d->ctwbs == 0 ) {
-            d->ctwbs = SSL_read( d->ssl, d->ctwb, bs );
-            if ( d->ctwbs < 0 ) {
-                if ( !finish )
-                    finish = sslErrorSeriousness( d->ctwbs );
-                d->ctwbs = 0;
-            }
-        }
-        if ( d->encwbs == 0 ) {
-            d->encwbs = BIO_read( d->networkBio, d->encwb, bs );
-            if ( d->encwbs < 0 )
-                d->encwbs = 0;
-        }
-
-        if ( !finish && !d->broken ) {
-            bool any = false;
-            fd_set r, w;
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-            if ( d->ctfd >= 0 ) {
-                if ( d->ctrbs == 0 ) {
-                    FD_SET( d->ctfd, &r );
-                    any = true;
-                }
-                if ( d->ctwbs ) {
-                    any = true;
-                    FD_SET( d->ctfd, &w );
-                }
-            }
-            if ( d->encfd >= 0 ) {
-                if ( d->encrbs == 0  ) {
-                    any = true;
-                    FD_SET( d->encfd, &r );
-                }
-                if ( d->encwbs ) {
-                    any = true;
-                    FD_SET( d->encfd, &w );
-                }
-            }
-            int maxfd = -1;
-            if ( maxfd < d->ctfd )
-                maxfd = d->ctfd;
-            if ( maxfd < d->encfd )
-                maxfd = d->encfd;
-            struct timeval tv;
-            if ( maxfd < 0 ) {
-                // if we don't have any fds yet, we wait for exactly 0.05s.
-                tv.tv_sec = 0;
-                tv.tv_usec = 50000; // 0.05s
-            }
-            else if ( any ) {
-                // if we think there's something to do, we wait for a
-                // few seconds. not very long, just in case openssl is
-                // acting behind our back.
-                tv.tv_sec = 4;
-                tv.tv_usec = 0;
-            }
-            else {
-                // we aren't going to read, we can't write. no point
-                // in prolonging the agony.
-                finish = true;
-                tv.tv_sec = 0;
-                tv.tv_usec = 0;
-            }
-
-            int n = finish ? 0 : select( maxfd+1, &r, &w, 0, &tv );
-            if ( n < 0 && errno != EINTR )
-                finish = true;
-
-            if ( n >= 0 ) {
-                crct = FD_ISSET( d->ctfd, &r );
-                cwct = FD_ISSET( d->ctfd, &w );
-                crenc = FD_ISSET( d->encfd, &r );
-                cwenc = FD_ISSET( d->encfd, &w );
-            } else {
-                crct = cwct = crenc = cwenc = false;
-            }
-
-        }
+    if ( !d->worker && d->ssl ) {
+        ::SSL_free( d->ssl );
+        d->ssl = 0;
     }
-
-    ::close( d->encfd );
-    ::close( d->ctfd );
-    SSL_free( d->ssl );
-    d->ssl = 0;
-    pthread_exit( 0 );
 }
 
 
-/*! Returns true if the openssl result status \a r is a serious error,
-    and false otherwise.
+/*! Returns true if the openssl result status \a r for the connection
+    \a ssl is a serious error, and false otherwise.
 */
 
-bool TlsThread::sslErrorSeriousness( int r ) {
-    int e = SSL_get_error( d->ssl, r  );
+static bool sslErrorSeriousness( SSL * ssl, int r ) {
+    int e = SSL_get_error( ssl, r  );
     switch( e ) {
     case SSL_ERROR_NONE:
     case SSL_ERROR_WANT_READ:
@@ -408,22 +1023,26 @@ bool TlsThread::sslErrorSeriousness( int r ) {
 
 
 /*! Records that \a fd should be used for cleartext communication with
-    the main aox thread. The TLS thread will close \a fd when it's done.
+    the main aox thread. The worker will close \a fd when it's done.
 */
 
 void TlsThread::setServerFD( int fd )
 {
     d->ctfd = fd;
+    if ( d->worker )
+        d->worker->wakeup();
 }
 
 
 /*! Records that \a fd should be used for encrypted communication with
-    the client. The TLS thread will close \a fd when it's done.
+    the client. The worker will close \a fd when it's done.
 */
 
 void TlsThread::setClientFD( int fd )
 {
     d->encfd = fd;
+    if ( d->worker )
+        d->worker->wakeup();
 }
 
 
@@ -438,14 +1057,13 @@ bool TlsThread::broken() const
 
 
 /*! Causes this TlsThread object to stop doing anything, in a great
-    hurry and without any attempt at talking to the client.
+    hurry and without any attempt at talking to the client. The worker
+    closes the file descriptors as soon as it wakes up.
 */
 
 void TlsThread::close()
 {
     d->broken = true;
-    ::close( d->encfd );
-    ::close( d->ctfd );
-    pthread_cancel( d->thread );
-    pthread_join( d->thread, 0 );
+    if ( d->worker )
+        d->worker->wakeup();
 }
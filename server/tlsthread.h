@@ -18,15 +18,13 @@ public:
     void setServerFD( int );
     void setClientFD( int );
 
-    void start();
-
     bool broken() const;
 
-    bool sslErrorSeriousness( int );
-    
     void close();
 
 private:
+    static void createWorkers();
+
     class TlsThreadData * d;
 };
 
@@ -5,9 +5,13 @@
 #include "helperrowcreator.h"
 #include "configuration.h"
 #include "transaction.h"
+#include "dbsignal.h"
 #include "address.h"
 #include "mailbox.h"
+#include "cache.h"
+#include "event.h"
 #include "query.h"
+#include "dict.h"
 #include "codec.h"
 class UserData
     : public Garbage
@@ -46,6 +50,57 @@ public:
 };
 
 
+// remembers the result of a successful refresh(), so that a repeat
+// login costs only the password verification, not a database round
+// trip per connection.
+
+class CachedUser
+    : public Garbage
+{
+public:
+    CachedUser(): id( 0 ), inboxId( 0 ), address( 0 ), quota( 0 ) {}
+
+    uint id;
+    UString login;
+    UString secret;
+    UString ldapdn;
+    uint inboxId;
+    UString home;
+    Address * address;
+    int64 quota;
+};
+
+
+class UserCache
+    : public Cache
+{
+public:
+    UserCache(): Cache( 4 ) {}
+    void clear() { byLogin.clear(); }
+
+    Dict<CachedUser> byLogin;
+};
+
+static UserCache * userCache = 0;
+
+
+// clears the user cache whenever this or any other process modifies
+// the users or aliases tables.
+
+class UserCacheFlusher
+    : public EventHandler
+{
+public:
+    UserCacheFlusher() {
+        (void)new DatabaseSignal( "users_updated", this );
+    }
+    void execute() {
+        if ( ::userCache )
+            ::userCache->clear();
+    }
+};
+
+
 /*! \class User user.h
 
     The User class models a single Archiveopteryx user, which may be
@@ -275,6 +330,31 @@ void User::refresh( EventHandler * user )
     if ( d->q )
         return;
     d->user = user;
+
+    if ( !::userCache ) {
+        ::userCache = new UserCache;
+        (void)new UserCacheFlusher;
+    }
+
+    if ( !d->login.isEmpty() ) {
+        CachedUser * u =
+            ::userCache->byLogin.find( d->login.utf8().lower() );
+        if ( u ) {
+            d->id = u->id;
+            d->login = u->login;
+            d->secret = u->secret;
+            d->ldapdn = u->ldapdn;
+            d->inboxId = u->inboxId;
+            d->home = Mailbox::obtain( u->home, true );
+            d->home->setOwner( u->id );
+            d->address = u->address;
+            d->quota = u->quota;
+            d->state = Refreshed;
+            d->user = 0;
+            return;
+        }
+    }
+
     if ( !psl ) {
         psl = new PreparedStatement(
             "select u.id, u.login, u.secret, u.ldapdn, "
@@ -355,6 +435,17 @@ void User::refreshHelper()
         d->quota = r->getBigint( "quota" );
         d->state = Refreshed;
         d->q = 0;
+
+        CachedUser * u = new CachedUser;
+        u->id = d->id;
+        u->login = d->login;
+        u->secret = d->secret;
+        u->ldapdn = d->ldapdn;
+        u->inboxId = d->inboxId;
+        u->home = d->home->name();
+        u->address = d->address;
+        u->quota = d->quota;
+        ::userCache->byLogin.insert( d->login.utf8().lower(), u );
     }
     if ( d->user )
         d->user->execute();
@@ -459,6 +550,7 @@ void User::createHelper()
         q3->bind( 2, m );
         d->t->enqueue( q3 );
 
+        d->t->enqueue( new Query( "notify users_updated", 0 ) );
         d->t->commit();
     }
 
@@ -487,6 +579,7 @@ Query * User::remove( Transaction * t )
     Query * q = new Query( "delete from users where login=$1", 0 );
     q->bind( 1, d->login );
     t->enqueue( q );
+    t->enqueue( new Query( "notify users_updated", 0 ) );
     return q;
 }
 
@@ -523,6 +616,8 @@ void User::csHelper()
         d->q->bind( 1, d->secret );
         d->q->bind( 2, d->login );
         d->q->execute();
+        Query * n = new Query( "notify users_updated", 0 );
+        n->execute();
     }
 
     if ( !d->q->done() )
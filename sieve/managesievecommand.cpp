@@ -2,9 +2,11 @@
 
 #include "managesievecommand.h"
 
+#include "md5.h"
 #include "utf.h"
 #include "date.h"
 #include "dict.h"
+#include "cache.h"
 #include "user.h"
 #include "query.h"
 #include "scope.h"
@@ -55,6 +57,36 @@ public:
 };
 
 
+// a cache of validation verdicts, keyed by script checksum. clients
+// habitually resubmit the same script (a syntax check followed by the
+// real upload, or a settings UI that saves unchanged scripts), and
+// parsing a big corporate script is the only expensive step in
+// putScript, so remembering the verdict makes the repeats free. the
+// parse tree is read-only after parsing, so it can be shared, too.
+
+class CachedVerdict
+    : public Garbage
+{
+public:
+    CachedVerdict(): script( 0 ) {}
+    EString errors;
+    SieveScript * script;
+};
+
+
+class ScriptVerdictCache
+    : public Cache
+{
+public:
+    ScriptVerdictCache(): Cache( 4 ) {}
+    void clear() { byChecksum.clear(); }
+    Dict<CachedVerdict> byChecksum;
+};
+
+
+static ScriptVerdictCache * verdictCache = 0;
+
+
 /*! \class ManageSieveCommand managesievecommand.h
     This class represents a single ManageSieve command. It is analogous to a
     POP Command. Almost identical, in fact.
@@ -356,11 +388,19 @@ bool ManageSieveCommand::putScript()
             no( "Script cannot be empty" );
             return true;
         }
-        SieveScript script;
-        script.parse( d->script.crlf() );
-        EString e = script.parseErrors();
-        if ( !e.isEmpty() ) {
-            no( e );
+        if ( !::verdictCache )
+            ::verdictCache = new ScriptVerdictCache;
+        EString sum = MD5::hash( d->script.crlf() ).hex();
+        CachedVerdict * v = ::verdictCache->byChecksum.find( sum );
+        if ( !v ) {
+            v = new CachedVerdict;
+            v->script = new SieveScript;
+            v->script->parse( d->script.crlf() );
+            v->errors = v->script->parseErrors();
+            ::verdictCache->byChecksum.insert( sum, v );
+        }
+        if ( !v->errors.isEmpty() ) {
+            no( v->errors );
             return true;
         }
         if ( d->name.isEmpty() ) {
@@ -373,7 +413,7 @@ bool ManageSieveCommand::putScript()
         // mailboxes in the user's namespace, create those. if any
         // refer to mailboxes not owned by the user, deny the command.
         List<SieveCommand> stack;
-        stack.append( script.topLevelCommands() );
+        stack.append( v->script->topLevelCommands() );
         while ( !stack.isEmpty() ) {
             SieveCommand * c = stack.shift();
             if ( c->block() )
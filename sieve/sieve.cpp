@@ -3,7 +3,10 @@
 #include "sieve.h"
 
 #include "md5.h"
+#include "map.h"
 #include "utf.h"
+#include "dict.h"
+#include "cache.h"
 #include "date.h"
 #include "html.h"
 #include "user.h"
@@ -40,11 +43,14 @@ public:
           message( 0 ),
           state( 0 ),
           handler( 0 ),
+          lookups( 0 ),
+          lookup( 0 ),
           autoresponses( 0 ),
           transaction( 0 ),
           injector( 0 ),
           vacations( 0 ),
-          softError( false )
+          softError( false ),
+          headersIndexed( false )
     {}
 
     class Recipient
@@ -71,6 +77,7 @@ public:
         List<SieveAction> actions;
         List<SieveCommand> pending;
         Query * sq;
+        UString lookupLocalpart;
         SieveScript * script;
         EString error;
         UString prefix;
@@ -92,13 +99,18 @@ public:
     Date * arrivalTime;
     uint state;
     EventHandler * handler;
+    List<Recipient> * lookups;
+    Query * lookup;
     Query * autoresponses;
     Transaction * transaction;
     Injector * injector;
     List<SieveAction> * vacations;
     bool softError;
+    Dict< List<HeaderField> > headerIndex;
+    bool headersIndexed;
 
     Recipient * recipient( Address * a );
+    List<HeaderField> * fieldsNamed( const EString & );
 };
 
 
@@ -128,6 +140,104 @@ SieveData::Recipient * SieveData::recipient( Address * a )
 }
 
 
+// Returns the message's header fields named name (header-cased), or a
+// null pointer if there are none. The first call scans the header and
+// indexes the fields by name, so that evaluating fifty recipients'
+// scripts against the same delivery doesn't rescan the same fields
+// fifty times. Must not be called before the header has been parsed.
+
+List<HeaderField> * SieveData::fieldsNamed( const EString & name )
+{
+    if ( !headersIndexed ) {
+        headersIndexed = true;
+        List<HeaderField>::Iterator hf( message->header()->fields() );
+        while ( hf ) {
+            List<HeaderField> * l = headerIndex.find( hf->name() );
+            if ( !l ) {
+                l = new List<HeaderField>;
+                headerIndex.insert( hf->name(), l );
+            }
+            l->append( hf );
+            ++hf;
+        }
+    }
+    return headerIndex.find( name );
+}
+
+
+class CachedScript
+    : public Garbage
+{
+public:
+    CachedScript(): script( 0 ) {}
+    EString source;
+    SieveScript * script;
+};
+
+
+// a cache of parsed sieve scripts, keyed by script owner. with one
+// evaluation per incoming message, the same script is parsed over and
+// over; the parse tree is read-only during evaluation, so everyone
+// can share one. the stored source tells us whether the cached tree
+// still matches what's in the database.
+
+class SieveScriptCache
+    : public Cache
+{
+public:
+    SieveScriptCache(): Cache( 4 ) {}
+    void clear() { byOwner.clear(); }
+    Map<CachedScript> byOwner;
+};
+
+
+static SieveScriptCache * scriptCache = 0;
+
+
+// remembers which correspondents were recently sent an autoresponse,
+// so that during a mailing-list flood the already-answered case is a
+// hash probe instead of a database query. the database remains the
+// authority: a cache miss still queries autoresponses, and entries
+// are dropped wholesale at GC time.
+
+class AutoresponseCache
+    : public Cache
+{
+public:
+    AutoresponseCache(): Cache( 8 ) {}
+    void clear() { answered.clear(); }
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): expires( 0 ) {}
+        uint expires;
+    };
+
+    Dict<Entry> answered;
+};
+
+
+static AutoresponseCache * responseCache = 0;
+static const uint maxCachedResponses = 4096;
+
+
+// returns the cache key for the vacation action a: the two
+// correspondents and the handle, just like the autoresponses columns
+// the database check compares.
+
+static EString responseKey( SieveAction * a )
+{
+    EString k( a->senderAddress()->toString( false ) );
+    k.append( ' ' );
+    k.append( a->recipientAddress()->toString( false ) );
+    k.append( ' ' );
+    k.append( a->handle().utf8() );
+    return k;
+}
+
+
 /*! \class Sieve sieve.h
 
     The Sieve class interprets the Sieve language, which processes
@@ -166,27 +276,55 @@ void Sieve::execute()
     // 0: find the data needed for evaluate().
     if ( d->state == 0 ) {
         bool wasReady = ready();
-        List<SieveData::Recipient>::Iterator i( d->recipients );
-        while ( i ) {
-            if ( i->sq && i->sq->hasResults() ) {
-                Row * r;
-                SieveData::Recipient *in = i;
-                for ( in = i ;
-                      (r = i->sq->nextRow()) ;
-                      in = new SieveData::Recipient( i->address, 0, d) ) {
-                    if ( !r->isNull( "mailbox" ) )
-                        in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
-                    if ( !r->isNull( "script" ) ) {
-                        in->prefix = r->getUString( "namespace" ) + "/" +
-                                    r->getUString( "login" ) + "/";
-                        in->user = new User;
-                        in->user->setLogin( r->getUString( "login" ) );
-                        in->user->setId( r->getInt( "userid" ) );
-                        in->user->setAddress( new Address(
-                                                 r->getUString( "name" ),
-                                                 r->getEString( "localpart" ),
-                                                 r->getEString( "domain" ) ) );
-                        in->script->parse( r->getEString( "script" ).crlf() );
+        if ( d->lookup && d->lookup->done() ) {
+            Row * r;
+            while ( (r = d->lookup->nextRow()) != 0 ) {
+                // the batched query may return rows for several
+                // recipients; find the one this row belongs to
+                UString lp( r->getUString( "localpart" ).titlecased() );
+                UString dom( r->getUString( "domain" ).titlecased() );
+                List<SieveData::Recipient>::Iterator i( d->recipients );
+                SieveData::Recipient * in = 0;
+                while ( i && !in ) {
+                    if ( i->sq == d->lookup &&
+                         i->lookupLocalpart.titlecased() == lp &&
+                         i->address->domain().titlecased() == dom )
+                        in = i;
+                    ++i;
+                }
+                if ( !in )
+                    continue;
+                // a second row for the same address fills in a copy,
+                // as delivery to one address can hit several aliases
+                if ( in->mailbox )
+                    in = new SieveData::Recipient( in->address, 0, d );
+                if ( !r->isNull( "mailbox" ) )
+                    in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
+                if ( !r->isNull( "script" ) ) {
+                    in->prefix = r->getUString( "namespace" ) + "/" +
+                                 r->getUString( "login" ) + "/";
+                    in->user = new User;
+                    in->user->setLogin( r->getUString( "login" ) );
+                    in->user->setId( r->getInt( "userid" ) );
+                    in->user->setAddress( new Address(
+                                             r->getUString( "name" ),
+                                             r->getEString( "localpart" ),
+                                             r->getEString( "domain" ) ) );
+                    EString source = r->getEString( "script" ).crlf();
+                    if ( !::scriptCache )
+                        ::scriptCache = new SieveScriptCache;
+                    CachedScript * cs
+                        = ::scriptCache->byOwner.find( in->user->id() );
+                    if ( cs && cs->source == source ) {
+                        in->script = cs->script;
+                    }
+                    else {
+                        in->script->parse( source );
+                        cs = new CachedScript;
+                        cs->source = source;
+                        cs->script = in->script;
+                        ::scriptCache->byOwner.insert( in->user->id(),
+                                                       cs );
                         EString errors = in->script->parseErrors();
                         if ( !errors.isEmpty() ) {
                             log( "Note: Sieve script for " +
@@ -201,22 +339,29 @@ void Sieve::execute()
                                 ++i;
                             }
                         }
-                        List<SieveCommand>::Iterator
-                            c(in->script->topLevelCommands());
-                        while ( c ) {
-                            in->pending.append( c );
-                            ++c;
-                        }
+                    }
+                    List<SieveCommand>::Iterator
+                        c(in->script->topLevelCommands());
+                    while ( c ) {
+                        in->pending.append( c );
+                        ++c;
                     }
                 }
-                i->sq = 0;
             }
-            if ( i->sq && i->sq->done() )
-                i->sq = 0;
-            ++i;
+
+            List<SieveData::Recipient>::Iterator i( d->recipients );
+            while ( i ) {
+                if ( i->sq == d->lookup )
+                    i->sq = 0;
+                ++i;
+            }
+            d->lookup = 0;
+            // recipients that arrived while the query ran form the
+            // next batch
+            resolveRecipients();
         }
         if ( ready() && !wasReady ) {
-            i = d->recipients.first();
+            List<SieveData::Recipient>::Iterator i( d->recipients );
             while ( i ) {
                 EventHandler * h = i->handler;
                 i->handler = 0;
@@ -239,6 +384,23 @@ void Sieve::execute()
 
         if ( !d->autoresponses ) {
             d->vacations = vacations();
+            if ( ::responseCache ) {
+                Date now;
+                now.setCurrentTime();
+                List<SieveAction>::Iterator i( d->vacations );
+                while ( i ) {
+                    AutoresponseCache::Entry * e =
+                        ::responseCache->answered.find( responseKey( i ) );
+                    if ( e && e->expires > now.unixTime() ) {
+                        log( "Suppressing vacation response to " +
+                             i->recipientAddress()->toString( false ) );
+                        d->vacations->take( i );
+                    }
+                    else {
+                        ++i;
+                    }
+                }
+            }
             if ( d->vacations->isEmpty() ) {
                 d->state = 2;
             }
@@ -389,6 +551,14 @@ void Sieve::execute()
             q->bind( 3, e.isoDateTime() );
             q->bind( 4, i->handle() );
             d->transaction->enqueue( q );
+
+            if ( !::responseCache )
+                ::responseCache = new AutoresponseCache;
+            if ( ::responseCache->answered.count() < maxCachedResponses ) {
+                AutoresponseCache::Entry * en = new AutoresponseCache::Entry;
+                en->expires = (uint)e.unixTime();
+                ::responseCache->answered.insert( responseKey( i ), en );
+            }
             ++i;
         }
 
@@ -469,6 +639,10 @@ void Sieve::addRecipient( Address * address, Mailbox * destination,
     script and other needed information so that delivery to \a address
     can be evaluated. Calls \a user when the information is available.
 
+    The lookup does not start at once: recipients accumulate until
+    resolveRecipients() is called, so that a pipelined burst of RCPT
+    TO commands can be resolved with a single query.
+
     If \a address is not a registered alias, Sieve will refuse mail to
     it.
 */
@@ -483,18 +657,6 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
 
     r->handler = user;
 
-    r->sq = new Query( "select al.mailbox, s.script, m.owner, "
-                       "n.name as namespace, u.id as userid, u.login, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from aliases al "
-                       "join addresses a on (al.address=a.id) "
-                       "join mailboxes m on (al.mailbox=m.id) "
-                       "left join scripts s on "
-                       " (s.owner=m.owner and s.active='t') "
-                       "left join users u on (s.owner=u.id) "
-                       "left join namespaces n on (u.parentspace=n.id) "
-                       "where m.deleted='f' and "
-                       "a.localpart=$1 and a.domain=$2", this );
     UString localpart( address->localpart() );
     if ( Configuration::toggle( Configuration::UseSubaddressing ) ) {
         EString sep( Configuration::text( Configuration::AddressSeparator ) );
@@ -516,9 +678,56 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
                 localpart = localpart.mid( 0, n );
         }
     }
-    r->sq->bind( 1, localpart );
-    r->sq->bind( 2, address->domain() );
-    r->sq->execute();
+    r->lookupLocalpart = localpart;
+
+    if ( !d->lookups )
+        d->lookups = new List<SieveData::Recipient>;
+    d->lookups->append( r );
+}
+
+
+/*! Issues one aliases lookup covering every recipient added with
+    addRecipient() since the last lookup was issued. SMTP calls this
+    once it has worked through its input buffer, so a 100-recipient
+    pipelined envelope costs one query rather than 100.
+
+    If a lookup is already in flight, the new recipients wait and form
+    the next batch; execute() calls back here when the running query
+    finishes. Does nothing if no recipients are waiting.
+*/
+
+void Sieve::resolveRecipients()
+{
+    if ( d->lookup || !d->lookups || d->lookups->isEmpty() )
+        return;
+
+    d->lookup = new Query( "select al.mailbox, s.script, m.owner, "
+                           "n.name as namespace, u.id as userid, u.login, "
+                           "a.name, a.localpart::text, a.domain::text "
+                           "from aliases al "
+                           "join addresses a on (al.address=a.id) "
+                           "join mailboxes m on (al.mailbox=m.id) "
+                           "left join scripts s on "
+                           " (s.owner=m.owner and s.active='t') "
+                           "left join users u on (s.owner=u.id) "
+                           "left join namespaces n on (u.parentspace=n.id) "
+                           "where m.deleted='f' and "
+                           "a.localpart=any($1) and a.domain=any($2)", this );
+
+    UStringList localparts;
+    UStringList domains;
+    List<SieveData::Recipient>::Iterator i( d->lookups );
+    while ( i ) {
+        i->sq = d->lookup;
+        localparts.append( i->lookupLocalpart );
+        domains.append( i->address->domain() );
+        ++i;
+    }
+    d->lookups = 0;
+
+    d->lookup->bind( 1, localparts );
+    d->lookup->bind( 2, domains );
+    d->lookup->execute();
 }
 
 
@@ -1191,19 +1400,21 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         if ( !d->message )
             return Undecidable;
         haystack = new UStringList;
-        List<HeaderField>::Iterator hf( d->message->header()->fields() );
-        Utf8Codec c;
-        while ( hf ) {
-            if ( hf->type() <= HeaderField::LastAddressField &&
-                 t->headers()->contains( c.toUnicode( hf->name() ) ) ) {
-                AddressField * af = (AddressField*)((HeaderField*)hf);
-                List<Address>::Iterator a( af->addresses() );
-                while ( a ) {
-                    addAddress( haystack, a, t->addressPart() );
-                    ++a;
+        UStringList::Iterator h( t->headers() );
+        while ( h ) {
+            List<HeaderField>::Iterator hf( d->fieldsNamed( h->ascii() ) );
+            while ( hf ) {
+                if ( hf->type() <= HeaderField::LastAddressField ) {
+                    AddressField * af = (AddressField*)((HeaderField*)hf);
+                    List<Address>::Iterator a( af->addresses() );
+                    while ( a ) {
+                        addAddress( haystack, a, t->addressPart() );
+                        ++a;
+                    }
                 }
+                ++hf;
             }
-            ++hf;
+            ++h;
         }
     }
     else if ( t->identifier() == "allof" ) {
@@ -1258,10 +1469,9 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
                  !d->message->hasHeaders() )
                 return Undecidable;
 
-            List<HeaderField>::Iterator hf( d->message->header()->fields() );
+            List<HeaderField>::Iterator hf( d->fieldsNamed( i->ascii() ) );
             while ( hf ) {
-                if ( hf->name() == i->ascii() )
-                    haystack->append( hf->value() );
+                haystack->append( hf->value() );
                 ++hf;
             }
 
@@ -1284,9 +1494,8 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         Date dt;
         if ( t->headers() ) {
             UString * hk = t->headers()->first();
-            List<HeaderField>::Iterator hf( d->message->header()->fields() );
-            while ( hf && hf->name() != hk->ascii() )
-                ++hf;
+            List<HeaderField> * fl = d->fieldsNamed( hk->ascii() );
+            HeaderField * hf = fl ? fl->firstElement() : 0;
             if ( hf )
                 dt.setRfc822( hf->rfc822( false ) );
         }
@@ -1393,8 +1602,13 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         if ( !d->message )
             return Undecidable;
         uint s = d->message->rfc822Size();
-        if ( !s )
+        if ( !s ) {
+            // a freshly received message doesn't know its size, and
+            // serialising it just to measure is expensive, so record
+            // the answer for the other recipients and the injector
             s = d->message->rfc822( false ).length();
+            d->message->setRfc822Size( s );
+        }
         if ( t->sizeOverLimit() ) {
             if ( s > t->sizeLimit() )
                 return True;
@@ -1865,6 +2079,8 @@ bool Sieve::rejected() const
 
 bool Sieve::ready() const
 {
+    if ( d->lookups && !d->lookups->isEmpty() )
+        return false;
     List<SieveData::Recipient>::Iterator i( d->recipients );
     while ( i && !i->sq )
         ++i;
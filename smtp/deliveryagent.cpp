@@ -5,6 +5,8 @@
 #include "spoolmanager.h"
 #include "transaction.h"
 #include "estringlist.h"
+#include "integerset.h"
+#include "dict.h"
 #include "smtpclient.h"
 #include "recipient.h"
 #include "injector.h"
@@ -130,6 +132,7 @@ void DeliveryAgent::execute()
         d->t->rollback();
         d->messageId = 0;
         log( "Could not find/lock deliveries row; aborting" );
+        SpoolManager::deliveryDone();
         return;
     }
 
@@ -151,6 +154,7 @@ void DeliveryAgent::execute()
             d->t->rollback();
             d->messageId = 0;
             log( "Delivery already completed; will do nothing", Log::Debug );
+            SpoolManager::deliveryDone();
             return;
         }
     }
@@ -212,6 +216,7 @@ void DeliveryAgent::execute()
     }
 
     d->messageId = 0;
+    SpoolManager::deliveryDone();
 }
 
 
@@ -376,6 +381,7 @@ void DeliveryAgent::updateDelivery()
 {
     uint handled = 0;
     uint unhandled = 0;
+    Dict<IntegerSet> groups;
     List<Recipient>::Iterator it( d->dsn->recipients() );
     while ( it ) {
         Recipient * r = it;
@@ -385,22 +391,43 @@ void DeliveryAgent::updateDelivery()
             unhandled++;
         else
             handled++;
+        if ( d->t->state() != Transaction::Executing &&
+             r->action() != Recipient::Delivered &&
+             r->action() != Recipient::Relayed &&
+             r->action() != Recipient::Expanded )
+            continue;
+        // recipients that ended in the same state are updated
+        // together below; bulk mail usually receives the same
+        // response for every recipient, so this is one update per
+        // attempt rather than one per recipient.
+        EString key = fn( r->action() ) + " " + r->status();
+        IntegerSet * g = groups.find( key );
+        if ( !g ) {
+            g = new IntegerSet;
+            groups.insert( key, g );
+        }
+        g->add( r->finalRecipient()->id() );
+    }
+
+    Dict<IntegerSet>::Iterator g( groups );
+    while ( g ) {
+        EString key = g.key();
+        int sp = key.find( ' ' );
         Query * q =
             new Query( "update delivery_recipients "
                        "set action=$1, status=$2, "
                        "last_attempt=current_timestamp "
-                       "where delivery=$3 and recipient=$4",
+                       "where delivery=$3 and recipient=any($4)",
                        this );
-        q->bind( 1, (int)r->action() );
-        q->bind( 2, r->status() );
+        q->bind( 1, key.mid( 0, sp ).number( 0 ) );
+        q->bind( 2, key.mid( sp + 1 ) );
         q->bind( 3, d->deliveryId );
-        q->bind( 4, r->finalRecipient()->id() );
+        q->bind( 4, *g );
         if ( d->t->state() == Transaction::Executing )
             d->t->enqueue( q );
-        else if ( r->action() == Recipient::Delivered ||
-                  r->action() == Recipient::Relayed ||
-                  r->action() == Recipient::Expanded )
+        else
             q->execute();
+        ++g;
     }
 
     if ( d->dsn->allOk() ) {
@@ -228,6 +228,11 @@ void SMTP::execute()
         }
     }
 
+    // any RCPT TO commands above queued their address lookups; now
+    // that the whole pipelined burst has run, issue them as one query
+    if ( d->sieve )
+        d->sieve->resolveRecipients();
+
     // allow execute() to be called again
     d->executing = false;
 }
@@ -410,6 +415,19 @@ void SMTP::setBody( const EString & b )
 }
 
 
+/*! Appends \a b to the stored body in place. setBody() would do, but
+    since body() shares its data with the caller, a setBody( body() +
+    chunk ) round trip copies the entire message so far for each BDAT
+    chunk. This function keeps the copying linear.
+*/
+
+void SMTP::appendBody( const EString & b )
+{
+    d->body.detach();
+    d->body.append( b );
+}
+
+
 /*! Returns what setBody() set. Used for SmtpBdat instances to
     coordinate the body.
 */
@@ -125,6 +125,12 @@ void SmtpData::execute()
     }
 
     // state 1: have sent 354, have not yet received CR LF "." CR LF.
+    if ( d->state == 1 ) {
+        // grow the body once per read event instead of once per line;
+        // for a large message that saves a stack of reallocations
+        Buffer * r = server()->readBuffer();
+        d->body.reserve( d->body.length() + r->size() );
+    }
     while ( d->state == 1 ) {
         Buffer * r = server()->readBuffer();
         EString * line = r->removeLine( 262144 );
@@ -599,9 +605,7 @@ void SmtpBdat::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b = server()->body();
-    b.append( d->chunk );
-    server()->setBody( b );
+    server()->appendBody( d->chunk );
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -687,9 +691,7 @@ void SmtpBurl::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b( server()->body() );
-    b.append( d->url->text() );
-    server()->setBody( b );
+    server()->appendBody( d->url->text() );
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -28,20 +28,24 @@ class SpoolManagerData
 {
 public:
     SpoolManagerData()
-        : q( 0 ), t( 0 ), again( false )
+        : q( 0 ), t( 0 ), again( false ), waiting( false )
     {}
 
     Query * q;
     Timer * t;
     List<DeliveryAgent> agents;
     bool again;
+    bool waiting;
 };
 
 
 /*! \class SpoolManager spoolmanager.h
 
-    This class periodically attempts to deliver mail from the
-    deliveries table to a smarthost using DeliveryAgent.
+    This class attempts to deliver mail from the deliveries table to
+    a smarthost using DeliveryAgent. It is woken at once when the
+    Injector notifies deliveries_updated, and uses a Timer only to
+    retry messages whose earlier attempts failed, so an empty spool
+    costs no queries at all.
 
     Each archiveopteryx process has only one instance of this class,
     which is created by SpoolManager::setup().
@@ -90,6 +94,7 @@ void SpoolManager::execute()
 
         log( "Starting queue run" );
         d->again = false;
+        d->waiting = false;
         reset();
         EString s( "select d.message, "
                    "extract(epoch from"
@@ -128,14 +133,25 @@ void SpoolManager::execute()
     // Yes. What?
 
     if ( d->q ) {
+        uint limit =
+            Configuration::scalar( Configuration::SmartHostParallelism );
         while ( d->q->hasResults() ) {
             Row * r = d->q->nextRow();
             int64 deliverableAt = r->getBigint( "delay" );
             if ( deliverableAt <= 0 ) {
-                DeliveryAgent * a
-                    = new DeliveryAgent( r->getInt( "message" ) );
-                (void)new Timer( a, d->agents.count() * 5 );
-                d->agents.append( a );
+                if ( d->agents.count() < limit ) {
+                    DeliveryAgent * a
+                        = new DeliveryAgent( r->getInt( "message" ) );
+                    (void)new Timer( a, 0 );
+                    d->agents.append( a );
+                }
+                else {
+                    // deliverable, but all the agents we may run are
+                    // busy. deliveryDone() starts another queue run
+                    // as soon as one of them finishes, so one slow
+                    // delivery doesn't block the rest of the spool.
+                    d->waiting = true;
+                }
             }
             else if ( delay > deliverableAt )
                 delay = deliverableAt;
@@ -174,6 +190,22 @@ void SpoolManager::deliverNewMessage()
 
 
 
+/*! Called by DeliveryAgent when a delivery attempt has finished, so
+    that any message held back by smarthost-parallelism can have its
+    turn.
+*/
+
+void SpoolManager::deliveryDone()
+{
+    if ( !::sm || !::sm->d->waiting )
+        return;
+    ::sm->d->waiting = false;
+    ::sm->d->again = true;
+    if ( !::sm->d->q )
+        ::sm->reset();
+}
+
+
 /*! Resets the perishable state of this SpoolManager, i.e. all but the
     Timer. Provided for convenience.
 */
@@ -16,6 +16,7 @@ public:
 
     static void setup();
     static void shutdown();
+    static void deliveryDone();
 
     void deliverNewMessage();
 